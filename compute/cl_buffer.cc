@@ -1,7 +1,79 @@
 #include "compute/cl_buffer.h"
 
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
 namespace compute {
 
+namespace {
+
+uint32_t FloatBits(float value) {
+  uint32_t bits;
+  std::memcpy(&bits, &value, sizeof(bits));
+  return bits;
+}
+
+float BitsToFloat(uint32_t bits) {
+  float value;
+  std::memcpy(&value, &bits, sizeof(value));
+  return value;
+}
+
+// Rounds to the nearest half, ties to even. Overflows to infinity.
+uint16_t FloatToHalf(float value) {
+  const uint32_t bits = FloatBits(value);
+  const uint16_t sign = (bits >> 16) & 0x8000;
+  const uint32_t magnitude = bits & 0x7fffffff;
+  if (magnitude >= 0x47800000) {
+    // Too large for a half (or infinity), or NaN. Values just below this
+    // threshold round up to infinity below.
+    return sign | ((magnitude > 0x7f800000) ? 0x7e00 : 0x7c00);
+  }
+  if (magnitude < 0x38800000) {
+    // Subnormal half (or zero). Adding 0.5 lets the float unit do the
+    // rounding of the shifted mantissa.
+    const float shifted = BitsToFloat(magnitude) + 0.5f;
+    return sign | static_cast<uint16_t>(FloatBits(shifted) - 0x3f000000);
+  }
+  // Rebias the exponent (127 -> 15) and round the 13 dropped mantissa bits.
+  const uint32_t odd = (magnitude >> 13) & 1;
+  const uint32_t rounded = magnitude + 0xc8000fff + odd;
+  return sign | static_cast<uint16_t>(rounded >> 13);
+}
+
+float HalfToFloat(uint16_t half) {
+  const uint32_t sign = static_cast<uint32_t>(half & 0x8000) << 16;
+  const uint32_t exponent = (half >> 10) & 0x1f;
+  const uint32_t mantissa = half & 0x3ff;
+  if (exponent == 0) {
+    // Zero or subnormal: mantissa * 2^-24.
+    const float value = static_cast<float>(mantissa) * (1.0f / 16777216.0f);
+    return BitsToFloat(sign | FloatBits(value));
+  }
+  if (exponent == 0x1f) {
+    return BitsToFloat(sign | 0x7f800000 | (mantissa << 13));
+  }
+  return BitsToFloat(sign | ((exponent + 112) << 23) | (mantissa << 13));
+}
+
+}  // namespace
+
+size_t DeviceFormatSize(DeviceFormat format) {
+  switch (format) {
+    case Float64:
+      return sizeof(double);
+    case Float32:
+      return sizeof(float);
+    case Float16:
+      return sizeof(uint16_t);
+    default:
+      std::cerr << "Unknown device format: " << format << std::endl;
+      std::exit(1);
+  }
+}
+
 std::unique_ptr<ClBuffer> ClBuffer::MakeBufferFromColumnVector(
     Matrix<double> column_vector) {
   std::vector<double> values = {};
@@ -40,39 +112,75 @@ size_t ClBuffer::size() const {
     if (gpu_size == 1) {
       return 0;
     }
-    if (gpu_size % sizeof(double) != 0) {
-      std::cerr << "GPU Buffer is not an even multiple of doubles. Invalid GPU "
-                   "buffer size."
+    if (gpu_size % DeviceFormatSize(format_) != 0) {
+      std::cerr << "GPU Buffer is not an even multiple of its value type. "
+                   "Invalid GPU buffer size."
                 << std::endl;
       std::exit(1);
     }
-    return gpu_size / sizeof(double);
+    return gpu_size / DeviceFormatSize(format_);
   }
 }
 
 void ClBuffer::MoveToCpu(const std::unique_ptr<cl::CommandQueue>& cq) {
-  cl::CommandQueue& queue = (cq) ? *cq : *cq_;
   if (state_ == CPU) {
     return;
   }
+  cl::CommandQueue& queue = (cq) ? *cq : *cq_;
   if (!gpu_buffer_) {
     std::cerr << "Error, unexpected nullptr gpu_buffer_" << std::endl;
     std::exit(1);
   }
-  cpu_buffer_.resize(size());
-  if (size() != 0) {
-    CL_CHECK(queue.enqueueReadBuffer(*gpu_buffer_, CL_TRUE, 0,
-                                     sizeof(double) * size(), &cpu_buffer_[0]));
+  const size_t buffer_size = size();
+  cpu_buffer_.resize(buffer_size);
+  if (buffer_size != 0) {
+    switch (format_) {
+      case Float64:
+        CL_CHECK(queue.enqueueReadBuffer(*gpu_buffer_, CL_TRUE, 0,
+                                         sizeof(double) * buffer_size,
+                                         &cpu_buffer_[0]));
+        break;
+      case Float32: {
+        std::vector<float> values(buffer_size);
+        CL_CHECK(queue.enqueueReadBuffer(*gpu_buffer_, CL_TRUE, 0,
+                                         sizeof(float) * buffer_size,
+                                         values.data()));
+        std::copy(values.begin(), values.end(), cpu_buffer_.begin());
+        break;
+      }
+      case Float16: {
+        std::vector<uint16_t> values(buffer_size);
+        CL_CHECK(queue.enqueueReadBuffer(*gpu_buffer_, CL_TRUE, 0,
+                                         sizeof(uint16_t) * buffer_size,
+                                         values.data()));
+        for (size_t i = 0; i < buffer_size; ++i) {
+          cpu_buffer_[i] = HalfToFloat(values[i]);
+        }
+        break;
+      }
+    }
   }
   gpu_buffer_.reset(nullptr);
   state_ = CPU;
 }
 
+void ClBuffer::SetDeviceFormat(DeviceFormat format) {
+  if (format == format_) {
+    return;
+  }
+  const bool on_gpu = (state_ == GPU);
+  MoveToCpu();
+  format_ = format;
+  if (on_gpu) {
+    MoveToGpu();
+  }
+}
+
 void ClBuffer::MoveToGpu(const std::unique_ptr<cl::CommandQueue>& cq) {
-  cl::CommandQueue& queue = (cq) ? *cq : *cq_;
-  if (state_ == GPU) {
+  if (state_ == GPU || host_only_) {
     return;
   }
+  cl::CommandQueue& queue = (cq) ? *cq : *cq_;
   CHECK_NOTNULL(context_);
   if (gpu_buffer_) {
     gpu_buffer_.reset();
@@ -88,15 +196,141 @@ void ClBuffer::MoveToGpu(const std::unique_ptr<cl::CommandQueue>& cq) {
     state_ = GPU;
     return;
   }
+  const size_t bytes = DeviceFormatSize(format_) * size();
   gpu_buffer_ = std::make_unique<cl::Buffer>(*context_, CL_MEM_READ_WRITE,
-                                             sizeof(double) * size(), nullptr,
-                                             &buffer_init);
+                                             bytes, nullptr, &buffer_init);
   CL_CHECK(buffer_init);
-  CL_CHECK(queue.enqueueWriteBuffer(*gpu_buffer_, CL_TRUE, 0,
-                                    sizeof(double) * size(), &cpu_buffer_[0]));
+  switch (format_) {
+    case Float64:
+      CL_CHECK(queue.enqueueWriteBuffer(*gpu_buffer_, CL_TRUE, 0, bytes,
+                                        &cpu_buffer_[0]));
+      break;
+    case Float32: {
+      std::vector<float> values(cpu_buffer_.begin(), cpu_buffer_.end());
+      CL_CHECK(queue.enqueueWriteBuffer(*gpu_buffer_, CL_TRUE, 0, bytes,
+                                        values.data()));
+      break;
+    }
+    case Float16: {
+      std::vector<uint16_t> values(size());
+      for (size_t i = 0; i < values.size(); ++i) {
+        values[i] = FloatToHalf(static_cast<float>(cpu_buffer_[i]));
+      }
+      CL_CHECK(queue.enqueueWriteBuffer(*gpu_buffer_, CL_TRUE, 0, bytes,
+                                        values.data()));
+      break;
+    }
+  }
   state_ = GPU;
 }
 
+void ClBuffer::EnqueueWrite(const double *values, cl::CommandQueue *queue,
+                            std::vector<uint8_t> *staging, cl::Event *event,
+                            const std::vector<cl::Event> *wait) {
+  if (state_ == CPU) {
+    std::cerr << "Error: EnqueueWrite() used while buffer is in CPU."
+              << std::endl;
+    std::exit(1);
+  }
+  const size_t buffer_size = size();
+  const size_t bytes = DeviceFormatSize(format_) * buffer_size;
+  staging->resize(bytes);
+  switch (format_) {
+    case Float64:
+      std::memcpy(staging->data(), values, bytes);
+      break;
+    case Float32: {
+      float *device_values = reinterpret_cast<float *>(staging->data());
+      std::copy(values, values + buffer_size, device_values);
+      break;
+    }
+    case Float16: {
+      uint16_t *device_values = reinterpret_cast<uint16_t *>(staging->data());
+      for (size_t i = 0; i < buffer_size; ++i) {
+        device_values[i] = FloatToHalf(static_cast<float>(values[i]));
+      }
+      break;
+    }
+  }
+  CL_CHECK(queue->enqueueWriteBuffer(*gpu_buffer_, CL_FALSE, 0, bytes,
+                                     staging->data(),
+                                     (wait && !wait->empty()) ? wait : nullptr,
+                                     event));
+}
+
+void ClBuffer::EnqueueRead(cl::CommandQueue *queue,
+                           std::vector<uint8_t> *staging,
+                           cl::Event *event) const {
+  if (state_ == CPU) {
+    std::cerr << "Error: EnqueueRead() used while buffer is in CPU."
+              << std::endl;
+    std::exit(1);
+  }
+  const size_t bytes = DeviceFormatSize(format_) * size();
+  staging->resize(bytes);
+  CL_CHECK(queue->enqueueReadBuffer(*gpu_buffer_, CL_FALSE, 0, bytes,
+                                    staging->data(), nullptr, event));
+}
+
+void ClBuffer::ConvertStaging(const std::vector<uint8_t> &staging,
+                              double *values) const {
+  const size_t buffer_size = size();
+  switch (format_) {
+    case Float64:
+      std::memcpy(values, staging.data(), sizeof(double) * buffer_size);
+      break;
+    case Float32: {
+      const float *device_values =
+          reinterpret_cast<const float *>(staging.data());
+      std::copy(device_values, device_values + buffer_size, values);
+      break;
+    }
+    case Float16: {
+      const uint16_t *device_values =
+          reinterpret_cast<const uint16_t *>(staging.data());
+      for (size_t i = 0; i < buffer_size; ++i) {
+        values[i] = HalfToFloat(device_values[i]);
+      }
+      break;
+    }
+  }
+}
+
+double ClBuffer::ReadValue(size_t index) const {
+  if (state_ == CPU) {
+    std::cerr << "Error: ReadValue() used while buffer is in CPU." << std::endl;
+    std::exit(1);
+  }
+  if (index >= size()) {
+    std::cerr << "Error: ReadValue() index " << index
+              << " is out of range (size " << size() << ")." << std::endl;
+    std::exit(1);
+  }
+  const size_t value_size = DeviceFormatSize(format_);
+  switch (format_) {
+    case Float64: {
+      double value;
+      CL_CHECK(cq_->enqueueReadBuffer(*gpu_buffer_, CL_TRUE,
+                                      index * value_size, value_size, &value));
+      return value;
+    }
+    case Float32: {
+      float value;
+      CL_CHECK(cq_->enqueueReadBuffer(*gpu_buffer_, CL_TRUE,
+                                      index * value_size, value_size, &value));
+      return value;
+    }
+    case Float16: {
+      uint16_t value;
+      CL_CHECK(cq_->enqueueReadBuffer(*gpu_buffer_, CL_TRUE,
+                                      index * value_size, value_size, &value));
+      return HalfToFloat(value);
+    }
+  }
+  std::cerr << "Error: unknown device format " << format_ << std::endl;
+  std::exit(1);
+}
+
 std::string ClBuffer::to_string() const {
   if (state_ == GPU) {
     std::cerr << "Error: to_string() used while buffer is in GPU." << std::endl;
@@ -121,6 +355,24 @@ double& ClBuffer::operator[](size_t index) {
   return cpu_buffer_[index];
 }
 
+double* ClBuffer::data() {
+  if (state_ == GPU) {
+    std::cerr << "Error: data() used while buffer is in GPU." << std::endl;
+    std::exit(1);
+  }
+
+  return cpu_buffer_.data();
+}
+
+const double* ClBuffer::data() const {
+  if (state_ == GPU) {
+    std::cerr << "Error: data() used while buffer is in GPU." << std::endl;
+    std::exit(1);
+  }
+
+  return cpu_buffer_.data();
+}
+
 const double& ClBuffer::operator[](size_t index) const {
   if (state_ == GPU) {
     std::cerr << "Error: [] used while buffer is in GPU." << std::endl;
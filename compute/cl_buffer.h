@@ -1,10 +1,12 @@
 #ifndef CL_BUFFER_H
 #define CL_BUFFER_H
 
+#include <cstdint>
 #include <iostream>
 #include <limits>
 #include <memory>
 #include <utility>
+#include <vector>
 
 #include "clutil/util.h"
 #include "geometry/dynamic_matrix.h"
@@ -36,6 +38,20 @@ namespace compute {
     }                                                             \
   } while (0);
 
+// Type of the values a buffer holds in device memory. The host copy is always
+// double, values are converted whenever the buffer moves between the CPU and
+// the GPU.
+enum DeviceFormat {
+  Float64 = 0,
+  Float32,
+  // IEEE 754 half precision. Kernels can only access buffers in this format on
+  // devices with the cl_khr_fp16 extension.
+  Float16,
+};
+
+// Size in bytes of a value in the given format.
+size_t DeviceFormatSize(DeviceFormat format);
+
 // A wrapper around cl::Buffer which allows for each transfer between CPU and
 // GPU. By default, initialized to in CPU state. Access operators only allowed
 // after MoveToCpu is called.
@@ -51,16 +67,19 @@ class ClBuffer {
   // GPU.
   ClBuffer DeepClone() {
     if (state_ == CPU) {
-      return ClBuffer(cpu_buffer_, cq_, context_);
+      ClBuffer clone(cpu_buffer_, cq_, context_);
+      clone.host_only_ = host_only_;
+      clone.format_ = format_;
+      return clone;
     } else {
       cl_int buffer_init;
       auto gpu_buffer = std::make_unique<cl::Buffer>(
-          *context_, CL_MEM_READ_WRITE, size() * sizeof(double), nullptr,
-          &buffer_init);
+          *context_, CL_MEM_READ_WRITE, size() * DeviceFormatSize(format_),
+          nullptr, &buffer_init);
       CL_CHECK(buffer_init);
       CL_CHECK(cq_->enqueueCopyBuffer(*gpu_buffer_, *gpu_buffer, 0, 0,
-                                      size() * sizeof(double)));
-      return ClBuffer(cq_, context_, std::move(gpu_buffer));
+                                      size() * DeviceFormatSize(format_)));
+      return ClBuffer(cq_, context_, std::move(gpu_buffer), format_);
     }
   }
 
@@ -82,12 +101,16 @@ class ClBuffer {
     CHECK_NOTNULL(context_);
     CHECK_NOTNULL(cq_);
   }
+  // Wraps a buffer which is already in device memory, holding values in the
+  // given format.
   ClBuffer(cl::CommandQueue *cq, cl::Context *context,
-           std::unique_ptr<cl::Buffer> &&gpu_buffer)
+           std::unique_ptr<cl::Buffer> &&gpu_buffer,
+           DeviceFormat format = Float64)
       : state_(GPU),
         gpu_buffer_(std::move(gpu_buffer)),
         cq_(cq),
-        context_(context) {
+        context_(context),
+        format_(format) {
     CHECK_NOTNULL(context_);
     CHECK_NOTNULL(cq_);
   }
@@ -95,24 +118,28 @@ class ClBuffer {
       : state_(other.state_),
         cpu_buffer_(other.cpu_buffer_),
         cq_(other.cq_),
-        context_(other.context_) {
+        context_(other.context_),
+        host_only_(other.host_only_),
+        format_(other.format_) {
     if (other.state_ == GPU) {
       CHECK_NOTNULL(context_);
       CHECK_NOTNULL(cq_);
       cl_int buffer_init;
       gpu_buffer_ = std::make_unique<cl::Buffer>(
-          *context_, CL_MEM_READ_WRITE, other.size() * sizeof(double), nullptr,
-          &buffer_init);
+          *context_, CL_MEM_READ_WRITE,
+          other.size() * DeviceFormatSize(format_), nullptr, &buffer_init);
       CL_CHECK(buffer_init);
       CL_CHECK(cq_->enqueueCopyBuffer(*other.gpu_buffer_, *gpu_buffer_, 0, 0,
-                                      other.size() * sizeof(double)));
+                                      other.size() * DeviceFormatSize(format_)));
     }
   }
   ClBuffer(ClBuffer &&other)
       : state_(other.state_),
         cpu_buffer_(std::move(other.cpu_buffer_)),
         cq_(other.cq_),
-        context_(other.context_) {
+        context_(other.context_),
+        host_only_(other.host_only_),
+        format_(other.format_) {
     if (other.state_ == GPU) {
       gpu_buffer_ = std::move(other.gpu_buffer_);
       other.state_ = CPU;
@@ -134,14 +161,57 @@ class ClBuffer {
 
   void RegisterClBackend(cl::CommandQueue *queue, cl::Context *context) {
     MoveToCpu();
+    host_only_ = false;
     CHECK_NOTNULL(cq_ = queue);
     CHECK_NOTNULL(context_ = context);
     MoveToGpu();
   }
 
+  // Used by the native CPU backend. Moves the buffer to the CPU and keeps it
+  // there: MoveToGpu() becomes a no-op until a CL backend is registered again.
+  void PinToCpu() {
+    MoveToCpu();
+    host_only_ = true;
+  }
+
+  bool IsPinnedToCpu() const { return host_only_; }
+
+  // The format of the values in device memory, Float64 by default. Changing it
+  // round-trips the buffer through the CPU if it is on the GPU.
+  DeviceFormat device_format() const { return format_; }
+  void SetDeviceFormat(DeviceFormat format);
+
   void MoveToCpu(const std::unique_ptr<cl::CommandQueue> &cq = nullptr);
   void MoveToGpu(const std::unique_ptr<cl::CommandQueue> &cq = nullptr);
 
+  // Starts a non-blocking write of size() values to the GPU buffer on queue,
+  // and returns without waiting for it. The values are converted to the
+  // device format in *staging, which must be left alone until *event
+  // completes. The write starts after the events in wait, if any. Only use
+  // this after MoveToGpu!
+  void EnqueueWrite(const double *values, cl::CommandQueue *queue,
+                    std::vector<uint8_t> *staging, cl::Event *event,
+                    const std::vector<cl::Event> *wait = nullptr);
+
+  // The reverse of EnqueueWrite(): starts a non-blocking read of the GPU
+  // buffer on queue into *staging, in the device format, and returns without
+  // waiting for it. Once *event completes, ConvertStaging() converts the
+  // values. Only use this after MoveToGpu!
+  void EnqueueRead(cl::CommandQueue *queue, std::vector<uint8_t> *staging,
+                   cl::Event *event) const;
+  // Converts the size() values of a completed EnqueueRead() into values.
+  void ConvertStaging(const std::vector<uint8_t> &staging,
+                      double *values) const;
+
+  // Reads the value at index back from the GPU buffer (blocking), without
+  // moving the rest of the buffer. Only use this after MoveToGpu!
+  double ReadValue(size_t index) const;
+
+  // The command queue and context of the CL backend this buffer is registered
+  // with, null if there is none.
+  cl::CommandQueue *command_queue() const { return cq_; }
+  cl::Context *context() const { return context_; }
+
   Location GetBufferLocation() { return state_; }
   size_t size() const;
   void resize(size_t new_size,
@@ -150,6 +220,8 @@ class ClBuffer {
   // Only use these after MoveToCpu!
   double &operator[](size_t index);
   double &at(size_t index) { return (*this)[index]; }
+  double *data();
+  const double *data() const;
   const double &operator[](size_t index) const;
   const double &at(size_t index) const { return (*this)[index]; }
   std::string to_string() const;
@@ -168,6 +240,12 @@ class ClBuffer {
     cpu_buffer_ = rhs.cpu_buffer_;
     cq_ = rhs.cq_;
     context_ = rhs.context_;
+    host_only_ = rhs.host_only_;
+    format_ = rhs.format_;
+
+    if (host_only_) {
+      return *this;
+    }
 
     CHECK_NOTNULL(cq_);
     CHECK_NOTNULL(context_);
@@ -178,12 +256,26 @@ class ClBuffer {
     return *this;
   }
 
+  // Exchanges the contents of two buffers, including their GPU buffers,
+  // without copying any values.
+  void swap(ClBuffer &other) {
+    std::swap(state_, other.state_);
+    cpu_buffer_.swap(other.cpu_buffer_);
+    gpu_buffer_.swap(other.gpu_buffer_);
+    std::swap(cq_, other.cq_);
+    std::swap(context_, other.context_);
+    std::swap(host_only_, other.host_only_);
+    std::swap(format_, other.format_);
+  }
+
  private:
   Location state_;
   std::vector<double> cpu_buffer_;
   std::unique_ptr<cl::Buffer> gpu_buffer_;
   cl::CommandQueue *cq_ = nullptr;
   cl::Context *context_ = nullptr;
+  bool host_only_ = false;
+  DeviceFormat format_ = Float64;
 };
 
 }  // namespace compute
@@ -227,4 +227,90 @@ TEST_CASE("Opencl tests", "[cl]") {
   }
 }
 
+TEST_CASE("Device formats are converted on transfer", "[cl]") {
+  OpenClState cl_;
+  std::vector<std::string> sources = {
+      "",
+  };
+  cl_.device = SelectDevice();
+  cl_ = CompileCl(sources, cl_.device);
+
+  // All exactly representable as halves, except for the last value.
+  const std::vector<double> values = {0.0, -1.5, 0.25, 2048.0, 65504.0, 0.1};
+  for (DeviceFormat format : {Float64, Float32, Float16}) {
+    CAPTURE(format);
+    ClBuffer buf(values, &cl_.queue, &std::get<0>(cl_.compilation_units));
+    buf.SetDeviceFormat(format);
+    buf.MoveToGpu();
+    REQUIRE(buf.size() == values.size());
+    auto clone = buf.DeepClone();
+    REQUIRE(clone.device_format() == format);
+    clone.MoveToCpu();
+    for (size_t i = 0; i + 1 < values.size(); ++i) {
+      REQUIRE(clone[i] == values[i]);
+    }
+    REQUIRE(clone[values.size() - 1] == Approx(0.1).epsilon(1e-3));
+  }
+
+  SECTION("Non-blocking writes are converted to the device format") {
+    for (DeviceFormat format : {Float64, Float32, Float16}) {
+      CAPTURE(format);
+      ClBuffer buf(values.size(), &cl_.queue,
+                   &std::get<0>(cl_.compilation_units));
+      buf.SetDeviceFormat(format);
+      buf.MoveToGpu();
+      std::vector<uint8_t> staging;
+      cl::Event written;
+      buf.EnqueueWrite(values.data(), &cl_.queue, &staging, &written);
+      REQUIRE(written.wait() == CL_SUCCESS);
+      buf.MoveToCpu();
+      for (size_t i = 0; i + 1 < values.size(); ++i) {
+        REQUIRE(buf[i] == values[i]);
+      }
+    }
+  }
+
+  SECTION("Non-blocking reads are converted from the device format") {
+    for (DeviceFormat format : {Float64, Float32, Float16}) {
+      CAPTURE(format);
+      ClBuffer buf(values, &cl_.queue, &std::get<0>(cl_.compilation_units));
+      buf.SetDeviceFormat(format);
+      buf.MoveToGpu();
+      std::vector<uint8_t> staging;
+      cl::Event read;
+      buf.EnqueueRead(&cl_.queue, &staging, &read);
+      REQUIRE(read.wait() == CL_SUCCESS);
+      std::vector<double> read_values(values.size());
+      buf.ConvertStaging(staging, read_values.data());
+      for (size_t i = 0; i + 1 < values.size(); ++i) {
+        REQUIRE(read_values[i] == values[i]);
+      }
+    }
+  }
+
+  SECTION("Single values are read back in the device format") {
+    for (DeviceFormat format : {Float64, Float32, Float16}) {
+      CAPTURE(format);
+      ClBuffer buf(values, &cl_.queue, &std::get<0>(cl_.compilation_units));
+      buf.SetDeviceFormat(format);
+      buf.MoveToGpu();
+      for (size_t i = 0; i + 1 < values.size(); ++i) {
+        REQUIRE(buf.ReadValue(i) == values[i]);
+      }
+      REQUIRE(buf.GetBufferLocation() == ClBuffer::GPU);
+    }
+  }
+
+  SECTION("Changing the format of a GPU buffer keeps its values") {
+    ClBuffer buf(values, &cl_.queue, &std::get<0>(cl_.compilation_units));
+    buf.MoveToGpu();
+    buf.SetDeviceFormat(Float32);
+    REQUIRE(buf.GetBufferLocation() == ClBuffer::GPU);
+    buf.MoveToCpu();
+    for (size_t i = 0; i + 1 < values.size(); ++i) {
+      REQUIRE(buf[i] == values[i]);
+    }
+  }
+}
+
 }  // namespace compute
@@ -0,0 +1,184 @@
+#include "compute/kernel_cache.h"
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+namespace compute {
+
+namespace {
+
+constexpr char kMagic[8] = {'P', 'L', 'K', 'C', 'A', 'C', 'H', 'E'};
+
+// Bump whenever the entry layout changes.
+constexpr uint32_t kFormatVersion = 1;
+
+// Creates directory and all of its parents. Returns false on failure.
+bool MakeDirectories(const std::string &directory) {
+  for (size_t slash = directory.find('/', 1); ;
+       slash = directory.find('/', slash + 1)) {
+    const std::string prefix = directory.substr(0, slash);
+    if (mkdir(prefix.c_str(), 0755) != 0 && errno != EEXIST) {
+      return false;
+    }
+    if (slash == std::string::npos) {
+      return true;
+    }
+  }
+}
+
+template <typename T>
+void WriteValue(std::ofstream *out, T value) {
+  out->write(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+template <typename T>
+bool ReadValue(std::ifstream *in, T *value) {
+  in->read(reinterpret_cast<char *>(value), sizeof(*value));
+  return static_cast<bool>(*in);
+}
+
+bool ReadBytes(std::ifstream *in, uint64_t size, char *destination) {
+  in->read(destination, size);
+  return static_cast<bool>(*in);
+}
+
+}  // namespace
+
+std::string KernelCache::DefaultDirectory() {
+  const char *override_directory = std::getenv("PLASTICITY_KERNEL_CACHE");
+  if (override_directory != nullptr) {
+    const std::string directory(override_directory);
+    return (directory == "off") ? "" : directory;
+  }
+  const char *xdg_cache = std::getenv("XDG_CACHE_HOME");
+  if (xdg_cache != nullptr && xdg_cache[0] != '\0') {
+    return std::string(xdg_cache) + "/plasticity/kernels";
+  }
+  const char *home = std::getenv("HOME");
+  if (home != nullptr && home[0] != '\0') {
+    return std::string(home) + "/.cache/plasticity/kernels";
+  }
+  return "";
+}
+
+uint64_t KernelCache::Hash(const std::string &data, uint64_t seed) {
+  constexpr uint64_t kFnvPrime = 1099511628211ULL;
+  uint64_t hash = seed;
+  for (unsigned char c : data) {
+    hash ^= c;
+    hash *= kFnvPrime;
+  }
+  return hash;
+}
+
+std::string KernelCache::EntryPath(uint64_t key) const {
+  std::stringstream path;
+  path << directory_ << "/" << std::hex << key << ".clbin";
+  return path.str();
+}
+
+bool KernelCache::Lookup(uint64_t key, Entry *entry) const {
+  if (!enabled()) {
+    return false;
+  }
+  std::ifstream in(EntryPath(key), std::ios::binary);
+  if (!in.is_open()) {
+    return false;
+  }
+
+  // Entries are validated field by field, anything unexpected is a miss.
+  char magic[sizeof(kMagic)];
+  uint32_t version;
+  uint64_t stored_key;
+  uint64_t source_size;
+  uint64_t source_hash;
+  uint64_t binary_size;
+  if (!ReadBytes(&in, sizeof(magic), magic) ||
+      !std::equal(magic, magic + sizeof(magic), kMagic) ||
+      !ReadValue(&in, &version) || version != kFormatVersion ||
+      !ReadValue(&in, &stored_key) || stored_key != key ||
+      !ReadValue(&in, &source_size)) {
+    return false;
+  }
+
+  // Check the declared sizes against the file size before allocating.
+  const std::streampos header_end = in.tellg();
+  in.seekg(0, std::ios::end);
+  const uint64_t remaining = in.tellg() - header_end;
+  in.seekg(header_end);
+  if (source_size > remaining) {
+    return false;
+  }
+  Entry result;
+  result.source.resize(source_size);
+  if (!ReadBytes(&in, source_size, &result.source[0]) ||
+      !ReadValue(&in, &source_hash) || source_hash != Hash(result.source) ||
+      !ReadValue(&in, &binary_size) ||
+      binary_size > remaining - source_size) {
+    return false;
+  }
+  result.binary.resize(binary_size);
+  if (!ReadBytes(&in, binary_size,
+                 reinterpret_cast<char *>(result.binary.data()))) {
+    return false;
+  }
+
+  *entry = std::move(result);
+  return true;
+}
+
+bool KernelCache::Store(uint64_t key, const Entry &entry) const {
+  if (!enabled()) {
+    return false;
+  }
+  if (!MakeDirectories(directory_)) {
+    std::cerr << "Could not create kernel cache directory " << directory_
+              << std::endl;
+    return false;
+  }
+
+  // Write to a temporary file and rename it into place, so that concurrent
+  // processes never observe a partially written entry.
+  const std::string path = EntryPath(key);
+  const std::string temporary_path =
+      path + ".tmp." + std::to_string(getpid());
+  {
+    std::ofstream out(temporary_path, std::ios::binary | std::ios::trunc);
+    if (!out.is_open()) {
+      std::cerr << "Could not write kernel cache entry " << temporary_path
+                << std::endl;
+      return false;
+    }
+    out.write(kMagic, sizeof(kMagic));
+    WriteValue(&out, kFormatVersion);
+    WriteValue(&out, key);
+    WriteValue<uint64_t>(&out, entry.source.size());
+    out.write(entry.source.data(), entry.source.size());
+    WriteValue(&out, Hash(entry.source));
+    WriteValue<uint64_t>(&out, entry.binary.size());
+    out.write(reinterpret_cast<const char *>(entry.binary.data()),
+              entry.binary.size());
+    if (!out) {
+      std::cerr << "Could not write kernel cache entry " << temporary_path
+                << std::endl;
+      std::remove(temporary_path.c_str());
+      return false;
+    }
+  }
+  if (std::rename(temporary_path.c_str(), path.c_str()) != 0) {
+    std::remove(temporary_path.c_str());
+    return false;
+  }
+  return true;
+}
+
+}  // namespace compute
@@ -0,0 +1,57 @@
+#ifndef KERNEL_CACHE_H
+#define KERNEL_CACHE_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace compute {
+
+// A persistent on-disk cache of compiled OpenCL programs. Each entry holds the
+// generated kernel source together with the device binary returned by
+// CL_PROGRAM_BINARIES, so that a warm start can skip both code generation and
+// compilation.
+//
+// Entries are keyed by a 64-bit hash which the caller derives from everything
+// the program depends on (architecture, kernel templates, device and driver).
+// Each entry is stored in its own file, written atomically.
+class KernelCache {
+ public:
+  struct Entry {
+    std::string source;
+    std::vector<unsigned char> binary;
+  };
+
+  // The cache directory is taken from $PLASTICITY_KERNEL_CACHE, falling back
+  // to $XDG_CACHE_HOME/plasticity/kernels and then
+  // $HOME/.cache/plasticity/kernels. Setting PLASTICITY_KERNEL_CACHE=off
+  // disables the cache (and an empty string is returned).
+  static std::string DefaultDirectory();
+
+  // 64-bit FNV-1a. Stable across platforms and runs, unlike std::hash.
+  static uint64_t Hash(const std::string &data,
+                       uint64_t seed = 14695981039346656037ULL);
+
+  // An empty directory disables the cache.
+  explicit KernelCache(const std::string &directory = DefaultDirectory())
+      : directory_(directory) {}
+
+  bool enabled() const { return !directory_.empty(); }
+
+  // Returns false if there is no valid entry for key. Corrupt or truncated
+  // entries are treated as misses.
+  bool Lookup(uint64_t key, Entry *entry) const;
+
+  // Returns false (after logging) if the entry could not be written. Failing
+  // to write the cache is never fatal.
+  bool Store(uint64_t key, const Entry &entry) const;
+
+  std::string EntryPath(uint64_t key) const;
+
+ private:
+  std::string directory_;
+};
+
+}  // namespace compute
+
+#endif  // KERNEL_CACHE_H
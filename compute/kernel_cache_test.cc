@@ -0,0 +1,83 @@
+#define CATCH_CONFIG_MAIN
+#include "third_party/catch.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+
+#include "compute/kernel_cache.h"
+
+namespace compute {
+
+namespace {
+
+std::string MakeTemporaryDirectory() {
+  char directory[] = "/tmp/kernel_cache_test.XXXXXX";
+  REQUIRE(mkdtemp(directory) != nullptr);
+  // Use a nested path so that Store() has to create the directories.
+  return std::string(directory) + "/nested/cache";
+}
+
+}  // namespace
+
+TEST_CASE("Kernel cache round trips entries", "[kernel_cache]") {
+  KernelCache cache(MakeTemporaryDirectory());
+  const uint64_t key = KernelCache::Hash("architecture");
+
+  KernelCache::Entry entry;
+  REQUIRE(!cache.Lookup(key, &entry));
+
+  KernelCache::Entry stored;
+  stored.source = "kernel void evaluate_1() {}";
+  stored.binary = {0x7f, 'E', 'L', 'F', 0, 1, 2, 255};
+  REQUIRE(cache.Store(key, stored));
+
+  REQUIRE(cache.Lookup(key, &entry));
+  REQUIRE(entry.source == stored.source);
+  REQUIRE(entry.binary == stored.binary);
+
+  SECTION("Other keys miss") {
+    REQUIRE(!cache.Lookup(key + 1, &entry));
+  }
+
+  SECTION("Truncated entries miss") {
+    const std::string path = cache.EntryPath(key);
+    std::ifstream in(path, std::ios::binary);
+    std::string contents((std::istreambuf_iterator<char>(in)),
+                         std::istreambuf_iterator<char>());
+    in.close();
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out.write(contents.data(), contents.size() - 3);
+    out.close();
+    REQUIRE(!cache.Lookup(key, &entry));
+  }
+
+  SECTION("Corrupt source misses") {
+    const std::string path = cache.EntryPath(key);
+    std::fstream file(path, std::ios::binary | std::ios::in | std::ios::out);
+    // Skip the header (magic, version, key and source size).
+    file.seekp(8 + 4 + 8 + 8);
+    file.put('X');
+    file.close();
+    REQUIRE(!cache.Lookup(key, &entry));
+  }
+}
+
+TEST_CASE("Disabled kernel cache never hits", "[kernel_cache]") {
+  KernelCache cache("");
+  KernelCache::Entry entry;
+  entry.source = "source";
+  REQUIRE(!cache.enabled());
+  REQUIRE(!cache.Store(1, entry));
+  REQUIRE(!cache.Lookup(1, &entry));
+}
+
+TEST_CASE("Kernel cache hash is stable", "[kernel_cache]") {
+  // FNV-1a reference values.
+  REQUIRE(KernelCache::Hash("") == 14695981039346656037ULL);
+  REQUIRE(KernelCache::Hash("a") == 0xaf63dc4c8601ec8cULL);
+  REQUIRE(KernelCache::Hash("abc") != KernelCache::Hash("acb"));
+}
+
+}  // namespace compute
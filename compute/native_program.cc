@@ -0,0 +1,123 @@
+#include "compute/native_program.h"
+
+#include <dlfcn.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+namespace compute {
+
+namespace {
+
+// Maps the subset of OpenCL C used by the kernels onto plain C.
+constexpr char kPrelude[] = R"(
+#include <math.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#define kernel
+#define __kernel
+#define global
+#define __global
+
+static __thread size_t plasticity_global_id[2];
+
+void plasticity_set_global_id(size_t id_0, size_t id_1) {
+  plasticity_global_id[0] = id_0;
+  plasticity_global_id[1] = id_1;
+}
+
+static inline size_t get_global_id(unsigned int dimension) {
+  return (dimension < 2) ? plasticity_global_id[dimension] : 0;
+}
+)";
+
+constexpr char kSetGlobalIdSymbol[] = "plasticity_set_global_id";
+
+std::string Compiler() {
+  const char *compiler = std::getenv("PLASTICITY_CC");
+  return (compiler != nullptr) ? compiler : "cc";
+}
+
+std::string ReadFile(const std::string &path) {
+  std::ifstream input(path);
+  std::stringstream buffer;
+  buffer << input.rdbuf();
+  return buffer.str();
+}
+
+}  // namespace
+
+std::unique_ptr<NativeProgram> NativeProgram::Compile(
+    const std::vector<std::string> &kernel_sources) {
+  const char *tmpdir = std::getenv("TMPDIR");
+  std::string directory_template =
+      std::string((tmpdir != nullptr) ? tmpdir : "/tmp") +
+      "/plasticity_native.XXXXXX";
+  if (mkdtemp(&directory_template[0]) == nullptr) {
+    std::cerr << "Could not create a temporary directory for native kernels."
+              << std::endl;
+    std::exit(1);
+  }
+  const std::string directory = directory_template;
+  const std::string source_path = directory + "/kernels.c";
+  const std::string library_path = directory + "/kernels.so";
+  const std::string log_path = directory + "/compile.log";
+
+  {
+    std::ofstream source(source_path);
+    source << kPrelude;
+    for (const std::string &kernel_source : kernel_sources) {
+      source << kernel_source << "\n";
+    }
+  }
+
+  const std::string command = Compiler() +
+                              " -std=gnu11 -O3 -march=native -fPIC -shared"
+                              // char is signed in OpenCL C.
+                              " -fsigned-char -w -o " +
+                              library_path + " " + source_path + " -lm > " +
+                              log_path + " 2>&1";
+  if (std::system(command.c_str()) != 0) {
+    std::cerr << "Failed to compile native kernels with: " << command
+              << std::endl;
+    std::cerr << ReadFile(log_path) << std::endl;
+    std::cerr << "Kernel source left at: " << source_path << std::endl;
+    std::exit(1);
+  }
+
+  void *handle = dlopen(library_path.c_str(), RTLD_NOW | RTLD_LOCAL);
+  if (handle == nullptr) {
+    std::cerr << "Failed to load native kernels: " << dlerror() << std::endl;
+    std::exit(1);
+  }
+
+  // The library stays mapped after its files are unlinked.
+  std::remove(source_path.c_str());
+  std::remove(library_path.c_str());
+  std::remove(log_path.c_str());
+  rmdir(directory.c_str());
+
+  return std::unique_ptr<NativeProgram>(new NativeProgram(handle));
+}
+
+NativeProgram::NativeProgram(void *handle) : handle_(handle) {
+  set_global_id_ = reinterpret_cast<SetGlobalIdFn>(Symbol(kSetGlobalIdSymbol));
+}
+
+NativeProgram::~NativeProgram() { dlclose(handle_); }
+
+void *NativeProgram::Symbol(const std::string &name) const {
+  void *symbol = dlsym(handle_, name.c_str());
+  if (symbol == nullptr) {
+    std::cerr << "Native kernel not found: " << name << std::endl;
+    std::exit(1);
+  }
+  return symbol;
+}
+
+}  // namespace compute
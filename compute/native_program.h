@@ -0,0 +1,75 @@
+#ifndef NATIVE_PROGRAM_H
+#define NATIVE_PROGRAM_H
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "compute/thread_pool.h"
+
+namespace compute {
+
+// Compiles OpenCL C kernel sources into a shared object with the host C
+// compiler and runs the kernels natively. This lets the generated kernels run
+// on machines without an OpenCL runtime.
+//
+// OpenCL qualifiers (kernel, global, ...) are defined away by a small prelude,
+// and get_global_id() reads a thread-local work-item index which Launch() sets
+// before calling the kernel for each work item. Kernels which rely on local
+// memory or barriers are not supported.
+//
+// The compiler is taken from $PLASTICITY_CC, falling back to "cc".
+class NativeProgram {
+ public:
+  // Compiles and loads kernel_sources. Exits with the compiler output on
+  // failure.
+  static std::unique_ptr<NativeProgram> Compile(
+      const std::vector<std::string> &kernel_sources);
+
+  ~NativeProgram();
+
+  NativeProgram(const NativeProgram &) = delete;
+  NativeProgram &operator=(const NativeProgram &) = delete;
+
+  // Runs kernel_name once for every work item of a global_size_0 x
+  // global_size_1 range, split across the thread pool. Args must match the
+  // kernel's parameter types exactly (pointers for global buffers, cl_int-sized
+  // ints for scalars). Blocks until all work items have finished.
+  template <typename... Args>
+  void Launch(const std::string &kernel_name, size_t global_size_0,
+              size_t global_size_1, Args... args) {
+    using KernelFn = void (*)(Args...);
+    KernelFn kernel = reinterpret_cast<KernelFn>(Symbol(kernel_name));
+    SetGlobalIdFn set_global_id = set_global_id_;
+    pool_.ParallelFor(
+        0, global_size_0 * global_size_1,
+        [&](size_t begin, size_t end) {
+          for (size_t item = begin; item < end; ++item) {
+            set_global_id(item % global_size_0, item / global_size_0);
+            kernel(args...);
+          }
+        },
+        kMinWorkItemsPerChunk);
+  }
+
+  // Returns the address of the named symbol in the compiled program. Exits if
+  // the symbol does not exist.
+  void *Symbol(const std::string &name) const;
+
+ private:
+  using SetGlobalIdFn = void (*)(size_t, size_t);
+
+  // Below this many work items per chunk, threading overhead dominates.
+  static constexpr size_t kMinWorkItemsPerChunk = 16;
+
+  explicit NativeProgram(void *handle);
+
+  void *handle_;
+  SetGlobalIdFn set_global_id_;
+  ThreadPool pool_;
+};
+
+}  // namespace compute
+
+#endif  // NATIVE_PROGRAM_H
@@ -0,0 +1,62 @@
+#define CATCH_CONFIG_MAIN
+#include "third_party/catch.h"
+
+#include <atomic>
+#include <vector>
+
+#include "compute/native_program.h"
+#include "compute/thread_pool.h"
+
+namespace compute {
+
+TEST_CASE("Thread pool covers the whole range exactly once", "[native]") {
+  ThreadPool pool(4);
+  std::vector<std::atomic<int>> visits(1000);
+  for (auto &visit : visits) {
+    visit = 0;
+  }
+  pool.ParallelFor(0, visits.size(),
+                   [&visits](size_t begin, size_t end) {
+                     for (size_t i = begin; i < end; ++i) {
+                       visits[i]++;
+                     }
+                   },
+                   1);
+  for (const auto &visit : visits) {
+    REQUIRE(visit == 1);
+  }
+}
+
+TEST_CASE("Native program runs OpenCL kernels", "[native]") {
+  const std::string kernel_source = R"(
+double Square(global double* I, int index) {
+  return I[index] * I[index];
+}
+
+kernel void square(global double* inputs, global double* outputs,
+                   int row_size) {
+  size_t column = get_global_id(0);
+  size_t row = get_global_id(1);
+  outputs[row * row_size + column] = Square(inputs, row * row_size + column);
+}
+)";
+  std::unique_ptr<NativeProgram> program =
+      NativeProgram::Compile({kernel_source});
+
+  constexpr int kRows = 30;
+  constexpr int kColumns = 40;
+  std::vector<double> inputs(kRows * kColumns);
+  std::vector<double> outputs(kRows * kColumns, 0.0);
+  for (size_t i = 0; i < inputs.size(); ++i) {
+    inputs[i] = static_cast<double>(i) - 100.5;
+  }
+
+  program->Launch("square", kColumns, kRows, inputs.data(), outputs.data(),
+                  kColumns);
+
+  for (size_t i = 0; i < inputs.size(); ++i) {
+    REQUIRE(outputs[i] == Approx(inputs[i] * inputs[i]));
+  }
+}
+
+}  // namespace compute
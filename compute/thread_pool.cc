@@ -0,0 +1,91 @@
+#include "compute/thread_pool.h"
+
+#include <algorithm>
+
+namespace compute {
+
+ThreadPool::ThreadPool(size_t num_threads) {
+  if (num_threads == 0) {
+    num_threads = std::max<size_t>(1, std::thread::hardware_concurrency());
+  }
+  for (size_t i = 0; i < num_threads; ++i) {
+    workers_.emplace_back(&ThreadPool::WorkerLoop, this);
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    shutting_down_ = true;
+  }
+  task_available_.notify_all();
+  for (std::thread &worker : workers_) {
+    worker.join();
+  }
+}
+
+void ThreadPool::WorkerLoop() {
+  while (true) {
+    std::function<void()> task;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      task_available_.wait(
+          lock, [this] { return shutting_down_ || !tasks_.empty(); });
+      if (tasks_.empty()) {
+        // Only reachable when shutting down.
+        return;
+      }
+      task = std::move(tasks_.front());
+      tasks_.pop_front();
+    }
+    task();
+  }
+}
+
+void ThreadPool::ParallelFor(size_t begin, size_t end,
+                             const std::function<void(size_t, size_t)> &fn,
+                             size_t min_chunk_size) {
+  if (end <= begin) {
+    return;
+  }
+  const size_t length = end - begin;
+  min_chunk_size = std::max<size_t>(1, min_chunk_size);
+  if (length <= min_chunk_size || workers_.size() <= 1) {
+    fn(begin, end);
+    return;
+  }
+
+  // A few chunks per worker so that uneven work items still balance out.
+  const size_t max_chunks = 4 * workers_.size();
+  const size_t num_chunks =
+      std::min(max_chunks, (length + min_chunk_size - 1) / min_chunk_size);
+  const size_t chunk_size = (length + num_chunks - 1) / num_chunks;
+
+  std::mutex done_mutex;
+  std::condition_variable done;
+  size_t remaining = 0;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (size_t chunk_begin = begin + chunk_size; chunk_begin < end;
+         chunk_begin += chunk_size) {
+      const size_t chunk_end = std::min(end, chunk_begin + chunk_size);
+      ++remaining;
+      tasks_.emplace_back([&, chunk_begin, chunk_end] {
+        fn(chunk_begin, chunk_end);
+        std::lock_guard<std::mutex> done_lock(done_mutex);
+        if (--remaining == 0) {
+          done.notify_one();
+        }
+      });
+    }
+  }
+  task_available_.notify_all();
+
+  // The calling thread takes the first chunk instead of idling.
+  fn(begin, std::min(end, begin + chunk_size));
+
+  std::unique_lock<std::mutex> lock(done_mutex);
+  done.wait(lock, [&remaining] { return remaining == 0; });
+}
+
+}  // namespace compute
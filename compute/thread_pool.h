@@ -0,0 +1,47 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace compute {
+
+// A fixed-size pool of worker threads. Used by the native CPU backend to split
+// a kernel's global range across cores.
+class ThreadPool {
+ public:
+  // A pool with num_threads workers. Zero means one per hardware thread.
+  explicit ThreadPool(size_t num_threads = 0);
+  ~ThreadPool();
+
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  // Calls fn(chunk_begin, chunk_end) over disjoint chunks covering
+  // [begin, end) and blocks until every chunk has run. Ranges smaller than
+  // min_chunk_size are run inline on the calling thread, since waking up the
+  // workers would cost more than the work itself.
+  void ParallelFor(size_t begin, size_t end,
+                   const std::function<void(size_t, size_t)> &fn,
+                   size_t min_chunk_size = 64);
+
+  size_t size() const { return workers_.size(); }
+
+ private:
+  void WorkerLoop();
+
+  std::vector<std::thread> workers_;
+  std::deque<std::function<void()>> tasks_;
+  std::mutex mutex_;
+  std::condition_variable task_available_;
+  bool shutting_down_ = false;
+};
+
+}  // namespace compute
+
+#endif  // THREAD_POOL_H
@@ -1,10 +1,14 @@
 #ifndef KALMAN_H
 #define KALMAN_H
 
+#include <algorithm>
+#include <functional>
 #include <memory>
 #include <tuple>
+#include <vector>
 
 #include "geometry/matrix.h"
+#include "symbolic/compiled_expression.h"
 #include "symbolic/expression.h"
 #include "symbolic/numeric_value.h"
 
@@ -31,10 +35,13 @@ class KalmanFilter {
   KalmanFilter(StateMatrix state_matrix, ControlMatrix control_matrix,
                ProcessNoiseMatrix process_noise,
                SensorTransform sensor_transform)
-      : state_transition_(state_matrix),
-        control_matrix_(control_matrix),
-        process_noise_(process_noise),
-        sensor_transform_(sensor_transform) {}
+      : state_transition_(state_matrix.Map(Compiler())),
+        control_matrix_(control_matrix.Map(Compiler())),
+        process_noise_(process_noise.Map(Compiler())),
+        sensor_transform_(sensor_transform),
+        registers_(std::max({MaxRegisters(state_transition_),
+                             MaxRegisters(control_matrix_),
+                             MaxRegisters(process_noise_)})) {}
 
   // Initialize sets initial values for X and P.
   void initialize(Time time_s, StateVector initial_state,
@@ -54,7 +61,15 @@ class KalmanFilter {
   }
 
   std::tuple<StateVector, StateCovariance> PredictState(Time time_s) const {
-    auto expression_evaluator = evaluator(time_s);
+    // Scratch space for this call, so that concurrent predictions don't share
+    // any state.
+    std::vector<double> registers(registers_);
+    const double dt = time_s - last_sample_time_;
+    std::function<Number(const symbolic::CompiledExpression&)>
+        expression_evaluator = [&dt, &registers](
+                                   const symbolic::CompiledExpression& exp) {
+          return exp.Evaluate(&dt, registers.data());
+        };
 
     Matrix<kNumStates, kNumStates, Number> state_transition =
         state_transition_.Map(expression_evaluator);
@@ -108,24 +123,41 @@ class KalmanFilter {
   }
 
  private:
-  std::function<Number(const symbolic::Expression&)> evaluator(double time_s) const {
-    return [time_s, this](const symbolic::Expression& exp) {
-      symbolic::Expression copy =
-          exp.Bind("t", symbolic::NumericValue(time_s - last_sample_time_));
-      symbolic::NumericValue v = *copy.Evaluate();
-      return v.real();
+  // Matrix entries are compiled once, with "t" as their only variable, so a
+  // prediction doesn't Bind() or allocate per entry.
+  static std::function<symbolic::CompiledExpression(const symbolic::Expression&)>
+  Compiler() {
+    return [](const symbolic::Expression& exp) {
+      return symbolic::CompiledExpression(exp, {"t"});
     };
   }
 
-  const StateMatrix state_transition_;
-  const ControlMatrix control_matrix_;
-  const ProcessNoiseMatrix process_noise_;
+  template <size_t kRows, size_t kCols>
+  static size_t MaxRegisters(
+      const Matrix<kRows, kCols, symbolic::CompiledExpression>& matrix) {
+    size_t registers = 0;
+    for (size_t i = 0; i < kRows; ++i) {
+      for (size_t j = 0; j < kCols; ++j) {
+        registers = std::max(registers, matrix.at(i, j).registers());
+      }
+    }
+    return registers;
+  }
+
+  const Matrix<kNumStates, kNumStates, symbolic::CompiledExpression>
+      state_transition_;
+  const Matrix<kNumStates, kNumControls, symbolic::CompiledExpression>
+      control_matrix_;
+  const Matrix<kNumStates, kNumStates, symbolic::CompiledExpression>
+      process_noise_;
   const SensorTransform sensor_transform_;
 
   StateVector state_ = {};
   StateCovariance uncertainty_ = {};
   ControlVector last_control_ = {};
   Time last_sample_time_ = 0;
+  // The scratch space needed to evaluate any of the compiled matrices.
+  const size_t registers_;
 };
 
 }  // namespace filter
@@ -1,7 +1,12 @@
+#include <cmath>
+#include <cstdlib>
+#include <functional>
 #include <iostream>
+#include <tuple>
 
 #include "filter/kalman_filter.h"
 #include "symbolic/expression.h"
+#include "symbolic/numeric_value.h"
 
 using symbolic::CreateExpression;
 
@@ -42,6 +47,49 @@ int main() {
                                 sensor_transform);
 
   simple_tank_demo.initialize(
-      0, KalmanFilter::StateVector{{0}, {0}},
+      0, KalmanFilter::StateVector{{2}, {0.5}},
       KalmanFilter::StateCovariance{{1000, 0}, {0, 1000}});
+
+  // PredictState() evaluates compiled matrices. Step the filter with a few
+  // different time gaps and check each prediction against the same matrices
+  // evaluated with Bind() and Evaluate().
+  KalmanFilter::StateVector state{{2}, {0.5}};
+  KalmanFilter::StateCovariance covariance{{1000, 0}, {0, 1000}};
+  Number last_time = 0;
+  for (Number time : {0.1, 0.35, 0.4, 1.4, 1.45}) {
+    std::function<Number(const symbolic::Expression&)> evaluator =
+        [dt = time - last_time](const symbolic::Expression& exp) {
+          return exp.Bind("t", symbolic::NumericValue(dt)).Evaluate()->real();
+        };
+    Matrix<kNumStates, kNumStates, Number> transition =
+        state_matrix.Map(evaluator);
+    state = transition * state;
+    covariance = transition * covariance * transition.Transpose() +
+                 process_noise.Map(evaluator);
+
+    auto prediction = simple_tank_demo.PredictState(time);
+    for (size_t i = 0; i < kNumStates; ++i) {
+      for (size_t j = 0; j < kNumStates; ++j) {
+        Number expected = covariance.at(i, j);
+        Number actual = std::get<1>(prediction).at(i, j);
+        if (std::fabs(actual - expected) > 1e-9 * (1 + std::fabs(expected))) {
+          std::cerr << "Covariance (" << i << ", " << j << ") at t = " << time
+                    << " is " << actual << ", expected " << expected
+                    << std::endl;
+          std::exit(1);
+        }
+      }
+      Number expected = state.at(i, 0);
+      Number actual = std::get<0>(prediction).at(i, 0);
+      if (std::fabs(actual - expected) > 1e-9 * (1 + std::fabs(expected))) {
+        std::cerr << "State " << i << " at t = " << time << " is " << actual
+                  << ", expected " << expected << std::endl;
+        std::exit(1);
+      }
+    }
+
+    simple_tank_demo.ReportControl(time, KalmanFilter::ControlVector{});
+    last_time = time;
+  }
+  std::cout << "PredictState() matches Bind() and Evaluate()." << std::endl;
 };
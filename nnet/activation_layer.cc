@@ -1,5 +1,7 @@
 #include <memory>
 #include "nnet/activation_layer.h"
+#include "symbolic/cse.h"
+#include "symbolic/simplify.h"
 
 namespace nnet {
 
@@ -7,7 +9,10 @@ void ActivationLayer::GenerateOutputCode(
     const symbolic::Expression& index, codegen::Generator* cg) const {
   symbolic::Expression retval = activation_function_(generator_.I(index));
 
-  cg->AppendLineOfCode("return " + retval.to_string() + cg->linesep());
+  cg->AppendLineOfCode("return " +
+                       symbolic::HoistCommonSubexpressions(
+                           symbolic::Simplify(retval), cg) +
+                       cg->linesep());
 }
 
 void ActivationLayer::InputGradientCode(const symbolic::Expression &input_index,
@@ -18,7 +23,10 @@ void ActivationLayer::InputGradientCode(const symbolic::Expression &input_index,
       output.Derive(generator_.I(input_index).to_string());
   symbolic::Expression retval = generator_.GRADIENT(input_index) * deriv;
 
-  cg->AppendLineOfCode("return " + retval.to_string() + cg->linesep());
+  cg->AppendLineOfCode("return " +
+                       symbolic::HoistCommonSubexpressions(
+                           symbolic::Simplify(retval), cg) +
+                       cg->linesep());
 }
 
 void ActivationLayer::WeightGradientCode(
@@ -26,6 +34,14 @@ void ActivationLayer::WeightGradientCode(
   cg->AppendLineOfCode("return 0.0" + cg->linesep());
 }
 
+std::string ActivationLayer::KernelSignature() const {
+  // The activation function is opaque, so identify it by the expression it
+  // generates.
+  symbolic::Expression output =
+      activation_function_(generator_.I(symbolic::CreateExpression("index")));
+  return Super::KernelSignature() + "[" + output.to_string() + "]";
+}
+
 std::unique_ptr<LayerImpl> ActivationLayer::Clone() const {
   return std::make_unique<ActivationLayer>(dimensions_.num_inputs,
                                            activation_function_, layer_index_);
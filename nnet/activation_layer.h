@@ -37,6 +37,12 @@ class ActivationLayer : public LayerImpl {
     return "activation_layer";
   }
 
+  std::string KernelSignature() const override;
+
+  const ActivationFunctionType &activation_function() const {
+    return activation_function_;
+  }
+
  private:
   ActivationFunctionType activation_function_;
   SymbolGenerator generator_;
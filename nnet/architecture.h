@@ -46,8 +46,10 @@ struct Architecture {
     return AddActivationLayer(size, symbolic::Identity);
   }
 
+  // See DenseKernelStrategy. TiledDense is worth it for wide layers.
   Architecture& AddDenseLayer(
-      size_t num_outputs, const ActivationFunctionType& activation_function) {
+      size_t num_outputs, const ActivationFunctionType& activation_function,
+      DenseKernelStrategy strategy = GeneratedDense) {
     Dimensions dimensions = {
         // Num inputs = num previous layer outputs.
         layers[layers.size() - 1].GetDimensions().num_outputs,
@@ -55,7 +57,8 @@ struct Architecture {
         num_outputs,
     };
 
-    layers.push_back(Layer::MakeDenseLayer(layers.size(), dimensions));
+    layers.push_back(
+        Layer::MakeDenseLayer(layers.size(), dimensions, strategy));
     AddActivationLayer(activation_function);
     return *this;
   }
@@ -0,0 +1,431 @@
+// Benchmarks each layer type over a grid of dimensions, each convolution
+// strategy on a YOLO-shaped layer, and end-to-end training on a synthetic
+// CIFAR-shaped workload, then writes the results as JSON (see README). Compare
+// the output of two builds to catch regressions:
+//
+//   bazel run -c opt //nnet:benchmark -- /tmp/benchmark.json [--short]
+//
+// --short runs a smaller grid with fewer iterations. Set
+// PLASTICITY_BACKEND=native to benchmark the native CPU backend.
+//
+// Latencies are the median wall-clock time of a call, including launch
+// overhead, up to the completion of its device work (see Nnet::Finish()).
+#include "compute/cl_buffer.h"
+#include "nnet/architecture.h"
+#include "nnet/layer_dimensions.h"
+#include "nnet/nnet.h"
+#include "rapidjson/stringbuffer.h"
+#include "rapidjson/writer.h"
+#include "symbolic/expression.h"
+#include "symbolic/symbolic_util.h"
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace {
+
+// Bump when the meaning of a field changes, so that old results aren't
+// compared against new ones.
+constexpr char kBenchmarkFormatVersion[] = "1";
+
+struct LayerCase {
+  std::string type;
+  std::string dimensions;
+  nnet::Architecture model;
+  // Arithmetic operations of one sample's forward pass.
+  double flops;
+};
+
+struct Settings {
+  size_t batch_size;
+  // Timed runs of each measurement, after a warm-up run.
+  size_t iterations;
+  // Samples of the end-to-end training runs.
+  size_t training_samples;
+  bool short_grid;
+};
+
+// Median wall-clock milliseconds of settings.iterations runs of run, after one
+// warm-up run (which compiles kernels and allocates the batch buffers).
+double MedianMilliseconds(const Settings &settings,
+                          const std::function<void()> &run) {
+  run();
+  std::vector<double> milliseconds;
+  for (size_t i = 0; i < settings.iterations; ++i) {
+    auto start = std::chrono::high_resolution_clock::now();
+    run();
+    auto end = std::chrono::high_resolution_clock::now();
+    milliseconds.push_back(
+        std::chrono::duration<double, std::milli>(end - start).count());
+  }
+  std::sort(milliseconds.begin(), milliseconds.end());
+  return milliseconds[milliseconds.size() / 2];
+}
+
+std::vector<double> RandomValues(size_t size, std::mt19937 *generator) {
+  std::uniform_real_distribution<double> distribution(-1.0, 1.0);
+  std::vector<double> values(size);
+  for (double &value : values) {
+    value = distribution(*generator);
+  }
+  return values;
+}
+
+nnet::Architecture DenseCase(size_t inputs, size_t outputs) {
+  nnet::Architecture model(inputs);
+  model.AddDenseLayer(outputs, symbolic::Identity);
+  return model;
+}
+
+nnet::Architecture ConvolutionCase(const nnet::VolumeDimensions &input,
+                                   const nnet::FilterParams &filters) {
+  nnet::Architecture model(input.width * input.height * input.depth);
+  model.AddConvolutionLayer(input, filters, symbolic::Identity);
+  return model;
+}
+
+nnet::Architecture MaxPoolCase(const nnet::VolumeDimensions &input,
+                               const nnet::AreaDimensions &output) {
+  nnet::Architecture model(input.width * input.height * input.depth);
+  model.AddMaxPoolLayer(input, output);
+  return model;
+}
+
+nnet::Architecture SoftmaxCase(size_t size) {
+  nnet::Architecture model(size);
+  model.AddSoftmaxLayer(size);
+  return model;
+}
+
+nnet::Architecture ActivationCase(size_t size) {
+  nnet::Architecture model(size);
+  model.AddActivationLayer(symbolic::Relu);
+  return model;
+}
+
+// In each case, the benchmarked layer is layer 1 (layer 0 is the input).
+std::vector<LayerCase> LayerCases(bool short_grid) {
+  std::vector<LayerCase> cases;
+  std::vector<std::pair<size_t, size_t>> dense = {{256, 256}};
+  if (!short_grid) {
+    dense.insert(dense.end(), {{1024, 1024}, {4096, 1024}});
+  }
+  for (const auto &size : dense) {
+    cases.push_back({"dense",
+                     std::to_string(size.first) + "x" +
+                         std::to_string(size.second),
+                     DenseCase(size.first, size.second),
+                     2.0 * size.first * size.second});
+  }
+
+  std::vector<std::pair<nnet::VolumeDimensions, nnet::FilterParams>>
+      convolutions = {
+          // The first layer of cifar_test.
+          {{32, 32, 3}, {5, 5, 3, 1, 2, 16}},
+      };
+  if (!short_grid) {
+    convolutions.push_back({{16, 16, 16}, {5, 5, 16, 1, 2, 20}});
+    convolutions.push_back({{28, 28, 64}, {3, 3, 64, 1, 1, 64}});
+  }
+  for (const auto &convolution : convolutions) {
+    const nnet::VolumeDimensions &input = convolution.first;
+    const nnet::FilterParams &filters = convolution.second;
+    const size_t output_width =
+        (input.width - filters.width + 2 * filters.padding) / filters.stride +
+        1;
+    const size_t output_height =
+        (input.height - filters.height + 2 * filters.padding) /
+            filters.stride +
+        1;
+    cases.push_back(
+        {"convolution",
+         std::to_string(input.width) + "x" + std::to_string(input.height) +
+             "x" + std::to_string(input.depth) + " " +
+             std::to_string(filters.width) + "x" +
+             std::to_string(filters.height) + "x" +
+             std::to_string(filters.num_filters),
+         ConvolutionCase(input, filters),
+         2.0 * output_width * output_height * filters.num_filters *
+             filters.width * filters.height * filters.depth});
+  }
+
+  std::vector<std::pair<nnet::VolumeDimensions, nnet::AreaDimensions>> pools =
+      {{{32, 32, 16}, {16, 16}}};
+  if (!short_grid) {
+    pools.push_back({{16, 16, 20}, {8, 8}});
+  }
+  for (const auto &pool : pools) {
+    const nnet::VolumeDimensions &input = pool.first;
+    // One comparison per input.
+    cases.push_back({"max_pool",
+                     std::to_string(input.width) + "x" +
+                         std::to_string(input.height) + "x" +
+                         std::to_string(input.depth) + " to " +
+                         std::to_string(pool.second.width) + "x" +
+                         std::to_string(pool.second.height),
+                     MaxPoolCase(input, pool.second),
+                     1.0 * input.width * input.height * input.depth});
+  }
+
+  std::vector<size_t> softmax = {10};
+  std::vector<size_t> activation = {1024};
+  if (!short_grid) {
+    softmax.push_back(1000);
+    activation.push_back(65536);
+  }
+  for (size_t size : softmax) {
+    // An exponential, a sum and a division per output.
+    cases.push_back(
+        {"softmax", std::to_string(size), SoftmaxCase(size), 3.0 * size});
+  }
+  for (size_t size : activation) {
+    cases.push_back(
+        {"activation", std::to_string(size), ActivationCase(size), 1.0 * size});
+  }
+  return cases;
+}
+
+void BenchmarkLayer(const LayerCase &layer_case, const Settings &settings,
+                    rapidjson::Writer<rapidjson::StringBuffer> *writer) {
+  std::cout << "Layer " << layer_case.type << " " << layer_case.dimensions
+            << "..." << std::endl;
+  nnet::Nnet network(layer_case.model, nnet::Nnet::Xavier, nnet::MeanSquared);
+  std::mt19937 generator(1);
+  const size_t batch_size = settings.batch_size;
+  const size_t input_size = layer_case.model.input_size();
+  const size_t output_size = layer_case.model.output_size();
+  std::unique_ptr<compute::ClBuffer> inputs =
+      network.MakeBuffer(RandomValues(batch_size * input_size, &generator));
+  std::unique_ptr<compute::ClBuffer> expected =
+      network.MakeBuffer(RandomValues(batch_size * output_size, &generator));
+  inputs->MoveToGpu();
+  expected->MoveToGpu();
+
+  const double evaluate_ms = MedianMilliseconds(settings, [&]() {
+    network.BatchEvaluate(inputs, batch_size);
+    network.Finish();
+  });
+  std::vector<compute::ClBuffer> gradients;
+  const double gradients_ms = MedianMilliseconds(settings, [&]() {
+    network.BatchGradients(inputs, expected, batch_size, &gradients);
+    network.Finish();
+  });
+  const size_t weights = network.layer(1).weight_buffer().size();
+
+  // Each value of the inputs, weights and outputs is moved once.
+  const double bytes =
+      (batch_size * (input_size + output_size) + weights) *
+      compute::DeviceFormatSize(network.number_format());
+  writer->StartObject();
+  writer->Key("type");
+  writer->String(layer_case.type.c_str());
+  writer->Key("dimensions");
+  writer->String(layer_case.dimensions.c_str());
+  writer->Key("weights");
+  writer->Uint64(weights);
+  writer->Key("evaluate_ms");
+  writer->Double(evaluate_ms);
+  writer->Key("gflops");
+  writer->Double(layer_case.flops * batch_size / (evaluate_ms * 1e6));
+  writer->Key("gbps");
+  writer->Double(bytes / (evaluate_ms * 1e6));
+  // BatchGradients() runs the forward pass, then back propagation.
+  writer->Key("backprop_ms");
+  writer->Double(std::max(0.0, gradients_ms - evaluate_ms));
+  if (weights > 0) {
+    const double update_ms = MedianMilliseconds(settings, [&]() {
+      network.ApplyGradients(gradients);
+      network.Finish();
+    });
+    writer->Key("weight_update_ms");
+    writer->Double(update_ms);
+  }
+  writer->EndObject();
+}
+
+// Evaluate latency of one convolution layer with each ConvolutionStrategy, on
+// the same weights and inputs. On the native backend every strategy falls
+// back to DirectConvolution, so only that one is timed.
+void BenchmarkConvolutionStrategies(
+    const Settings &settings,
+    rapidjson::Writer<rapidjson::StringBuffer> *writer) {
+  // A 3x3 layer from the middle of the YOLOv1 stack, scaled down.
+  const nnet::VolumeDimensions input =
+      settings.short_grid ? nnet::VolumeDimensions{14, 14, 32}
+                          : nnet::VolumeDimensions{28, 28, 128};
+  nnet::FilterParams filters = {
+      3,            // filter x size.
+      3,            // filter y size.
+      input.depth,  // filter z depth size.
+      1,            // stride.
+      1,            // padding.
+      input.depth,  // number of filters.
+  };
+  const std::string dimensions =
+      std::to_string(input.width) + "x" + std::to_string(input.height) + "x" +
+      std::to_string(input.depth) + " 3x3x" + std::to_string(input.depth);
+  const double flops = 2.0 * input.width * input.height * filters.num_filters *
+                       filters.width * filters.height * filters.depth;
+  const bool native = nnet::Nnet::DefaultBackend() == nnet::Nnet::NativeCpu;
+  const std::vector<std::pair<nnet::ConvolutionStrategy, const char *>>
+      strategies = {{nnet::DirectConvolution, "direct"},
+                    {nnet::Im2ColConvolution, "im2col"},
+                    {nnet::WinogradConvolution, "winograd"}};
+  for (const auto &strategy : strategies) {
+    if (native && strategy.first != nnet::DirectConvolution) {
+      continue;
+    }
+    std::cout << "Convolution strategy " << strategy.second << " "
+              << dimensions << "..." << std::endl;
+    filters.strategy = strategy.first;
+    nnet::Architecture model = ConvolutionCase(input, filters);
+    nnet::Nnet network(model, nnet::Nnet::Xavier, nnet::MeanSquared);
+    std::mt19937 generator(1);
+    std::unique_ptr<compute::ClBuffer> inputs = network.MakeBuffer(
+        RandomValues(settings.batch_size * model.input_size(), &generator));
+    inputs->MoveToGpu();
+    const double evaluate_ms = MedianMilliseconds(settings, [&]() {
+      network.BatchEvaluate(inputs, settings.batch_size);
+      network.Finish();
+    });
+
+    writer->StartObject();
+    writer->Key("strategy");
+    writer->String(strategy.second);
+    writer->Key("dimensions");
+    writer->String(dimensions.c_str());
+    writer->Key("evaluate_ms");
+    writer->Double(evaluate_ms);
+    writer->Key("gflops");
+    writer->Double(flops * settings.batch_size / (evaluate_ms * 1e6));
+    writer->EndObject();
+  }
+}
+
+// The network of cifar_test.
+nnet::Architecture CifarModel() {
+  nnet::Architecture model(32 * 32 * 3);
+  model.AddConvolutionLayer({32, 32, 3}, {5, 5, 3, 1, 2, 16})
+      .AddMaxPoolLayer({32, 32, 16}, {16, 16})
+      .AddConvolutionLayer({16, 16, 16}, {5, 5, 16, 1, 2, 20})
+      .AddMaxPoolLayer({16, 16, 20}, {8, 8})
+      .AddConvolutionLayer({8, 8, 20}, {5, 5, 20, 1, 2, 20})
+      .AddMaxPoolLayer({8, 8, 20}, {4, 4})
+      .AddDenseLayer(10, symbolic::Identity)
+      .AddSoftmaxLayer(10);
+  return model;
+}
+
+// Samples per second of Train() (batch_size 1) or BatchTrain(), on random
+// inputs and one-hot outputs already on the device.
+void BenchmarkTraining(size_t batch_size, const Settings &settings,
+                       rapidjson::Writer<rapidjson::StringBuffer> *writer) {
+  std::cout << "Training, batches of " << batch_size << "..." << std::endl;
+  nnet::Architecture model = CifarModel();
+  nnet::Nnet network(model, nnet::Nnet::Xavier, nnet::CrossEntropy);
+  network.SetLearningParameters({.learning_rate = 0.0001});
+  std::mt19937 generator(1);
+  const size_t samples =
+      std::max(batch_size, settings.training_samples / batch_size * batch_size);
+  std::vector<std::unique_ptr<compute::ClBuffer>> inputs;
+  std::vector<std::unique_ptr<compute::ClBuffer>> outputs;
+  for (size_t sample = 0; sample < samples; ++sample) {
+    std::vector<double> output(model.output_size(), 0.0);
+    output[sample % output.size()] = 1.0;
+    inputs.push_back(
+        network.MakeBuffer(RandomValues(model.input_size(), &generator)));
+    outputs.push_back(network.MakeBuffer(output));
+    inputs.back()->MoveToGpu();
+    outputs.back()->MoveToGpu();
+  }
+
+  auto train = [&]() {
+    for (size_t first = 0; first < samples; first += batch_size) {
+      if (batch_size == 1) {
+        network.Train(inputs[first], outputs[first]);
+        continue;
+      }
+      std::set<int> batch;
+      for (size_t sample = first; sample < first + batch_size; ++sample) {
+        batch.insert(sample);
+      }
+      network.BatchTrain(inputs, outputs, batch);
+    }
+    network.Finish();
+  };
+  const double milliseconds = MedianMilliseconds(settings, train);
+
+  writer->StartObject();
+  writer->Key("mode");
+  writer->String((batch_size == 1) ? "Train" : "BatchTrain");
+  writer->Key("batch_size");
+  writer->Uint64(batch_size);
+  writer->Key("samples_per_second");
+  writer->Double(1000.0 * samples / milliseconds);
+  writer->EndObject();
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  std::string output_path = "benchmark.json";
+  Settings settings = {32, 10, 256, false};
+  for (int i = 1; i < argc; ++i) {
+    const std::string arg = argv[i];
+    if (arg == "--short") {
+      settings = {8, 3, 32, true};
+    } else if (arg.find("--") == 0) {
+      std::cerr << "Unknown option " << arg << std::endl;
+      return 1;
+    } else {
+      output_path = arg;
+    }
+  }
+
+  const bool native = nnet::Nnet::DefaultBackend() == nnet::Nnet::NativeCpu;
+  rapidjson::StringBuffer output;
+  rapidjson::Writer<rapidjson::StringBuffer> writer(output);
+  writer.StartObject();
+  writer.Key("version");
+  writer.String(kBenchmarkFormatVersion);
+  writer.Key("backend");
+  writer.String(native ? "native" : "opencl");
+  writer.Key("batch_size");
+  writer.Uint64(settings.batch_size);
+  writer.Key("iterations");
+  writer.Uint64(settings.iterations);
+  writer.Key("layers");
+  writer.StartArray();
+  for (const LayerCase &layer_case : LayerCases(settings.short_grid)) {
+    BenchmarkLayer(layer_case, settings, &writer);
+  }
+  writer.EndArray();
+  writer.Key("convolution_strategies");
+  writer.StartArray();
+  BenchmarkConvolutionStrategies(settings, &writer);
+  writer.EndArray();
+  writer.Key("training");
+  writer.StartArray();
+  BenchmarkTraining(1, settings, &writer);
+  BenchmarkTraining(settings.batch_size, settings, &writer);
+  writer.EndArray();
+  writer.EndObject();
+
+  std::ofstream file(output_path);
+  if (!file.is_open()) {
+    std::cerr << "Could not open " << output_path << " to write the results."
+              << std::endl;
+    return 1;
+  }
+  file << output.GetString() << std::endl;
+  std::cout << "Wrote the results to " << output_path << std::endl;
+  return 0;
+}
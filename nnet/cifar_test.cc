@@ -2,11 +2,15 @@
 #include "nnet/layer_dimensions.h"
 #include "nnet/nnet.h"
 #include "symbolic/expression.h"
+#include "symbolic/simplify.h"
 #include "external/libjpeg_turbo/turbojpeg.h"
 
+#include <algorithm>
 #include <cassert>
 #include <chrono>
+#include <cstring>
 #include <fstream>
+#include <iomanip>
 #include <iostream>
 #include <sstream>
 #include <string>
@@ -241,6 +245,172 @@ void PrintStatus(nnet::Nnet* test_net, const std::vector<Sample>& samples,
             << "%)" << std::endl;
 }
 
+// Packs the normalized inputs of samples [begin, end) back-to-back, for
+// Nnet::BatchEvaluate().
+std::unique_ptr<compute::ClBuffer> PackedInputs(
+    nnet::Nnet *network, const std::vector<Sample> &samples, size_t begin,
+    size_t end) {
+  std::vector<double> packed;
+  packed.reserve((end - begin) * kSampleSize);
+  for (size_t i = begin; i < end; ++i) {
+    std::unique_ptr<compute::ClBuffer> input =
+        samples[i].NormalizedInput(network);
+    input->MoveToCpu();
+    packed.insert(packed.end(), input->data(), input->data() + kSampleSize);
+  }
+  return network->MakeBuffer(packed);
+}
+
+// Returns the predicted label of every sample.
+std::vector<uint8_t> Predict(nnet::Nnet *network,
+                             const std::vector<Sample> &samples) {
+  constexpr size_t kBatchSize = 100;
+  std::vector<uint8_t> labels;
+  for (size_t begin = 0; begin < samples.size(); begin += kBatchSize) {
+    const size_t end = std::min(samples.size(), begin + kBatchSize);
+    std::unique_ptr<compute::ClBuffer> outputs = network->BatchEvaluate(
+        PackedInputs(network, samples, begin, end), end - begin);
+    outputs->MoveToCpu();
+    for (size_t sample = 0; sample < end - begin; ++sample) {
+      const double *output = outputs->data() + sample * kOutputSize;
+      labels.push_back(std::max_element(output, output + kOutputSize) -
+                       output);
+    }
+  }
+  return labels;
+}
+
+// Prints the accuracy and the confusion matrix of the network on samples. The
+// whole dataset is uploaded once and evaluated on the device.
+void PrintAccuracyReport(nnet::Nnet *network,
+                         const std::vector<Sample> &samples) {
+  std::unique_ptr<compute::ClBuffer> inputs =
+      PackedInputs(network, samples, 0, samples.size());
+  std::vector<double> label_values;
+  label_values.reserve(samples.size());
+  for (const Sample &sample : samples) {
+    label_values.push_back(sample.label);
+  }
+  std::unique_ptr<compute::ClBuffer> labels = network->MakeBuffer(label_values);
+  inputs->MoveToGpu();
+  labels->MoveToGpu();
+
+  auto start = std::chrono::high_resolution_clock::now();
+  const nnet::Nnet::ClassificationReport report =
+      network->EvaluateClassifier(inputs, labels, samples.size());
+  auto end = std::chrono::high_resolution_clock::now();
+  std::cout << "Accuracy on " << report.samples
+            << " samples: " << 100.0 * report.accuracy() << "% ("
+            << std::chrono::duration<double>(end - start).count() << " s)"
+            << std::endl;
+  std::cout << "Confusion matrix (rows: actual, columns: predicted):"
+            << std::endl;
+  for (size_t actual = 0; actual < report.classes; ++actual) {
+    std::cout << std::setw(12) << LabelToString(actual);
+    for (size_t predicted = 0; predicted < report.classes; ++predicted) {
+      std::cout << std::setw(6) << report.count(actual, predicted);
+    }
+    std::cout << std::endl;
+  }
+}
+
+// Quantizes the network to int8 (see Nnet::Quantize()), calibrating on the
+// first training samples, and compares its accuracy on the test batch to the
+// full precision network's.
+void PrintQuantizationReport(nnet::Nnet *test_net,
+                             const std::vector<Sample> &samples,
+                             const std::vector<Sample> &test_batch) {
+  constexpr size_t kCalibrationSamples = 500;
+  const std::vector<uint8_t> full_precision = Predict(test_net, test_batch);
+  const size_t full_precision_bytes = test_net->InferenceWeightBytes();
+
+  const size_t calibration_samples =
+      std::min(kCalibrationSamples, samples.size());
+  test_net->Quantize(PackedInputs(test_net, samples, 0, calibration_samples),
+                     calibration_samples);
+  const std::vector<uint8_t> quantized = Predict(test_net, test_batch);
+
+  size_t full_precision_correct = 0;
+  size_t quantized_correct = 0;
+  size_t agreements = 0;
+  for (size_t i = 0; i < test_batch.size(); ++i) {
+    const uint8_t label = test_batch[i].label;
+    full_precision_correct += (full_precision[i] == label);
+    quantized_correct += (quantized[i] == label);
+    agreements += (full_precision[i] == quantized[i]);
+  }
+  auto percent = [&test_batch](size_t count) {
+    return 100.0 * static_cast<double>(count) / test_batch.size();
+  };
+  std::cout << "Quantization report (" << test_batch.size()
+            << " test samples, calibrated on " << calibration_samples
+            << "):" << std::endl;
+  std::cout << "Full precision accuracy: " << percent(full_precision_correct)
+            << "%" << std::endl;
+  std::cout << "Int8 accuracy: " << percent(quantized_correct) << "%"
+            << std::endl;
+  std::cout << "Predictions which agree: " << percent(agreements) << "%"
+            << std::endl;
+  std::cout << "Weight memory: " << full_precision_bytes << " -> "
+            << test_net->InferenceWeightBytes() << " bytes" << std::endl;
+}
+
+// Packs the normalized inputs and one-hot outputs of samples [begin, end)
+// back-to-back, for InputPipeline::Push().
+void PackBatch(nnet::Nnet *network, const std::vector<Sample> &samples,
+               size_t begin, size_t end, std::vector<double> *inputs,
+               std::vector<double> *outputs) {
+  inputs->clear();
+  outputs->clear();
+  for (size_t i = begin; i < end; ++i) {
+    std::unique_ptr<compute::ClBuffer> input =
+        samples[i].NormalizedInput(network);
+    std::unique_ptr<compute::ClBuffer> output =
+        samples[i].OneHotEncodedOutput(network);
+    inputs->insert(inputs->end(), input->data(), input->data() + kSampleSize);
+    outputs->insert(outputs->end(), output->data(),
+                    output->data() + kOutputSize);
+  }
+}
+
+// Trains on minibatches streamed from host memory through an
+// nnet::InputPipeline (--pipeline), instead of keeping every sample on the
+// GPU. The next batch uploads while the current one trains.
+void TrainPipelined(nnet::Nnet *network, const std::vector<Sample> &samples,
+                    size_t epochs) {
+  constexpr size_t kBatchSize = 50;
+  const size_t batches = samples.size() / kBatchSize;
+  std::unique_ptr<nnet::InputPipeline> pipeline =
+      network->MakeInputPipeline(kBatchSize);
+  std::vector<double> inputs;
+  std::vector<double> outputs;
+  for (size_t epoch = 1; epoch <= epochs; ++epoch) {
+    auto start = std::chrono::high_resolution_clock::now();
+    PackBatch(network, samples, 0, kBatchSize, &inputs, &outputs);
+    pipeline->Push(inputs, outputs);
+    for (size_t batch = 0; batch < batches; ++batch) {
+      if (batch + 1 < batches) {
+        PackBatch(network, samples, (batch + 1) * kBatchSize,
+                  (batch + 2) * kBatchSize, &inputs, &outputs);
+        pipeline->Push(inputs, outputs);
+      }
+      network->BatchTrain(pipeline.get());
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    auto duration =
+        std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
+    const nnet::InputPipeline::Stats &stats = pipeline->stats();
+    std::cout << "Epoch " << epoch << std::endl;
+    std::cout << "Training rate (samples per second): "
+              << 1000.0 * batches * kBatchSize / duration.count() << std::endl;
+    std::cout << "Input transfers: " << stats.transfer_seconds << "s, "
+              << 100.0 * stats.hidden_fraction() << "% hidden behind training"
+              << std::endl;
+    pipeline->ResetStats();
+    PrintStatus(network, samples, 1000);
+  }
+}
+
 // Trains a neural network to learn if given point is in unit circle.
 int main(int argc, char *argv[]) {
   // This option exists for profiling/debugging.
@@ -348,6 +518,13 @@ int main(int argc, char *argv[]) {
       .AddSoftmaxLayer(10);
   std::cout << "Initializing network..." << std::endl;
   nnet::Nnet test_net(model, nnet::Nnet::Xavier, nnet::CrossEntropy);
+  const symbolic::SimplifyStats simplify_stats = symbolic::TotalSimplifyStats();
+  // Zero if the kernels came from the kernel cache.
+  if (simplify_stats.nodes_before > 0) {
+    std::cout << "Simplified kernel expressions from "
+              << simplify_stats.nodes_before << " to "
+              << simplify_stats.nodes_after << " nodes." << std::endl;
+  }
 
   // Load weights if applicable.
   if (!weight_file_path.empty()) {
@@ -390,70 +567,93 @@ int main(int argc, char *argv[]) {
     std::cerr << "No samples found, quitting!" << std::endl;
     return -1;
   }
-  std::cout << "Moving samples to GPU..." << std::endl;
-  std::vector<std::unique_ptr<compute::ClBuffer>> inputs;
-  std::vector<std::unique_ptr<compute::ClBuffer>> outputs;
-  
-  for (const auto& sample : samples) {
-    auto input = sample.NormalizedInput(&test_net);
-    auto expected = sample.OneHotEncodedOutput(&test_net);
-    input->MoveToGpu();
-    expected->MoveToGpu();
-    inputs.emplace_back(std::move(input));
-    outputs.emplace_back(std::move(expected));
-  }
-  for (const auto& sample : test_batch) {
-    auto input = sample.NormalizedInput(&test_net);
-    auto expected = sample.OneHotEncodedOutput(&test_net);
-    input->MoveToGpu();
-    expected->MoveToGpu();
-    inputs.emplace_back(std::move(input));
-    outputs.emplace_back(std::move(expected));
-  }
-  std::cout << "Entire dataset of " << inputs.size()
-            << " examples is now stored on GPU!" << std::endl;
-
   nnet::Nnet::LearningParameters params{.learning_rate = 0.0001};
   test_net.SetLearningParameters(params);
 
-  // constexpr int kBatchSize=50;
+  // Samples the device work of one call in 100, see nnet/profiler.h.
+  if (options.count("--profile") == 1) {
+    nnet::Profiler::Options profiler_options;
+    profiler_options.sample_every = 100;
+    test_net.EnableProfiling(profiler_options);
+  }
 
-  int samples_so_far = 0;
-  auto start = std::chrono::high_resolution_clock::now();
-  for (size_t epoch = 1; epoch <= kNumTrainingEpochs; ++epoch) {
-    for (size_t i = 0; i < samples.size(); i += 1) {
-      auto& input = inputs[i];
-      auto& expected = outputs[i];
-      // SGD
-      test_net.Train(input, expected);
-      
-      // Minibatch.
-      // std::vector<int> batch(kBatchSize);
-      // std::generate(batch.begin(), batch.end(), std::rand);
-      // std::set<int> batch_set(batch.begin(), batch.end());
-      // test_net.BatchTrain(inputs, outputs, batch_set);
-
-      samples_so_far++;
-      if (samples_so_far % 100000 == 0) {
-        PrintStatus(&test_net, samples, 1000);
-        SaveWeightsToFile(&test_net, weight_file_path);
-      }
-      if (samples_so_far % 5000 == 0) {
-        std::cout << "Progress: " << samples_so_far - 1 << " / "
-                  << (kNumTrainingEpochs * samples.size()) << std::endl;
-        std::cout << "Epoch " << epoch << std::endl;
-        auto end = std::chrono::high_resolution_clock::now();
-        auto duration =
-            std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
-        double rate = 1000 * 5000.0 / duration.count();
-        std::cout << "Training rate (samples per second): " << rate
-                  << std::endl;
-        start = std::chrono::high_resolution_clock::now();
+  if (options.count("--pipeline") == 1) {
+    TrainPipelined(&test_net, samples, kNumTrainingEpochs);
+  } else {
+    std::cout << "Moving samples to GPU..." << std::endl;
+    std::vector<std::unique_ptr<compute::ClBuffer>> inputs;
+    std::vector<std::unique_ptr<compute::ClBuffer>> outputs;
+
+    for (const auto& sample : samples) {
+      auto input = sample.NormalizedInput(&test_net);
+      auto expected = sample.OneHotEncodedOutput(&test_net);
+      input->MoveToGpu();
+      expected->MoveToGpu();
+      inputs.emplace_back(std::move(input));
+      outputs.emplace_back(std::move(expected));
+    }
+    for (const auto& sample : test_batch) {
+      auto input = sample.NormalizedInput(&test_net);
+      auto expected = sample.OneHotEncodedOutput(&test_net);
+      input->MoveToGpu();
+      expected->MoveToGpu();
+      inputs.emplace_back(std::move(input));
+      outputs.emplace_back(std::move(expected));
+    }
+    std::cout << "Entire dataset of " << inputs.size()
+              << " examples is now stored on GPU!" << std::endl;
+
+    // constexpr int kBatchSize=50;
+
+    int samples_so_far = 0;
+    auto start = std::chrono::high_resolution_clock::now();
+    for (size_t epoch = 1; epoch <= kNumTrainingEpochs; ++epoch) {
+      for (size_t i = 0; i < samples.size(); i += 1) {
+        auto& input = inputs[i];
+        auto& expected = outputs[i];
+        // SGD
+        test_net.Train(input, expected);
+
+        // Minibatch.
+        // std::vector<int> batch(kBatchSize);
+        // std::generate(batch.begin(), batch.end(), std::rand);
+        // std::set<int> batch_set(batch.begin(), batch.end());
+        // test_net.BatchTrain(inputs, outputs, batch_set);
+
+        samples_so_far++;
+        if (samples_so_far % 100000 == 0) {
+          PrintStatus(&test_net, samples, 1000);
+          SaveWeightsToFile(&test_net, weight_file_path);
+        }
+        if (samples_so_far % 5000 == 0) {
+          std::cout << "Progress: " << samples_so_far - 1 << " / "
+                    << (kNumTrainingEpochs * samples.size()) << std::endl;
+          std::cout << "Epoch " << epoch << std::endl;
+          auto end = std::chrono::high_resolution_clock::now();
+          auto duration =
+              std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
+          double rate = 1000 * 5000.0 / duration.count();
+          std::cout << "Training rate (samples per second): " << rate
+                    << std::endl;
+          start = std::chrono::high_resolution_clock::now();
+        }
       }
     }
   }
 
   std::cout << "Training completed!" << std::endl;
+  PrintAccuracyReport(&test_net, test_batch);
+
+  if (test_net.profiler() != nullptr) {
+    test_net.profiler()->WriteSummary(std::cout);
+    if (test_net.profiler()->SaveChromeTrace("cifar_trace.json")) {
+      std::cout << "Wrote the device trace to cifar_trace.json." << std::endl;
+    }
+  }
+
+  if (options.count("--quantize") == 1) {
+    PrintQuantizationReport(&test_net, samples, test_batch);
+  }
 
   char kTempDirectory[] = "/tmp/cifarsort.XXXXXX";
   std::string tempdir(mkdtemp(kTempDirectory));
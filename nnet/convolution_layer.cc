@@ -1,6 +1,7 @@
 #include "nnet/convolution_layer.h"
 
 #include <cassert>
+#include <sstream>
 
 namespace nnet {
 
@@ -47,224 +48,520 @@ const std::vector<std::string> &ConvolutionLayer::weights() const {
   return generator_.weights();
 }
 
+// The generated code is specialized to the layer: dimensions are folded into
+// constants, the output coordinates are computed once, and filters of up to
+// kMaxUnrolledTaps taps per plane are unrolled so that each tap reads the
+// input and weights at a constant offset. Padding is only checked for outputs
+// whose filter overlaps the border of the input.
 void ConvolutionLayer::GenerateOutputCode(const symbolic::Expression &index,
                                           codegen::Generator *cg) const {
+  OutputCode(index, /*quantized=*/false, cg);
+}
+
+// The quantized code reads int8 filters, and accumulates in an int starting
+// from the int32 bias of the filter.
+void ConvolutionLayer::GenerateQuantizedOutputCode(
+    const symbolic::Expression &index, codegen::Generator *cg) const {
+  OutputCode(index, /*quantized=*/true, cg);
+}
+
+size_t ConvolutionLayer::QuantizedRowSize() const {
+  return filters_.width * filters_.height * filters_.depth + 1;
+}
+
+void ConvolutionLayer::OutputCode(const symbolic::Expression &index,
+                                  bool quantized,
+                                  codegen::Generator *cg) const {
   std::tuple<size_t, size_t, size_t> output_dims =
       GetOutputDimensions(imdim_, filters_);
   size_t output_width = std::get<0>(output_dims);
   size_t output_height = std::get<1>(output_dims);
-  size_t output_depth = std::get<2>(output_dims);
 
-  symbolic::Expression output_row = symbolic::Unflatten3dRow(
-      output_width, output_height, output_depth, index);
+  const std::string input_width = std::to_string(imdim_.width);
+  const std::string input_height = std::to_string(imdim_.height);
+  const std::string input_plane_size =
+      std::to_string(imdim_.width * imdim_.height);
+  const std::string filter_plane_size =
+      std::to_string(filters_.width * filters_.height);
+  const size_t filter_size =
+      filters_.width * filters_.height * filters_.depth;
 
-  symbolic::Expression output_col = symbolic::Unflatten3dCol(
-      output_width, output_height, output_depth, index);
+  UnflattenIndexCode(index.to_string(), output_width, output_height, "output",
+                     cg);
+  // Top-left corner of the filter in the input.
+  const std::string stride =
+      (filters_.stride == 1) ? "" : " * " + std::to_string(filters_.stride);
+  const std::string padding =
+      (filters_.padding == 0) ? "" : " - " + std::to_string(filters_.padding);
+  cg->AppendLineOfCode(
+      cg->assign("const int input_row", "output_row" + stride + padding) +
+      cg->linesep());
+  cg->AppendLineOfCode(
+      cg->assign("const int input_col", "output_col" + stride + padding) +
+      cg->linesep());
+  cg->AppendLineOfCode(
+      cg->assign(quantized ? "global const char* filter"
+                           : "global number* filter",
+                 "W + output_z * " + std::to_string(filter_size + 1)) +
+      cg->linesep());
+  cg->AppendLineOfCode(
+      cg->assign("int input", "input_row * " + input_width + " + input_col") +
+      cg->linesep());
+  cg->AppendLineOfCode(
+      (quantized
+           ? cg->assign("int output", cg->array_access("B", "output_z"))
+           : cg->assign("number output",
+                        cg->array_access("filter",
+                                         std::to_string(filter_size)))) +
+      cg->linesep());
 
-  symbolic::Expression output_filter = symbolic::Unflatten3dPlane(
-      output_width, output_height, output_depth, index);
+  const bool unroll = filters_.width * filters_.height <= kMaxUnrolledTaps;
+  // Without padding, every tap of every output is inside the input.
+  const bool bounds_check = filters_.padding != 0;
 
-  symbolic::Expression conv_row, conv_col;
-  std::tie(conv_row, conv_col) = GetInputCoordinates(output_row, output_col);
+  // Appends the code for a single tap of the filter on the current plane.
+  // f_y and f_x are either constants or loop variables.
+  auto tap_code = [&](const std::string &f_y, const std::string &f_x,
+                      const std::string &in_range) {
+    const std::string weight = cg->array_access(
+        "filter", unroll ? std::to_string(std::stoul(f_y) * filters_.width +
+                                          std::stoul(f_x))
+                         : f_y + " * " + std::to_string(filters_.width) +
+                               " + " + f_x);
+    const std::string value = cg->array_access(
+        "I", unroll ? "input + " + std::to_string(std::stoul(f_y) *
+                                                      imdim_.width +
+                                                  std::stoul(f_x))
+                    : "input + " + f_y + " * " + input_width + " + " + f_x);
+    const std::string sum =
+        cg->add_assign("output", weight + " * " + value) + cg->linesep();
+    return in_range.empty() ? sum : cg->if_expr(in_range) + " " + sum;
+  };
+  auto row_in_range = [&](const std::string &f_y) {
+    return cg->op_and("input_row + " + f_y + " >= 0",
+                      "input_row + " + f_y + " < " + input_height);
+  };
+  auto col_in_range = [&](const std::string &f_x) {
+    return cg->op_and("input_col + " + f_x + " >= 0",
+                      "input_col + " + f_x + " < " + input_width);
+  };
+  // Appends the loop over the planes of the input.
+  auto planes_code = [&](bool check) {
+    cg->AppendLineOfCode(
+        "for (int f_z = 0; f_z < " + std::to_string(filters_.depth) +
+        "; ++f_z, filter += " + filter_plane_size +
+        ", input += " + input_plane_size + ")");
+    cg->PushScope();
+    if (unroll) {
+      for (size_t f_y = 0; f_y < filters_.height; ++f_y) {
+        for (size_t f_x = 0; f_x < filters_.width; ++f_x) {
+          cg->AppendLineOfCode(tap_code(
+              std::to_string(f_y), std::to_string(f_x),
+              check ? cg->op_and("row_in_range_" + std::to_string(f_y),
+                                 "col_in_range_" + std::to_string(f_x))
+                    : ""));
+        }
+      }
+    } else {
+      cg->AppendLineOfCode(
+          cg->for_loop("int f_y = 0",
+                       "f_y < " + std::to_string(filters_.height), "++f_y",
+                       cg->for_loop("int f_x = 0",
+                                    "f_x < " + std::to_string(filters_.width),
+                                    "++f_x",
+                                    tap_code("f_y", "f_x",
+                                             check ? cg->op_and(
+                                                         row_in_range("f_y"),
+                                                         col_in_range("f_x"))
+                                                   : ""))));
+    }
+    cg->PopScope();
+  };
 
-  // Sum up the convolution, adding it to the output.
-  cg->AppendLineOfCode(
-      cg->assign("double output", generator_.W(output_filter).to_string()) +
+  if (!bounds_check) {
+    planes_code(false);
+    cg->AppendLineOfCode("return output" + cg->linesep());
+    return;
+  }
+
+  // Outputs whose filter lies entirely inside the input skip the checks.
+  cg->AppendLineOfCode(cg->assign(
+      "const int interior",
+      cg->op_and(cg->op_and("input_row >= 0",
+                            "input_row + " +
+                                std::to_string(filters_.height) +
+                                " <= " + input_height),
+                 cg->op_and("input_col >= 0",
+                            "input_col + " + std::to_string(filters_.width) +
+                                " <= " + input_width))) +
       cg->linesep());
-  symbolic::Expression f_x = symbolic::Expression::CreateInteger("f_x");
-  symbolic::Expression f_y = symbolic::Expression::CreateInteger("f_y");
-  symbolic::Expression f_z = symbolic::Expression::CreateInteger("f_z");
-  symbolic::Expression input_x = conv_col + f_x - filters_.width/2;
-  symbolic::Expression input_y = conv_row + f_y - filters_.height/2;
-  symbolic::Expression input_z = f_z;
-  symbolic::Expression output_factor =
-      generator_.W(output_filter, f_y, f_x, f_z) *
-      generator_.BoundsCheckedI(input_y, input_x, input_z);
-  string output_sum =
-      cg->add_assign("output", output_factor.to_string() + cg->linesep());
-  string for_loop_z =
-      cg->for_loop("int f_z = 0", "f_z < " + std::to_string(filters_.depth),
-                   "++f_z", output_sum);
-  string for_loop_yz =
-      cg->for_loop("int f_y = 0", "f_y < " + std::to_string(filters_.height),
-                   "++f_y", for_loop_z);
-  string for_loop_xyz =
-      cg->for_loop("int f_x = 0", "f_x < " + std::to_string(filters_.width),
-                   "++f_x", for_loop_yz);
-  cg->AppendLineOfCode(for_loop_xyz);
+  cg->AppendLineOfCode(cg->if_expr("interior"));
+  cg->PushScope();
+  planes_code(false);
+  cg->AppendLineOfCode("return output" + cg->linesep());
+  cg->PopScope();
+  if (unroll) {
+    for (size_t f_y = 0; f_y < filters_.height; ++f_y) {
+      cg->AppendLineOfCode(
+          cg->assign("const int row_in_range_" + std::to_string(f_y),
+                     row_in_range(std::to_string(f_y))) +
+          cg->linesep());
+    }
+    for (size_t f_x = 0; f_x < filters_.width; ++f_x) {
+      cg->AppendLineOfCode(
+          cg->assign("const int col_in_range_" + std::to_string(f_x),
+                     col_in_range(std::to_string(f_x))) +
+          cg->linesep());
+    }
+  }
+  planes_code(true);
   cg->AppendLineOfCode("return output" + cg->linesep());
 }
 
-// Returns Row, Col symbolic.
-std::tuple<symbolic::Expression, symbolic::Expression>
-ConvolutionLayer::GetInputCoordinates(
-    const symbolic::Expression &output_row,
-    const symbolic::Expression &output_col) const {
-  return std::make_tuple<symbolic::Expression, symbolic::Expression>(
-      output_row * filters_.stride - filters_.padding + (filters_.height / 2),
-      output_col * filters_.stride - filters_.padding + (filters_.width / 2));
-}
-
-// Returns Row, Col symbolic.
-std::tuple<symbolic::Expression, symbolic::Expression>
-ConvolutionLayer::GetOutputCoordinates(
-    const symbolic::Expression &input_row,
-    const symbolic::Expression &input_col) const {
-  return std::make_tuple<symbolic::Expression, symbolic::Expression>(
-      (input_row + filters_.padding - (filters_.height / 2)) / filters_.stride,
-      (input_col + filters_.padding - (filters_.width / 2)) / filters_.stride);
-}
-
+// Input (row, col) is tap (f_y, f_x) of the output at
+// ((row + padding - f_y) / stride, (col + padding - f_x) / stride), if the
+// division is exact and that output exists. The input gradient sums these taps
+// over every filter. Like the output code, it is specialized to the layer:
+// filters of up to kMaxUnrolledTaps taps per plane are unrolled, and with a
+// stride of 1, inputs whose taps all land on outputs skip the checks.
 void ConvolutionLayer::InputGradientCode(const symbolic::Expression &index,
                                          codegen::Generator *cg) const {
   std::tuple<size_t, size_t, size_t> output_dims =
       GetOutputDimensions(imdim_, filters_);
-  size_t output_width = std::get<0>(output_dims);
-  size_t output_height = std::get<1>(output_dims);
-  size_t output_depth = std::get<2>(output_dims);
-  size_t input_width = imdim_.width;
-  size_t input_height = imdim_.height;
-  size_t input_depth = imdim_.depth;
-
-  symbolic::Expression input_row =
-      symbolic::Unflatten3dRow(input_width, input_height, input_depth, index);
-
-  symbolic::Expression input_col =
-      symbolic::Unflatten3dCol(input_width, input_height, input_depth, index);
-
-  symbolic::Expression input_plane =
-      symbolic::Unflatten3dPlane(input_width, input_height, input_depth, index);
-
-  symbolic::Expression output_row, output_col;
-  std::tie(output_row, output_col) = GetOutputCoordinates(input_row, input_col);
-
-  // The "net" includes all outputs which depend on this input. This is
-  // determined in the input coordinate domain by the filter size. After finding
-  // the farthest points in the input domain for which the convolution filter
-  // would include this input, those farthest points are converted to the output
-  // domain to create the output net.
-  int input_net_width = filters_.width / 2;
-  int input_net_height = filters_.height / 2;
-
-  // The two farthest points are referred to as "a" and "b" (a being closer to
-  // (0, 0) and b being closer to (width, height)). These are opposite corners
-  // of a rectangle containing all points which, if used as the center of a
-  // convolution, would include the currently selected input.
-  symbolic::Expression input_a_row = input_row - input_net_height;
-  symbolic::Expression input_a_col = input_col - input_net_width;
-  symbolic::Expression input_b_row = input_row + input_net_height;
-  symbolic::Expression input_b_col = input_col + input_net_width;
-  
-  // Convert the net endpoints from the input domain to the output domain.
-  // This may result in the rectangle not perfectly covering the same points, as
-  // input->output is a many to one relationship. However, in the case where a
-  // point is covered which does not include this input in its convolution,
-  // bounds checking will result in the gradient for that point to be zero (see
-  // BoundsCheckedW()) and in the case where a point is not covered, it is
-  // because there exists no output centered on that input point (in cases where
-  // stride > 1), so rounding down will give us the furthest point in that
-  // direction which might cover this input in its convolution.
-  symbolic::Expression output_a_row, output_a_col, output_b_row, output_b_col;
-  std::tie(output_a_row, output_a_col) = GetOutputCoordinates(input_a_row, input_a_col);
-  std::tie(output_b_row, output_b_col) = GetOutputCoordinates(input_b_row, input_b_col);
-
-  // Sum up the convolution, adding it to the output.
-  cg->AppendLineOfCode(cg->assign("double gradient", "0") + cg->linesep());
-  // d iterates from output_a_row to output_b_row.
-  symbolic::Expression d = symbolic::Expression::CreateInteger("d");
-  // k iterates from output_a_col to output_b_col.
-  symbolic::Expression k = symbolic::Expression::CreateInteger("k");
-  symbolic::Expression filter = symbolic::Expression::CreateInteger("filter");
-  symbolic::Expression z = input_plane;
-  symbolic::Expression neighbor_output_flat_index =
-      symbolic::Flatten3d(output_width, output_height, output_depth,
-                          d, k, filter);
-
-  symbolic::Expression input_d, input_k;
-  std::tie(input_d, input_k) = GetInputCoordinates(d, k);
-  symbolic::Expression self_in_neighbor_row = input_row - input_d + (filters_.height / 2);
-  symbolic::Expression self_in_neighbor_col = input_col - input_k + (filters_.width / 2);
-  // When looking at the gradient component propagated from a neighbor
-  // output, we want to consider which weight this input is multiplied by
-  // to generate that output (this is the derivative wrt ourselves). So to
-  // get this, we need to figure out the relative coordinate of this input
-  // within the convolution domain of the neighboring output. Thinking of
-  // the 1-dimensional case, say you have a convolution of width 3. If you
-  // are looking for the backprop gradients of position I in an input
-  // array...
-  // Example 1D convolution:
-  //                 [ w1, w2, w3]
-  // [i[-3], i[-2], i[-1], i, i[+1], i[+2], i[+3]]
-  //
-  // output = (i[-1] * w1) + (i * w2) + (i[+1] * w3)
-  //
-  // derivative of output w.r.t. i[-1] = w1.
-  //
-  // So for all partial derivatives wrt to some input, we need to find the
-  // weights (w1 in this case) multiplied by this input in order to
-  // generate all neighboring outputs.
-  symbolic::Expression gradient_factor =
-      generator_.BoundsCheckedW(filter, self_in_neighbor_row, self_in_neighbor_col, z) *
-      generator_.GRADIENT(neighbor_output_flat_index);
-  symbolic::Expression bounds_checked_gradient_factor = IfInRange(input_d, 0, imdim_.height, IfInRange(input_k, 0, imdim_.width, gradient_factor, 0.0), 0.0);
-  string output_sum = cg->add_assign(
-      "gradient", bounds_checked_gradient_factor.to_string() + cg->linesep());
-
-  string for_loop_f = cg->for_loop(
-      "int filter = 0", "filter < " + std::to_string(filters_.num_filters),
-      "++filter", output_sum);
-  string for_loop_kf =
-      cg->for_loop("int k = " + output_a_col.to_string(),
-                   "k <= " + output_b_col.to_string(), "++k", for_loop_f);
-  string for_loop_dkf =
-      cg->for_loop("int d = " + output_a_row.to_string(),
-                   "d <= " + output_b_row.to_string(), "++d", for_loop_kf);
-  cg->AppendLineOfCode(for_loop_dkf);
+  const size_t output_width = std::get<0>(output_dims);
+  const size_t output_height = std::get<1>(output_dims);
+  const size_t filter_size =
+      filters_.width * filters_.height * filters_.depth;
+
+  UnflattenIndexCode(index.to_string(), imdim_.width, imdim_.height, "input",
+                     cg);
+  // The weights of this input's plane, in the first filter.
+  cg->AppendLineOfCode(
+      cg->assign("global number* filter",
+                 "W + input_z * " +
+                     std::to_string(filters_.width * filters_.height)) +
+      cg->linesep());
+  cg->AppendLineOfCode(
+      cg->assign("const global number* output_gradient", "GRADIENT") +
+      cg->linesep());
+  cg->AppendLineOfCode(cg->assign("number gradient", "0") + cg->linesep());
+
+  const bool unroll = filters_.width * filters_.height <= kMaxUnrolledTaps;
+  const std::string padding =
+      (filters_.padding == 0) ? "" : " + " + std::to_string(filters_.padding);
+  const std::string stride = std::to_string(filters_.stride);
+
+  // Appends the output row (or column) of tap f of axis, and whether the
+  // input is on that tap of an output.
+  auto axis_code = [&](const std::string &axis, const std::string &f,
+                       const std::string &suffix, size_t output_size) {
+    const std::string numerator =
+        "input_" + axis + padding + ((f == "0") ? "" : " - " + f);
+    const std::string output = "out_" + axis + suffix;
+    if (filters_.stride == 1) {
+      cg->AppendLineOfCode(cg->assign("const int " + output, numerator) +
+                           cg->linesep());
+      cg->AppendLineOfCode(
+          cg->assign("const int " + axis + "_ok" + suffix,
+                     cg->op_and(output + " >= 0",
+                                output + " < " +
+                                    std::to_string(output_size))) +
+          cg->linesep());
+      return;
+    }
+    cg->AppendLineOfCode(
+        cg->assign("const int " + output, "(" + numerator + ") / " + stride) +
+        cg->linesep());
+    cg->AppendLineOfCode(
+        cg->assign("const int " + axis + "_ok" + suffix,
+                   cg->op_and(cg->op_and(numerator + " >= 0",
+                                         "(" + numerator + ") % " + stride +
+                                             " == 0"),
+                              output + " < " + std::to_string(output_size))) +
+        cg->linesep());
+  };
+  // Appends the code for a single tap of every filter. f_y and f_x are
+  // either constants or loop variables, and suffix names their outputs.
+  auto tap_code = [&](const std::string &f_y, const std::string &f_x,
+                      const std::string &row_suffix,
+                      const std::string &col_suffix, bool check) {
+    const std::string weight = cg->array_access(
+        "filter", unroll ? std::to_string(std::stoul(f_y) * filters_.width +
+                                          std::stoul(f_x))
+                         : f_y + " * " + std::to_string(filters_.width) +
+                               " + " + f_x);
+    const std::string output_gradient = cg->array_access(
+        "output_gradient", "out_row" + row_suffix + " * " +
+                               std::to_string(output_width) + " + out_col" +
+                               col_suffix);
+    const std::string sum =
+        cg->add_assign("gradient", weight + " * " + output_gradient) +
+        cg->linesep();
+    return check ? cg->if_expr(cg->op_and("row_ok" + row_suffix,
+                                          "col_ok" + col_suffix)) +
+                       " " + sum
+                 : sum;
+  };
+  // Appends the loop over the filters.
+  auto filters_code = [&](bool check) {
+    cg->AppendLineOfCode(
+        "for (int f = 0; f < " + std::to_string(filters_.num_filters) +
+        "; ++f, filter += " + std::to_string(filter_size + 1) +
+        ", output_gradient += " +
+        std::to_string(output_width * output_height) + ")");
+    cg->PushScope();
+    if (unroll) {
+      for (size_t f_y = 0; f_y < filters_.height; ++f_y) {
+        for (size_t f_x = 0; f_x < filters_.width; ++f_x) {
+          cg->AppendLineOfCode(tap_code(
+              std::to_string(f_y), std::to_string(f_x),
+              "_" + std::to_string(f_y), "_" + std::to_string(f_x), check));
+        }
+      }
+    } else {
+      cg->AppendLineOfCode("for (int f_y = 0; f_y < " +
+                           std::to_string(filters_.height) + "; ++f_y)");
+      cg->PushScope();
+      axis_code("row", "f_y", "", output_height);
+      cg->AppendLineOfCode("for (int f_x = 0; f_x < " +
+                           std::to_string(filters_.width) + "; ++f_x)");
+      cg->PushScope();
+      axis_code("col", "f_x", "", output_width);
+      cg->AppendLineOfCode(tap_code("f_y", "f_x", "", "", /*check=*/true));
+      cg->PopScope();
+      cg->PopScope();
+    }
+    cg->PopScope();
+  };
+
+  if (!unroll) {
+    filters_code(true);
+    cg->AppendLineOfCode("return gradient" + cg->linesep());
+    return;
+  }
+
+  for (size_t f_y = 0; f_y < filters_.height; ++f_y) {
+    axis_code("row", std::to_string(f_y), "_" + std::to_string(f_y),
+              output_height);
+  }
+  for (size_t f_x = 0; f_x < filters_.width; ++f_x) {
+    axis_code("col", std::to_string(f_x), "_" + std::to_string(f_x),
+              output_width);
+  }
+  if (filters_.stride == 1) {
+    // Every tap lands on an output when the first and last ones do.
+    const std::string last_row = "_" + std::to_string(filters_.height - 1);
+    const std::string last_col = "_" + std::to_string(filters_.width - 1);
+    cg->AppendLineOfCode(cg->if_expr(cg->op_and(
+        cg->op_and("row_ok_0", "row_ok" + last_row),
+        cg->op_and("col_ok_0", "col_ok" + last_col))));
+    cg->PushScope();
+    filters_code(false);
+    cg->AppendLineOfCode("return gradient" + cg->linesep());
+    cg->PopScope();
+  }
+  filters_code(true);
   cg->AppendLineOfCode("return gradient" + cg->linesep());
 }
 
+// Weight (f_z, f_y, f_x) of a filter multiplies input
+// (f_z, out_row * stride - padding + f_y, out_col * stride - padding + f_x)
+// to compute output (out_row, out_col) of the filter. The range of outputs
+// for which that input exists is computed up front, so the loops over the
+// outputs have no bounds checks.
 void ConvolutionLayer::WeightGradientCode(const symbolic::Expression &index,
                                           codegen::Generator *cg) const {
+  std::tuple<size_t, size_t, size_t> output_dims =
+      GetOutputDimensions(imdim_, filters_);
+  const size_t output_width = std::get<0>(output_dims);
+  const size_t output_height = std::get<1>(output_dims);
+  const size_t filter_size =
+      filters_.width * filters_.height * filters_.depth;
+
+  cg->AppendLineOfCode(
+      cg->assign("const int weight_filter",
+                 index.to_string() + " / " + std::to_string(filter_size + 1)) +
+      cg->linesep());
+  cg->AppendLineOfCode(
+      cg->assign("const int weight_offset",
+                 index.to_string() + " - weight_filter * " +
+                     std::to_string(filter_size + 1)) +
+      cg->linesep());
+  cg->AppendLineOfCode(
+      cg->assign("const global number* output_gradient",
+                 "GRADIENT + weight_filter * " +
+                     std::to_string(output_width * output_height)) +
+      cg->linesep());
+  cg->AppendLineOfCode(cg->assign("number gradient", "0") + cg->linesep());
+
+  // The bias is added to every output of the filter.
+  cg->AppendLineOfCode(cg->if_expr("weight_offset == " +
+                                   std::to_string(filter_size)));
+  cg->PushScope();
+  cg->AppendLineOfCode(cg->for_loop(
+      "int output = 0",
+      "output < " + std::to_string(output_width * output_height), "++output",
+      cg->add_assign("gradient",
+                     cg->array_access("output_gradient", "output")) +
+          cg->linesep()));
+  cg->AppendLineOfCode("return gradient" + cg->linesep());
+  cg->PopScope();
+
+  UnflattenIndexCode("weight_offset", filters_.width, filters_.height,
+                     "weight", cg);
+  cg->AppendLineOfCode(
+      cg->assign("const global activation* input",
+                 "I + weight_z * " +
+                     std::to_string(imdim_.width * imdim_.height)) +
+      cg->linesep());
+
+  const std::string padding = std::to_string(filters_.padding);
+  const std::string stride = std::to_string(filters_.stride);
+  // Appends the first and last + 1 output row (or column) whose input is
+  // inside the input, clamped to the outputs.
+  auto range_code = [&](const std::string &axis, size_t input_size,
+                        size_t output_size) {
+    const std::string weight = "weight_" + axis;
+    const std::string first = padding + " - " + weight;
+    const std::string last =
+        std::to_string(input_size - 1) + " + " + padding + " - " + weight;
+    const std::string end = (filters_.stride == 1)
+                                ? "(" + last + ") + 1"
+                                : "(" + last + ") / " + stride + " + 1";
+    cg->AppendLineOfCode(
+        cg->assign("const int " + axis + "_begin",
+                   cg->ternary(first + " > 0",
+                               (filters_.stride == 1)
+                                   ? first
+                                   : "(" + first + " + " +
+                                         std::to_string(filters_.stride - 1) +
+                                         ") / " + stride,
+                               "0")) +
+        cg->linesep());
+    cg->AppendLineOfCode(cg->assign("const int " + axis + "_end_unclamped",
+                                    cg->ternary(last + " < 0", "0", end)) +
+                         cg->linesep());
+    cg->AppendLineOfCode(
+        cg->assign("const int " + axis + "_end",
+                   cg->ternary(axis + "_end_unclamped < " +
+                                   std::to_string(output_size),
+                               axis + "_end_unclamped",
+                               std::to_string(output_size))) +
+        cg->linesep());
+  };
+  range_code("row", imdim_.height, output_height);
+  range_code("col", imdim_.width, output_width);
+
+  const std::string column_step =
+      (filters_.stride == 1) ? "out_col" : "out_col * " + stride;
+  cg->AppendLineOfCode("for (int out_row = row_begin; out_row < row_end; "
+                       "++out_row)");
+  cg->PushScope();
+  cg->AppendLineOfCode(
+      cg->assign("const int input_line",
+                 "(out_row * " + stride + " - " + padding + " + weight_row) * " +
+                     std::to_string(imdim_.width) + " - " + padding +
+                     " + weight_col") +
+      cg->linesep());
+  cg->AppendLineOfCode(cg->for_loop(
+      "int out_col = col_begin", "out_col < col_end", "++out_col",
+      cg->add_assign(
+          "gradient",
+          cg->array_access("output_gradient",
+                           "out_row * " + std::to_string(output_width) +
+                               " + out_col") +
+              " * " + cg->array_access("input", "input_line + " + column_step)) +
+          cg->linesep()));
+  cg->PopScope();
+  cg->AppendLineOfCode("return gradient" + cg->linesep());
+}
+
+namespace {
+
+size_t DivideRoundingUp(size_t a, size_t b) { return (a + b - 1) / b; }
+
+}  // namespace
+
+bool ConvolutionLayer::WinogradEligible(const FilterParams &filters) {
+  return filters.width == 3 && filters.height == 3 && filters.stride == 1;
+}
+
+std::string ConvolutionLayer::TiledEvaluationTemplate() const {
+  switch (filters_.strategy) {
+    case Im2ColConvolution:
+      return "nnet/kernels/convolution_im2col.kernel.cl";
+    case WinogradConvolution:
+      return WinogradEligible(filters_)
+                 ? "nnet/kernels/convolution_winograd.kernel.cl"
+                 : "";
+    default:
+      return "";
+  }
+}
+
+std::vector<std::pair<std::string, size_t>>
+ConvolutionLayer::TiledKernelParameters() const {
   std::tuple<size_t, size_t, size_t> output_dims =
       GetOutputDimensions(imdim_, filters_);
   size_t output_width = std::get<0>(output_dims);
   size_t output_height = std::get<1>(output_dims);
-  size_t output_depth = std::get<2>(output_dims);
+  return {
+      {"INPUT_WIDTH", imdim_.width},
+      {"INPUT_HEIGHT", imdim_.height},
+      {"OUTPUT_WIDTH", output_width},
+      {"OUTPUT_HEIGHT", output_height},
+      {"FILTER_WIDTH", filters_.width},
+      {"FILTER_HEIGHT", filters_.height},
+      {"FILTER_DEPTH", filters_.depth},
+      // Weights per filter, not counting the bias.
+      {"FILTER_SIZE", filters_.width * filters_.height * filters_.depth},
+      {"NUM_FILTERS", filters_.num_filters},
+      {"STRIDE", filters_.stride},
+      {"PADDING", filters_.padding},
+      {"TILE_WIDTH", kTileWidth},
+      {"FILTERS_PER_ITEM", kFiltersPerItem},
+      {"PIXELS_PER_ITEM", kPixelsPerItem},
+      {"TILE_DEPTH", kTileDepth},
+      // 2x2 output tiles of the Winograd kernel.
+      {"HORIZONTAL_TILES", DivideRoundingUp(output_width, 2)},
+      {"VERTICAL_TILES", DivideRoundingUp(output_height, 2)},
+      {"CHANNELS_PER_STEP", kWinogradChannelsPerStep},
+  };
+}
 
-  symbolic::Expression filter = generator_.GetWeightFilter(index);
-  symbolic::Expression weight_x = generator_.GetWeightX(index);
-  symbolic::Expression weight_y = generator_.GetWeightY(index);
-  symbolic::Expression weight_z = generator_.GetWeightZ(index);
-
-  cg->AppendLineOfCode(cg->assign("double gradient", "0") + cg->linesep());
-  symbolic::Expression out_x = symbolic::Expression::CreateInteger("out_x");
-  symbolic::Expression out_y = symbolic::Expression::CreateInteger("out_y");
-  symbolic::Expression output_flat_index = symbolic::Flatten3d(
-      output_width, output_height, output_depth, out_y, out_x, filter);
-  symbolic::Expression input_y, input_x;
-  std::tie(input_y, input_x) = GetInputCoordinates(out_y, out_x);
-  // Correctly handle the input for bias weight indices.
-  size_t filter_size = filters_.width * filters_.height * filters_.depth + 1;
-  symbolic::Expression input = symbolic::IfInRange(
-      index % filter_size, filter_size - 1, filter_size, 1.0,
-      // input_y is the center of the convolution, but weight coordinates use
-      // (0, 0) as the top-left, so subtract filters_.(height or width)/2 to
-      // translate coordinates.
-      generator_.BoundsCheckedI(input_y + weight_y - (filters_.height / 2),
-                                input_x + weight_x - (filters_.width / 2),
-                                weight_z));
-  symbolic::Expression gradient_factor =
-      generator_.GRADIENT(output_flat_index) * input;
-  string output_sum =
-      cg->add_assign("gradient", gradient_factor.to_string() + cg->linesep());
-  string for_loop_y = cg->for_loop("int out_y = 0",
-                                   "out_y < " + std::to_string(output_width),
-                                   "++out_y", output_sum);
-  string for_loop_xy = cg->for_loop("int out_x = 0",
-                                    "out_x < " + std::to_string(output_height),
-                                    "++out_x", for_loop_y);
-  cg->AppendLineOfCode(for_loop_xy);
-  cg->AppendLineOfCode("return gradient" + cg->linesep());
+// Dimension 0 covers the output pixels (or 2x2 output tiles, for Winograd) of
+// the whole batch, dimension 1 covers the filters.
+KernelRange ConvolutionLayer::TiledEvaluateRange(size_t batch_size) const {
+  std::tuple<size_t, size_t, size_t> output_dims =
+      GetOutputDimensions(imdim_, filters_);
+  const size_t filter_workgroups =
+      DivideRoundingUp(filters_.num_filters, kTileWidth * kFiltersPerItem);
+  if (filters_.strategy == WinogradConvolution) {
+    const size_t tiles = batch_size *
+                         DivideRoundingUp(std::get<0>(output_dims), 2) *
+                         DivideRoundingUp(std::get<1>(output_dims), 2);
+    return KernelRange{
+        {DivideRoundingUp(tiles, kTileWidth) * kTileWidth,
+         filter_workgroups * kTileWidth},
+        {kTileWidth, kTileWidth}};
+  }
+  const size_t pixels =
+      batch_size * std::get<0>(output_dims) * std::get<1>(output_dims);
+  const size_t pixel_workgroups =
+      DivideRoundingUp(pixels, kTileWidth * kPixelsPerItem);
+  return KernelRange{
+      {pixel_workgroups * kTileWidth, filter_workgroups * kTileWidth},
+      {kTileWidth, kTileWidth}};
+}
+
+std::string ConvolutionLayer::KernelSignature() const {
+  std::stringstream signature;
+  signature << Super::KernelSignature() << "[" << imdim_.width << "x"
+            << imdim_.height << "x" << imdim_.depth << ";" << filters_.width
+            << "x" << filters_.height << "x" << filters_.depth << ";"
+            << filters_.stride << ";" << filters_.padding << ";"
+            << filters_.num_filters << ";" << filters_.strategy << "]";
+  return signature.str();
 }
 
 std::unique_ptr<LayerImpl> ConvolutionLayer::Clone() const {
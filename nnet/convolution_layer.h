@@ -32,24 +32,49 @@ class ConvolutionLayer : public LayerImpl {
 
   void GenerateOutputCode(
       const symbolic::Expression& index, codegen::Generator *cg) const override;
+  void GenerateQuantizedOutputCode(
+      const symbolic::Expression& index, codegen::Generator *cg) const override;
+  size_t QuantizedRowSize() const override;
   void WeightGradientCode(const symbolic::Expression &index,
                           codegen::Generator *cg) const override;
   void InputGradientCode(const symbolic::Expression &index,
                          codegen::Generator *cg) const override;
 
+  std::string TiledEvaluationTemplate() const override;
+  std::vector<std::pair<std::string, size_t>> TiledKernelParameters()
+      const override;
+  KernelRange TiledEvaluateRange(size_t batch_size) const override;
+
   std::unique_ptr<LayerImpl> Clone() const override;
 
   std::string layer_type() const override {
     return "convolution_layer";
   }
 
+  std::string KernelSignature() const override;
+
+  // Tiling of the Im2ColConvolution kernel. Workgroups are kTileWidth x
+  // kTileWidth work items, each of which computes kFiltersPerItem filters for
+  // kPixelsPerItem output pixels. Pixels of every sample in the batch are
+  // packed together, so small layers still fill the workgroups. The filter
+  // taps are reduced kTileDepth at a time.
+  static constexpr size_t kTileWidth = 16;
+  static constexpr size_t kFiltersPerItem = 2;
+  static constexpr size_t kPixelsPerItem = 4;
+  static constexpr size_t kTileDepth = 16;
+
+  // Tiling of the WinogradConvolution kernel. Workgroups are kTileWidth x
+  // kTileWidth work items, each of which computes kFiltersPerItem filters for
+  // one 2x2 tile of outputs. The channels are reduced kWinogradChannelsPerStep
+  // at a time.
+  static constexpr size_t kWinogradChannelsPerStep = 4;
+
+  // True if the filters can be evaluated with WinogradConvolution.
+  static bool WinogradEligible(const FilterParams& filters);
+
  private:
-   std::tuple<symbolic::Expression, symbolic::Expression>
-   GetOutputCoordinates(const symbolic::Expression &input_row,
-                        const symbolic::Expression &input_col) const;
-   std::tuple<symbolic::Expression, symbolic::Expression>
-   GetInputCoordinates(const symbolic::Expression &output_row,
-                       const symbolic::Expression &output_col) const;
+   void OutputCode(const symbolic::Expression &index, bool quantized,
+                   codegen::Generator *cg) const;
    ConvSymbolGenerator generator_;
    FilterParams filters_;
    VolumeDimensions imdim_;
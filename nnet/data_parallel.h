@@ -0,0 +1,270 @@
+#ifndef DATA_PARALLEL_H
+#define DATA_PARALLEL_H
+
+#include "clutil/util.h"
+#include "compute/cl_buffer.h"
+#include "nnet/architecture.h"
+#include "nnet/layer_dimensions.h"
+#include "nnet/nnet.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <vector>
+
+namespace nnet {
+
+// Devices to place count replicas on. The default device is split into count
+// sub-devices with an equal share of its compute units if the driver allows it
+// (see clCreateSubDevices()), which keeps the replicas of a multi-core CPU from
+// competing for the same cores. Otherwise the platform's devices are used,
+// round-robin when there are fewer than count of them.
+inline std::vector<cl::Device> ReplicaDevices(size_t count) {
+  cl::Platform platform = clutil::GetDefaultPlatform();
+  std::vector<cl::Device> devices = clutil::GetPlatformDevices(platform);
+  if (devices.empty()) {
+    std::cerr << "No OpenCL Devices on this platform." << std::endl;
+    std::exit(1);
+  }
+
+  cl_uint compute_units = 0;
+  CL_CHECK(devices[0].getInfo(CL_DEVICE_MAX_COMPUTE_UNITS, &compute_units));
+  if (count > 1 && compute_units >= count) {
+    const cl_device_partition_property properties[] = {
+        CL_DEVICE_PARTITION_EQUALLY,
+        static_cast<cl_device_partition_property>(compute_units / count), 0};
+    std::vector<cl::Device> sub_devices;
+    if (devices[0].createSubDevices(properties, &sub_devices) == CL_SUCCESS &&
+        sub_devices.size() >= count) {
+      sub_devices.resize(count);
+      return sub_devices;
+    }
+  }
+
+  std::vector<cl::Device> replica_devices;
+  for (size_t i = 0; i < count; ++i) {
+    replica_devices.push_back(devices[i % devices.size()]);
+  }
+  return replica_devices;
+}
+
+// Trains a network on several devices at once, with synchronous data
+// parallelism. Each device holds a replica of the network with the same
+// weights. BatchTrain() splits the batch into one shard per replica, computes
+// the gradients of every shard on its replica (see Nnet::BatchGradients()),
+// sums them across replicas, and applies the sum on every replica. The
+// replicas take the same step, and the result is the same as training a
+// single network on the whole batch:
+//
+//   DataParallelTrainer trainer(model, ReplicaDevices(2));
+//   trainer.SetLearningParameters(params);
+//   for (size_t k = 0; k < batches; ++k) {
+//     trainer.BatchTrain(inputs[k], outputs[k], batch_size);
+//   }
+//   trainer.replica(0).Evaluate(...);
+//
+// The replicas have separate OpenCL contexts, so the gradients are summed
+// through the host: they are read back from every replica at once, summed,
+// and the sum is written back to every replica.
+class DataParallelTrainer {
+ public:
+  // A replica on each of devices.
+  DataParallelTrainer(const Architecture &model,
+                      const std::vector<cl::Device> &devices,
+                      LossFunction loss_function = MeanSquared,
+                      Nnet::Precision precision = Nnet::DoublePrecision) {
+    for (const cl::Device &device : devices) {
+      replicas_.push_back(std::make_unique<Nnet>(
+          model, replicas_.empty() ? Nnet::Xavier : Nnet::NoWeightInit,
+          loss_function, Nnet::OpenCl, precision, device));
+    }
+    Initialize(model);
+  }
+
+  // count replicas on the native CPU backend, which run one after the other.
+  // Only useful for testing, and for machines without OpenCL.
+  DataParallelTrainer(const Architecture &model, size_t count,
+                      LossFunction loss_function = MeanSquared) {
+    for (size_t i = 0; i < count; ++i) {
+      replicas_.push_back(std::make_unique<Nnet>(
+          model, replicas_.empty() ? Nnet::Xavier : Nnet::NoWeightInit,
+          loss_function, Nnet::NativeCpu));
+    }
+    Initialize(model);
+  }
+
+  size_t replicas() const { return replicas_.size(); }
+  Nnet &replica(size_t index) { return *replicas_[index]; }
+
+  void SetLearningParameters(const Nnet::LearningParameters &params) {
+    for (auto &replica : replicas_) {
+      replica->SetLearningParameters(params);
+    }
+  }
+
+  // One optimizer step on batch_size samples, packed back-to-back in inputs
+  // and outputs like the arguments of Nnet::BatchEvaluate(). Each replica
+  // gets a contiguous shard of the batch, so batch_size must be at least
+  // replicas().
+  void BatchTrain(const std::unique_ptr<compute::ClBuffer> &inputs,
+                  const std::unique_ptr<compute::ClBuffer> &outputs,
+                  size_t batch_size) {
+    if (batch_size < replicas_.size()) {
+      std::cerr << "DataParallelTrainer needs at least one sample per replica, "
+                << "got a batch of " << batch_size << " for "
+                << replicas_.size() << " replicas." << std::endl;
+      std::exit(1);
+    }
+    inputs->MoveToCpu();
+    outputs->MoveToCpu();
+
+    // Every replica is enqueued before any gradients are read back, so the
+    // devices work on their shards concurrently.
+    size_t first_sample = 0;
+    for (size_t r = 0; r < replicas_.size(); ++r) {
+      const size_t shard_size = batch_size / replicas_.size() +
+                                ((r < batch_size % replicas_.size()) ? 1 : 0);
+      const double *shard_inputs = inputs->data() + first_sample * input_size_;
+      const double *shard_outputs =
+          outputs->data() + first_sample * output_size_;
+      shard_inputs_[r] = std::make_unique<compute::ClBuffer>(
+          std::vector<double>(shard_inputs,
+                              shard_inputs + shard_size * input_size_));
+      shard_outputs_[r] = std::make_unique<compute::ClBuffer>(
+          std::vector<double>(shard_outputs,
+                              shard_outputs + shard_size * output_size_));
+      replicas_[r]->BatchGradients(shard_inputs_[r], shard_outputs_[r],
+                                   shard_size, &gradients_[r]);
+      first_sample += shard_size;
+    }
+
+    AllReduceGradients();
+    for (size_t r = 0; r < replicas_.size(); ++r) {
+      replicas_[r]->ApplyGradients(gradients_[r]);
+    }
+  }
+
+  // Copies the weights of replica 0 to the others. The replicas take the same
+  // steps, but different devices may round differently, so long runs can call
+  // this now and then to keep them from drifting apart.
+  void SyncWeights() {
+    Nnet &root = *replicas_[0];
+    for (size_t r = 1; r < replicas_.size(); ++r) {
+      for (size_t i = 0; i < root.number_of_layers(); ++i) {
+        compute::ClBuffer &source = root.layer(i).weight_buffer();
+        compute::ClBuffer &destination = replicas_[r]->layer(i).weight_buffer();
+        std::copy(source.data(), source.data() + source.size(),
+                  destination.data());
+      }
+    }
+  }
+
+ private:
+  // Replica 0 draws the initial weights, the others copy them.
+  void Initialize(const Architecture &model) {
+    if (replicas_.empty()) {
+      std::cerr << "DataParallelTrainer needs at least one replica."
+                << std::endl;
+      std::exit(1);
+    }
+    input_size_ = model.input_size();
+    output_size_ = model.output_size();
+    SyncWeights();
+    gradients_.resize(replicas_.size());
+    shard_inputs_.resize(replicas_.size());
+    shard_outputs_.resize(replicas_.size());
+    staging_.resize(replicas_.size());
+  }
+
+  // Sums the gradients of every replica on the host and writes the sum back
+  // to every replica. The reads of every layer and replica are enqueued
+  // before the host waits for any of them, and so are the writes.
+  void AllReduceGradients() {
+    const size_t layers = gradients_[0].size();
+    if (replicas_[0]->backend() == Nnet::NativeCpu) {
+      for (size_t i = 0; i < layers; ++i) {
+        compute::ClBuffer &sum = gradients_[0][i];
+        for (size_t r = 1; r < replicas_.size(); ++r) {
+          const compute::ClBuffer &gradients = gradients_[r][i];
+          for (size_t k = 0; k < sum.size(); ++k) {
+            sum[k] += gradients[k];
+          }
+        }
+        for (size_t r = 1; r < replicas_.size(); ++r) {
+          std::copy(sum.data(), sum.data() + sum.size(),
+                    gradients_[r][i].data());
+        }
+      }
+      return;
+    }
+
+    std::vector<cl::Event> reads;
+    for (size_t r = 0; r < replicas_.size(); ++r) {
+      staging_[r].resize(layers);
+      for (size_t i = 0; i < layers; ++i) {
+        compute::ClBuffer &gradients = gradients_[r][i];
+        if (gradients.size() == 0) {
+          continue;
+        }
+        reads.emplace_back();
+        gradients.EnqueueRead(gradients.command_queue(), &staging_[r][i],
+                              &reads.back());
+      }
+    }
+    if (!reads.empty()) {
+      CL_CHECK(cl::Event::waitForEvents(reads));
+    }
+
+    sums_.resize(layers);
+    std::vector<cl::Event> writes;
+    for (size_t i = 0; i < layers; ++i) {
+      const compute::ClBuffer &first = gradients_[0][i];
+      if (first.size() == 0) {
+        continue;
+      }
+      std::vector<double> &sum = sums_[i];
+      sum.resize(first.size());
+      first.ConvertStaging(staging_[0][i], sum.data());
+      values_.resize(first.size());
+      for (size_t r = 1; r < replicas_.size(); ++r) {
+        gradients_[r][i].ConvertStaging(staging_[r][i], values_.data());
+        for (size_t k = 0; k < sum.size(); ++k) {
+          sum[k] += values_[k];
+        }
+      }
+      // The staging buffers were read, they now stage the writes.
+      for (size_t r = 0; r < replicas_.size(); ++r) {
+        compute::ClBuffer &gradients = gradients_[r][i];
+        writes.emplace_back();
+        gradients.EnqueueWrite(sum.data(), gradients.command_queue(),
+                               &staging_[r][i], &writes.back());
+      }
+    }
+    // The staging buffers must outlive the writes.
+    if (!writes.empty()) {
+      CL_CHECK(cl::Event::waitForEvents(writes));
+    }
+  }
+
+  std::vector<std::unique_ptr<Nnet>> replicas_;
+  size_t input_size_ = 0;
+  size_t output_size_ = 0;
+  // gradients_[r][i] holds the gradients of layer i's weights on replica r.
+  std::vector<std::vector<compute::ClBuffer>> gradients_;
+  // Host memory of AllReduceGradients(), kept between batches.
+  // staging_[r][i] holds layer i's gradients on replica r in its device
+  // format, sums_[i] the sum of layer i's gradients.
+  std::vector<std::vector<std::vector<uint8_t>>> staging_;
+  std::vector<std::vector<double>> sums_;
+  std::vector<double> values_;
+  // The shards of the last batch. Kept until the next one, since the replicas
+  // may still be reading them.
+  std::vector<std::unique_ptr<compute::ClBuffer>> shard_inputs_;
+  std::vector<std::unique_ptr<compute::ClBuffer>> shard_outputs_;
+};
+
+}  // namespace nnet
+
+#endif /* DATA_PARALLEL_H */
@@ -1,4 +1,6 @@
 #include "nnet/dense_layer.h"
+#include "symbolic/cse.h"
+#include "symbolic/simplify.h"
 
 #include <vector>
 #include <cassert>
@@ -11,10 +13,24 @@ const std::vector<std::string>& DenseLayer::weights() const {
 
 void DenseLayer::GenerateOutputCode(const symbolic::Expression &output_index,
                                     codegen::Generator *cg) const {
+  OutputCode(output_index, /*quantized=*/false, cg);
+}
+
+void DenseLayer::GenerateQuantizedOutputCode(
+    const symbolic::Expression &output_index, codegen::Generator *cg) const {
+  OutputCode(output_index, /*quantized=*/true, cg);
+}
 
+// The quantized code differs only in the accumulator, which is an int holding
+// the int32 bias rather than the bias weight.
+void DenseLayer::OutputCode(const symbolic::Expression &output_index,
+                            bool quantized, codegen::Generator *cg) const {
   // Initialize output to bias weight value.
   cg->AppendLineOfCode(
-      cg->assign("double output", generator_.W(output_index).to_string()) +
+      (quantized ? cg->assign("int output",
+                              cg->array_access("B", output_index.to_string()))
+                 : cg->assign("number output",
+                              generator_.W(output_index).to_string())) +
       cg->linesep());
   symbolic::Expression i = Expression::CreateInteger("i");
   symbolic::Expression output_factor =
@@ -36,7 +52,10 @@ void DenseLayer::InputGradientCode(const symbolic::Expression &input_index,
     symbolic::Expression grad_component = generator_.GRADIENT(out_index) * generator_.W(symbolic::Expression(out_index), input_index);
     retval += grad_component;
   }
-  cg->AppendLineOfCode("return " + retval.to_string() + cg->linesep());
+  cg->AppendLineOfCode("return " +
+                       symbolic::HoistCommonSubexpressions(
+                           symbolic::Simplify(retval), cg) +
+                       cg->linesep());
 }
 
 // The weight gradient is just the input for that weight multiplied by the
@@ -51,11 +70,71 @@ void DenseLayer::WeightGradientCode(
                           generator_.GRADIENT(node) * generator_.I(edge),
                           generator_.GRADIENT(node));
 
-  cg->AppendLineOfCode("return " + retval.to_string() + cg->linesep());
+  cg->AppendLineOfCode("return " +
+                       symbolic::HoistCommonSubexpressions(
+                           symbolic::Simplify(retval), cg) +
+                       cg->linesep());
+}
+
+namespace {
+
+size_t DivideRoundingUp(size_t a, size_t b) { return (a + b - 1) / b; }
+
+}  // namespace
+
+std::string DenseLayer::TiledEvaluationTemplate() const {
+  return (strategy_ == TiledDense)
+             ? "nnet/kernels/dense_evaluate_tiled.kernel.cl"
+             : "";
+}
+
+std::string DenseLayer::TiledWeightUpdateTemplate() const {
+  return (strategy_ == TiledDense)
+             ? "nnet/kernels/dense_weight_update_tiled.kernel.cl"
+             : "";
+}
+
+std::vector<std::pair<std::string, size_t>> DenseLayer::TiledKernelParameters()
+    const {
+  return {
+      {"TILE_WIDTH", kTileWidth},
+      {"OUTPUTS_PER_ITEM", kOutputsPerItem},
+      {"SAMPLES_PER_ITEM", kSamplesPerItem},
+      {"TILE_DEPTH", kTileDepth},
+  };
+}
+
+// Dimension 0 covers the outputs, kTileWidth * kOutputsPerItem per workgroup.
+// Dimension 1 covers the batch, kSamplesPerItem samples per work item.
+KernelRange DenseLayer::TiledEvaluateRange(size_t batch_size) const {
+  const size_t workgroups =
+      DivideRoundingUp(dimensions_.num_outputs, kTileWidth * kOutputsPerItem);
+  return KernelRange{
+      {workgroups * kTileWidth, DivideRoundingUp(batch_size, kSamplesPerItem)},
+      {kTileWidth, 1}};
+}
+
+// Dimension 0 covers the weight columns (num_inputs + 1, including the bias).
+// Dimension 1 covers the outputs, kTileWidth * kOutputsPerItem per workgroup.
+KernelRange DenseLayer::TiledWeightUpdateRange() const {
+  const size_t columns =
+      DivideRoundingUp(dimensions_.num_inputs + 1, kTileWidth) * kTileWidth;
+  const size_t workgroups =
+      DivideRoundingUp(dimensions_.num_outputs, kTileWidth * kOutputsPerItem);
+  return KernelRange{{columns, workgroups * kTileWidth},
+                     {kTileWidth, kTileWidth}};
+}
+
+size_t DenseLayer::QuantizedRowSize() const {
+  return dimensions_.num_inputs + 1;
+}
+
+std::string DenseLayer::KernelSignature() const {
+  return Super::KernelSignature() + "[" + std::to_string(strategy_) + "]";
 }
 
 std::unique_ptr<LayerImpl> DenseLayer::Clone() const {
-  return std::make_unique<DenseLayer>(dimensions_, layer_index_);
+  return std::make_unique<DenseLayer>(dimensions_, layer_index_, strategy_);
 }
 
 }  // namespace nnet
@@ -20,31 +20,61 @@ class DenseLayer : public LayerImpl {
   // Reference objects in superclass with Super::
   using Super = LayerImpl;
 
-  DenseLayer(const Dimensions& dimensions, size_t layer_index)
+  DenseLayer(const Dimensions& dimensions, size_t layer_index,
+             DenseKernelStrategy strategy = GeneratedDense)
       : Super(dimensions, layer_index),
         generator_(dimensions),
-        dimensions_(dimensions) {}
+        dimensions_(dimensions),
+        strategy_(strategy) {}
 
   const std::vector<std::string>& weights() const override;
 
   void GenerateOutputCode(const symbolic::Expression &index,
                           codegen::Generator* cg) const override;
 
+  void GenerateQuantizedOutputCode(const symbolic::Expression &index,
+                                   codegen::Generator* cg) const override;
+  size_t QuantizedRowSize() const override;
+
   void InputGradientCode(const symbolic::Expression &input_index,
                          codegen::Generator* cg) const override;
 
   void WeightGradientCode(const symbolic::Expression &weight_index,
                           codegen::Generator* cg) const override;
 
+  std::string TiledEvaluationTemplate() const override;
+  std::string TiledWeightUpdateTemplate() const override;
+  std::vector<std::pair<std::string, size_t>> TiledKernelParameters()
+      const override;
+  KernelRange TiledEvaluateRange(size_t batch_size) const override;
+  KernelRange TiledWeightUpdateRange() const override;
+
   std::unique_ptr<LayerImpl> Clone() const override;
 
   std::string layer_type() const override {
     return "dense_layer";
   }
 
+  std::string KernelSignature() const override;
+
+  // Tiling of the TiledDense kernels. The evaluate kernel runs workgroups of
+  // kTileWidth work items, each of which computes kOutputsPerItem outputs for
+  // kSamplesPerItem samples. The weight update kernel runs kTileWidth x
+  // kTileWidth workgroups, each work item computing the gradients of
+  // kOutputsPerItem weights. Both kernels step through their reduction
+  // (inputs and samples respectively) kTileDepth values at a time.
+  static constexpr size_t kTileWidth = 16;
+  static constexpr size_t kOutputsPerItem = 4;
+  static constexpr size_t kSamplesPerItem = 4;
+  static constexpr size_t kTileDepth = 16;
+
  private:
+  void OutputCode(const symbolic::Expression &output_index, bool quantized,
+                  codegen::Generator* cg) const;
+
   DenseSymbolGenerator generator_;
   Dimensions dimensions_;
+  DenseKernelStrategy strategy_;
 };
 
 }  // namespace nnet
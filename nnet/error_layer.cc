@@ -1,4 +1,5 @@
 #include "nnet/error_layer.h"
+#include "symbolic/simplify.h"
 
 #include <fstream>
 
@@ -33,10 +34,11 @@ std::string FileToString(std::string filepath) {
   return buffer.str();
 }
 
-std::string ErrorLayer::GenerateErrorKernels() const {
+std::string ErrorLayer::GenerateErrorKernels(
+    bool use_reduction_kernels) const {
   std::string error_source = FileToString("nnet/kernels/error.kernel.cl");
 
-  symbolic::Expression error = GenerateErrorComponent();
+  symbolic::Expression error = symbolic::Simplify(GenerateErrorComponent());
   symbolic::Expression gradient = error.Derive(O().to_string());
 
   if (!FindAndReplace(&error_source, "ERROR_EXPRESSION_HERE",
@@ -52,7 +54,19 @@ std::string ErrorLayer::GenerateErrorKernels() const {
         << std::endl;
     std::exit(1);
   }
-  return error_source;
+  if (!use_reduction_kernels) {
+    return error_source;
+  }
+
+  std::string reduce_source =
+      FileToString("nnet/kernels/error_reduce.kernel.cl");
+  if (!FindAndReplace(&reduce_source, "WORKGROUP_SIZE_HERE",
+                      std::to_string(kReductionWorkgroupSize))) {
+    std::cerr << "Could not find template substring \"WORKGROUP_SIZE_HERE\"."
+              << std::endl;
+    std::exit(1);
+  }
+  return error_source + reduce_source;
 }
 
 constexpr char kIndexName[] = "index";
@@ -6,10 +6,17 @@
 #include "symbolic/expression.h"
 #include "symbolic/symbolic_util.h"
 
+#include <algorithm>
+#include <cstddef>
+
 namespace nnet {
 
 class ErrorLayer {
  public:
+  // Local size of the error reduction kernels, which is also the most
+  // workgroups a sample is split into.
+  static constexpr size_t kReductionWorkgroupSize = 64;
+
   ErrorLayer(LossFunction loss_function, size_t size)
       : loss_function_(loss_function),
         size_(size),
@@ -26,18 +33,39 @@ class ErrorLayer {
   //
   // The second kernel generates gradients for the beginning of the backwards
   // pass of back prop.
-  std::string GenerateErrorKernels() const;
+  //
+  // If use_reduction_kernels is set, also returns the kernels which sum the
+  // error values of a batch on the device (see
+  // nnet/kernels/error_reduce.kernel.cl). They need local memory and
+  // barriers, which the native backend doesn't support.
+  std::string GenerateErrorKernels(bool use_reduction_kernels) const;
 
   std::string ErrorKernelName() const { return "error_value"; }
 
   std::string GradientKernelName() const { return "error_gradients"; }
 
+  std::string PartialSumsKernelName() const { return "error_partial_sums"; }
+
+  std::string SampleSumsKernelName() const { return "error_sample_sums"; }
+
+  // Workgroups per sample of the partial sums kernel.
+  size_t ReductionGroupsPerSample() const {
+    const size_t groups =
+        (size_ + kReductionWorkgroupSize - 1) / kReductionWorkgroupSize;
+    return std::max<size_t>(1, std::min(groups, kReductionWorkgroupSize));
+  }
+
   size_t workgroup_size() const {
     return workgroup_size_;
   }
 
   size_t size() const { return size_; }
 
+  std::string KernelSignature() const {
+    return "error_layer_" + std::to_string(loss_function_) + "(" +
+           std::to_string(size_) + ")";
+  }
+
  private:
   symbolic::Expression O() const;
   symbolic::Expression E() const;
@@ -0,0 +1,125 @@
+#include "nnet/event_graph.h"
+
+#include "compute/cl_buffer.h"
+
+#include <iostream>
+
+namespace nnet {
+
+EventGraph::EventGraph(const cl::Context &context, const cl::Device &device,
+                       cl_command_queue_properties properties)
+    : initialized_(true) {
+  cl_command_queue_properties supported = 0;
+  CL_CHECK(device.getInfo(CL_DEVICE_QUEUE_PROPERTIES, &supported));
+  out_of_order_ = (supported & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE) != 0;
+  cl_int queue_init;
+  queue_ = cl::CommandQueue(
+      context, device,
+      properties | (out_of_order_ ? CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE : 0),
+      &queue_init);
+  CL_CHECK(queue_init);
+}
+
+void EventGraph::Import(cl::CommandQueue *queue,
+                        const std::vector<cl::Event> &events) {
+  buffers_.clear();
+  events_.clear();
+  imported_ = events;
+  cl::Event marker;
+  CL_CHECK(queue->enqueueMarkerWithWaitList(nullptr, &marker));
+  imported_.push_back(marker);
+  if (profiler_) {
+    profiler_->BeginSegment();
+  }
+}
+
+void EventGraph::Export(cl::CommandQueue *queue) {
+  if (events_.empty()) {
+    return;
+  }
+  CL_CHECK(queue->enqueueBarrierWithWaitList(&events_));
+  // Submit the graph's commands now, they may be waiting on nothing else.
+  CL_CHECK(queue_.flush());
+}
+
+cl::Event EventGraph::EnqueueKernel(const cl::Kernel &kernel,
+                                    const cl::NDRange &global,
+                                    const cl::NDRange &local,
+                                    const std::vector<cl::Buffer> &reads,
+                                    const std::vector<cl::Buffer> &writes) {
+  const std::vector<cl::Event> dependencies = Dependencies(reads, writes);
+  cl::Event event;
+  cl_int result = queue_.enqueueNDRangeKernel(
+      kernel, cl::NullRange, global, local,
+      dependencies.empty() ? nullptr : &dependencies, &event);
+  if (result != CL_SUCCESS) {
+    std::cerr << "Error enqueuing kernel in the event graph: " << result
+              << std::endl;
+    std::exit(1);
+  }
+  Record(event, reads, writes);
+  if (profiler_ && profiler_->sampling()) {
+    std::string name;
+    CL_CHECK(kernel.getInfo(CL_KERNEL_FUNCTION_NAME, &name));
+    profiler_->RecordKernel(event, name);
+  }
+  return event;
+}
+
+cl::Event EventGraph::EnqueueCopy(const cl::Buffer &source,
+                                  const cl::Buffer &destination,
+                                  size_t source_offset,
+                                  size_t destination_offset, size_t bytes) {
+  const std::vector<cl::Event> dependencies =
+      Dependencies({source}, {destination});
+  cl::Event event;
+  CL_CHECK(queue_.enqueueCopyBuffer(
+      source, destination, source_offset, destination_offset, bytes,
+      dependencies.empty() ? nullptr : &dependencies, &event));
+  Record(event, {source}, {destination});
+  if (profiler_ && profiler_->sampling()) {
+    profiler_->RecordTransfer(event, "copy");
+  }
+  return event;
+}
+
+void EventGraph::Finish() {
+  if (initialized_) {
+    CL_CHECK(queue_.finish());
+  }
+}
+
+std::vector<cl::Event> EventGraph::Dependencies(
+    const std::vector<cl::Buffer> &reads,
+    const std::vector<cl::Buffer> &writes) {
+  std::vector<cl::Event> dependencies = imported_;
+  for (const cl::Buffer &buffer : reads) {
+    const BufferState &state = buffers_[buffer()];
+    dependencies.insert(dependencies.end(), state.write.begin(),
+                        state.write.end());
+  }
+  for (const cl::Buffer &buffer : writes) {
+    const BufferState &state = buffers_[buffer()];
+    dependencies.insert(dependencies.end(), state.write.begin(),
+                        state.write.end());
+    dependencies.insert(dependencies.end(), state.reads.begin(),
+                        state.reads.end());
+  }
+  return dependencies;
+}
+
+void EventGraph::Record(const cl::Event &event,
+                        const std::vector<cl::Buffer> &reads,
+                        const std::vector<cl::Buffer> &writes) {
+  for (const cl::Buffer &buffer : reads) {
+    buffers_[buffer()].reads.push_back(event);
+  }
+  for (const cl::Buffer &buffer : writes) {
+    BufferState &state = buffers_[buffer()];
+    state.write = {event};
+    state.reads.clear();
+  }
+  events_.push_back(event);
+}
+
+}  // namespace nnet
@@ -0,0 +1,100 @@
+#ifndef EVENT_GRAPH_H
+#define EVENT_GRAPH_H
+
+#include "clutil/util.h"
+#include "nnet/profiler.h"
+
+#include <cstddef>
+#include <unordered_map>
+#include <vector>
+
+namespace nnet {
+
+// Orders the device work of a network by its data dependencies rather than by
+// submission order (see Nnet::graph()).
+//
+// Commands go to a single queue, which is out-of-order if the device supports
+// it. Each command lists the buffers it reads and writes, and waits for the
+// last write of each of them (read after write, write after write) and, for
+// the buffers it writes, for the reads since that write (write after read).
+// Commands without such a conflict, like the weight update of a layer and the
+// input gradients of the layer before it, may run concurrently.
+//
+// The network's own queue is in-order, and carries host transfers
+// (ClBuffer::MoveToCpu() and MoveToGpu()) and a few small kernels. Import()
+// and Export() order it with the graph through device-side markers and
+// barriers, so the host only waits for the graph when it reads a buffer back.
+//
+// If a Profiler is attached, each Import() begins one of its segments, and the
+// commands of sampled segments are recorded (the queue must then have been
+// created with CL_QUEUE_PROFILING_ENABLE, see properties below).
+class EventGraph {
+ public:
+  EventGraph() {}
+  // properties are added to those of the queue, like
+  // CL_QUEUE_PROFILING_ENABLE.
+  EventGraph(const cl::Context &context, const cl::Device &device,
+             cl_command_queue_properties properties = 0);
+
+  bool initialized() const { return initialized_; }
+  bool out_of_order() const { return out_of_order_; }
+
+  // Makes every later command wait for the commands enqueued on queue so far
+  // (which must be in-order), and for events. Earlier commands of the graph
+  // are forgotten: the caller must have passed them to Export(queue), so the
+  // queue's commands already wait for them.
+  void Import(cl::CommandQueue *queue,
+              const std::vector<cl::Event> &events = {});
+
+  // Makes the commands enqueued on queue from now on wait for every command
+  // of the graph so far. Doesn't block the host.
+  void Export(cl::CommandQueue *queue);
+
+  // Enqueues a kernel after the commands it depends on (see above), and
+  // returns its event.
+  cl::Event EnqueueKernel(const cl::Kernel &kernel, const cl::NDRange &global,
+                          const cl::NDRange &local,
+                          const std::vector<cl::Buffer> &reads,
+                          const std::vector<cl::Buffer> &writes);
+
+  // Copies bytes from source to destination, like
+  // cl::CommandQueue::enqueueCopyBuffer().
+  cl::Event EnqueueCopy(const cl::Buffer &source,
+                        const cl::Buffer &destination, size_t source_offset,
+                        size_t destination_offset, size_t bytes);
+
+  // Blocks until every command of the graph has completed.
+  void Finish();
+
+  // Commands enqueued since the last Import().
+  size_t size() const { return events_.size(); }
+
+  // Not owned, null to stop profiling.
+  void set_profiler(Profiler *profiler) { profiler_ = profiler; }
+
+ private:
+  struct BufferState {
+    // Empty if the buffer wasn't written since the last Import().
+    std::vector<cl::Event> write;
+    std::vector<cl::Event> reads;
+  };
+
+  std::vector<cl::Event> Dependencies(const std::vector<cl::Buffer> &reads,
+                                      const std::vector<cl::Buffer> &writes);
+  void Record(const cl::Event &event, const std::vector<cl::Buffer> &reads,
+              const std::vector<cl::Buffer> &writes);
+
+  cl::CommandQueue queue_;
+  bool initialized_ = false;
+  bool out_of_order_ = false;
+  // Every command waits for these (see Import()).
+  std::vector<cl::Event> imported_;
+  // Keyed on the cl_mem of each buffer.
+  std::unordered_map<cl_mem, BufferState> buffers_;
+  std::vector<cl::Event> events_;
+  Profiler *profiler_ = nullptr;
+};
+
+}  // namespace nnet
+
+#endif  // EVENT_GRAPH_H
@@ -0,0 +1,126 @@
+#include "nnet/input_pipeline.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+
+namespace nnet {
+
+double InputPipeline::Stats::hidden_seconds() const {
+  return std::max(0.0, transfer_seconds - exposed_seconds);
+}
+
+double InputPipeline::Stats::hidden_fraction() const {
+  return (transfer_seconds > 0.0) ? hidden_seconds() / transfer_seconds : 0.0;
+}
+
+InputPipeline::InputPipeline(size_t batch_size, size_t input_size,
+                             size_t output_size, std::vector<Slot> slots,
+                             const cl::Context &context,
+                             const cl::Device &device)
+    : InputPipeline(batch_size, input_size, output_size, std::move(slots)) {
+  opencl_ = true;
+  cl_int queue_init;
+  transfer_queue_ = cl::CommandQueue(context, device,
+                                     CL_QUEUE_PROFILING_ENABLE, &queue_init);
+  CL_CHECK(queue_init);
+}
+
+InputPipeline::InputPipeline(size_t batch_size, size_t input_size,
+                             size_t output_size, std::vector<Slot> slots)
+    : batch_size_(batch_size),
+      input_size_(input_size),
+      output_size_(output_size),
+      slots_(std::move(slots)),
+      opencl_(false) {
+  if (batch_size_ == 0 || slots_.empty()) {
+    std::cerr << "An input pipeline needs a non-zero batch size and at least "
+                 "one slot."
+              << std::endl;
+    std::exit(1);
+  }
+}
+
+void InputPipeline::Push(const std::vector<double> &inputs,
+                         const std::vector<double> &outputs) {
+  if (full()) {
+    std::cerr << "InputPipeline::Push called with all " << depth()
+              << " slots pending. Train on a batch first." << std::endl;
+    std::exit(1);
+  }
+  if (inputs.size() != batch_size_ * input_size_ ||
+      outputs.size() != batch_size_ * output_size_) {
+    std::cerr << "InputPipeline::Push expects " << batch_size_
+              << " samples, got " << inputs.size() << " input and "
+              << outputs.size() << " output values." << std::endl;
+    std::exit(1);
+  }
+
+  // Slots are used round-robin, so the next free one follows the newest
+  // pending batch.
+  const size_t index =
+      pending_.empty() ? 0 : (pending_.back() + 1) % slots_.size();
+  Slot &slot = slots_[index];
+  pending_.push_back(index);
+  if (!opencl_) {
+    std::copy(inputs.begin(), inputs.end(), slot.inputs->data());
+    std::copy(outputs.begin(), outputs.end(), slot.outputs->data());
+    return;
+  }
+  slot.uploads.resize(2);
+  slot.inputs->EnqueueWrite(inputs.data(), &transfer_queue_,
+                            &slot.input_staging, &slot.uploads[0],
+                            &slot.consumers);
+  slot.outputs->EnqueueWrite(outputs.data(), &transfer_queue_,
+                             &slot.output_staging, &slot.uploads[1],
+                             &slot.consumers);
+  slot.consumers.clear();
+  if (profiler_ && profiler_->sampling()) {
+    profiler_->RecordTransfer(slot.uploads[0], "upload_inputs");
+    profiler_->RecordTransfer(slot.uploads[1], "upload_outputs");
+  }
+  // Submit the writes now rather than whenever the queue is next flushed.
+  CL_CHECK(transfer_queue_.flush());
+}
+
+InputPipeline::Slot &InputPipeline::Front() {
+  if (pending_.empty()) {
+    std::cerr << "InputPipeline::Front called with no pending batches."
+              << std::endl;
+    std::exit(1);
+  }
+  Slot &slot = slots_[pending_.front()];
+  if (slot.uploads.empty()) {
+    return slot;
+  }
+
+  auto start = std::chrono::high_resolution_clock::now();
+  CL_CHECK(cl::Event::waitForEvents(slot.uploads));
+  auto end = std::chrono::high_resolution_clock::now();
+  stats_.exposed_seconds +=
+      std::chrono::duration<double>(end - start).count();
+  for (const cl::Event &upload : slot.uploads) {
+    cl_ulong upload_start = 0;
+    cl_ulong upload_end = 0;
+    CL_CHECK(upload.getProfilingInfo(CL_PROFILING_COMMAND_START,
+                                     &upload_start));
+    CL_CHECK(upload.getProfilingInfo(CL_PROFILING_COMMAND_END, &upload_end));
+    stats_.transfer_seconds += (upload_end - upload_start) * 1e-9;
+  }
+  slot.uploads.clear();
+  return slot;
+}
+
+void InputPipeline::Pop(std::vector<cl::Event> consumed) {
+  if (pending_.empty()) {
+    std::cerr << "InputPipeline::Pop called with no pending batches."
+              << std::endl;
+    std::exit(1);
+  }
+  slots_[pending_.front()].consumers = std::move(consumed);
+  pending_.pop_front();
+  stats_.batches++;
+}
+
+}  // namespace nnet
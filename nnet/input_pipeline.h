@@ -0,0 +1,120 @@
+#ifndef INPUT_PIPELINE_H
+#define INPUT_PIPELINE_H
+
+#include "clutil/util.h"
+#include "compute/cl_buffer.h"
+#include "nnet/profiler.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <vector>
+
+namespace nnet {
+
+// Streams training batches to the device ahead of training (see
+// Nnet::MakeInputPipeline() and Nnet::BatchTrain(InputPipeline *)).
+//
+// The pipeline owns depth() staging slots, each holding one batch. Push()
+// converts a batch to the device format and enqueues non-blocking writes of it
+// on a transfer queue of its own, then returns. Training only waits for the
+// upload of the batch it consumes, so the upload of batch k+1 overlaps the
+// training of batch k:
+//
+//   pipeline->Push(inputs[0], outputs[0]);
+//   for (size_t k = 0; k < batches; ++k) {
+//     if (k + 1 < batches) {
+//       pipeline->Push(inputs[k + 1], outputs[k + 1]);
+//     }
+//     network.BatchTrain(pipeline.get());
+//   }
+//
+// On the native CPU backend there is no transfer, Push() copies the batch.
+class InputPipeline {
+ public:
+  struct Stats {
+    // Batches trained on.
+    size_t batches = 0;
+    // Device time spent uploading those batches.
+    double transfer_seconds = 0.0;
+    // Time training spent waiting for uploads to complete.
+    double exposed_seconds = 0.0;
+
+    // Transfer time which overlapped training.
+    double hidden_seconds() const;
+    // hidden_seconds() / transfer_seconds, zero if nothing was transferred.
+    double hidden_fraction() const;
+  };
+
+  // A staged batch: batch_size() inputs and expected outputs, packed
+  // back-to-back like the arguments of Nnet::BatchEvaluate().
+  struct Slot {
+    std::unique_ptr<compute::ClBuffer> inputs;
+    std::unique_ptr<compute::ClBuffer> outputs;
+    // Device format copies of the values being uploaded.
+    std::vector<uint8_t> input_staging;
+    std::vector<uint8_t> output_staging;
+    std::vector<cl::Event> uploads;
+    // Device commands which read the slot's buffers, see Pop().
+    std::vector<cl::Event> consumers;
+  };
+
+  // Samples have input_size inputs and output_size expected outputs. The
+  // buffers of slots are GPU buffers of the network, sized for batch_size
+  // samples. Uploads run on a new (profiling) command queue of context and
+  // device.
+  InputPipeline(size_t batch_size, size_t input_size, size_t output_size,
+                std::vector<Slot> slots, const cl::Context &context,
+                const cl::Device &device);
+
+  // Native CPU backend: the buffers of slots are pinned to the CPU.
+  InputPipeline(size_t batch_size, size_t input_size, size_t output_size,
+                std::vector<Slot> slots);
+
+  size_t batch_size() const { return batch_size_; }
+  size_t depth() const { return slots_.size(); }
+
+  // Batches pushed and not trained on yet.
+  size_t pending() const { return pending_.size(); }
+  bool empty() const { return pending_.empty(); }
+  bool full() const { return pending_.size() == slots_.size(); }
+
+  // Starts uploading a batch of batch_size() samples and returns without
+  // waiting for it. Exits if the pipeline is full or the sizes are wrong.
+  void Push(const std::vector<double> &inputs,
+            const std::vector<double> &outputs);
+
+  // The oldest pending batch, once its upload completes. Used by
+  // Nnet::BatchTrain().
+  Slot &Front();
+
+  // Frees the slot of the oldest pending batch. consumed are the device
+  // commands still reading its buffers: the next upload to the slot waits for
+  // them on the device rather than the host waiting here. Without them,
+  // training on the batch must be complete.
+  void Pop(std::vector<cl::Event> consumed = {});
+
+  const Stats &stats() const { return stats_; }
+  void ResetStats() { stats_ = Stats(); }
+
+  // Records the uploads of Push() as transfers, while profiler is sampling
+  // (see Nnet::EnableProfiling()). Not owned, null to stop.
+  void set_profiler(Profiler *profiler) { profiler_ = profiler; }
+
+ private:
+  size_t batch_size_;
+  size_t input_size_;
+  size_t output_size_;
+  std::vector<Slot> slots_;
+  // Indices of the slots of pending batches, oldest first.
+  std::deque<size_t> pending_;
+  bool opencl_;
+  cl::CommandQueue transfer_queue_;
+  Stats stats_;
+  Profiler *profiler_ = nullptr;
+};
+
+}  // namespace nnet
+
+#endif  // INPUT_PIPELINE_H
@@ -7,8 +7,8 @@
 // @param W: weights
 // @param weight_index: Which weight to calculate the gradient for.
 // output: adjustment for the requested weight_index.
-double CalculateWeightGradient_LAYERID(global double* I, global double* W,
-                                       const global double* GRADIENT,
+number CalculateWeightGradient_LAYERID(global activation* I, global number* W,
+                                       const global number* GRADIENT,
                                        int weight_index) {
   WEIGHT_GRADIENTS_HERE
 }
@@ -19,36 +19,41 @@ double CalculateWeightGradient_LAYERID(global double* I, global double* W,
 // @param W: weights
 // @param input_index: Which input to calculate the backwards GRADIENT for.
 // output: gradient for the requested input_index.
-double CalculateInputGradient_LAYERID(global double* I, global double* W,
-                                      const global double* GRADIENT,
+number CalculateInputGradient_LAYERID(global activation* I, global number* W,
+                                      const global number* GRADIENT,
                                       int input_index) {
   INPUT_GRADIENTS_HERE
 }
 
-kernel void new_weights_LAYERID(
-    global double* inputs, global double* weights,
-    const global double* output_gradient,  // back-propagated output gradient.
-    global double* new_weights, global double* learning_rate) {
-  size_t i = get_global_id(0);
-  new_weights[i] = weights[i] - learning_rate[0] * CalculateWeightGradient_LAYERID(
-                                           inputs, weights, output_gradient, i);
+// If the activation layer before this layer was fused into the layer before
+// it, this is the derivative of its activation function (otherwise 1). The
+// input gradients are scaled by it, which makes them gradients with respect to
+// the pre-activation values, so the activation layer's own input_delta kernel
+// can be skipped.
+number InputActivationDerivative_LAYERID(number value) {
+  return INPUT_ACTIVATION_DERIVATIVE_HERE;
 }
 
-kernel void weight_deltas_LAYERID(
-    global double* inputs, global double* weights,
-    const global double* output_gradient,  // back-propagated output gradient.
-    global double* weight_deltas, global double* learning_rate) {
-  size_t i = get_global_id(0);
-  weight_deltas[i] = - learning_rate[0] * CalculateWeightGradient_LAYERID(
-                                           inputs, weights, output_gradient, i);
-}
+// The kernel below operates on a batch of samples, packed back-to-back in
+// inputs (NUM_INPUTS values per sample) and output_gradient (NUM_OUTPUTS values
+// per sample). The weight update kernels which go with it are in
+// weight_update.kernel.cl (or in a layer's tiled replacement for it).
 
+// Dimension 0 indexes the inputs of this layer, dimension 1 indexes the sample.
+// input_pre_activations holds the inputs before the fused activation. Without
+// one it is ignored (the caller passes inputs again).
 kernel void input_delta_LAYERID(
-    global double* inputs, global double* weights,
-    const global double* output_gradient,  // back-propagated output gradient.
-    global double* input_deltas) {
+    global activation* inputs, global number* weights,
+    const global number* output_gradient,  // back-propagated output gradient.
+    global number* input_deltas,
+    const global activation* input_pre_activations) {
   size_t i = get_global_id(0);
+  size_t sample = get_global_id(1);
   // de/di = de/do * do/di
-  input_deltas[i] =
-      CalculateInputGradient_LAYERID(inputs, weights, output_gradient, i);
+  input_deltas[sample * NUM_INPUTS + i] =
+      CalculateInputGradient_LAYERID(inputs + sample * NUM_INPUTS, weights,
+                                     output_gradient + sample * NUM_OUTPUTS,
+                                     i) *
+      InputActivationDerivative_LAYERID(
+          input_pre_activations[sample * NUM_INPUTS + i]);
 }
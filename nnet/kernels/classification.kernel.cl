@@ -0,0 +1,35 @@
+// Classification statistics of a batch of network outputs, packed
+// back-to-back (num_classes values per sample). See
+// Nnet::EvaluateClassifier().
+
+// One work item per sample: predictions[sample] is the index of the sample's
+// largest output (the first one, on ties).
+kernel void argmax_outputs(const global activation* outputs,
+                           global int* predictions, int num_classes) {
+  size_t sample = get_global_id(0);
+  const global activation* output = outputs + sample * num_classes;
+  int best = 0;
+  for (int i = 1; i < num_classes; ++i) {
+    if (output[i] > output[best]) {
+      best = i;
+    }
+  }
+  predictions[sample] = best;
+}
+
+// One work item per actual class, so that no two work items update the same
+// counter: adds the samples of the batch labelled with that class to its row
+// of confusion, by predicted class. labels holds the class index of each
+// sample of the dataset, the batch starts at first_sample.
+kernel void confusion_counts(const global number* labels,
+                             const global int* predictions,
+                             global int* confusion, int first_sample,
+                             int batch_size, int num_classes) {
+  int actual = get_global_id(0);
+  global int* row = confusion + actual * num_classes;
+  for (int sample = 0; sample < batch_size; ++sample) {
+    if ((int)labels[first_sample + sample] == actual) {
+      row[predictions[sample]] += 1;
+    }
+  }
+}
@@ -0,0 +1,129 @@
+// THIS FILE IS A TEMPLATE. The files in //plasticity/nnet parse this to generate an OpenCl kernel.
+//
+// Tiled replacement for evaluate.kernel.cl, used by convolution layers with the
+// Im2ColConvolution strategy. The convolution is evaluated as the matrix
+// product
+//
+//   outputs[filter][pixel] = bias[filter] +
+//       sum over taps of weights[filter][tap] * columns[tap][pixel]
+//
+// where columns is the im2col matrix of the input: column p holds the
+// FILTER_SIZE input values (zero where the filter overlaps the padding) which
+// output pixel p is computed from, in the same (z, y, x) order as the filter
+// weights. Pixels of every sample in the batch are packed side by side.
+//
+// columns is never stored. Each workgroup of TILE_WIDTH x TILE_WIDTH work items
+// computes TILE_WIDTH * FILTERS_PER_ITEM filters for TILE_WIDTH *
+// PIXELS_PER_ITEM pixels, and steps through the taps TILE_DEPTH at a time. For
+// each step it gathers a tile of columns, and the matching tile of weights,
+// into local memory. Bounds checks against the padding happen once per tile
+// element, rather than once per multiply. Each work item accumulates its
+// FILTERS_PER_ITEM x PIXELS_PER_ITEM outputs in registers.
+//
+// Dimension 0 indexes output pixels, dimension 1 indexes filters. Both are
+// rounded up to whole workgroups.
+kernel void evaluate_LAYERID(global activation* inputs, global number* weights,
+                             global activation* outputs, int batch_size,
+                             global activation* pre_activations,
+                             int save_pre_activations) {
+  // Padded by a column to avoid local memory bank conflicts.
+  local number weight_tile[TILE_WIDTH * FILTERS_PER_ITEM][TILE_DEPTH + 1];
+  local number column_tile[TILE_DEPTH][TILE_WIDTH * PIXELS_PER_ITEM];
+
+  const int local_pixel = get_local_id(0);
+  const int local_filter = get_local_id(1);
+  const int local_index = local_filter * TILE_WIDTH + local_pixel;
+  const int first_pixel = get_group_id(0) * TILE_WIDTH * PIXELS_PER_ITEM;
+  const int first_filter = get_group_id(1) * TILE_WIDTH * FILTERS_PER_ITEM;
+  const int pixels_per_sample = OUTPUT_WIDTH * OUTPUT_HEIGHT;
+  const int total_pixels = batch_size * pixels_per_sample;
+
+  // Filters and pixels are interleaved across the workgroup. Work item (p, f)
+  // computes filters first_filter + f + r * TILE_WIDTH for pixels
+  // first_pixel + p + c * TILE_WIDTH. Start from the bias, like the generated
+  // kernel.
+  number accumulators[FILTERS_PER_ITEM][PIXELS_PER_ITEM];
+  for (int r = 0; r < FILTERS_PER_ITEM; ++r) {
+    const int filter = first_filter + local_filter + r * TILE_WIDTH;
+    const number bias = (filter < NUM_FILTERS)
+                            ? weights[filter * (FILTER_SIZE + 1) + FILTER_SIZE]
+                            : 0.0;
+    for (int c = 0; c < PIXELS_PER_ITEM; ++c) {
+      accumulators[r][c] = bias;
+    }
+  }
+
+  for (int tile_start = 0; tile_start < FILTER_SIZE; tile_start += TILE_DEPTH) {
+    for (int e = local_index; e < TILE_WIDTH * FILTERS_PER_ITEM * TILE_DEPTH;
+         e += TILE_WIDTH * TILE_WIDTH) {
+      const int f = e / TILE_DEPTH;
+      const int k = e % TILE_DEPTH;
+      const int filter = first_filter + f;
+      const int tap = tile_start + k;
+      weight_tile[f][k] = (filter < NUM_FILTERS && tap < FILTER_SIZE)
+                              ? weights[filter * (FILTER_SIZE + 1) + tap]
+                              : 0.0;
+    }
+    // im2col. Neighbouring work items gather neighbouring pixels.
+    for (int e = local_index; e < TILE_DEPTH * TILE_WIDTH * PIXELS_PER_ITEM;
+         e += TILE_WIDTH * TILE_WIDTH) {
+      const int k = e / (TILE_WIDTH * PIXELS_PER_ITEM);
+      const int p = e % (TILE_WIDTH * PIXELS_PER_ITEM);
+      const int pixel = first_pixel + p;
+      const int tap = tile_start + k;
+      number value = 0.0;
+      if (pixel < total_pixels && tap < FILTER_SIZE) {
+        const int sample = pixel / pixels_per_sample;
+        const int sample_pixel = pixel % pixels_per_sample;
+        const int output_row = sample_pixel / OUTPUT_WIDTH;
+        const int output_col = sample_pixel % OUTPUT_WIDTH;
+        const int filter_z = tap / (FILTER_WIDTH * FILTER_HEIGHT);
+        const int filter_plane_tap = tap % (FILTER_WIDTH * FILTER_HEIGHT);
+        const int filter_y = filter_plane_tap / FILTER_WIDTH;
+        const int filter_x = filter_plane_tap % FILTER_WIDTH;
+        const int row = output_row * STRIDE - PADDING + filter_y;
+        const int col = output_col * STRIDE - PADDING + filter_x;
+        if (row >= 0 && row < INPUT_HEIGHT && col >= 0 && col < INPUT_WIDTH) {
+          value = inputs[sample * NUM_INPUTS +
+                         filter_z * INPUT_WIDTH * INPUT_HEIGHT +
+                         row * INPUT_WIDTH + col];
+        }
+      }
+      column_tile[k][p] = value;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (int k = 0; k < TILE_DEPTH; ++k) {
+      number weight[FILTERS_PER_ITEM];
+      for (int r = 0; r < FILTERS_PER_ITEM; ++r) {
+        weight[r] = weight_tile[local_filter + r * TILE_WIDTH][k];
+      }
+      for (int c = 0; c < PIXELS_PER_ITEM; ++c) {
+        const number column = column_tile[k][local_pixel + c * TILE_WIDTH];
+        for (int r = 0; r < FILTERS_PER_ITEM; ++r) {
+          accumulators[r][c] += weight[r] * column;
+        }
+      }
+    }
+    // Don't overwrite the tiles until every work item is done with them.
+    barrier(CLK_LOCAL_MEM_FENCE);
+  }
+
+  for (int c = 0; c < PIXELS_PER_ITEM; ++c) {
+    const int pixel = first_pixel + local_pixel + c * TILE_WIDTH;
+    if (pixel >= total_pixels) {
+      break;
+    }
+    const int sample = pixel / pixels_per_sample;
+    const int sample_pixel = pixel % pixels_per_sample;
+    for (int r = 0; r < FILTERS_PER_ITEM; ++r) {
+      const int filter = first_filter + local_filter + r * TILE_WIDTH;
+      if (filter < NUM_FILTERS) {
+        StoreOutput_LAYERID(
+            outputs, pre_activations, save_pre_activations,
+            sample * NUM_OUTPUTS + filter * pixels_per_sample + sample_pixel,
+            accumulators[r][c]);
+      }
+    }
+  }
+}
@@ -0,0 +1,186 @@
+// THIS FILE IS A TEMPLATE. The files in //plasticity/nnet parse this to generate an OpenCl kernel.
+//
+// Tiled replacement for evaluate.kernel.cl, used by 3x3, stride 1 convolution
+// layers with the WinogradConvolution strategy. The output of each filter is
+// computed in 2x2 tiles with the Winograd F(2x2, 3x3) algorithm:
+//
+//   Y = A^T [ sum over channels (G g G^T) .* (B^T d B) ] A
+//
+// where g is the 3x3 filter slice of a channel, d is the 4x4 input tile which
+// covers the 2x2 output tile and .* is the elementwise product. Each output
+// tile then takes 16 multiplies per channel instead of 36.
+//
+//         [1  0 -1  0]         [ 1    0    0 ]
+//   B^T = [0  1  1  0]     G = [1/2  1/2  1/2]     A^T = [1 1  1  0]
+//         [0 -1  1  0]         [1/2 -1/2  1/2]           [0 1 -1 -1]
+//         [0  1  0 -1]         [ 0    0    1 ]
+//
+// Each workgroup of TILE_WIDTH x TILE_WIDTH work items computes
+// TILE_WIDTH * FILTERS_PER_ITEM filters for TILE_WIDTH output tiles, and steps
+// through the channels CHANNELS_PER_STEP at a time. For each step it
+// transforms the filters and input tiles into local memory, so every transform
+// is shared by the whole workgroup. Each work item accumulates the 4x4
+// transformed products of its FILTERS_PER_ITEM filters in registers, and
+// applies the output transform at the end.
+//
+// Dimension 0 indexes output tiles (of every sample in the batch), dimension 1
+// indexes filters. Both are rounded up to whole workgroups.
+kernel void evaluate_LAYERID(global activation* inputs, global number* weights,
+                             global activation* outputs, int batch_size,
+                             global activation* pre_activations,
+                             int save_pre_activations) {
+  local number filter_tile[CHANNELS_PER_STEP][16]
+                          [TILE_WIDTH * FILTERS_PER_ITEM];
+  local number input_tile[CHANNELS_PER_STEP][16][TILE_WIDTH];
+
+  const int local_tile = get_local_id(0);
+  const int local_filter = get_local_id(1);
+  const int local_index = local_filter * TILE_WIDTH + local_tile;
+  const int first_tile = get_group_id(0) * TILE_WIDTH;
+  const int first_filter = get_group_id(1) * TILE_WIDTH * FILTERS_PER_ITEM;
+  const int tiles_per_sample = HORIZONTAL_TILES * VERTICAL_TILES;
+  const int total_tiles = batch_size * tiles_per_sample;
+
+  number accumulators[FILTERS_PER_ITEM][16];
+  for (int r = 0; r < FILTERS_PER_ITEM; ++r) {
+    for (int e = 0; e < 16; ++e) {
+      accumulators[r][e] = 0.0;
+    }
+  }
+
+  for (int first_channel = 0; first_channel < FILTER_DEPTH;
+       first_channel += CHANNELS_PER_STEP) {
+    // Filter transform, U = G g G^T.
+    for (int e = local_index; e < TILE_WIDTH * FILTERS_PER_ITEM * CHANNELS_PER_STEP;
+         e += TILE_WIDTH * TILE_WIDTH) {
+      const int f = e / CHANNELS_PER_STEP;
+      const int c = e % CHANNELS_PER_STEP;
+      const int filter = first_filter + f;
+      const int channel = first_channel + c;
+      if (filter >= NUM_FILTERS || channel >= FILTER_DEPTH) {
+        for (int i = 0; i < 16; ++i) {
+          filter_tile[c][i][f] = 0.0;
+        }
+        continue;
+      }
+      const int g = filter * (FILTER_SIZE + 1) + channel * 9;
+      number gg[4][3];
+      for (int x = 0; x < 3; ++x) {
+        const number g0 = weights[g + x];
+        const number g1 = weights[g + 3 + x];
+        const number g2 = weights[g + 6 + x];
+        gg[0][x] = g0;
+        gg[1][x] = 0.5 * (g0 + g1 + g2);
+        gg[2][x] = 0.5 * (g0 - g1 + g2);
+        gg[3][x] = g2;
+      }
+      for (int y = 0; y < 4; ++y) {
+        filter_tile[c][y * 4 + 0][f] = gg[y][0];
+        filter_tile[c][y * 4 + 1][f] = 0.5 * (gg[y][0] + gg[y][1] + gg[y][2]);
+        filter_tile[c][y * 4 + 2][f] = 0.5 * (gg[y][0] - gg[y][1] + gg[y][2]);
+        filter_tile[c][y * 4 + 3][f] = gg[y][2];
+      }
+    }
+    // Input transform, V = B^T d B. Neighbouring work items transform
+    // neighbouring tiles.
+    for (int e = local_index; e < TILE_WIDTH * CHANNELS_PER_STEP;
+         e += TILE_WIDTH * TILE_WIDTH) {
+      const int t = e % TILE_WIDTH;
+      const int c = e / TILE_WIDTH;
+      const int tile = first_tile + t;
+      const int channel = first_channel + c;
+      number d[4][4];
+      for (int y = 0; y < 4; ++y) {
+        for (int x = 0; x < 4; ++x) {
+          d[y][x] = 0.0;
+        }
+      }
+      if (tile < total_tiles && channel < FILTER_DEPTH) {
+        const int sample = tile / tiles_per_sample;
+        const int sample_tile = tile % tiles_per_sample;
+        const int top = (sample_tile / HORIZONTAL_TILES) * 2 - PADDING;
+        const int left = (sample_tile % HORIZONTAL_TILES) * 2 - PADDING;
+        const int plane =
+            sample * NUM_INPUTS + channel * INPUT_WIDTH * INPUT_HEIGHT;
+        for (int y = 0; y < 4; ++y) {
+          const int row = top + y;
+          if (row < 0 || row >= INPUT_HEIGHT) {
+            continue;
+          }
+          for (int x = 0; x < 4; ++x) {
+            const int col = left + x;
+            if (col >= 0 && col < INPUT_WIDTH) {
+              d[y][x] = inputs[plane + row * INPUT_WIDTH + col];
+            }
+          }
+        }
+      }
+      number bd[4][4];
+      for (int x = 0; x < 4; ++x) {
+        bd[0][x] = d[0][x] - d[2][x];
+        bd[1][x] = d[1][x] + d[2][x];
+        bd[2][x] = d[2][x] - d[1][x];
+        bd[3][x] = d[1][x] - d[3][x];
+      }
+      for (int y = 0; y < 4; ++y) {
+        input_tile[c][y * 4 + 0][t] = bd[y][0] - bd[y][2];
+        input_tile[c][y * 4 + 1][t] = bd[y][1] + bd[y][2];
+        input_tile[c][y * 4 + 2][t] = bd[y][2] - bd[y][1];
+        input_tile[c][y * 4 + 3][t] = bd[y][1] - bd[y][3];
+      }
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (int c = 0; c < CHANNELS_PER_STEP; ++c) {
+      for (int e = 0; e < 16; ++e) {
+        const number v = input_tile[c][e][local_tile];
+        for (int r = 0; r < FILTERS_PER_ITEM; ++r) {
+          accumulators[r][e] +=
+              filter_tile[c][e][local_filter + r * TILE_WIDTH] * v;
+        }
+      }
+    }
+    // Don't overwrite the tiles until every work item is done with them.
+    barrier(CLK_LOCAL_MEM_FENCE);
+  }
+
+  const int tile = first_tile + local_tile;
+  if (tile >= total_tiles) {
+    return;
+  }
+  const int sample = tile / tiles_per_sample;
+  const int sample_tile = tile % tiles_per_sample;
+  const int top = (sample_tile / HORIZONTAL_TILES) * 2;
+  const int left = (sample_tile % HORIZONTAL_TILES) * 2;
+  for (int r = 0; r < FILTERS_PER_ITEM; ++r) {
+    const int filter = first_filter + local_filter + r * TILE_WIDTH;
+    if (filter >= NUM_FILTERS) {
+      break;
+    }
+    // Output transform, Y = A^T M A.
+    number am[2][4];
+    for (int x = 0; x < 4; ++x) {
+      am[0][x] = accumulators[r][x] + accumulators[r][4 + x] +
+                 accumulators[r][8 + x];
+      am[1][x] = accumulators[r][4 + x] - accumulators[r][8 + x] -
+                 accumulators[r][12 + x];
+    }
+    const number bias = weights[filter * (FILTER_SIZE + 1) + FILTER_SIZE];
+    const int plane = sample * NUM_OUTPUTS +
+                      filter * OUTPUT_WIDTH * OUTPUT_HEIGHT;
+    for (int y = 0; y < 2; ++y) {
+      const int row = top + y;
+      if (row >= OUTPUT_HEIGHT) {
+        break;
+      }
+      const number y0 = am[y][0] + am[y][1] + am[y][2];
+      const number y1 = am[y][1] - am[y][2] - am[y][3];
+      StoreOutput_LAYERID(outputs, pre_activations, save_pre_activations,
+                          plane + row * OUTPUT_WIDTH + left, bias + y0);
+      if (left + 1 < OUTPUT_WIDTH) {
+        StoreOutput_LAYERID(outputs, pre_activations, save_pre_activations,
+                            plane + row * OUTPUT_WIDTH + left + 1, bias + y1);
+      }
+    }
+  }
+}
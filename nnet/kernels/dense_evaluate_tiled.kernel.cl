@@ -0,0 +1,99 @@
+// THIS FILE IS A TEMPLATE. The files in //plasticity/nnet parse this to generate an OpenCl kernel.
+//
+// Tiled replacement for evaluate.kernel.cl, used by dense layers with the
+// TiledDense strategy. Evaluates outputs = W * inputs + bias for a whole batch
+// as a matrix product. Weights are stored row-major, NUM_INPUTS + 1 per output
+// with the bias last.
+//
+// Each workgroup of TILE_WIDTH work items computes a block of
+// TILE_WIDTH * OUTPUTS_PER_ITEM outputs for SAMPLES_PER_ITEM samples. The
+// workgroup steps through the inputs TILE_DEPTH at a time, staging the inputs
+// of its samples and the matching weights in local memory. Each work item
+// accumulates its OUTPUTS_PER_ITEM x SAMPLES_PER_ITEM outputs in registers, so
+// every value read from local memory is used several times.
+//
+// Dimension 0 indexes the outputs, dimension 1 indexes blocks of samples. Both
+// are rounded up to whole workgroups, values out of range are padded with
+// zeroes.
+kernel void evaluate_LAYERID(global activation* inputs, global number* weights,
+                             global activation* outputs, int batch_size,
+                             global activation* pre_activations,
+                             int save_pre_activations) {
+  local number input_tile[SAMPLES_PER_ITEM][TILE_DEPTH];
+  // Padded by a column to avoid local memory bank conflicts.
+  local number weight_tile[TILE_WIDTH * OUTPUTS_PER_ITEM][TILE_DEPTH + 1];
+
+  const int local_index = get_local_id(0);
+  const int first_output = get_group_id(0) * TILE_WIDTH * OUTPUTS_PER_ITEM;
+  const int first_sample = get_group_id(1) * SAMPLES_PER_ITEM;
+
+  // Outputs are interleaved across the workgroup. Work item j computes outputs
+  // first_output + j + r * TILE_WIDTH. Start from the bias, like the generated
+  // kernel.
+  number accumulators[SAMPLES_PER_ITEM][OUTPUTS_PER_ITEM];
+  for (int r = 0; r < OUTPUTS_PER_ITEM; ++r) {
+    const int output = first_output + local_index + r * TILE_WIDTH;
+    const number bias =
+        (output < NUM_OUTPUTS)
+            ? weights[output * (NUM_INPUTS + 1) + NUM_INPUTS]
+            : 0.0;
+    for (int s = 0; s < SAMPLES_PER_ITEM; ++s) {
+      accumulators[s][r] = bias;
+    }
+  }
+
+  for (int tile_start = 0; tile_start < NUM_INPUTS; tile_start += TILE_DEPTH) {
+    // Neighbouring work items load neighbouring inputs, so that global memory
+    // reads are coalesced.
+    for (int e = local_index; e < SAMPLES_PER_ITEM * TILE_DEPTH;
+         e += TILE_WIDTH) {
+      const int s = e / TILE_DEPTH;
+      const int k = e % TILE_DEPTH;
+      const int sample = first_sample + s;
+      const int input = tile_start + k;
+      input_tile[s][k] = (sample < batch_size && input < NUM_INPUTS)
+                             ? inputs[sample * NUM_INPUTS + input]
+                             : 0.0;
+    }
+    for (int e = local_index; e < TILE_WIDTH * OUTPUTS_PER_ITEM * TILE_DEPTH;
+         e += TILE_WIDTH) {
+      const int o = e / TILE_DEPTH;
+      const int k = e % TILE_DEPTH;
+      const int output = first_output + o;
+      const int input = tile_start + k;
+      weight_tile[o][k] = (output < NUM_OUTPUTS && input < NUM_INPUTS)
+                              ? weights[output * (NUM_INPUTS + 1) + input]
+                              : 0.0;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (int k = 0; k < TILE_DEPTH; ++k) {
+      number weight[OUTPUTS_PER_ITEM];
+      for (int r = 0; r < OUTPUTS_PER_ITEM; ++r) {
+        weight[r] = weight_tile[local_index + r * TILE_WIDTH][k];
+      }
+      for (int s = 0; s < SAMPLES_PER_ITEM; ++s) {
+        const number input = input_tile[s][k];
+        for (int r = 0; r < OUTPUTS_PER_ITEM; ++r) {
+          accumulators[s][r] += weight[r] * input;
+        }
+      }
+    }
+    // Don't overwrite the tiles until every work item is done with them.
+    barrier(CLK_LOCAL_MEM_FENCE);
+  }
+
+  for (int s = 0; s < SAMPLES_PER_ITEM; ++s) {
+    const int sample = first_sample + s;
+    if (sample >= batch_size) {
+      break;
+    }
+    for (int r = 0; r < OUTPUTS_PER_ITEM; ++r) {
+      const int output = first_output + local_index + r * TILE_WIDTH;
+      if (output < NUM_OUTPUTS) {
+        StoreOutput_LAYERID(outputs, pre_activations, save_pre_activations,
+                            sample * NUM_OUTPUTS + output, accumulators[s][r]);
+      }
+    }
+  }
+}
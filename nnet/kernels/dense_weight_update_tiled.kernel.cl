@@ -0,0 +1,125 @@
+// THIS FILE IS A TEMPLATE. The files in //plasticity/nnet parse this to generate an
+// OpenCl kernel.
+//
+// Tiled replacement for weight_update.kernel.cl, used by dense layers with the
+// TiledDense strategy. The gradient of weight (output, input) is the sum over
+// the batch of output_gradient[output] * inputs[input], where the bias weight
+// (input == NUM_INPUTS) sees an input of 1. That is a matrix product, reduced
+// over the samples of the batch.
+//
+// Each workgroup of TILE_WIDTH x TILE_WIDTH work items computes the gradients
+// of TILE_WIDTH weight columns for TILE_WIDTH * OUTPUTS_PER_ITEM outputs. The
+// workgroup steps through the batch TILE_DEPTH samples at a time, staging the
+// inputs and output gradients of those samples in local memory. Each work item
+// accumulates OUTPUTS_PER_ITEM gradients in registers.
+//
+// Dimension 0 indexes the weight columns (NUM_INPUTS + 1 of them, the last is
+// the bias), dimension 1 indexes the outputs. Both are rounded up to whole
+// workgroups.
+
+// Accumulates this work item's OUTPUTS_PER_ITEM weight gradients, summed over
+// the batch, into accumulators. input_tile and gradient_tile are scratch local
+// memory of TILE_DEPTH * TILE_WIDTH and
+// TILE_DEPTH * TILE_WIDTH * OUTPUTS_PER_ITEM values.
+void AccumulateWeightGradients_LAYERID(global activation* inputs,
+                                       const global number* output_gradient,
+                                       int batch_size,
+                                       local number* input_tile,
+                                       local number* gradient_tile,
+                                       number* accumulators) {
+  const int local_column = get_local_id(0);
+  const int local_row = get_local_id(1);
+  const int local_index = local_row * TILE_WIDTH + local_column;
+  const int first_output = get_group_id(1) * TILE_WIDTH * OUTPUTS_PER_ITEM;
+
+  for (int r = 0; r < OUTPUTS_PER_ITEM; ++r) {
+    accumulators[r] = 0.0;
+  }
+
+  for (int tile_start = 0; tile_start < batch_size; tile_start += TILE_DEPTH) {
+    // Neighbouring work items load neighbouring values, so that global memory
+    // reads are coalesced.
+    for (int e = local_index; e < TILE_DEPTH * TILE_WIDTH;
+         e += TILE_WIDTH * TILE_WIDTH) {
+      const int s = e / TILE_WIDTH;
+      const int c = e % TILE_WIDTH;
+      const int sample = tile_start + s;
+      const int input = get_group_id(0) * TILE_WIDTH + c;
+      number value = 0.0;
+      if (sample < batch_size) {
+        if (input < NUM_INPUTS) {
+          value = inputs[sample * NUM_INPUTS + input];
+        } else if (input == NUM_INPUTS) {
+          value = 1.0;
+        }
+      }
+      input_tile[e] = value;
+    }
+    for (int e = local_index; e < TILE_DEPTH * TILE_WIDTH * OUTPUTS_PER_ITEM;
+         e += TILE_WIDTH * TILE_WIDTH) {
+      const int s = e / (TILE_WIDTH * OUTPUTS_PER_ITEM);
+      const int o = e % (TILE_WIDTH * OUTPUTS_PER_ITEM);
+      const int sample = tile_start + s;
+      const int output = first_output + o;
+      gradient_tile[e] = (sample < batch_size && output < NUM_OUTPUTS)
+                             ? output_gradient[sample * NUM_OUTPUTS + output]
+                             : 0.0;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (int s = 0; s < TILE_DEPTH; ++s) {
+      const number input = input_tile[s * TILE_WIDTH + local_column];
+      const local number* gradients =
+          gradient_tile + s * TILE_WIDTH * OUTPUTS_PER_ITEM;
+      for (int r = 0; r < OUTPUTS_PER_ITEM; ++r) {
+        accumulators[r] += gradients[local_row + r * TILE_WIDTH] * input;
+      }
+    }
+    // Don't overwrite the tiles until every work item is done with them.
+    barrier(CLK_LOCAL_MEM_FENCE);
+  }
+}
+
+kernel void new_weights_LAYERID(
+    global activation* inputs, global number* weights,
+    const global number* output_gradient,  // back-propagated output gradient.
+    global number* new_weights, global number* learning_rate, int batch_size) {
+  local number input_tile[TILE_DEPTH * TILE_WIDTH];
+  local number gradient_tile[TILE_DEPTH * TILE_WIDTH * OUTPUTS_PER_ITEM];
+  number gradients[OUTPUTS_PER_ITEM];
+  AccumulateWeightGradients_LAYERID(inputs, output_gradient, batch_size,
+                                    input_tile, gradient_tile, gradients);
+
+  const int column = get_global_id(0);
+  const int first_output =
+      get_group_id(1) * TILE_WIDTH * OUTPUTS_PER_ITEM + get_local_id(1);
+  for (int r = 0; r < OUTPUTS_PER_ITEM; ++r) {
+    const int output = first_output + r * TILE_WIDTH;
+    if (column <= NUM_INPUTS && output < NUM_OUTPUTS) {
+      const int i = output * (NUM_INPUTS + 1) + column;
+      new_weights[i] = weights[i] - learning_rate[0] * gradients[r];
+    }
+  }
+}
+
+kernel void weight_delta_LAYERID(
+    global activation* inputs, global number* weights,
+    const global number* output_gradient,  // back-propagated output gradient.
+    global number* weight_deltas, global number* learning_rate, int batch_size) {
+  local number input_tile[TILE_DEPTH * TILE_WIDTH];
+  local number gradient_tile[TILE_DEPTH * TILE_WIDTH * OUTPUTS_PER_ITEM];
+  number gradients[OUTPUTS_PER_ITEM];
+  AccumulateWeightGradients_LAYERID(inputs, output_gradient, batch_size,
+                                    input_tile, gradient_tile, gradients);
+
+  const int column = get_global_id(0);
+  const int first_output =
+      get_group_id(1) * TILE_WIDTH * OUTPUTS_PER_ITEM + get_local_id(1);
+  for (int r = 0; r < OUTPUTS_PER_ITEM; ++r) {
+    const int output = first_output + r * TILE_WIDTH;
+    if (column <= NUM_INPUTS && output < NUM_OUTPUTS) {
+      weight_deltas[output * (NUM_INPUTS + 1) + column] =
+          - learning_rate[0] * gradients[r];
+    }
+  }
+}
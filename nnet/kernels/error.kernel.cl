@@ -1,21 +1,21 @@
-double CalculateError(const global double* O, const global double* E, int index) {
+number CalculateError(const global activation* O, const global activation* E, int index) {
   return ERROR_EXPRESSION_HERE;
 }
 
-double CalculateErrorGradient(const global double* O, const global double* E, int index) {
+number CalculateErrorGradient(const global activation* O, const global activation* E, int index) {
   return GRADIENT_EXPRESSION_HERE;
 }
 
 kernel void error_value(
-    const global double* output, const global double* expected,
-    global double* error_components) {
+    const global activation* output, const global activation* expected,
+    global number* error_components) {
   size_t i = get_global_id(0);
   error_components[i] = CalculateError(output, expected, i);
 }
 
 kernel void error_gradients(
-    const global double* output, const global double* expected,
-    global double* output_gradient) {
+    const global activation* output, const global activation* expected,
+    global number* output_gradient) {
   size_t i = get_global_id(0);
   output_gradient[i] = CalculateErrorGradient(output, expected, i);
 }
@@ -0,0 +1,73 @@
+// THIS FILE IS A TEMPLATE. ErrorLayer::GenerateErrorKernels() appends it to
+// error.kernel.cl (which defines CalculateError) for the OpenCL backend.
+//
+// Reduces the error components of a batch of outputs, packed back-to-back
+// (sample_size values per sample), in two passes:
+//
+// error_partial_sums: dimension 0 is split into groups_per_sample
+// workgroups per sample, and dimension 1 is the sample. Each work item sums
+// the components at a stride, then the workgroup sums those in local memory
+// and writes one partial sum.
+//
+// error_sample_sums: a single workgroup. Each work item adds up the partial
+// sums of some samples, writing each sample's error, then the workgroup sums
+// the sample errors in local memory and writes their mean after them.
+
+#define ERROR_REDUCTION_WORKGROUP_SIZE WORKGROUP_SIZE_HERE
+
+// Sums values[0 .. ERROR_REDUCTION_WORKGROUP_SIZE) into values[0].
+void ReduceWorkgroupSum(local number* values) {
+  const int item = get_local_id(0);
+  for (int stride = ERROR_REDUCTION_WORKGROUP_SIZE / 2; stride > 0;
+       stride /= 2) {
+    barrier(CLK_LOCAL_MEM_FENCE);
+    if (item < stride) {
+      values[item] += values[item + stride];
+    }
+  }
+  barrier(CLK_LOCAL_MEM_FENCE);
+}
+
+kernel void error_partial_sums(
+    const global activation* output, const global activation* expected,
+    global number* partial_sums, int sample_size) {
+  local number sums[ERROR_REDUCTION_WORKGROUP_SIZE];
+  const int sample = get_global_id(1);
+  const int groups_per_sample = get_num_groups(0);
+  const global activation* sample_output = output + sample * sample_size;
+  const global activation* sample_expected = expected + sample * sample_size;
+
+  number sum = 0;
+  for (int i = get_global_id(0); i < sample_size;
+       i += groups_per_sample * ERROR_REDUCTION_WORKGROUP_SIZE) {
+    sum += CalculateError(sample_output, sample_expected, i);
+  }
+  sums[get_local_id(0)] = sum;
+  ReduceWorkgroupSum(sums);
+  if (get_local_id(0) == 0) {
+    partial_sums[sample * groups_per_sample + get_group_id(0)] = sums[0];
+  }
+}
+
+// sample_errors holds batch_size + 1 values: the error of each sample, then
+// their mean.
+kernel void error_sample_sums(const global number* partial_sums,
+                              global number* sample_errors,
+                              int groups_per_sample, int batch_size) {
+  local number sums[ERROR_REDUCTION_WORKGROUP_SIZE];
+  number sum = 0;
+  for (int sample = get_local_id(0); sample < batch_size;
+       sample += ERROR_REDUCTION_WORKGROUP_SIZE) {
+    number sample_error = 0;
+    for (int group = 0; group < groups_per_sample; ++group) {
+      sample_error += partial_sums[sample * groups_per_sample + group];
+    }
+    sample_errors[sample] = sample_error;
+    sum += sample_error;
+  }
+  sums[get_local_id(0)] = sum;
+  ReduceWorkgroupSum(sums);
+  if (get_local_id(0) == 0) {
+    sample_errors[batch_size] = sums[0] / batch_size;
+  }
+}
@@ -1,11 +1,22 @@
 // THIS FILE IS A TEMPLATE. The files in //plasticity/nnet parse this to generate an OpenCl kernel.
 
 // This function is generated automatically, do not edit.
-double Calculate_LAYERID(global double* I, global double* W, int output_index) {
+number Calculate_LAYERID(global activation* I, global number* W, int output_index) {
   EXPRESSION_HERE
 }
 
-kernel void evaluate_LAYERID(global double* inputs, global double* weights, global double* outputs) {
+// Dimension 0 of the NDRange indexes the outputs of this layer and dimension 1
+// indexes the sample within a batch. Samples are packed back-to-back in inputs
+// and outputs (NUM_INPUTS and NUM_OUTPUTS values per sample respectively). A
+// one-dimensional launch evaluates a single sample. batch_size is only needed
+// by tiled replacements of this kernel, whose ranges are rounded up.
+// pre_activations and save_pre_activations are passed on to StoreOutput (see
+// store_output.kernel.cl).
+kernel void evaluate_LAYERID(global activation* inputs, global number* weights, global activation* outputs, int batch_size, global activation* pre_activations, int save_pre_activations) {
   size_t index = get_global_id(0);
-  outputs[index] = Calculate_LAYERID(inputs, weights, index);
+  size_t sample = get_global_id(1);
+  StoreOutput_LAYERID(
+      outputs, pre_activations, save_pre_activations,
+      sample * NUM_OUTPUTS + index,
+      Calculate_LAYERID(inputs + sample * NUM_INPUTS, weights, index));
 }
@@ -0,0 +1,40 @@
+// THIS FILE IS A TEMPLATE. The files in //plasticity/nnet parse this to generate an OpenCl kernel.
+//
+// Int8 evaluation of a quantized dense or convolution layer (see
+// nnet/quantization.h). scales[0] is the reciprocal of the scale of the
+// layer's inputs, scales[1] is the scale of the int32 sums (the product of the
+// weight and input scales).
+
+// This function is generated automatically, do not edit.
+int CalculateInt8_LAYERID(global const char* I, global const char* W,
+                          global const int* B, int output_index) {
+  EXPRESSION_HERE
+}
+
+// One work item per input value of the batch. Rounds half away from zero and
+// saturates, like QuantizeValue().
+kernel void quantize_input_LAYERID(global activation* inputs,
+                                   global char* quantized,
+                                   global number* scales) {
+  size_t index = get_global_id(0);
+  number value = round(inputs[index] * scales[0]);
+  value = (value > 127) ? 127 : ((value < -127) ? -127 : value);
+  quantized[index] = (char)value;
+}
+
+// Dimension 0 of the NDRange indexes the outputs of this layer and dimension 1
+// indexes the sample within a batch, as in evaluate.kernel.cl. The outputs are
+// stored through StoreOutput (see store_output.kernel.cl), which applies the
+// fused activation, if any.
+kernel void evaluate_int8_LAYERID(global const char* inputs,
+                                  global const char* weights,
+                                  global const int* biases,
+                                  global activation* outputs,
+                                  global number* scales) {
+  size_t index = get_global_id(0);
+  size_t sample = get_global_id(1);
+  StoreOutput_LAYERID(
+      outputs, outputs, 0, sample * NUM_OUTPUTS + index,
+      scales[1] * CalculateInt8_LAYERID(inputs + sample * NUM_INPUTS, weights,
+                                        biases, index));
+}
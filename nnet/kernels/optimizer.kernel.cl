@@ -0,0 +1,48 @@
+// Fused weight updates of the optimizers of Nnet::LearningParameters, one work
+// item per weight. gradients holds the gradient of each weight, summed over
+// the batch. The weights and the optimizer's state are updated in place.
+
+kernel void momentum_update(global number* weights,
+                            const global number* gradients,
+                            global number* velocity,
+                            global number* learning_rate, float momentum) {
+  size_t i = get_global_id(0);
+  velocity[i] = momentum * velocity[i] - learning_rate[0] * gradients[i];
+  weights[i] += velocity[i];
+}
+
+kernel void rmsprop_update(global number* weights,
+                           const global number* gradients,
+                           global number* mean_square,
+                           global number* learning_rate, float rho,
+                           float epsilon) {
+  size_t i = get_global_id(0);
+  number gradient = gradients[i];
+  mean_square[i] = rho * mean_square[i] + (1 - rho) * gradient * gradient;
+  weights[i] -= learning_rate[0] * gradient / (sqrt(mean_square[i]) + epsilon);
+}
+
+// step_size scales the learning rate to correct the bias of both moment
+// estimates towards zero: sqrt(1 - beta2^t) / (1 - beta1^t) at step t.
+kernel void adam_update(global number* weights, const global number* gradients,
+                        global number* first_moment,
+                        global number* second_moment,
+                        global number* learning_rate, float beta1, float beta2,
+                        float epsilon, float step_size) {
+  size_t i = get_global_id(0);
+  number gradient = gradients[i];
+  first_moment[i] = beta1 * first_moment[i] + (1 - beta1) * gradient;
+  second_moment[i] =
+      beta2 * second_moment[i] + (1 - beta2) * gradient * gradient;
+  weights[i] -= step_size * learning_rate[0] * first_moment[i] /
+                (sqrt(second_moment[i]) + epsilon);
+}
+
+// Plain gradient descent, for gradients computed separately from the update
+// (see Nnet::ApplyGradients()). Backpropagate() uses the layers' new_weights
+// kernels instead.
+kernel void sgd_update(global number* weights, const global number* gradients,
+                       global number* learning_rate) {
+  size_t i = get_global_id(0);
+  weights[i] -= learning_rate[0] * gradients[i];
+}
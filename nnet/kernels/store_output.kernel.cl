@@ -0,0 +1,17 @@
+// THIS FILE IS A TEMPLATE. The files in //plasticity/nnet parse this to generate an OpenCl kernel.
+//
+// Prepended to every evaluate kernel, which stores its outputs through this
+// function. If the activation layer which follows this layer was fused into
+// it, the activation function is applied here (otherwise values are stored
+// unchanged). Training needs the values before the activation for its
+// derivative, so when save_pre_activations is set they are stored in
+// pre_activations as well.
+void StoreOutput_LAYERID(global activation* outputs,
+                         global activation* pre_activations,
+                         int save_pre_activations, int index, number value) {
+  if (save_pre_activations) {
+    pre_activations[index] = value;
+  }
+  outputs[index] = ACTIVATION_HERE;
+}
+
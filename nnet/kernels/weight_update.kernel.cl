@@ -0,0 +1,35 @@
+// THIS FILE IS A TEMPLATE. The files in //plasticity/nnet parse this to generate an
+// OpenCl kernel. It is appended to back_prop.kernel.cl, which defines
+// CalculateWeightGradient_LAYERID.
+
+// These kernels operate on a batch of samples, packed back-to-back in
+// inputs (NUM_INPUTS values per sample) and output_gradient (NUM_OUTPUTS values
+// per sample). Weight gradients are summed across the batch on the device.
+
+kernel void new_weights_LAYERID(
+    global activation* inputs, global number* weights,
+    const global number* output_gradient,  // back-propagated output gradient.
+    global number* new_weights, global number* learning_rate, int batch_size) {
+  size_t i = get_global_id(0);
+  number gradient = 0;
+  for (int sample = 0; sample < batch_size; ++sample) {
+    gradient += CalculateWeightGradient_LAYERID(
+        inputs + sample * NUM_INPUTS, weights,
+        output_gradient + sample * NUM_OUTPUTS, i);
+  }
+  new_weights[i] = weights[i] - learning_rate[0] * gradient;
+}
+
+kernel void weight_delta_LAYERID(
+    global activation* inputs, global number* weights,
+    const global number* output_gradient,  // back-propagated output gradient.
+    global number* weight_deltas, global number* learning_rate, int batch_size) {
+  size_t i = get_global_id(0);
+  number gradient = 0;
+  for (int sample = 0; sample < batch_size; ++sample) {
+    gradient += CalculateWeightGradient_LAYERID(
+        inputs + sample * NUM_INPUTS, weights,
+        output_gradient + sample * NUM_OUTPUTS, i);
+  }
+  weight_deltas[i] = - learning_rate[0] * gradient;
+}
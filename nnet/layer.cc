@@ -1,5 +1,6 @@
 #include "nnet/layer.h"
 #include "nnet/nnet.h"
+#include "symbolic/simplify.h"
 
 #include <fstream>
 #include <future>
@@ -39,13 +40,19 @@ Layer::Layer(Layer &&other)
       eval_workgroup_size_(other.eval_workgroup_size_),
       weight_train_workgroup_size_(other.weight_train_workgroup_size_),
       bp_train_workgroup_size_(other.bp_train_workgroup_size_),
-      weights_(std::move(other.weights_)) {}
+      fused_activation_(std::move(other.fused_activation_)),
+      fused_input_activation_(std::move(other.fused_input_activation_)),
+      weights_(std::move(other.weights_)),
+      optimizer_state_(std::move(other.optimizer_state_)) {}
 Layer::Layer(const Layer &other)
     : impl_(other.impl_->Clone()),
       eval_workgroup_size_(other.eval_workgroup_size_),
       weight_train_workgroup_size_(other.weight_train_workgroup_size_),
       bp_train_workgroup_size_(other.bp_train_workgroup_size_),
-      weights_(other.weights_) {}
+      fused_activation_(other.fused_activation_),
+      fused_input_activation_(other.fused_input_activation_),
+      weights_(other.weights_),
+      optimizer_state_(other.optimizer_state_) {}
 
 void Layer::RegisterToNetwork(nnet::Nnet *network) {
   // Awesome, we have a network registered. Use it to allocate a buffer for the
@@ -55,8 +62,10 @@ void Layer::RegisterToNetwork(nnet::Nnet *network) {
 }
 
 // Dense layer static constructors.
-Layer Layer::MakeDenseLayer(size_t layer_index, const Dimensions &dimensions) {
-  return Layer(std::make_unique<DenseLayer>(dimensions, layer_index));
+Layer Layer::MakeDenseLayer(size_t layer_index, const Dimensions &dimensions,
+                            DenseKernelStrategy strategy) {
+  return Layer(
+      std::make_unique<DenseLayer>(dimensions, layer_index, strategy));
 }
 
 // Convolution layer static constructor.
@@ -135,11 +144,92 @@ std::string FileToString(std::string filepath) {
   return buffer.str();
 }
 
+// Substitutes the parameters shared by every kernel template: the per-sample
+// strides used to index into batched inputs and outputs, and the parameters
+// of any tiled kernels.
+void SubstituteLayerParameters(const LayerImpl &impl, std::string *source) {
+  while (FindAndReplace(source, "NUM_INPUTS",
+                        std::to_string(impl.GetDimensions().num_inputs))) {
+  }
+  while (FindAndReplace(source, "NUM_OUTPUTS",
+                        std::to_string(impl.GetDimensions().num_outputs))) {
+  }
+  for (const auto &parameter : impl.TiledKernelParameters()) {
+    while (FindAndReplace(source, parameter.first,
+                          std::to_string(parameter.second))) {
+    }
+  }
+}
+
+// Code for the activation function (or its derivative) at the kernel variable
+// "value". An empty activation function is the identity.
+std::string ActivationCode(const Layer::ActivationFunctionType &activation) {
+  const Expression value = Expression::CreateNumericValue("value");
+  return activation ? symbolic::Simplify(activation(value)).to_string()
+                    : value.to_string();
+}
+
+std::string ActivationDerivativeCode(
+    const Layer::ActivationFunctionType &activation) {
+  if (!activation) {
+    return "1.0";
+  }
+  const Expression value = Expression::CreateNumericValue("value");
+  return activation(value).Derive(value.to_string()).to_string();
+}
+
 }  // namespace
 
-std::string Layer::GenerateEvaluationKernel() const {
-  std::string evaluate_source =
-      FileToString("nnet/kernels/evaluate.kernel.cl");
+const Layer::ActivationFunctionType *Layer::activation_function() const {
+  const auto *activation = dynamic_cast<const ActivationLayer *>(impl_.get());
+  return activation ? &activation->activation_function() : nullptr;
+}
+
+bool Layer::CanFuseActivation() const {
+  return dynamic_cast<const DenseLayer *>(impl_.get()) ||
+         dynamic_cast<const ConvolutionLayer *>(impl_.get());
+}
+
+void Layer::FuseActivation(const ActivationFunctionType &activation_function) {
+  fused_activation_ = activation_function;
+}
+
+void Layer::FuseInputActivation(
+    const ActivationFunctionType &activation_function) {
+  fused_input_activation_ = activation_function;
+}
+
+std::string Layer::KernelSignature() const {
+  std::string signature = impl_->KernelSignature();
+  if (fused_activation_) {
+    signature += "+activation[" + ActivationCode(fused_activation_) + "]";
+  }
+  if (fused_input_activation_) {
+    signature +=
+        "+input_activation[" + ActivationCode(fused_input_activation_) + "]";
+  }
+  return signature;
+}
+
+std::string Layer::StoreOutputKernel() const {
+  std::string source = FileToString("nnet/kernels/store_output.kernel.cl");
+  while (FindAndReplace(&source, "LAYERID",
+                        std::to_string(impl_->layer_index()))) {
+  }
+  if (!FindAndReplace(&source, "ACTIVATION_HERE",
+                      ActivationCode(fused_activation_))) {
+    std::cerr << "Could not find template substring \"ACTIVATION_HERE\"."
+              << std::endl;
+    std::exit(1);
+  }
+  return source;
+}
+
+std::string Layer::GenerateEvaluationKernel(bool use_tiled_kernels) const {
+  const std::string tiled_template = impl_->TiledEvaluationTemplate();
+  const bool tiled = use_tiled_kernels && !tiled_template.empty();
+  std::string evaluate_source = FileToString(
+      tiled ? tiled_template : "nnet/kernels/evaluate.kernel.cl");
 
   // Validate input dimensions.
   if ((GetDimensions().num_inputs == 0) || (GetDimensions().num_outputs == 0)) {
@@ -152,6 +242,15 @@ std::string Layer::GenerateEvaluationKernel() const {
     std::exit(1);
   }
 
+  if (tiled) {
+    // Tiled kernels are written by hand, there is no expression to generate.
+    while (FindAndReplace(&evaluate_source, "LAYERID",
+                          std::to_string(impl_->layer_index()))) {
+    }
+    SubstituteLayerParameters(*impl_, &evaluate_source);
+    return StoreOutputKernel() + evaluate_source;
+  }
+
   codegen::CudaGenerator generator;
   impl_->GenerateOutputCode(
       Expression::CreateInteger(internal::kernel_symbols::kOutputIndex),
@@ -163,10 +262,10 @@ std::string Layer::GenerateEvaluationKernel() const {
     std::exit(1);
   }
 
-  // LAYERID shows up exactly 3 times in the kernel template. Yes this is hacky.
+  // LAYERID shows up exactly 4 times in the kernel template. Yes this is hacky.
   // It's a side project.
   // TODO(sharf): Use a real templating system for the kernels.
-  const size_t kNumberExpectedReplacements = 3;
+  const size_t kNumberExpectedReplacements = 4;
 
   for (size_t replacement_time = 0;
        replacement_time < kNumberExpectedReplacements; ++replacement_time) {
@@ -178,7 +277,35 @@ std::string Layer::GenerateEvaluationKernel() const {
     }
   }
 
-  return evaluate_source;
+  SubstituteLayerParameters(*impl_, &evaluate_source);
+
+  return StoreOutputKernel() + evaluate_source;
+}
+
+std::string Layer::GenerateQuantizedEvaluationKernel() const {
+  if (QuantizedRowSize() == 0) {
+    std::cerr << "Layer " << LayerSuffix() << " can't be quantized."
+              << std::endl;
+    std::exit(1);
+  }
+  std::string evaluate_source =
+      FileToString("nnet/kernels/evaluate_int8.kernel.cl");
+
+  codegen::CudaGenerator generator;
+  impl_->GenerateQuantizedOutputCode(
+      Expression::CreateInteger(internal::kernel_symbols::kOutputIndex),
+      &generator);
+  if (!FindAndReplace(&evaluate_source, "EXPRESSION_HERE", generator.code())) {
+    std::cerr << "Could not find template substring \"EXPRESSION_HERE\"."
+              << std::endl;
+    std::exit(1);
+  }
+  while (FindAndReplace(&evaluate_source, "LAYERID",
+                        std::to_string(impl_->layer_index()))) {
+  }
+  SubstituteLayerParameters(*impl_, &evaluate_source);
+
+  return StoreOutputKernel() + evaluate_source;
 }
 
 std::string Layer::WeightsToString() {
@@ -197,9 +324,13 @@ std::string Layer::WeightsToString() {
   return output.str();
 }
 
-std::string Layer::GenerateTrainingKernels() const {
+std::string Layer::GenerateTrainingKernels(bool use_tiled_kernels) const {
+  const std::string tiled_template = impl_->TiledWeightUpdateTemplate();
+  const bool tiled = use_tiled_kernels && !tiled_template.empty();
   std::string train_source =
-      FileToString("nnet/kernels/back_prop.kernel.cl");
+      FileToString("nnet/kernels/back_prop.kernel.cl") +
+      FileToString(tiled ? tiled_template
+                         : "nnet/kernels/weight_update.kernel.cl");
 
   codegen::CudaGenerator input_gen;
   impl_->InputGradientCode(
@@ -225,6 +356,14 @@ std::string Layer::GenerateTrainingKernels() const {
     std::exit(1);
   }
 
+  if (!FindAndReplace(&train_source, "INPUT_ACTIVATION_DERIVATIVE_HERE",
+                      ActivationDerivativeCode(fused_input_activation_))) {
+    std::cerr << "Could not find template substring "
+                 "\"INPUT_ACTIVATION_DERIVATIVE_HERE\"."
+              << std::endl;
+    std::exit(1);
+  }
+
   // Yes this is hacky.  It's a side project.
   // TODO(sharf): Use a real templating system for the kernels.
   while (true) {
@@ -233,10 +372,32 @@ std::string Layer::GenerateTrainingKernels() const {
       break;
     }
   }
+  SubstituteLayerParameters(*impl_, &train_source);
 
   return train_source;
 }
 
+KernelRange Layer::EvaluateRange(size_t batch_size) const {
+  if (!impl_->TiledEvaluationTemplate().empty()) {
+    return impl_->TiledEvaluateRange(batch_size);
+  }
+  // Dimension 0 is the layer output, dimension 1 is the sample.
+  return KernelRange{{GetDimensions().num_outputs, batch_size},
+                     {eval_workgroup_size_, 1}};
+}
+
+KernelRange Layer::WeightUpdateRange() const {
+  if (!impl_->TiledWeightUpdateTemplate().empty()) {
+    return impl_->TiledWeightUpdateRange();
+  }
+  return KernelRange{{weights_.size(), 1}, {weight_train_workgroup_size_, 1}};
+}
+
+KernelRange Layer::QuantizedEvaluateRange(size_t batch_size) const {
+  return KernelRange{{GetDimensions().num_outputs, batch_size},
+                     {eval_workgroup_size_, 1}};
+}
+
 Matrix<Expression> Layer::InputExpression() const {
   const size_t num_inputs = GetDimensions().num_inputs;
   Matrix<Expression> result(num_inputs, 1);
@@ -48,7 +48,8 @@ class Layer {
 
   // Dense Layer constructor. Dense layers alone do not contain an activation
   // function. This is done via a separate activation layer.
-  static Layer MakeDenseLayer(size_t layer_index, const Dimensions &dimensions);
+  static Layer MakeDenseLayer(size_t layer_index, const Dimensions &dimensions,
+                              DenseKernelStrategy strategy = GeneratedDense);
 
   // Convolutional Layer constructors.
   static Layer MakeConvolutionLayer(size_t layer_index,
@@ -81,12 +82,19 @@ class Layer {
   }
 
   compute::ClBuffer &weight_buffer() { return weights_; }
+  const compute::ClBuffer &weight_buffer() const { return weights_; }
+
+  // Per-weight state of the optimizer (see Nnet::ResetOptimizerState()), one
+  // buffer of weight_buffer().size() values per quantity it tracks.
+  std::vector<compute::ClBuffer> &optimizer_state() { return optimizer_state_; }
 
   Dimensions GetDimensions() const { return impl_->GetDimensions(); }
 
   // This function returns the source code of an OpenCL kernel which evaluates
-  // the output of this layer, given the input.
-  std::string GenerateEvaluationKernel() const;
+  // the output of this layer, given the input. If use_tiled_kernels is set
+  // and the layer has a tiled evaluation kernel (which needs local memory and
+  // barriers), that is used instead of the generated one.
+  std::string GenerateEvaluationKernel(bool use_tiled_kernels) const;
 
   std::string EvaluateKernelName() const {
     return "evaluate_" + std::to_string(impl_->layer_index());
@@ -94,13 +102,49 @@ class Layer {
 
   // This function returns the source code of two OpenCL kernels which calculate
   // the weight update (via gradient descent) and the backpropagated weights for
-  // the next layer backwards.
-  std::string GenerateTrainingKernels() const;
+  // the next layer backwards. use_tiled_kernels is as above.
+  std::string GenerateTrainingKernels(bool use_tiled_kernels) const;
+
+  std::string LayerType() const { return impl_->layer_type(); }
 
   std::string LayerSuffix() const {
     return impl_->layer_type() + "_" + std::to_string(impl_->layer_index());
   }
 
+  std::string KernelSignature() const;
+
+  // Kernel fusion (see Nnet::FuseActivations()). The activation function of an
+  // activation layer can be fused into the layer before it, whose evaluate
+  // kernel then applies it to its outputs. Its derivative is then applied by
+  // the input gradient kernel of the layer after it, which receives the
+  // pre-activation values of its inputs.
+  //
+  // Returns null unless this is an activation layer.
+  const ActivationFunctionType *activation_function() const;
+  // Only dense and convolution layers take fused activations.
+  bool CanFuseActivation() const;
+  void FuseActivation(const ActivationFunctionType &activation_function);
+  void FuseInputActivation(const ActivationFunctionType &activation_function);
+  bool has_fused_activation() const {
+    return static_cast<bool>(fused_activation_);
+  }
+  bool has_fused_input_activation() const {
+    return static_cast<bool>(fused_input_activation_);
+  }
+
+  // Post-training int8 quantization (see Nnet::Quantize()). The quantized
+  // kernels are compiled into a program of their own, on demand.
+  size_t QuantizedRowSize() const { return impl_->QuantizedRowSize(); }
+  std::string GenerateQuantizedEvaluationKernel() const;
+
+  std::string QuantizeInputKernelName() const {
+    return "quantize_input_" + std::to_string(impl_->layer_index());
+  }
+
+  std::string QuantizedEvaluateKernelName() const {
+    return "evaluate_int8_" + std::to_string(impl_->layer_index());
+  }
+
   std::string InputGradientKernelName() const {
     return "input_delta_" + LayerSuffix();
   }
@@ -116,6 +160,13 @@ class Layer {
   Matrix<symbolic::Expression> InputExpression() const;
   Matrix<symbolic::Expression> OutputExpression() const;
 
+  // Launch geometry of the OpenCL evaluate kernel for a batch of samples, and
+  // of the weight update (and weight gradient) kernels. Assumes tiled kernels
+  // are used where available.
+  KernelRange EvaluateRange(size_t batch_size) const;
+  KernelRange WeightUpdateRange() const;
+  KernelRange QuantizedEvaluateRange(size_t batch_size) const;
+
   size_t eval_workgroup_size() const { return eval_workgroup_size_; }
   size_t weight_train_workgroup_size() const {
     return weight_train_workgroup_size_;
@@ -123,6 +174,10 @@ class Layer {
   size_t bp_train_workgroup_size() const { return bp_train_workgroup_size_; }
 
  private:
+  // The StoreOutput_<index>() function used by the evaluate kernel, which
+  // applies the fused activation (if any).
+  std::string StoreOutputKernel() const;
+
   Nnet *nnet_;
   SymbolGenerator generator_;
   std::unique_ptr<LayerImpl> impl_;
@@ -130,8 +185,13 @@ class Layer {
   const size_t weight_train_workgroup_size_;
   const size_t bp_train_workgroup_size_;
 
+  // Empty unless fused, see FuseActivation().
+  ActivationFunctionType fused_activation_;
+  ActivationFunctionType fused_input_activation_;
+
   // Weights are cached in the GPU between training runs.
   compute::ClBuffer weights_;
+  std::vector<compute::ClBuffer> optimizer_state_;
 };
 
 }  // namespace nnet
@@ -10,6 +10,18 @@ enum LossFunction {
   CrossEntropy,
 };
 
+// How the kernels of a dense layer are built.
+enum DenseKernelStrategy {
+  // Generated from the layer's symbolic expressions, one work item per output
+  // (or weight).
+  GeneratedDense = 0,
+  // Hand-written kernels which stage tiles of the inputs and weights in local
+  // memory and compute a block of outputs (or weight gradients) per work item.
+  // Faster for wide layers. The native CPU backend falls back to
+  // GeneratedDense.
+  TiledDense,
+};
+
 struct Dimensions {
   size_t num_inputs;
   size_t num_outputs;
@@ -19,6 +31,26 @@ struct Dimensions {
 // than one dimension type.
 using LinearDimensions = Dimensions;
 
+// How a convolution layer is evaluated.
+enum ConvolutionStrategy {
+  // The generated kernel loops over the filter for each output value, bounds
+  // checking every input it reads.
+  DirectConvolution = 0,
+  // Lowers the convolution to a matrix product between the filters and the
+  // im2col matrix of the input (one column of filter-sized patches per output
+  // pixel). The im2col matrix is never stored: workgroups build tiles of it in
+  // local memory, handling padding once per tile element, and multiply them
+  // with tiles of the filters. The native CPU backend falls back to
+  // DirectConvolution.
+  Im2ColConvolution,
+  // Winograd F(2x2, 3x3). Computes each 2x2 block of outputs from the
+  // transformed 4x4 input tile and transformed filters, with 16 multiplies per
+  // channel instead of 36. Only 3x3 filters with stride 1 are eligible, other
+  // layers (and the native CPU backend) fall back to DirectConvolution.
+  // Results match DirectConvolution up to floating point rounding.
+  WinogradConvolution,
+};
+
 struct FilterParams {
   // Dimensions of each filter.
   size_t width;
@@ -35,6 +67,8 @@ struct FilterParams {
 
   // The number of filters.
   size_t num_filters;
+
+  ConvolutionStrategy strategy = DirectConvolution;
 };
 
 struct VolumeDimensions {
@@ -1,3 +1,5 @@
+#include "nnet/layer_impl.h"
+
 #include "geometry/dynamic_matrix.h"
 #include "stats/normal.h"
 #include "symbolic/expression.h"
@@ -24,4 +26,24 @@ Matrix<symbolic::Expression> AddBias(Matrix<symbolic::Expression> x) {
   return biased_layer;
 }
 
+void UnflattenIndexCode(const std::string &index, size_t width, size_t height,
+                        const std::string &prefix, codegen::Generator *cg) {
+  const std::string plane_size = std::to_string(width * height);
+  cg->AppendLineOfCode(
+      cg->assign("const int " + prefix + "_z", index + " / " + plane_size) +
+      cg->linesep());
+  cg->AppendLineOfCode(cg->assign("const int " + prefix + "_pixel",
+                                  index + " - " + prefix + "_z * " +
+                                      plane_size) +
+                       cg->linesep());
+  cg->AppendLineOfCode(cg->assign("const int " + prefix + "_row",
+                                  prefix + "_pixel / " +
+                                      std::to_string(width)) +
+                       cg->linesep());
+  cg->AppendLineOfCode(cg->assign("const int " + prefix + "_col",
+                                  prefix + "_pixel - " + prefix + "_row * " +
+                                      std::to_string(width)) +
+                       cg->linesep());
+}
+
 }
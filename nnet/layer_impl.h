@@ -8,11 +8,35 @@
 #include "symbolic/expression.h"
 #include "symbolic/symbolic_util.h"
 
+#include <array>
+#include <string>
+#include <utility>
+#include <vector>
+
 namespace nnet {
 
+// Launch geometry of a kernel. A local size of zero leaves the workgroup size
+// up to the OpenCL runtime.
+struct KernelRange {
+  std::array<size_t, 2> global;
+  std::array<size_t, 2> local;
+};
+
 // Adds a bias input to the end of a column vector.
 Matrix<symbolic::Expression> AddBias(Matrix<symbolic::Expression> x);
 
+// Filter (or pooling group) loops with at most this many taps per plane are
+// fully unrolled in the generated kernels.
+constexpr size_t kMaxUnrolledTaps = 49;
+
+// Emits code declaring the ints <prefix>_z, <prefix>_row and <prefix>_col,
+// the coordinates of index in a planar volume of the given width and height.
+// Each coordinate is computed once, with a division and a multiply-subtract in
+// place of the modulus, rather than being re-derived from index wherever it is
+// used.
+void UnflattenIndexCode(const std::string &index, size_t width, size_t height,
+                        const std::string &prefix, codegen::Generator *cg);
+
 class LayerImpl {
  public:
   // Dim(num_outputs * (num_inputs + 1))
@@ -36,6 +60,41 @@ class LayerImpl {
   virtual void WeightGradientCode(const symbolic::Expression &weight_index,
                                   codegen::Generator *cg) const = 0;
 
+  // Layers may replace the generated evaluate and weight update kernels with
+  // hand-written, tiled kernels. These keep the names and arguments of the
+  // kernels they replace, but may use local memory and barriers, so they are
+  // only used on the OpenCL backend.
+  //
+  // Returns the path of the kernel template, or an empty string to use the
+  // generated kernel. LAYERID, NUM_INPUTS and NUM_OUTPUTS are substituted as
+  // in the generic templates, along with TiledKernelParameters().
+  virtual std::string TiledEvaluationTemplate() const { return ""; }
+  virtual std::string TiledWeightUpdateTemplate() const { return ""; }
+
+  // (name, value) pairs substituted into the tiled kernel templates.
+  virtual std::vector<std::pair<std::string, size_t>> TiledKernelParameters()
+      const {
+    return {};
+  }
+
+  // Launch geometry of the tiled kernels.
+  virtual KernelRange TiledEvaluateRange(size_t batch_size) const {
+    return KernelRange{};
+  }
+  virtual KernelRange TiledWeightUpdateRange() const { return KernelRange{}; }
+
+  // Post-training int8 quantization (see nnet/quantization.h). Layers whose
+  // weights are laid out in rows, one per output channel and each ending in
+  // the bias of that channel, can be evaluated with int8 weights and inputs.
+  // Returns the row length, or zero if the layer can't be quantized.
+  virtual size_t QuantizedRowSize() const { return 0; }
+
+  // Like GenerateOutputCode(), but for the int8 evaluate kernel: I and W hold
+  // int8 values, B the int32 biases, and the code returns the int32 sum. Only
+  // called if QuantizedRowSize() is non-zero.
+  virtual void GenerateQuantizedOutputCode(
+      const symbolic::Expression &output_index, codegen::Generator *cg) const {}
+
   virtual std::unique_ptr<LayerImpl> Clone() const = 0;
 
   Dimensions GetDimensions() const { return dimensions_; }
@@ -44,6 +103,15 @@ class LayerImpl {
 
   virtual std::string layer_type() const = 0;
 
+  // Uniquely identifies the kernel source generated by this layer. Two layers
+  // with the same signature generate identical kernels. Subclasses must
+  // extend this with any parameter which affects code generation.
+  virtual std::string KernelSignature() const {
+    return layer_type() + "_" + std::to_string(layer_index_) + "(" +
+           std::to_string(dimensions_.num_inputs) + "," +
+           std::to_string(dimensions_.num_outputs) + ")";
+  }
+
   virtual ~LayerImpl() {}
 
  protected:
@@ -1,6 +1,8 @@
 #include "nnet/max_pool_layer.h"
 #include "symbolic/symbolic_util.h"
 
+#include <sstream>
+
 namespace nnet {
 
 MaxPoolLayer::MaxPoolLayer(const VolumeDimensions& input,
@@ -37,107 +39,106 @@ std::tuple<size_t, size_t, size_t> MaxPoolLayer::GetOutputDimensions(
   return std::make_tuple(output.width, output.height, dim.depth);
 }
 
-void MaxPoolLayer::GenerateOutputCode(const symbolic::Expression &index,
-                                      codegen::Generator *cg) const {
-  // Get 3D output dimensions.
-  std::tuple<size_t, size_t, size_t> output_dims =
-      GetOutputDimensions(input_, target_);
-  size_t output_width = std::get<0>(output_dims);
-  size_t output_height = std::get<1>(output_dims);
-  size_t output_depth = std::get<2>(output_dims);
-
-  size_t group_width = input_.width / output_width;
-  size_t group_height = input_.height / output_height;
-
-  symbolic::Expression output_row = symbolic::Unflatten3dRow(
-      output_width, output_height, output_depth, index);
-
-  symbolic::Expression output_col = symbolic::Unflatten3dCol(
-      output_width, output_height, output_depth, index);
-
-  symbolic::Expression output_z = symbolic::Unflatten3dPlane(
-      output_width, output_height, output_depth, index);
+// Pooling groups always lie inside the input, so the generated code reads them
+// without bounds checks. Groups of up to kMaxUnrolledTaps inputs are unrolled.
+void MaxPoolLayer::GroupLoopCode(const std::string &group_start,
+                                 const std::string &body_prefix,
+                                 const std::string &body_suffix,
+                                 codegen::Generator *cg) const {
+  size_t group_width = input_.width / target_.width;
+  size_t group_height = input_.height / target_.height;
+  if (group_width * group_height <= kMaxUnrolledTaps) {
+    for (size_t group_r = 0; group_r < group_height; ++group_r) {
+      for (size_t group_c = 0; group_c < group_width; ++group_c) {
+        cg->AppendLineOfCode(
+            body_prefix +
+            cg->array_access("I", group_start + " + " +
+                                      std::to_string(group_r * input_.width +
+                                                     group_c)) +
+            body_suffix);
+      }
+    }
+    return;
+  }
+  cg->AppendLineOfCode(cg->for_loop(
+      "int group_r = 0", "group_r < " + std::to_string(group_height),
+      "++group_r",
+      cg->for_loop("int group_c = 0",
+                   "group_c < " + std::to_string(group_width), "++group_c",
+                   body_prefix +
+                       cg->array_access("I", group_start + " + group_r * " +
+                                                 std::to_string(input_.width) +
+                                                 " + group_c") +
+                       body_suffix)));
+}
 
-  symbolic::Expression group_r_start = output_row * group_height;
-  symbolic::Expression group_c_start = output_col * group_width;
+// Returns code for the flat index of the first input of the pooling group of
+// output (output_z, output_row, output_col).
+std::string MaxPoolLayer::GroupStart() const {
+  size_t group_width = input_.width / target_.width;
+  size_t group_height = input_.height / target_.height;
+  return "output_z * " + std::to_string(input_.width * input_.height) +
+         " + output_row * " + std::to_string(group_height * input_.width) +
+         " + output_col * " + std::to_string(group_width);
+}
 
-  symbolic::Expression group_r = symbolic::Expression::CreateInteger("group_r");
-  symbolic::Expression group_c = symbolic::Expression::CreateInteger("group_c");
-  symbolic::Expression depth = symbolic::Expression::CreateInteger("depth");
-  symbolic::Expression max = symbolic::Expression::CreateNumericValue("max");
-  cg->AppendLineOfCode("double " + max.to_string() + " = -INFINITY" + cg->linesep());
-  cg->AppendLineOfCode("for (size_t group_r = 0; group_r < " +
-                       std::to_string(group_height) + "; ++group_r)");
-  cg->PushScope();
-  cg->AppendLineOfCode("for (size_t group_c = 0; group_c < " +
-                       std::to_string(group_width) + "; ++group_c)");
-  cg->PushScope();
-  symbolic::Expression current_input = generator_.BoundsCheckedI(group_r_start + group_r, group_c_start + group_c, output_z);
+void MaxPoolLayer::GenerateOutputCode(const symbolic::Expression &index,
+                                      codegen::Generator *cg) const {
+  UnflattenIndexCode(index.to_string(), target_.width, target_.height,
+                     "output", cg);
+  cg->AppendLineOfCode(cg->assign("const int group_start", GroupStart()) +
+                       cg->linesep());
+  cg->AppendLineOfCode(cg->assign("number max", "-INFINITY") + cg->linesep());
+  cg->AppendLineOfCode(cg->assign("number value", "0") + cg->linesep());
+  GroupLoopCode("group_start", "value = ",
+                cg->linesep() + " " +
+                    cg->if_expr(cg->gt("value", "max")) + " " +
+                    cg->assign("max", "value") + cg->linesep(),
+                cg);
   cg->AppendLineOfCode(
-      cg->if_expr(cg->gt(current_input.to_string(), max.to_string())));
-  cg->PushScope();
-  cg->AppendLineOfCode(cg->assign(max.to_string(), current_input.to_string()) + cg->linesep()); 
-  cg->AppendLineOfCode("if (isinf(max)) {"
-      "printf(\"inf found near row %i col %i of input\\n\", " + group_r_start.to_string() + ", " + group_c_start.to_string() + ");}");
-  cg->PopScope();
-  cg->PopScope();
-  cg->PopScope();
-  cg->AppendLineOfCode("return " + max.to_string() + cg->linesep());
+      "if (isinf(max)) {"
+      "printf(\"inf found near row %i col %i of input\\n\", "
+      "output_row * " +
+      std::to_string(input_.height / target_.height) + ", output_col * " +
+      std::to_string(input_.width / target_.width) + ");}");
+  cg->AppendLineOfCode("return max" + cg->linesep());
 }
 
 void MaxPoolLayer::InputGradientCode(
     const symbolic::Expression& input_index, codegen::Generator *cg) const {
-  // Okay so for this input, find the group it belongs to.
-  std::tuple<size_t, size_t, size_t> output_dims =
-      GetOutputDimensions(input_, target_);
-  size_t output_width = std::get<0>(output_dims);
-  size_t output_height = std::get<1>(output_dims);
-  size_t output_depth = std::get<2>(output_dims);
-  size_t input_depth = output_depth;
-
-  size_t group_width = input_.width / output_width;
-  size_t group_height = input_.height / output_height;
-
-  symbolic::Expression input_row = symbolic::Unflatten3dRow(
-      input_.width, input_.height, input_depth, input_index);
-
-  symbolic::Expression input_col = symbolic::Unflatten3dCol(
-      input_.width, input_.height, input_depth, input_index);
-
-  symbolic::Expression input_z = symbolic::Unflatten3dPlane(
-      input_.width, input_.height, input_depth, input_index);
-
-  symbolic::Expression output_row = input_row / group_height;
-  symbolic::Expression output_col = input_col / group_width;
-  symbolic::Expression output_z = input_z;
-  symbolic::Expression output_flat_index =
-      symbolic::Flatten3d(output_width, output_height, output_depth, output_row,
-                          output_col, output_z);
-
-  symbolic::Expression group_r_start = output_row * group_height;
-  symbolic::Expression group_c_start = output_col * group_width;
-
-  symbolic::Expression group_r = symbolic::Expression::CreateInteger("group_r");
-  symbolic::Expression group_c = symbolic::Expression::CreateInteger("group_c");
-  symbolic::Expression depth = symbolic::Expression::CreateInteger("depth");
-  symbolic::Expression current_input = generator_.I(input_row, input_col, input_z);
-  cg->AppendLineOfCode("for (size_t group_r = 0; group_r < " +
-                       std::to_string(group_height) + "; ++group_r)");
-  cg->PushScope();
-  cg->AppendLineOfCode("for (size_t group_c = 0; group_c < " +
-                       std::to_string(group_width) + "; ++group_c)");
-  cg->PushScope();
-  symbolic::Expression value = generator_.I(group_r_start + group_r, group_c_start + group_c, output_z);
-  cg->AppendLineOfCode(
-      cg->if_expr(cg->gt(value.to_string(), current_input.to_string())));
-  cg->PushScope();
-  cg->AppendLineOfCode("return 0.0" + cg->linesep()); 
-  cg->PopScope();
-  cg->PopScope();
-  cg->PopScope();
-  cg->AppendLineOfCode("return " +
-                       generator_.GRADIENT(output_flat_index).to_string() +
+  size_t group_width = input_.width / target_.width;
+  size_t group_height = input_.height / target_.height;
+
+  // Find the output of the group this input belongs to. The gradient only
+  // flows back to the (first) maximum of the group.
+  UnflattenIndexCode(input_index.to_string(), input_.width, input_.height,
+                     "input", cg);
+  cg->AppendLineOfCode(cg->assign("const int output_z", "input_z") +
                        cg->linesep());
+  cg->AppendLineOfCode(cg->assign("const int output_row",
+                                  "input_row / " +
+                                      std::to_string(group_height)) +
+                       cg->linesep());
+  cg->AppendLineOfCode(cg->assign("const int output_col",
+                                  "input_col / " +
+                                      std::to_string(group_width)) +
+                       cg->linesep());
+  cg->AppendLineOfCode(cg->assign("const int group_start", GroupStart()) +
+                       cg->linesep());
+  cg->AppendLineOfCode(
+      cg->assign("const number current",
+                 cg->array_access("I", input_index.to_string())) +
+      cg->linesep());
+  GroupLoopCode("group_start", "if(",
+                " > current) return 0.0" + cg->linesep(), cg);
+  cg->AppendLineOfCode(
+      "return " +
+      cg->array_access("GRADIENT",
+                       "output_z * " +
+                           std::to_string(target_.width * target_.height) +
+                           " + output_row * " + std::to_string(target_.width) +
+                           " + output_col") +
+      cg->linesep());
 }
 
 void MaxPoolLayer::WeightGradientCode(
@@ -145,6 +146,14 @@ void MaxPoolLayer::WeightGradientCode(
   cg->AppendLineOfCode("return 0.0" + cg->linesep());
 }
 
+std::string MaxPoolLayer::KernelSignature() const {
+  std::stringstream signature;
+  signature << Super::KernelSignature() << "[" << input_.width << "x"
+            << input_.height << "x" << input_.depth << ";" << target_.width
+            << "x" << target_.height << "]";
+  return signature.str();
+}
+
 std::unique_ptr<LayerImpl> MaxPoolLayer::Clone() const {
   return std::make_unique<MaxPoolLayer>(input_, target_, layer_index_);
 }
@@ -52,7 +52,17 @@ class MaxPoolLayer : public LayerImpl {
     return "max_pool_layer";
   }
 
+  std::string KernelSignature() const override;
+
  private:
+  std::string GroupStart() const;
+  // Appends body_prefix + <input> + body_suffix for each input of the pooling
+  // group starting at group_start.
+  void GroupLoopCode(const std::string &group_start,
+                     const std::string &body_prefix,
+                     const std::string &body_suffix,
+                     codegen::Generator *cg) const;
+
   InputVolumeSymbolGenerator generator_;
   VolumeDimensions input_;
   AreaDimensions target_;
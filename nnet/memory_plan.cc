@@ -0,0 +1,70 @@
+#include "nnet/memory_plan.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+#include <limits>
+
+namespace nnet {
+
+namespace {
+constexpr size_t kNoArena = std::numeric_limits<size_t>::max();
+}  // namespace
+
+MemoryPlan::MemoryPlan(const std::vector<size_t> &layer_sizes,
+                       const std::vector<bool> &fused_activations)
+    : layer_sizes_(layer_sizes), output_arenas_(layer_sizes.size(), kNoArena) {
+  if (fused_activations.size() != layer_sizes.size()) {
+    std::cerr << "MemoryPlan: expected fusion flags for "
+              << layer_sizes.size() << " layers, got "
+              << fused_activations.size() << "." << std::endl;
+    std::exit(1);
+  }
+  // Number of kernels launched so far, the parity picks the arena.
+  size_t launches = 0;
+  for (size_t layer = 0; layer < layer_sizes.size(); ++layer) {
+    const size_t last_output =
+        fused_activations[layer] ? layer + 1 : layer;
+    if (last_output + 1 >= layer_sizes.size()) {
+      // The last launch writes the result.
+      break;
+    }
+    const size_t arena = launches % 2;
+    output_arenas_[layer] = arena;
+    arena_sizes_[arena] = std::max(arena_sizes_[arena], layer_sizes[layer]);
+    ++launches;
+    layer = last_output;
+  }
+}
+
+size_t MemoryPlan::OutputArena(size_t layer) const {
+  if (layer >= output_arenas_.size() || output_arenas_[layer] == kNoArena) {
+    std::cerr << "MemoryPlan: layer " << layer
+              << " does not write to an inference arena." << std::endl;
+    std::exit(1);
+  }
+  return output_arenas_[layer];
+}
+
+std::vector<MemoryPlan::Region> MemoryPlan::TrainingRegions(
+    size_t batch_size, size_t alignment) const {
+  std::vector<Region> regions;
+  size_t offset = 0;
+  for (size_t layer_size : layer_sizes_) {
+    regions.push_back({offset, batch_size * layer_size});
+    offset += batch_size * layer_size;
+    offset = ((offset + alignment - 1) / alignment) * alignment;
+  }
+  return regions;
+}
+
+size_t MemoryPlan::TrainingPoolSize(size_t batch_size,
+                                    size_t alignment) const {
+  const std::vector<Region> regions = TrainingRegions(batch_size, alignment);
+  if (regions.empty()) {
+    return 0;
+  }
+  return regions.back().offset + regions.back().size;
+}
+
+}  // namespace nnet
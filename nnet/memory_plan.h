@@ -0,0 +1,67 @@
+#ifndef MEMORY_PLAN_H
+#define MEMORY_PLAN_H
+
+#include <array>
+#include <cstddef>
+#include <vector>
+
+namespace nnet {
+
+// Ahead-of-time placement of the layer outputs of a network, computed once
+// from the layer sizes (after activations have been fused, see
+// Nnet::FuseActivations()). All sizes and offsets are in values, and scale
+// with the batch size.
+//
+// Inference only needs the outputs of a layer until the next layer has read
+// them, so the layers ping-pong between two arenas: each layer which launches
+// a kernel reads the arena written by the one before it and writes the other.
+// The outputs of the last layer are the result, which belongs to the caller.
+//
+// Training saves the outputs of every layer (the pre-activation values, for a
+// layer with a fused activation) for back propagation. They are all written
+// before the first one is read back, so their lifetimes all overlap and they
+// are laid out back-to-back in a single pool.
+class MemoryPlan {
+ public:
+  struct Region {
+    size_t offset;
+    size_t size;
+  };
+
+  MemoryPlan() = default;
+
+  // layer_sizes[i] is the number of outputs of layer i for one sample.
+  // fused_activations[i] is set if the activation layer after layer i is fused
+  // into it, in which case that activation layer launches no kernel.
+  MemoryPlan(const std::vector<size_t> &layer_sizes,
+             const std::vector<bool> &fused_activations);
+
+  // The arena (0 or 1) which receives the outputs of the given layer during
+  // inference. Only valid for layers which launch a kernel, other than the
+  // last one.
+  size_t OutputArena(size_t layer) const;
+
+  // Arena sizes for a single sample. Only as large as the layers which write
+  // to them require.
+  size_t arena_size(size_t arena) const { return arena_sizes_[arena]; }
+
+  // The region of the training pool which holds the saved outputs of each
+  // layer, for a batch of batch_size samples. Each region starts on a multiple
+  // of alignment values (sub-buffers must be aligned to the device's base
+  // address alignment).
+  std::vector<Region> TrainingRegions(size_t batch_size,
+                                      size_t alignment) const;
+
+  // Size of the pool which holds the regions above.
+  size_t TrainingPoolSize(size_t batch_size, size_t alignment) const;
+
+ private:
+  std::vector<size_t> layer_sizes_;
+  // Arena of each layer, see OutputArena().
+  std::vector<size_t> output_arenas_;
+  std::array<size_t, 2> arena_sizes_ = {0, 0};
+};
+
+}  // namespace nnet
+
+#endif  // MEMORY_PLAN_H
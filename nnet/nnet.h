@@ -1,13 +1,21 @@
 #ifndef NNET_H
 #define NNET_H
 #include "compute/cl_buffer.h"
+#include "compute/kernel_cache.h"
+#include "compute/native_program.h"
 #include "clutil/util.h"
 #include "geometry/dynamic_matrix.h"
 #include "nnet/architecture.h"
 #include "nnet/error_layer.h"
+#include "nnet/event_graph.h"
+#include "nnet/input_pipeline.h"
 #include "nnet/layer.h"
 #include "nnet/layer_dimensions.h"
+#include "nnet/memory_plan.h"
+#include "nnet/profiler.h"
+#include "nnet/quantization.h"
 #include "nnet/symbol_generator.h"
+#include "nnet/weight_file.h"
 #include "rapidjson/document.h"
 #include "rapidjson/writer.h"
 #include "rapidjson/stringbuffer.h"
@@ -15,11 +23,18 @@
 #include "symbolic/expression.h"
 #include "symbolic/symbolic_util.h"
 
+#include <algorithm>
+#include <array>
 #include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
 #include <fstream>
 #include <future>
 #include <map>
 #include <memory>
+#include <optional>
+#include <set>
 #include <sstream>
 
 namespace nnet {
@@ -28,13 +43,76 @@ typedef double Number;
 
 constexpr const char *kWeightFileFormatVersion = "dev";
 
+// Names of the int8 arrays of a quantized layer in a binary weight file,
+// appended to the layer's name (see Nnet::SaveWeightsToFile()).
+constexpr const char *kInt8WeightsSuffix = "/int8_weights";
+constexpr const char *kInt32BiasesSuffix = "/int32_biases";
+constexpr const char *kQuantizationScalesSuffix = "/quantization_scales";
+
+// Part of the key of every compiled program in the kernel cache. Bump this
+// whenever code generation changes in a way which isn't reflected in the
+// kernel templates or in Layer::KernelSignature(), to invalidate stale
+// programs. Nnet::CachedSourceIsCurrent() also catches most such changes.
+constexpr const char *kKernelCacheVersion = "5";
+
 // Creates a neural network symbolically. Networks are modeled with the
 // nnet::Architecture struct.
 class Nnet {
  public:
+  // How Backpropagate() turns the gradient of each weight into an update.
+  // Updates run in fused kernels on the device (see
+  // nnet/kernels/optimizer.kernel.cl), and the optimizer's state is kept on
+  // the device next to the weights (see Layer::optimizer_state()).
+  enum Optimizer {
+    // Plain gradient descent, no state.
+    SGD = 0,
+    // Gradient descent with a velocity per weight.
+    Momentum,
+    // Divides the gradient by a running average of its magnitude.
+    RMSProp,
+    // Bias-corrected running averages of the gradient and its square.
+    Adam,
+  };
+
   struct LearningParameters {
     Number learning_rate;
     bool dynamic_learning_rate = false;
+    Optimizer optimizer = SGD;
+    // Momentum: decay of the velocity.
+    Number momentum = 0.9;
+    // RMSProp: decay of the average squared gradient.
+    Number rho = 0.9;
+    // Adam: decay of the first and second moment estimates.
+    Number beta1 = 0.9;
+    Number beta2 = 0.999;
+    // RMSProp & Adam: keeps the update finite where the gradient vanishes.
+    Number epsilon = 1e-8;
+  };
+
+  // Results of EvaluateClassifier().
+  struct ClassificationReport {
+    size_t samples = 0;
+    size_t classes = 0;
+    // confusion_matrix[actual * classes + predicted] counts the samples
+    // labelled actual for which the largest output was predicted.
+    std::vector<size_t> confusion_matrix;
+
+    size_t count(size_t actual, size_t predicted) const {
+      return confusion_matrix[actual * classes + predicted];
+    }
+
+    size_t correct() const {
+      size_t correct = 0;
+      for (size_t i = 0; i < classes; ++i) {
+        correct += count(i, i);
+      }
+      return correct;
+    }
+
+    // Samples with labels outside [0, classes) count as wrong.
+    double accuracy() const {
+      return (samples > 0) ? static_cast<double>(correct()) / samples : 0.0;
+    }
   };
 
   enum InitStrategy {
@@ -47,24 +125,72 @@ class Nnet {
     InitToOne,
   };
 
+  enum Backend {
+    // Kernels are compiled and run through OpenCL.
+    OpenCl = 0,
+    // Kernels are compiled into a shared object with the host C compiler and
+    // run natively, with each kernel's range split across a thread pool. No
+    // OpenCL runtime is needed. Buffers made by the network are pinned to the
+    // CPU, and MoveToGpu() on them is a no-op.
+    NativeCpu,
+  };
+
+  // The type of the values the OpenCL kernels compute with and keep in device
+  // memory. The host side of every buffer is double regardless, values are
+  // converted when buffers move to and from the device. The native CPU backend
+  // always uses DoublePrecision.
+  enum Precision {
+    DoublePrecision = 0,
+    // Halves the memory traffic of every kernel, and many OpenCL CPUs and
+    // integrated GPUs have much lower double than float throughput.
+    SinglePrecision,
+    // Weights, gradients and arithmetic in float, the values passed between
+    // layers in half. Needs the cl_khr_fp16 extension, devices without it
+    // fall back to SinglePrecision.
+    MixedPrecision,
+  };
+
+  // The backend used when none is passed to the constructor. Set
+  // PLASTICITY_BACKEND=native to run on the native CPU backend, which lets the
+  // existing tests and tools run on machines without OpenCL.
+  static Backend DefaultBackend() {
+    const char *backend = std::getenv("PLASTICITY_BACKEND");
+    if ((backend != nullptr) && (std::string(backend) == "native")) {
+      return NativeCpu;
+    }
+    return OpenCl;
+  }
+
   // TODO(sharf): create factory class since C++'s doesn't allow named
   // parameters and I want this API to be readable.
+  //
+  // device selects the OpenCL device to run on, instead of the platform's
+  // first one (see nnet/data_parallel.h, which places a replica per device).
   Nnet(const Architecture &model, InitStrategy weight_initialization = Xavier,
-       LossFunction loss_function = MeanSquared)
-      : model_(model), error_(loss_function, model.output_size()) {
+       LossFunction loss_function = MeanSquared,
+       Backend backend = DefaultBackend(),
+       Precision precision = DoublePrecision,
+       std::optional<cl::Device> device = std::nullopt)
+      : model_(model),
+        error_(loss_function, model.output_size()),
+        backend_(backend),
+        precision_((backend == NativeCpu) ? DoublePrecision : precision),
+        device_(std::move(device)) {
     if (!model_.VerifyArchitecture()) {
       std::cerr << "Invalid dimensions passed to Nnet(): " << model.to_string()
                 << std::endl;
       std::exit(1);
     }
 
+    FuseActivations();
     CompileKernelsIfRequired();
 
     eval_layer_outputs_ = std::make_unique<std::vector<compute::ClBuffer>>();
 
-    auto queue = MakeCommandQueue();
     size_t max_layer_output_size = 0;
     size_t max_layer_weight_size = 0;
+    std::vector<size_t> layer_sizes;
+    std::vector<bool> fused_activations;
     for (size_t i = 0; i < model_.layers.size(); ++i) {
       model_.layers[i].RegisterToNetwork(this);
 
@@ -80,34 +206,62 @@ class Nnet {
 
       eval_layer_outputs_->emplace_back(
           model_.layers[i].GetDimensions().num_outputs);
-      RegisterBuffer(&eval_layer_outputs_->back());
+      RegisterBuffer(&eval_layer_outputs_->back(), activation_format());
+
+      layer_sizes.push_back(layer_size);
+      fused_activations.push_back(model_.layers[i].has_fused_activation());
     }
+    memory_plan_ = MemoryPlan(layer_sizes, fused_activations);
 
     max_layer_output_size_ = max_layer_output_size;
-    layer_outputs_ = MakeBuffer(max_layer_output_size);
     backprop_gradients_ = MakeBuffer(max_layer_output_size);
     next_backprop_gradients_ = MakeBuffer(max_layer_output_size);
     next_weight_buffer_ = MakeBuffer(max_layer_weight_size);
     learning_rate_buffer_ = MakeBuffer(1);
+    // The weight_delta kernels compute -learning_rate * gradient, so -1 makes
+    // them write the gradient itself (see EnqueueWeightGradients()).
+    gradient_scale_buffer_ = MakeBuffer({-1.0});
 
-    layer_outputs_->MoveToGpu();
     backprop_gradients_->MoveToGpu();
     next_backprop_gradients_->MoveToGpu();
     next_weight_buffer_->MoveToGpu();
     learning_rate_buffer_->MoveToGpu();
+    gradient_scale_buffer_->MoveToGpu();
 
     CalculateInitialWeights(weight_initialization);
+
+    // SGD writes each layer's new weights to a spare buffer, which is then
+    // swapped with the layer's weights (see Backpropagate()).
+    if (backend_ == OpenCl) {
+      for (const Layer &layer : model_.layers) {
+        spare_weights_.push_back(MakeGpuBuffer(layer.weight_buffer().size()));
+      }
+    }
   }
 
   std::unique_ptr<compute::ClBuffer> MakeBuffer(size_t size) {
-    return std::make_unique<compute::ClBuffer>(
+    if (backend_ == NativeCpu) {
+      auto buffer = std::make_unique<compute::ClBuffer>(size);
+      buffer->PinToCpu();
+      return buffer;
+    }
+    auto buffer = std::make_unique<compute::ClBuffer>(
         size, &opencl_.queue, &std::get<0>(opencl_.compilation_units));
+    buffer->SetDeviceFormat(number_format());
+    return buffer;
   }
 
   std::unique_ptr<compute::ClBuffer> MakeBuffer(
       const std::vector<double> &values) {
-    return std::make_unique<compute::ClBuffer>(
+    if (backend_ == NativeCpu) {
+      auto buffer = std::make_unique<compute::ClBuffer>(values);
+      buffer->PinToCpu();
+      return buffer;
+    }
+    auto buffer = std::make_unique<compute::ClBuffer>(
         values, &opencl_.queue, &std::get<0>(opencl_.compilation_units));
+    buffer->SetDeviceFormat(number_format());
+    return buffer;
   }
 
   std::unique_ptr<compute::ClBuffer> MakeBuffer(
@@ -117,15 +271,44 @@ class Nnet {
   }
 
   std::unique_ptr<compute::ClBuffer> MakeBuffer() {
-    return std::make_unique<compute::ClBuffer>(
+    if (backend_ == NativeCpu) {
+      return MakeBuffer(0);
+    }
+    auto buffer = std::make_unique<compute::ClBuffer>(
         &opencl_.queue, &std::get<0>(opencl_.compilation_units));
+    buffer->SetDeviceFormat(number_format());
+    return buffer;
   }
 
+  // Buffers default to the format of weights and gradients. Pass
+  // activation_format() for buffers which hold layer inputs or outputs.
   void RegisterBuffer(compute::ClBuffer *buffer) {
+    RegisterBuffer(buffer, number_format());
+  }
+
+  void RegisterBuffer(compute::ClBuffer *buffer, compute::DeviceFormat format) {
+    if (backend_ == NativeCpu) {
+      buffer->PinToCpu();
+      return;
+    }
+    buffer->SetDeviceFormat(format);
     buffer->RegisterClBackend(&opencl_.queue,
                               &std::get<0>(opencl_.compilation_units));
   }
 
+  Backend backend() const { return backend_; }
+  Precision precision() const { return precision_; }
+
+  // Device formats of weights & gradients, and of the values passed between
+  // layers (which includes network inputs, outputs and expected outputs).
+  compute::DeviceFormat number_format() const {
+    return (precision_ == DoublePrecision) ? compute::Float64
+                                           : compute::Float32;
+  }
+  compute::DeviceFormat activation_format() const {
+    return (precision_ == MixedPrecision) ? compute::Float16 : number_format();
+  }
+
   // Intended mostly for testing or low-level hacks. Proceed with caution.
   Architecture &model() {
     for (size_t i = 0; i < model_.layers.size(); ++i) {
@@ -144,22 +327,134 @@ class Nnet {
   }
 
   void CompileKernelsIfRequired() {
+    if (backend_ == NativeCpu) {
+      if (!native_program_) {
+        native_program_ = compute::NativeProgram::Compile(GenerateKernelSources());
+      }
+      return;
+    }
     if (opencl_.compiled) {
       return;
     }
     opencl_.device = SelectDevice();
+    if (precision_ == MixedPrecision && !SupportsHalf(opencl_.device)) {
+      std::cerr << "Device lacks cl_khr_fp16, using SinglePrecision instead of "
+                   "MixedPrecision."
+                << std::endl;
+      precision_ = SinglePrecision;
+    }
+
+    // Code generation and compilation are slow for large networks. If this
+    // architecture was already compiled for this device, load the program
+    // binary from the on-disk cache instead.
+    compute::KernelCache cache;
+    const uint64_t cache_key = KernelCacheKey(opencl_.device);
+    compute::KernelCache::Entry cached;
+    if (cache.Lookup(cache_key, &cached) &&
+        CachedSourceIsCurrent(cached.source) &&
+        LoadClBinary(cached.binary, opencl_.device, &opencl_)) {
+      return;
+    }
+
+    std::vector<std::string> kernel_sources = GenerateKernelSources();
+    opencl_ = CompileCl(kernel_sources, opencl_.device);
+    if (!cache.enabled()) {
+      return;
+    }
+    std::vector<std::vector<unsigned char>> binaries;
+    if (CL_SUCCESS != std::get<1>(opencl_.compilation_units)
+                          .getInfo(CL_PROGRAM_BINARIES, &binaries) ||
+        binaries.size() != 1 || binaries[0].empty()) {
+      std::cerr << "Could not fetch program binary, not caching kernels."
+                << std::endl;
+      return;
+    }
+    compute::KernelCache::Entry compiled;
+    for (const std::string &kernel_source : kernel_sources) {
+      compiled.source += kernel_source;
+    }
+    compiled.binary = std::move(binaries[0]);
+    cache.Store(cache_key, compiled);
+  }
+
+  // The cache key covers the kernel templates but not the code generators
+  // themselves, so a build which generates different code for the same layers
+  // would load stale programs if kKernelCacheVersion isn't bumped. As a
+  // fingerprint of the generators, regenerate the evaluation kernel of the
+  // first layer of each type, which is much cheaper than generating every
+  // kernel, and check that the cached source contains it.
+  bool CachedSourceIsCurrent(const std::string &cached_source) const {
+    std::set<std::string> checked_types;
+    for (const Layer &layer : model_.layers) {
+      if (!checked_types.insert(layer.LayerType()).second) {
+        continue;
+      }
+      if (cached_source.find(layer.GenerateEvaluationKernel(
+              /*use_tiled_kernels=*/backend_ == OpenCl)) == std::string::npos) {
+        std::cerr << "Cached kernels for " << layer.LayerSuffix()
+                  << " are stale, regenerating them." << std::endl;
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Hashes everything the generated kernels depend on: the architecture, the
+  // loss function, the kernel templates and the device & driver. This lets the
+  // kernel cache be queried before generating any code.
+  uint64_t KernelCacheKey(const cl::Device &device) const {
+    std::stringstream key;
+    key << kKernelCacheVersion << "\n";
+    key << PrecisionPrelude() << "\n";
+    for (const Layer &layer : model_.layers) {
+      key << layer.KernelSignature() << "\n";
+    }
+    key << error_.KernelSignature() << "\n";
+    for (const char *kernel_template :
+         {"nnet/kernels/evaluate.kernel.cl", "nnet/kernels/back_prop.kernel.cl",
+          "nnet/kernels/weight_update.kernel.cl",
+          "nnet/kernels/dense_evaluate_tiled.kernel.cl",
+          "nnet/kernels/dense_weight_update_tiled.kernel.cl",
+          "nnet/kernels/convolution_im2col.kernel.cl",
+          "nnet/kernels/convolution_winograd.kernel.cl",
+          "nnet/kernels/store_output.kernel.cl",
+          "nnet/kernels/error.kernel.cl",
+          "nnet/kernels/error_reduce.kernel.cl",
+          "nnet/kernels/combine.kernel.cl",
+          "nnet/kernels/optimizer.kernel.cl",
+          "nnet/kernels/classification.kernel.cl"}) {
+      key << FileToString(kernel_template) << "\n";
+    }
+    for (cl_device_info info : {CL_DEVICE_VENDOR, CL_DEVICE_NAME,
+                                CL_DEVICE_VERSION, CL_DRIVER_VERSION}) {
+      std::string value;
+      device.getInfo(info, &value);
+      key << value << "\n";
+    }
+    return compute::KernelCache::Hash(key.str());
+  }
+
+
+  // Generates the source of every kernel used by this network.
+  std::vector<std::string> GenerateKernelSources() const {
+    // Tiled kernels need local memory and barriers, which the native backend
+    // doesn't support.
+    const bool use_tiled_kernels = (backend_ == OpenCl);
     std::vector<std::future<std::string>> kernel_futures;
     for (const Layer &layer : model_.layers) {
-      kernel_futures.push_back(std::async(
-          std::launch::async, &Layer::GenerateEvaluationKernel, &layer));
-      kernel_futures.push_back(std::async(
-          std::launch::async, &Layer::GenerateTrainingKernels, &layer));
+      kernel_futures.push_back(
+          std::async(std::launch::async, &Layer::GenerateEvaluationKernel,
+                     &layer, use_tiled_kernels));
+      kernel_futures.push_back(
+          std::async(std::launch::async, &Layer::GenerateTrainingKernels,
+                     &layer, use_tiled_kernels));
     }
-    kernel_futures.push_back(std::async(
-        std::launch::async, &ErrorLayer::GenerateErrorKernels, &error_));
+    kernel_futures.push_back(
+        std::async(std::launch::async, &ErrorLayer::GenerateErrorKernels,
+                   &error_, use_tiled_kernels));
 
     // Wait for kernels to be ready.
-    std::vector<std::string> kernel_sources;
+    std::vector<std::string> kernel_sources = {PrecisionPrelude()};
     for (auto &kernel_future : kernel_futures) {
       kernel_sources.push_back(kernel_future.get());
     }
@@ -167,7 +462,37 @@ class Nnet {
     // Batch training.
     kernel_sources.push_back(
         FileToString("nnet/kernels/combine.kernel.cl"));
-    opencl_ = CompileCl(kernel_sources, opencl_.device);
+    kernel_sources.push_back(
+        FileToString("nnet/kernels/optimizer.kernel.cl"));
+    kernel_sources.push_back(
+        FileToString("nnet/kernels/classification.kernel.cl"));
+    return kernel_sources;
+  }
+
+  // Defines the types which the kernel templates and generated code use:
+  // number for weights, gradients and arithmetic, and activation for the
+  // values passed between layers.
+  std::string PrecisionPrelude() const {
+    switch (precision_) {
+      case DoublePrecision:
+        return "typedef double number;\ntypedef double activation;\n";
+      case SinglePrecision:
+        return "typedef float number;\ntypedef float activation;\n";
+      case MixedPrecision:
+        return "#pragma OPENCL EXTENSION cl_khr_fp16 : enable\n"
+               "typedef float number;\ntypedef half activation;\n";
+      default:
+        std::cerr << "Unknown precision: " << precision_ << std::endl;
+        std::exit(1);
+    }
+  }
+
+  static bool SupportsHalf(const cl::Device &device) {
+    std::string extensions;
+    if (CL_SUCCESS != device.getInfo(CL_DEVICE_EXTENSIONS, &extensions)) {
+      return false;
+    }
+    return extensions.find("cl_khr_fp16") != std::string::npos;
   }
 
   static bool ClDevicesAreEqual(const cl::Device &a, const cl::Device &b) {
@@ -186,6 +511,9 @@ class Nnet {
   }
 
   cl::Device SelectDevice() {
+    if (device_) {
+      return *device_;
+    }
     // Select the default OpenCL device.
     cl::Platform platform = clutil::GetDefaultPlatform();
     std::vector<cl::Device> devices = clutil::GetPlatformDevices(platform);
@@ -213,63 +541,254 @@ class Nnet {
   std::unique_ptr<compute::ClBuffer> Evaluate(
       const std::unique_ptr<compute::ClBuffer> &inputs,
       std::unique_ptr<std::vector<compute::ClBuffer>> &out_layer_outputs) {
+    return Evaluate(inputs, 1, out_layer_outputs);
+  }
+
+  // Evaluates batch_size samples in a single pass through the network. The
+  // samples are packed back-to-back in inputs (input_size() values each), and
+  // the result holds output_size() values per sample in the same order.
+  std::unique_ptr<compute::ClBuffer> BatchEvaluate(
+      const std::unique_ptr<compute::ClBuffer> &inputs, size_t batch_size) {
+    std::unique_ptr<std::vector<compute::ClBuffer>> _(nullptr);
+    return Evaluate(inputs, batch_size, _);
+  }
+
+  // Same as above, but (*out_layer_outputs)[i] receives the outputs of layer i
+  // for the entire batch (packed the same way as the network outputs).
+  std::unique_ptr<compute::ClBuffer> Evaluate(
+      const std::unique_ptr<compute::ClBuffer> &inputs, size_t batch_size,
+      std::unique_ptr<std::vector<compute::ClBuffer>> &out_layer_outputs) {
     CompileKernelsIfRequired();
-    ClaimOwnership(inputs);
+    ClaimOwnership(inputs, activation_format());
+
+    if (batch_size == 0) {
+      std::cerr << "Nnet::Evaluate called with a batch size of zero."
+                << std::endl;
+      std::exit(1);
+    }
+    if (inputs->size() < batch_size * input_size()) {
+      std::cerr << "Nnet::Evaluate called with " << inputs->size()
+                << " input values, but a batch of " << batch_size
+                << " samples requires " << batch_size * input_size() << "."
+                << std::endl;
+      std::exit(1);
+    }
 
-    // Create a queue (a queue of commands that the GPU will execute)
-    // Assumes that all kernels compiled for same device.
-    auto queue = MakeCommandQueue();
+    if (backend_ == NativeCpu) {
+      return NativeEvaluate(inputs, batch_size, out_layer_outputs);
+    }
 
     inputs->MoveToGpu();
 
-    std::unique_ptr<compute::ClBuffer> nnet_input =
-        std::make_unique<compute::ClBuffer>(*inputs);
-
     // Load all weights into the GPU (weights which are already in the GPU will
     // be skipped).
     for (size_t i = 0; i < model_.layers.size(); ++i) {
       model_.layers[i].weight_buffer().MoveToGpu();
     }
 
+    // The outputs of intermediate layers go to the preallocated buffers of
+    // memory_plan_, which the previous call (or back propagation) may still be
+    // reading. The graph orders the kernels after those reads.
+    graph().Import(&opencl_.queue);
+
+    // Outputs saved for back propagation go into the training pool. Outputs
+    // saved for a caller are theirs to keep, so they get buffers of their own.
+    const bool use_training_pool =
+        out_layer_outputs && out_layer_outputs == eval_layer_outputs_;
+    if (use_training_pool) {
+      BindTrainingPool(batch_size);
+    }
+
+    cl::Buffer layer_input = *inputs->gpu_buffer();
+    cl::Buffer outputs;
     for (size_t index = 0; index < model_.layers.size(); ++index) {
       Layer &layer = model_.layers[index];
+      const size_t layer_output_size =
+          batch_size * layer.GetDimensions().num_outputs;
+      // If the next layer's activation is fused into this one, outputs receives
+      // the activated values. When the layer outputs are saved (for training),
+      // the values before the activation are saved too.
+      const size_t output_index =
+          layer.has_fused_activation() ? index + 1 : index;
+      const bool save_pre_activations =
+          layer.has_fused_activation() && out_layer_outputs;
+      cl::Buffer pre_activations;
+      if (use_training_pool) {
+        outputs = training_outputs_[output_index];
+        pre_activations = training_outputs_[index];
+      } else if (out_layer_outputs) {
+        outputs = AllocateGpuBuffer(layer_output_size);
+        pre_activations = save_pre_activations
+                              ? AllocateGpuBuffer(layer_output_size)
+                              : outputs;
+      } else {
+        // The network's outputs are returned to the caller.
+        outputs = (output_index + 1 == model_.layers.size())
+                      ? AllocateGpuBuffer(layer_output_size)
+                      : InferenceArena(memory_plan_.OutputArena(index),
+                                       batch_size);
+        pre_activations = outputs;
+      }
 
-      cl::Buffer outputs(
-          std::get<0>(opencl_.compilation_units), CL_MEM_READ_WRITE,
-          model_.layers[index].GetDimensions().num_outputs * sizeof(Number));
+      if (IsQuantized(index) && !out_layer_outputs) {
+        EnqueueQuantizedEvaluate(index, layer_input, outputs, batch_size);
+        index = output_index;
+        layer_input = outputs;
+        continue;
+      }
 
       // Evaluate.
-      cl_int result;
       std::string kernel_name = layer.EvaluateKernelName();
       cl::Kernel &evaluate = CacheFetchKernel(kernel_name);
-      CL_CHECK(evaluate.setArg(0, *nnet_input->gpu_buffer()));
+      CL_CHECK(evaluate.setArg(0, layer_input));
       CL_CHECK(evaluate.setArg(1, *layer.weight_buffer().gpu_buffer()));
       CL_CHECK(evaluate.setArg(2, outputs));
-      auto workgroup = (layer.eval_workgroup_size() != 0)
-                           ? cl::NDRange(layer.eval_workgroup_size())
-                           : cl::NullRange;
-      result = queue->enqueueNDRangeKernel(
-          evaluate, cl::NullRange,
-          cl::NDRange(layer.GetDimensions().num_outputs), workgroup);
-      if (result != CL_SUCCESS) {
-        std::cerr << "Error enqueuing Evaluation Kernel:  " << result
-                  << std::endl;
-        std::cerr << "Layer: " << layer.LayerSuffix() << std::endl;
-        std::exit(1);
-      }
-
-      if (out_layer_outputs) {
+      CL_CHECK(evaluate.setArg(3, static_cast<cl_int>(batch_size)));
+      CL_CHECK(evaluate.setArg(4, pre_activations));
+      CL_CHECK(evaluate.setArg(5, static_cast<cl_int>(save_pre_activations)));
+      const KernelRange range = layer.EvaluateRange(batch_size);
+      graph().EnqueueKernel(evaluate, GlobalRange(range), LocalRange(range),
+                            {layer_input, *layer.weight_buffer().gpu_buffer()},
+                            {outputs, pre_activations});
+
+      if (out_layer_outputs && !use_training_pool) {
+        out_layer_outputs->at(index).SetDeviceFormat(activation_format());
         out_layer_outputs->at(index).MoveToGpu();
-        *out_layer_outputs->at(index).gpu_buffer() = outputs;
+        *out_layer_outputs->at(index).gpu_buffer() = pre_activations;
+        if (output_index != index) {
+          out_layer_outputs->at(output_index)
+              .SetDeviceFormat(activation_format());
+          out_layer_outputs->at(output_index).MoveToGpu();
+          *out_layer_outputs->at(output_index).gpu_buffer() = outputs;
+        }
       }
 
+      // The fused activation layer is skipped, its outputs are this layer's.
+      index = output_index;
+
       // inputs = outputs (output of this layer is input for next layer).
-      *nnet_input->gpu_buffer() = outputs;
+      layer_input = outputs;
     }
 
-    queue->finish();
-    // input = output of previous layer (see above).
-    return nnet_input;
+    // Reading the outputs back (on opencl_.queue) waits for the graph, the
+    // host doesn't.
+    graph().Export(&opencl_.queue);
+    return std::make_unique<compute::ClBuffer>(
+        &opencl_.queue, &std::get<0>(opencl_.compilation_units),
+        std::make_unique<cl::Buffer>(outputs), activation_format());
+  }
+
+  // Evaluates a classifier on a dataset of num_samples inputs (packed
+  // back-to-back, like the inputs of BatchEvaluate()) and labels (the class
+  // index of each sample, in [0, output_size())), batch_size samples at a
+  // time. The predicted class of a sample is its largest output.
+  //
+  // Predictions are compared and counted on the device, and the dataset may
+  // already be there, so the only readback is the confusion matrix at the end.
+  ClassificationReport EvaluateClassifier(
+      const std::unique_ptr<compute::ClBuffer> &inputs,
+      const std::unique_ptr<compute::ClBuffer> &labels, size_t num_samples,
+      size_t batch_size = 256) {
+    CompileKernelsIfRequired();
+    if (num_samples == 0 || batch_size == 0) {
+      std::cerr << "EvaluateClassifier() needs samples and a non-zero batch "
+                   "size."
+                << std::endl;
+      std::exit(1);
+    }
+    if (inputs->size() < num_samples * input_size() ||
+        labels->size() < num_samples) {
+      std::cerr << "EvaluateClassifier() called with " << inputs->size()
+                << " input values and " << labels->size() << " labels for "
+                << num_samples << " samples." << std::endl;
+      std::exit(1);
+    }
+    ClaimOwnership(inputs, activation_format());
+    ClaimOwnership(labels, number_format());
+    batch_size = std::min(batch_size, num_samples);
+
+    ClassificationReport report;
+    report.samples = num_samples;
+    report.classes = output_size();
+    const size_t classes = report.classes;
+    const size_t batch_input_size = batch_size * input_size();
+    std::vector<int32_t> confusion(classes * classes, 0);
+
+    if (backend_ == NativeCpu) {
+      std::unique_ptr<compute::ClBuffer> batch_inputs =
+          MakeBuffer(batch_input_size);
+      std::vector<int32_t> predictions(batch_size);
+      for (size_t begin = 0; begin < num_samples; begin += batch_size) {
+        const size_t samples = std::min(batch_size, num_samples - begin);
+        const double *first_input = inputs->data() + begin * input_size();
+        std::copy(first_input, first_input + samples * input_size(),
+                  batch_inputs->data());
+        std::unique_ptr<compute::ClBuffer> outputs =
+            BatchEvaluate(batch_inputs, samples);
+        native_program_->Launch(
+            "argmax_outputs", samples, 1,
+            static_cast<const double *>(outputs->data()), predictions.data(),
+            static_cast<int>(classes));
+        native_program_->Launch(
+            "confusion_counts", classes, 1,
+            static_cast<const double *>(labels->data()),
+            static_cast<const int32_t *>(predictions.data()),
+            confusion.data(), static_cast<int>(begin),
+            static_cast<int>(samples), static_cast<int>(classes));
+      }
+    } else {
+      inputs->MoveToGpu();
+      labels->MoveToGpu();
+      std::unique_ptr<compute::ClBuffer> batch_inputs =
+          MakeGpuBuffer(batch_input_size, activation_format());
+      cl_int buffer_init;
+      cl::Buffer predictions(std::get<0>(opencl_.compilation_units),
+                             CL_MEM_READ_WRITE, batch_size * sizeof(int32_t),
+                             nullptr, &buffer_init);
+      CL_CHECK(buffer_init);
+      cl::Buffer gpu_confusion(std::get<0>(opencl_.compilation_units),
+                               CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+                               confusion.size() * sizeof(int32_t),
+                               confusion.data(), &buffer_init);
+      CL_CHECK(buffer_init);
+
+      const size_t value_size = compute::DeviceFormatSize(activation_format());
+      cl::Kernel &argmax = CacheFetchKernel("argmax_outputs");
+      cl::Kernel &counts = CacheFetchKernel("confusion_counts");
+      for (size_t begin = 0; begin < num_samples; begin += batch_size) {
+        const size_t samples = std::min(batch_size, num_samples - begin);
+        graph().Import(&opencl_.queue);
+        graph().EnqueueCopy(*inputs->gpu_buffer(), *batch_inputs->gpu_buffer(),
+                            begin * input_size() * value_size, 0,
+                            samples * input_size() * value_size);
+        graph().Export(&opencl_.queue);
+        std::unique_ptr<compute::ClBuffer> outputs =
+            BatchEvaluate(batch_inputs, samples);
+
+        graph().Import(&opencl_.queue);
+        CL_CHECK(argmax.setArg(0, *outputs->gpu_buffer()));
+        CL_CHECK(argmax.setArg(1, predictions));
+        CL_CHECK(argmax.setArg(2, static_cast<cl_int>(classes)));
+        graph().EnqueueKernel(argmax, cl::NDRange(samples), cl::NullRange,
+                              {*outputs->gpu_buffer()}, {predictions});
+        CL_CHECK(counts.setArg(0, *labels->gpu_buffer()));
+        CL_CHECK(counts.setArg(1, predictions));
+        CL_CHECK(counts.setArg(2, gpu_confusion));
+        CL_CHECK(counts.setArg(3, static_cast<cl_int>(begin)));
+        CL_CHECK(counts.setArg(4, static_cast<cl_int>(samples)));
+        CL_CHECK(counts.setArg(5, static_cast<cl_int>(classes)));
+        graph().EnqueueKernel(counts, cl::NDRange(classes), cl::NullRange,
+                              {*labels->gpu_buffer(), predictions},
+                              {gpu_confusion});
+        graph().Export(&opencl_.queue);
+      }
+      CL_CHECK(opencl_.queue.enqueueReadBuffer(
+          gpu_confusion, CL_TRUE, 0, confusion.size() * sizeof(int32_t),
+          confusion.data()));
+    }
+
+    report.confusion_matrix.assign(confusion.begin(), confusion.end());
+    return report;
   }
 
   void PrintColumnVector(std::string label, Matrix<Number> colvec) {
@@ -279,73 +798,155 @@ class Nnet {
 
   double Error(std::unique_ptr<compute::ClBuffer> &actual_output,
                std::unique_ptr<compute::ClBuffer> &expected) {
-    CompileKernelsIfRequired();
-
-    actual_output->MoveToGpu();
-    expected->MoveToGpu();
+    return BatchError(actual_output, expected, 1);
+  }
 
-    compute::ClBuffer error_components = *MakeBuffer(error_.size());
-    error_components.MoveToGpu();
+  // The mean error of a batch of outputs (packed back-to-back, like the
+  // results of BatchEvaluate()). The errors are summed on the device, and only
+  // the mean is read back.
+  double BatchError(std::unique_ptr<compute::ClBuffer> &actual_output,
+                    std::unique_ptr<compute::ClBuffer> &expected,
+                    size_t batch_size) {
+    std::unique_ptr<compute::ClBuffer> errors =
+        BatchErrors(actual_output, expected, batch_size);
+    if (backend_ == NativeCpu) {
+      return errors->at(batch_size);
+    }
+    return errors->ReadValue(batch_size);
+  }
 
-    // Calculate error component for each output in parallel.
-    cl_int result;
-    std::string kernel_name = error_.ErrorKernelName();
-    cl::Kernel &error_kernel = CacheFetchKernel(kernel_name);
-    CL_CHECK(error_kernel.setArg(0, *actual_output->gpu_buffer()));
-    CL_CHECK(error_kernel.setArg(1, *expected->gpu_buffer()));
-    CL_CHECK(error_kernel.setArg(2, *error_components.gpu_buffer()));
-    auto workgroup = (error_.workgroup_size() != 0)
-                         ? cl::NDRange(error_.workgroup_size())
-                         : cl::NullRange;
-    result = opencl_.queue.enqueueNDRangeKernel(
-        error_kernel, cl::NullRange, cl::NDRange(error_.size()), workgroup);
-    if (result != CL_SUCCESS) {
-      std::cerr << "Error enqueuing Error Kernel:  " << result << std::endl;
+  // The error of each sample of a batch of outputs, followed by their mean
+  // (batch_size + 1 values). The result is left on the device, nothing is read
+  // back.
+  //
+  // On OpenCL, the errors are reduced in two passes (see
+  // nnet/kernels/error_reduce.kernel.cl): workgroups sum chunks of each sample
+  // in local memory, then a single workgroup adds up the chunks of each sample
+  // and the mean.
+  std::unique_ptr<compute::ClBuffer> BatchErrors(
+      std::unique_ptr<compute::ClBuffer> &actual_output,
+      std::unique_ptr<compute::ClBuffer> &expected, size_t batch_size) {
+    CompileKernelsIfRequired();
+    if (batch_size == 0) {
+      std::cerr << "BatchErrors() needs at least one sample." << std::endl;
       std::exit(1);
     }
 
-    error_components.MoveToCpu();
-    double error = 0;
-    for (size_t i = 0; i < error_components.size(); ++i) {
-      error += error_components[i];
+    if (backend_ == NativeCpu) {
+      ClaimOwnership(actual_output, activation_format());
+      ClaimOwnership(expected, activation_format());
+      std::vector<double> error_components(batch_size * error_.size());
+      native_program_->Launch(
+          error_.ErrorKernelName(), error_components.size(), 1,
+          static_cast<const double *>(actual_output->data()),
+          static_cast<const double *>(expected->data()),
+          error_components.data());
+      std::unique_ptr<compute::ClBuffer> errors =
+          MakeBuffer(batch_size + 1);
+      double total = 0;
+      for (size_t sample = 0; sample < batch_size; ++sample) {
+        double error = 0;
+        for (size_t i = 0; i < error_.size(); ++i) {
+          error += error_components[sample * error_.size() + i];
+        }
+        errors->at(sample) = error;
+        total += error;
+      }
+      errors->at(batch_size) = total / batch_size;
+      return errors;
     }
 
-    return error;
+    actual_output->SetDeviceFormat(activation_format());
+    expected->SetDeviceFormat(activation_format());
+    actual_output->MoveToGpu();
+    expected->MoveToGpu();
+
+    const size_t groups_per_sample = error_.ReductionGroupsPerSample();
+    std::unique_ptr<compute::ClBuffer> partial_sums =
+        MakeGpuBuffer(batch_size * groups_per_sample);
+    std::unique_ptr<compute::ClBuffer> errors = MakeGpuBuffer(batch_size + 1);
+
+    graph().Import(&opencl_.queue);
+    cl::Kernel &partial_kernel =
+        CacheFetchKernel(error_.PartialSumsKernelName());
+    CL_CHECK(partial_kernel.setArg(0, *actual_output->gpu_buffer()));
+    CL_CHECK(partial_kernel.setArg(1, *expected->gpu_buffer()));
+    CL_CHECK(partial_kernel.setArg(2, *partial_sums->gpu_buffer()));
+    CL_CHECK(partial_kernel.setArg(3, static_cast<cl_int>(error_.size())));
+    graph().EnqueueKernel(
+        partial_kernel,
+        cl::NDRange(groups_per_sample * ErrorLayer::kReductionWorkgroupSize,
+                    batch_size),
+        cl::NDRange(ErrorLayer::kReductionWorkgroupSize, 1),
+        {*actual_output->gpu_buffer(), *expected->gpu_buffer()},
+        {*partial_sums->gpu_buffer()});
+
+    cl::Kernel &sample_kernel = CacheFetchKernel(error_.SampleSumsKernelName());
+    CL_CHECK(sample_kernel.setArg(0, *partial_sums->gpu_buffer()));
+    CL_CHECK(sample_kernel.setArg(1, *errors->gpu_buffer()));
+    CL_CHECK(sample_kernel.setArg(2, static_cast<cl_int>(groups_per_sample)));
+    CL_CHECK(sample_kernel.setArg(3, static_cast<cl_int>(batch_size)));
+    graph().EnqueueKernel(sample_kernel,
+                          cl::NDRange(ErrorLayer::kReductionWorkgroupSize),
+                          cl::NDRange(ErrorLayer::kReductionWorkgroupSize),
+                          {*partial_sums->gpu_buffer()},
+                          {*errors->gpu_buffer()});
+    graph().Export(&opencl_.queue);
+    return errors;
   }
 
+  // The error gradient is computed elementwise, so a batch of outputs (packed
+  // back-to-back) is handled by launching batch_size times as many work items.
   void ErrorGradients(
       const std::unique_ptr<compute::ClBuffer> &actual_output,
       const std::unique_ptr<compute::ClBuffer> &expected,
-      const std::unique_ptr<compute::ClBuffer> &out_error_gradients) {
+      const std::unique_ptr<compute::ClBuffer> &out_error_gradients,
+      size_t batch_size = 1) {
     CompileKernelsIfRequired();
 
+    if (backend_ == NativeCpu) {
+      ClaimOwnership(actual_output, activation_format());
+      ClaimOwnership(expected, activation_format());
+      ClaimOwnership(out_error_gradients, number_format());
+    }
+
+    actual_output->SetDeviceFormat(activation_format());
+    expected->SetDeviceFormat(activation_format());
+    out_error_gradients->SetDeviceFormat(number_format());
     actual_output->MoveToGpu();
     expected->MoveToGpu();
     out_error_gradients->MoveToGpu();
 
     // Resize the provided buffer if needed.
-    if (out_error_gradients->size() < error_.size()) {
+    if (out_error_gradients->size() < batch_size * error_.size()) {
       out_error_gradients->MoveToCpu();
-      out_error_gradients->resize(error_.size());
+      out_error_gradients->resize(batch_size * error_.size());
       out_error_gradients->MoveToGpu();
     }
 
+    if (backend_ == NativeCpu) {
+      native_program_->Launch(
+          error_.GradientKernelName(), batch_size * error_.size(), 1,
+          static_cast<const double *>(actual_output->data()),
+          static_cast<const double *>(expected->data()),
+          out_error_gradients->data());
+      return;
+    }
+
     // Calculate error component for each output in parallel.
-    cl_int result;
-    std::string kernel_name = error_.GradientKernelName();
-    cl::Kernel &error_kernel = CacheFetchKernel(kernel_name);
+    graph().Import(&opencl_.queue);
+    cl::Kernel &error_kernel = CacheFetchKernel(error_.GradientKernelName());
     CL_CHECK(error_kernel.setArg(0, *actual_output->gpu_buffer()));
     CL_CHECK(error_kernel.setArg(1, *expected->gpu_buffer()));
     CL_CHECK(error_kernel.setArg(2, *out_error_gradients->gpu_buffer()));
     auto workgroup = (error_.workgroup_size() != 0)
                          ? cl::NDRange(error_.workgroup_size())
                          : cl::NullRange;
-    result = opencl_.queue.enqueueNDRangeKernel(
-        error_kernel, cl::NullRange, cl::NDRange(error_.size()), workgroup);
-    if (result != CL_SUCCESS) {
-      std::cerr << "Error enqueuing Error Kernel:  " << result << std::endl;
-      std::exit(1);
-    }
+    graph().EnqueueKernel(
+        error_kernel, cl::NDRange(batch_size * error_.size()), workgroup,
+        {*actual_output->gpu_buffer(), *expected->gpu_buffer()},
+        {*out_error_gradients->gpu_buffer()});
+    graph().Export(&opencl_.queue);
   }
 
   void Train(std::unique_ptr<compute::ClBuffer> &in,
@@ -358,11 +959,60 @@ class Nnet {
     learning_rate_buffer_->MoveToCpu();
     learning_rate_buffer_->at(0) = params.learning_rate;
     learning_rate_buffer_->MoveToGpu();
+    const bool optimizer_changed =
+        params.optimizer != learning_parameters_.optimizer;
+    learning_parameters_ = params;
+    if (optimizer_changed) {
+      ResetOptimizerState();
+    }
+  }
+
+  const LearningParameters &learning_parameters() const {
+    return learning_parameters_;
+  }
+
+  // Zeroes the state of the optimizer (velocities, moment estimates) and its
+  // step count, for instance before fine-tuning loaded weights. The state is
+  // allocated on the device, and stays there.
+  void ResetOptimizerState() {
+    size_t state_buffers = 0;
+    switch (learning_parameters_.optimizer) {
+      case SGD:
+        break;
+      case Momentum:
+      case RMSProp:
+        state_buffers = 1;
+        break;
+      case Adam:
+        state_buffers = 2;
+        break;
+      default:
+        std::cerr << "Unknown optimizer: " << learning_parameters_.optimizer
+                  << std::endl;
+        std::exit(1);
+    }
+    for (Layer &layer : model_.layers) {
+      std::vector<compute::ClBuffer> &state = layer.optimizer_state();
+      state.clear();
+      const size_t number_of_weights = layer.weight_buffer().size();
+      if (number_of_weights == 0) {
+        continue;
+      }
+      for (size_t i = 0; i < state_buffers; ++i) {
+        state.emplace_back(std::vector<double>(number_of_weights, 0.0));
+      }
+      for (compute::ClBuffer &buffer : state) {
+        RegisterBuffer(&buffer);
+        buffer.MoveToGpu();
+      }
+    }
+    optimizer_steps_ = 0;
   }
 
   // Very customized version of Train.
   // input_gradients: backprop gradients propagated towards the input (this is
-  // how deep dream visuals are accomplished).
+  // how deep dream visuals are accomplished). Left on the GPU, call
+  // MoveToCpu() to read them.
   // initial_backprop_gradients: The gradients used to start backprop. Usually
   // this is the objective function, like some error fn applied on the network's
   // output. This version of Train() lets you specify a custom gradient.
@@ -370,14 +1020,13 @@ class Nnet {
              std::unique_ptr<compute::ClBuffer> &o,
              const std::unique_ptr<compute::ClBuffer> &input_gradients,
              const std::unique_ptr<compute::ClBuffer> &initial_backprop_gradients) {
-    cl::Device device = SelectDevice();
     CompileKernelsIfRequired();
 
     // Make sure all buffers are using the correct context & command queue.
-    ClaimOwnership(in);
-    ClaimOwnership(o);
-    ClaimOwnership(input_gradients);
-    ClaimOwnership(initial_backprop_gradients);
+    ClaimOwnership(in, activation_format());
+    ClaimOwnership(o, activation_format());
+    ClaimOwnership(input_gradients, number_format());
+    ClaimOwnership(initial_backprop_gradients, number_format());
 
     // Forward pass, store each layer's outputs as a column vector in
     // layer_outputs.
@@ -387,104 +1036,34 @@ class Nnet {
     initial_backprop_gradients->MoveToGpu();
     *backprop_gradients_ = *initial_backprop_gradients;
 
-    // Load all weights into the GPU (weights which are already in the GPU will
-    // be skipped).
-    LoadWeightsToGpu();
-
-    // Backpropagation algorithm.
-    // For each layer, take the current backpropagated gradients (stored in
-    // variable Matrix<Number> gradients) and pass it to the weight gradient
-    // kernel to calculate weight updates. Then pass it to the input gradient
-    // kernel to calculate the gradient for the next layer.
-    for (int i = model_.layers.size() - 1; i >= 0; --i) {
-      auto &layer = model_.layers[i];
-      const compute::ClBuffer &gpu_layer_input =
-          (i > 0) ? eval_layer_outputs_->at(i - 1) : *in;
-
-      if (layer.GetDimensions().num_inputs > 0) {
-        // Backprop gradient calculation.
-        std::string input_kernel_name = layer.InputGradientKernelName();
-        cl::Kernel &input_update = CacheFetchKernel(input_kernel_name);
-        CL_CHECK(input_update.setArg(0, *gpu_layer_input.gpu_buffer()));
-        CL_CHECK(input_update.setArg(1, *layer.weight_buffer().gpu_buffer()));
-        CL_CHECK(input_update.setArg(2, *backprop_gradients_->gpu_buffer()));
-        CL_CHECK(
-            input_update.setArg(3, *next_backprop_gradients_->gpu_buffer()));
-        auto workgroup = (layer.bp_train_workgroup_size() != 0)
-                             ? cl::NDRange(layer.bp_train_workgroup_size())
-                             : cl::NullRange;
-        cl_int result = opencl_.queue.enqueueNDRangeKernel(
-            input_update, cl::NullRange,
-            cl::NDRange(layer.GetDimensions().num_inputs), workgroup);
-        if (result != CL_SUCCESS) {
-          std::cerr << "Error enqueuing kernel "
-                    << layer.InputGradientKernelName()
-                    << " & error code: " << result << std::endl;
-          std::exit(1);
-        }
-      } else {
-        std::cerr
-            << "Error, incorrect model config. Layer with zero inputs found: "
-            << layer.LayerSuffix() << std::endl;
-      }
-
-      if (layer.weight_buffer().size() > 0) {
-        compute::ClBuffer gpu_new_weights = layer.weight_buffer().DeepClone();
-
-        // Backprop layer weight updates.
-        std::string weight_kernel_name = layer.WeightUpdateKernelName();
-        cl::Kernel &weight_update = CacheFetchKernel(weight_kernel_name);
-        CL_CHECK(weight_update.setArg(0, *gpu_layer_input.gpu_buffer()));
-        CL_CHECK(weight_update.setArg(1, *layer.weight_buffer().gpu_buffer()));
-        CL_CHECK(weight_update.setArg(2, *backprop_gradients_->gpu_buffer()));
-        CL_CHECK(weight_update.setArg(3, *gpu_new_weights.gpu_buffer()));
-        CL_CHECK(weight_update.setArg(4, *learning_rate_buffer_->gpu_buffer()));
-        auto workgroup = (layer.weight_train_workgroup_size() != 0)
-                             ? cl::NDRange(layer.weight_train_workgroup_size())
-                             : cl::NullRange;
-        cl_int result = opencl_.queue.enqueueNDRangeKernel(
-            weight_update, cl::NullRange,
-            cl::NDRange(layer.weight_buffer().size()), workgroup);
-        if (result != CL_SUCCESS) {
-          std::cerr << "Error enqueuing kernel "
-                    << layer.WeightUpdateKernelName()
-                    << " & error code: " << result << std::endl;
-          std::exit(1);
-        }
-        layer.weight_buffer() = gpu_new_weights;
-      }
-
-      // Use the new input gradients for the next layer backwards (the one
-      // before this one, we're iterating backwards).
-      backprop_gradients_.swap(next_backprop_gradients_);
-    }
-    if (input_gradients) {
-      input_gradients->MoveToGpu();
-      *input_gradients->gpu_buffer() = *backprop_gradients_->gpu_buffer();
-      input_gradients->MoveToCpu();
-    }
+    Backpropagate(in, 1, input_gradients);
   }
 
   // Customized version of Train().
   // input_gradients: Output parameter, the gradient back-propagated against the
-  // input.
+  // input. Left on the GPU, call MoveToCpu() to read it.
   void Train(std::unique_ptr<compute::ClBuffer> &in,
              std::unique_ptr<compute::ClBuffer> &o,
              const std::unique_ptr<compute::ClBuffer> &input_gradients) {
-    cl::Device device = SelectDevice();
     CompileKernelsIfRequired();
-  
+    ClaimOwnership(in, activation_format());
+    ClaimOwnership(o, activation_format());
+    ClaimOwnership(input_gradients, number_format());
+
     // Forward pass, store each layer's outputs as a column vector in
     // layer_outputs.
     std::unique_ptr<compute::ClBuffer> actual_output =
         Evaluate(in, eval_layer_outputs_);
 
-    // Generate output gradients (first part of backprop).
+    // Generate output gradients (first part of backprop), then backprop from
+    // them directly. Going through the overload above would repeat the forward
+    // pass.
     ErrorGradients(actual_output, o, backprop_gradients_);
-    Train(in, o, input_gradients, backprop_gradients_);
+    Backpropagate(in, 1, input_gradients);
   }
 
   cl::CommandQueue &command_queue() {
+    RequireOpenCl("command_queue");
     CompileKernelsIfRequired();
     return opencl_.queue;
   }
@@ -498,6 +1077,7 @@ class Nnet {
   }
 
   std::unique_ptr<cl::CommandQueue> MakeCommandQueue() {
+    RequireOpenCl("MakeCommandQueue");
     CompileKernelsIfRequired();
     return std::make_unique<cl::CommandQueue>(
         std::get<0>(opencl_.compilation_units), opencl_.device);
@@ -518,26 +1098,23 @@ class Nnet {
       const std::unique_ptr<compute::ClBuffer> &out,
       const std::unique_ptr<std::vector<compute::ClBuffer>> &out_gradients,
       const std::unique_ptr<compute::ClBuffer> &input_gradients) {
-    cl::Device device = SelectDevice();
+    RequireOpenCl("CalculateGradients");
     CompileKernelsIfRequired();
-    auto queue = MakeCommandQueue();
 
     // Make sure out_gradients is the correct size.
     out_gradients->resize(model_.layers.size());
 
-    std::unique_ptr<std::vector<compute::ClBuffer>> layer_outputs;
-
     // Forward pass, store each layer's outputs as a column vector in
-    // layer_outputs.
+    // eval_layer_outputs_.
     std::unique_ptr<compute::ClBuffer> actual_output =
-        Evaluate(in, layer_outputs);
+        Evaluate(in, eval_layer_outputs_);
 
     // Generate output gradients (first part of backprop).
     auto backprop_gradients = MakeBuffer(0);  // ErrorGradients will resize this.
     ErrorGradients(actual_output, out, backprop_gradients);
 
-    // Wait on Eval() and ErrorGradients to finish.
-    opencl_.queue.finish();
+    // Order the kernels below after Evaluate() and ErrorGradients().
+    graph().Import(&opencl_.queue);
 
     // Backpropagation algorithm.
     // For each layer, take the current backpropagated gradients (stored in
@@ -546,9 +1123,11 @@ class Nnet {
     // kernel to calculate the gradient for the next layer.
     for (int i = model_.layers.size() - 1; i >= 0; --i) {
       auto &layer = model_.layers[i];
+      if (BackpropagationFused(i)) {
+        continue;
+      }
       std::unique_ptr<compute::ClBuffer> next_backprop_gradients =
-          MakeBuffer(layer.GetDimensions().num_inputs);
-      next_backprop_gradients->MoveToGpu();
+          MakeGpuBuffer(layer.GetDimensions().num_inputs);
       const compute::ClBuffer &gpu_layer_input =
           (i > 0) ? eval_layer_outputs_->at(i - 1) : *in;
 
@@ -561,18 +1140,18 @@ class Nnet {
         CL_CHECK(input_update.setArg(2, *backprop_gradients->gpu_buffer()));
         CL_CHECK(
             input_update.setArg(3, *next_backprop_gradients->gpu_buffer()));
+        CL_CHECK(input_update.setArg(
+            4, *InputPreActivations(i, gpu_layer_input).gpu_buffer()));
         auto workgroup = (layer.bp_train_workgroup_size() != 0)
                              ? cl::NDRange(layer.bp_train_workgroup_size())
                              : cl::NullRange;
-        cl_int result = queue->enqueueNDRangeKernel(
-            input_update, cl::NullRange,
-            cl::NDRange(layer.GetDimensions().num_inputs), workgroup);
-        if (result != CL_SUCCESS) {
-          std::cerr << "Error enqueuing kernel "
-                    << layer.InputGradientKernelName()
-                    << " & error code: " << result << std::endl;
-          std::exit(1);
-        }
+        graph().EnqueueKernel(
+            input_update, cl::NDRange(layer.GetDimensions().num_inputs),
+            workgroup,
+            {*gpu_layer_input.gpu_buffer(), *layer.weight_buffer().gpu_buffer(),
+             *backprop_gradients->gpu_buffer(),
+             *InputPreActivations(i, gpu_layer_input).gpu_buffer()},
+            {*next_backprop_gradients->gpu_buffer()});
       } else {
         std::cerr
             << "Error, incorrect model config. Layer with zero inputs found: "
@@ -591,29 +1170,29 @@ class Nnet {
         CL_CHECK(weight_update.setArg(2, *backprop_gradients->gpu_buffer()));
         CL_CHECK(weight_update.setArg(3, *out_gradients->at(i).gpu_buffer()));
         CL_CHECK(weight_update.setArg(4, *learning_rate_buffer_->gpu_buffer()));
-        auto workgroup = (layer.weight_train_workgroup_size() != 0)
-                             ? cl::NDRange(layer.weight_train_workgroup_size())
-                             : cl::NullRange;
-        cl_int result = queue->enqueueNDRangeKernel(
-            weight_update, cl::NullRange,
-            cl::NDRange(layer.weight_buffer().size()), workgroup);
-        if (result != CL_SUCCESS) {
-          std::cerr << "Error enqueuing kernel "
-                    << layer.WeightGradientKernelName()
-                    << " & error code: " << result << std::endl;
-          std::exit(1);
-        }
+        CL_CHECK(weight_update.setArg(5, static_cast<cl_int>(1)));
+        const KernelRange range = layer.WeightUpdateRange();
+        graph().EnqueueKernel(
+            weight_update, GlobalRange(range), LocalRange(range),
+            {*gpu_layer_input.gpu_buffer(), *layer.weight_buffer().gpu_buffer(),
+             *backprop_gradients->gpu_buffer(),
+             *learning_rate_buffer_->gpu_buffer()},
+            {*out_gradients->at(i).gpu_buffer()});
       }
 
       // Use the new input gradients for the next layer backwards (the one
       // before this one, we're iterating backwards).
       backprop_gradients.swap(next_backprop_gradients);
     }
+    graph().Export(&opencl_.queue);
     if (input_gradients) {
+      input_gradients->SetDeviceFormat(number_format());
       input_gradients->MoveToGpu();
       *input_gradients->gpu_buffer() = *backprop_gradients->gpu_buffer();
     }
-    return *queue;
+    // Nothing has to wait for the gradients on the host until they are read
+    // back, finishing this queue waits for them.
+    return opencl_.queue;
   }
 
   void BatchTrain(std::vector<std::unique_ptr<compute::ClBuffer>> &ins,
@@ -623,58 +1202,339 @@ class Nnet {
     return BatchTrain(ins, outs, indices_to_train, _);
   }
 
+  // Performs a single gradient descent step using the sum of the gradients of
+  // every example in indices_to_train. The examples are packed into one batch
+  // and back-propagated together, with the per-example weight gradients
+  // reduced on the device.
+  //
+  // input_gradients (optional) receives the gradient back-propagated against
+  // each example's input, packed back-to-back in the order of indices_to_train.
+  // Like in Train(), it's left on the GPU.
   void BatchTrain(std::vector<std::unique_ptr<compute::ClBuffer>> &ins,
                   std::vector<std::unique_ptr<compute::ClBuffer>> &outs,
                   std::set<int> indices_to_train,
                   const std::unique_ptr<compute::ClBuffer> &input_gradients) {
-    cl::Device device = SelectDevice();
     CompileKernelsIfRequired();
 
-    LoadWeightsToGpu();
-
-    // Wait for weight loading to finish.
-    CL_CHECK(command_queue().finish());
+    const size_t batch_size = indices_to_train.size();
+    if (batch_size == 0) {
+      return;
+    }
 
-    std::vector<std::unique_ptr<std::vector<compute::ClBuffer>>>
-        batch_weight_gradients;
-    // initialize batch_weight_gradients.
-    std::vector<cl::CommandQueue> queues;
+    ClaimOwnership(input_gradients, number_format());
+    LoadWeightsToGpu();
+    ReserveBatchCapacity(batch_size, /*pack_samples=*/true);
+
+    // Pack the examples into contiguous batch buffers without leaving the GPU.
+    // The buffers are kept between calls, and may be larger than the batch.
+    std::unique_ptr<compute::ClBuffer> &batch_in = batch_inputs_;
+    std::unique_ptr<compute::ClBuffer> &batch_out = batch_outputs_;
+    const size_t value_size = compute::DeviceFormatSize(activation_format());
+    size_t sample = 0;
     for (int i : indices_to_train) {
-      batch_weight_gradients.emplace_back(
-          std::make_unique<std::vector<compute::ClBuffer>>());
-      queues.push_back(
-          CalculateGradients(ins[i], outs[i], batch_weight_gradients.back(), input_gradients));
+      ClaimOwnership(ins[i], activation_format());
+      ClaimOwnership(outs[i], activation_format());
+      if (backend_ == NativeCpu) {
+        std::copy(ins[i]->data(), ins[i]->data() + input_size(),
+                  batch_in->data() + sample * input_size());
+        std::copy(outs[i]->data(), outs[i]->data() + output_size(),
+                  batch_out->data() + sample * output_size());
+        ++sample;
+        continue;
+      }
+      // Uploads go through opencl_.queue, ahead of the graph's Import().
+      ins[i]->MoveToGpu();
+      outs[i]->MoveToGpu();
     }
-    for (size_t i = 0; i < queues.size(); ++i) {
-      queues[i].finish();
+    if (backend_ == OpenCl) {
+      graph().Import(&opencl_.queue);
+      for (int i : indices_to_train) {
+        graph().EnqueueCopy(*ins[i]->gpu_buffer(), *batch_in->gpu_buffer(), 0,
+                            sample * input_size() * value_size,
+                            input_size() * value_size);
+        graph().EnqueueCopy(*outs[i]->gpu_buffer(), *batch_out->gpu_buffer(),
+                            0, sample * output_size() * value_size,
+                            output_size() * value_size);
+        ++sample;
+      }
+      graph().Export(&opencl_.queue);
     }
 
-    // Accumulate the gradients from every example in the batch.
-    queues.clear();
-    for (size_t example = 0; example < batch_weight_gradients.size();
-         ++example) {
-      for (size_t layer = 0; layer < model_.layers.size(); ++layer) {
-          queues.push_back(
-              VectorAccumulate(model_.layers[layer].weight_buffer(),
-                               batch_weight_gradients[example]->at(layer))); 
-      }
-      // You can parallelize for each example to accumulate the weight deltas
-      // for all weights. But if you accumulate multiple examples in parallel, you
-      // get a race condition. Block before moving on to next example.
-      for (size_t i = 0; i < queues.size(); ++i) {
-        queues[i].finish();
-      }
+    // The copies above and the kernels below are ordered on the device (see
+    // EventGraph), the host doesn't wait for any of them.
+    std::unique_ptr<compute::ClBuffer> actual_output =
+        Evaluate(batch_in, batch_size, eval_layer_outputs_);
+    ErrorGradients(actual_output, batch_out, backprop_gradients_, batch_size);
+    Backpropagate(batch_in, batch_size, input_gradients);
+  }
+
+  // Creates a pipeline which uploads batches of batch_size samples while the
+  // network trains on earlier ones (see nnet/input_pipeline.h). depth is the
+  // number of batches staged at once, at least two for uploads to overlap
+  // training.
+  std::unique_ptr<InputPipeline> MakeInputPipeline(size_t batch_size,
+                                                   size_t depth = 2) {
+    CompileKernelsIfRequired();
+    if (batch_size == 0 || depth == 0) {
+      std::cerr << "MakeInputPipeline needs a non-zero batch size and depth."
+                << std::endl;
+      std::exit(1);
+    }
+    std::vector<InputPipeline::Slot> slots(depth);
+    for (InputPipeline::Slot &slot : slots) {
+      slot.inputs = MakeBuffer(batch_size * input_size());
+      slot.outputs = MakeBuffer(batch_size * output_size());
+      slot.inputs->SetDeviceFormat(activation_format());
+      slot.outputs->SetDeviceFormat(activation_format());
+      slot.inputs->MoveToGpu();
+      slot.outputs->MoveToGpu();
     }
-    for (size_t i = 0; i < queues.size(); ++i) {
-      queues[i].finish();
+    if (backend_ == NativeCpu) {
+      return std::make_unique<InputPipeline>(batch_size, input_size(),
+                                             output_size(), std::move(slots));
     }
+    auto pipeline = std::make_unique<InputPipeline>(
+        batch_size, input_size(), output_size(), std::move(slots),
+        std::get<0>(opencl_.compilation_units), opencl_.device);
+    pipeline->set_profiler(profiler_.get());
+    return pipeline;
   }
 
-  bool LoadWeightsFromString(const std::string &weight_string) {
-    rapidjson::Document d;
-    d.Parse(weight_string.c_str());
-
-    // Some helper routines
+  // Same as BatchTrain() above, on the oldest batch pushed to pipeline (which
+  // must come from this network's MakeInputPipeline()). Only waits for the
+  // upload of that batch, batches pushed after it keep uploading while it
+  // trains.
+  void BatchTrain(InputPipeline *pipeline) {
+    CompileKernelsIfRequired();
+    if (pipeline->empty()) {
+      std::cerr << "BatchTrain called with an empty input pipeline."
+                << std::endl;
+      std::exit(1);
+    }
+    const size_t batch_size = pipeline->batch_size();
+    LoadWeightsToGpu();
+    ReserveBatchCapacity(batch_size);
+
+    InputPipeline::Slot &batch = pipeline->Front();
+    std::unique_ptr<compute::ClBuffer> actual_output =
+        Evaluate(batch.inputs, batch_size, eval_layer_outputs_);
+    ErrorGradients(actual_output, batch.outputs, backprop_gradients_,
+                   batch_size);
+    std::unique_ptr<compute::ClBuffer> _(nullptr);
+    Backpropagate(batch.inputs, batch_size, _);
+    if (backend_ == NativeCpu) {
+      pipeline->Pop();
+      return;
+    }
+    // The slot can take the next batch once the device is done with it, the
+    // next upload to it waits for this marker.
+    cl::Event trained;
+    CL_CHECK(opencl_.queue.enqueueMarkerWithWaitList(nullptr, &trained));
+    CL_CHECK(opencl_.queue.flush());
+    pipeline->Pop({trained});
+  }
+
+  // Blocks until the device work enqueued so far has completed. Reading a
+  // buffer back already waits for the work which writes it, this is for
+  // timing.
+  void Finish() {
+    if (backend_ == NativeCpu || !opencl_.compiled) {
+      return;
+    }
+    CL_CHECK(opencl_.queue.finish());
+  }
+
+  // Opt-in profiling of the device work (see nnet/profiler.h). Waits for the
+  // work already enqueued, then recreates the command queues with
+  // CL_QUEUE_PROFILING_ENABLE. The profiler belongs to the network. Input
+  // pipelines made from now on record their uploads too.
+  Profiler *EnableProfiling(
+      const Profiler::Options &options = Profiler::Options()) {
+    RequireOpenCl("EnableProfiling");
+    CompileKernelsIfRequired();
+    profiler_ = std::make_unique<Profiler>(options);
+    RecreateQueues(CL_QUEUE_PROFILING_ENABLE);
+    return profiler_.get();
+  }
+
+  // Goes back to queues without profiling. Pipelines which record to the
+  // profiler must be gone, since it is deleted.
+  void DisableProfiling() {
+    if (!profiler_) {
+      return;
+    }
+    profiler_.reset();
+    RecreateQueues(0);
+  }
+
+  // Null unless profiling is enabled.
+  Profiler *profiler() { return profiler_.get(); }
+
+  // Data-parallel training (see nnet/data_parallel.h) splits a training step
+  // in two. BatchGradients() computes the gradients of the weights for a batch
+  // like BatchTrain() does, summed over the batch, but leaves the weights
+  // alone. ApplyGradients() then takes one optimizer step with them, once
+  // they have been summed across replicas.
+  //
+  // (*gradients)[i] receives the gradients of layer i's weights. The buffers
+  // are allocated on the first call, and stay on the device.
+  void BatchGradients(const std::unique_ptr<compute::ClBuffer> &inputs,
+                      const std::unique_ptr<compute::ClBuffer> &outputs,
+                      size_t batch_size,
+                      std::vector<compute::ClBuffer> *gradients) {
+    CompileKernelsIfRequired();
+    if (batch_size == 0) {
+      std::cerr << "BatchGradients called with an empty batch." << std::endl;
+      std::exit(1);
+    }
+    ClaimOwnership(inputs, activation_format());
+    ClaimOwnership(outputs, activation_format());
+    if (gradients->size() != model_.layers.size()) {
+      gradients->clear();
+      gradients->reserve(model_.layers.size());
+      for (const Layer &layer : model_.layers) {
+        gradients->emplace_back(layer.weight_buffer().size());
+        RegisterBuffer(&gradients->back());
+        gradients->back().MoveToGpu();
+      }
+    }
+    LoadWeightsToGpu();
+    ReserveBatchCapacity(batch_size);
+
+    std::unique_ptr<compute::ClBuffer> actual_output =
+        Evaluate(inputs, batch_size, eval_layer_outputs_);
+    ErrorGradients(actual_output, outputs, backprop_gradients_, batch_size);
+    std::unique_ptr<compute::ClBuffer> _(nullptr);
+    Backpropagate(inputs, batch_size, _, gradients);
+  }
+
+  // Takes one step of the current optimizer (see LearningParameters) with
+  // gradients from BatchGradients(), possibly accumulated across batches or
+  // replicas.
+  void ApplyGradients(std::vector<compute::ClBuffer> &gradients) {
+    CompileKernelsIfRequired();
+    if (gradients.size() != model_.layers.size()) {
+      std::cerr << "ApplyGradients expects gradients for each of the "
+                << model_.layers.size() << " layers, got " << gradients.size()
+                << std::endl;
+      std::exit(1);
+    }
+    // The weights are about to change, see Quantize().
+    ClearQuantization();
+    LoadWeightsToGpu();
+    ++optimizer_steps_;
+
+    if (backend_ != NativeCpu) {
+      graph().Import(&opencl_.queue);
+    }
+    for (size_t i = 0; i < model_.layers.size(); ++i) {
+      Layer &layer = model_.layers[i];
+      if (layer.weight_buffer().size() == 0) {
+        continue;
+      }
+      if (backend_ == NativeCpu) {
+        gradients[i].MoveToCpu();
+        NativeWeightUpdate(layer, gradients[i].data());
+        continue;
+      }
+      gradients[i].MoveToGpu();
+      EnqueueWeightUpdate(layer, *gradients[i].gpu_buffer());
+    }
+    if (backend_ != NativeCpu) {
+      graph().Export(&opencl_.queue);
+    }
+  }
+
+  // a = a + b. Both buffers must belong to this network (see RegisterBuffer()).
+  cl::CommandQueue VectorAccumulate(compute::ClBuffer &a,
+                                    compute::ClBuffer &b) {
+    CompileKernelsIfRequired();
+    std::string accumulate_kernel_name = "vector_accumulate";
+    if (backend_ == NativeCpu) {
+      native_program_->Launch(accumulate_kernel_name, a.size(), 1, a.data(),
+                              b.data());
+      return opencl_.queue;
+    }
+    cl::Kernel &accumulate_kernel = CacheFetchKernel(accumulate_kernel_name);
+    CL_CHECK(accumulate_kernel.setArg(0, *a.gpu_buffer()));
+    CL_CHECK(accumulate_kernel.setArg(1, *b.gpu_buffer()));
+    auto workgroup = cl::NDRange(CalculateWorkgroupSize(a.size()));
+    graph().Import(&opencl_.queue);
+    graph().EnqueueKernel(accumulate_kernel, cl::NDRange(a.size()), workgroup,
+                          {*a.gpu_buffer(), *b.gpu_buffer()},
+                          {*a.gpu_buffer()});
+    graph().Export(&opencl_.queue);
+    return opencl_.queue;
+  }
+
+  // Post-training int8 quantization, for inference. Evaluates
+  // calibration_inputs (batch_size samples, packed back-to-back) to find the
+  // range of the inputs of every dense and convolution layer, then quantizes
+  // the weights of those layers (see nnet/quantization.h). From then on,
+  // Evaluate() runs them with int8 weights and inputs, accumulating in int32.
+  // The other layers are unaffected.
+  //
+  // Evaluate() calls which save the layer outputs still use the full
+  // precision weights. Training discards the quantization, since the int8
+  // weights would be stale, as does loading new weights. Call Quantize()
+  // again after changing weights through GetWeight().
+  void Quantize(const std::unique_ptr<compute::ClBuffer> &calibration_inputs,
+                size_t batch_size) {
+    ClearQuantization();
+    auto layer_outputs = std::make_unique<std::vector<compute::ClBuffer>>(
+        model_.layers.size());
+    for (compute::ClBuffer &layer_output : *layer_outputs) {
+      RegisterBuffer(&layer_output, activation_format());
+    }
+    Evaluate(calibration_inputs, batch_size, layer_outputs);
+
+    std::vector<QuantizedWeights> quantized_weights(model_.layers.size());
+    for (size_t i = 0; i < model_.layers.size(); ++i) {
+      Layer &layer = model_.layers[i];
+      if (layer.QuantizedRowSize() == 0) {
+        continue;
+      }
+      compute::ClBuffer &inputs =
+          (i > 0) ? layer_outputs->at(i - 1) : *calibration_inputs;
+      inputs.MoveToCpu();
+      CalibrationRange input_range;
+      input_range.Observe(inputs.data(),
+                          batch_size * layer.GetDimensions().num_inputs);
+      compute::ClBuffer &weights = layer.weight_buffer();
+      weights.MoveToCpu();
+      quantized_weights[i] =
+          QuantizeWeights(weights.data(), weights.size(),
+                          layer.QuantizedRowSize(), input_range.max_magnitude());
+    }
+    if (!SetQuantizedWeights(std::move(quantized_weights))) {
+      std::exit(1);
+    }
+  }
+
+  bool quantized() const { return !quantized_layers_.empty(); }
+
+  // Returns to evaluating every layer with its full precision weights.
+  void ClearQuantization() { quantized_layers_.clear(); }
+
+  // Device memory taken by the weights which Evaluate() reads, in bytes.
+  size_t InferenceWeightBytes() const {
+    size_t bytes = 0;
+    for (size_t i = 0; i < model_.layers.size(); ++i) {
+      if (IsQuantized(i)) {
+        bytes += quantized_layers_[i].weights.size_in_bytes();
+      } else {
+        bytes += model_.layers[i].weight_buffer().size() *
+                 compute::DeviceFormatSize(number_format());
+      }
+    }
+    return bytes;
+  }
+
+  bool LoadWeightsFromString(const std::string &weight_string) {
+    rapidjson::Document d;
+    d.Parse(weight_string.c_str());
+
+    // Some helper routines
     auto validate_string = [&d](const std::string &field) -> bool {
       return (d.HasMember(field.c_str()) && d[field.c_str()].IsString());
     };
@@ -715,6 +1575,46 @@ class Nnet {
       return false;
     }
 
+    // Optional int8 weights, saved by WeightsToString() if the network was
+    // quantized.
+    auto parse_quantization = [](const auto &quantization,
+                                 QuantizedWeights *quantized) -> bool {
+      if (!quantization.IsObject() ||
+          !quantization.HasMember("weight_scale") ||
+          !quantization["weight_scale"].IsDouble() ||
+          !quantization.HasMember("input_scale") ||
+          !quantization["input_scale"].IsDouble() ||
+          !quantization.HasMember("weights") ||
+          !quantization["weights"].IsArray() ||
+          !quantization.HasMember("biases") ||
+          !quantization["biases"].IsArray()) {
+        std::cerr << "Malformed layer quantization." << std::endl;
+        return false;
+      }
+      quantized->weight_scale = quantization["weight_scale"].GetDouble();
+      quantized->input_scale = quantization["input_scale"].GetDouble();
+      for (auto &weight : quantization["weights"].GetArray()) {
+        if (!weight.IsInt() || std::abs(weight.GetInt()) > kQuantizedMax) {
+          std::cerr << "Quantized weight is not an int8!" << std::endl;
+          return false;
+        }
+        quantized->weights.push_back(static_cast<int8_t>(weight.GetInt()));
+      }
+      for (auto &bias : quantization["biases"].GetArray()) {
+        if (!bias.IsInt()) {
+          std::cerr << "Quantized bias is not an int32!" << std::endl;
+          return false;
+        }
+        quantized->biases.push_back(static_cast<int32_t>(bias.GetInt()));
+      }
+      return true;
+    };
+
+    // The weights are replaced, so any quantization of the old ones is stale.
+    ClearQuantization();
+    std::vector<QuantizedWeights> quantized_weights(model_.layers.size());
+    bool has_quantization = false;
+
     int layer_index = 0;
     for (auto &layer : layers) {
       if (!layer.HasMember("name")) {
@@ -755,8 +1655,19 @@ class Nnet {
         weight_index++;
       }
 
+      if (layer.HasMember("quantization")) {
+        if (!parse_quantization(layer["quantization"],
+                                &quantized_weights[layer_index])) {
+          return false;
+        }
+        has_quantization = true;
+      }
+
       layer_index++;
     }
+    if (has_quantization) {
+      return SetQuantizedWeights(std::move(quantized_weights));
+    }
     return true;
   }
 
@@ -783,6 +1694,28 @@ class Nnet {
         writer.Double(model_.layers[l].W(w));
       }
       writer.EndArray();
+      if (IsQuantized(l)) {
+        const QuantizedWeights &quantized = quantized_layers_[l].weights;
+        writer.Key("quantization");
+        writer.StartObject();
+        writer.Key("weight_scale");
+        writer.Double(quantized.weight_scale);
+        writer.Key("input_scale");
+        writer.Double(quantized.input_scale);
+        writer.Key("weights");
+        writer.StartArray();
+        for (int8_t weight : quantized.weights) {
+          writer.Int(weight);
+        }
+        writer.EndArray();
+        writer.Key("biases");
+        writer.StartArray();
+        for (int32_t bias : quantized.biases) {
+          writer.Int(bias);
+        }
+        writer.EndArray();
+        writer.EndObject();
+      }
       writer.EndObject();
     }
     writer.EndArray();
@@ -790,7 +1723,883 @@ class Nnet {
     return output.GetString();
   }
 
+  // Saves the weights to path in the binary format of nnet/weight_file.h,
+  // which loads much faster than the JSON of WeightsToString(). Quantized
+  // layers also save their int8 weights. Returns false on failure.
+  bool SaveWeightsToFile(const std::string &path) {
+    std::vector<WeightArray> arrays;
+    // Referenced by arrays until the file is written.
+    std::vector<std::array<double, 2>> scales(model_.layers.size());
+    for (size_t l = 0; l < model_.layers.size(); ++l) {
+      compute::ClBuffer &weights = model_.layers[l].weight_buffer();
+      weights.MoveToCpu();
+      const std::string name = model_.layers[l].LayerSuffix();
+      arrays.push_back({name, static_cast<uint32_t>(l), WeightFloat64,
+                        weights.data(), weights.size()});
+      if (!IsQuantized(l)) {
+        continue;
+      }
+      const QuantizedWeights &quantized = quantized_layers_[l].weights;
+      scales[l] = {quantized.weight_scale, quantized.input_scale};
+      arrays.push_back({name + kInt8WeightsSuffix, static_cast<uint32_t>(l),
+                        WeightInt8, quantized.weights.data(),
+                        quantized.weights.size()});
+      arrays.push_back({name + kInt32BiasesSuffix, static_cast<uint32_t>(l),
+                        WeightInt32, quantized.biases.data(),
+                        quantized.biases.size()});
+      arrays.push_back({name + kQuantizationScalesSuffix,
+                        static_cast<uint32_t>(l), WeightFloat64,
+                        scales[l].data(), scales[l].size()});
+    }
+    return WriteWeightFile(path, arrays);
+  }
+
+  // Loads weights saved by SaveWeightsToFile(). The file is mapped into
+  // memory rather than parsed. With the OpenCL backend and double precision,
+  // the weight buffers use the mapping as their host memory
+  // (CL_MEM_USE_HOST_PTR) instead of copying it, and the mapping lives as
+  // long as this network. Otherwise the weights are copied (converting them
+  // if needed) into the host buffers. Returns false if the file doesn't match
+  // the network.
+  bool LoadWeightsFromFile(const std::string &path) {
+    std::shared_ptr<MappedWeightFile> file = MappedWeightFile::Open(path);
+    if (!file) {
+      return false;
+    }
+
+    // Validate the whole file before replacing any weights.
+    std::vector<const WeightArray *> layer_weights;
+    std::vector<QuantizedWeights> quantized_weights(model_.layers.size());
+    bool has_quantization = false;
+    for (size_t l = 0; l < model_.layers.size(); ++l) {
+      const Layer &layer = model_.layers[l];
+      const std::string name = layer.LayerSuffix();
+      const WeightArray *array = file->Find(name);
+      if (array == nullptr) {
+        std::cerr << "Weight file is missing layer " << name << std::endl;
+        return false;
+      }
+      if (array->layer_index != l) {
+        std::cerr << "Layer index mismatch: " << array->layer_index
+                  << " != (expected) " << l << std::endl;
+        return false;
+      }
+      if (array->count != layer.weight_buffer().size()) {
+        std::cerr << "layer size mismatch!" << std::endl;
+        return false;
+      }
+      if (array->type != WeightFloat64 && array->type != WeightFloat32) {
+        std::cerr << "Weights of layer " << name << " are not floating point."
+                  << std::endl;
+        return false;
+      }
+      layer_weights.push_back(array);
+
+      const WeightArray *int8_weights = file->Find(name + kInt8WeightsSuffix);
+      if (int8_weights == nullptr) {
+        continue;
+      }
+      const WeightArray *biases = file->Find(name + kInt32BiasesSuffix);
+      const WeightArray *quantization_scales =
+          file->Find(name + kQuantizationScalesSuffix);
+      if (int8_weights->type != WeightInt8 || biases == nullptr ||
+          biases->type != WeightInt32 || quantization_scales == nullptr ||
+          quantization_scales->type != WeightFloat64 ||
+          quantization_scales->count != 2) {
+        std::cerr << "Malformed layer quantization." << std::endl;
+        return false;
+      }
+      QuantizedWeights &quantized = quantized_weights[l];
+      const int8_t *weight_values =
+          static_cast<const int8_t *>(int8_weights->data);
+      quantized.weights.assign(weight_values,
+                               weight_values + int8_weights->count);
+      for (int8_t weight : quantized.weights) {
+        if (std::abs(weight) > kQuantizedMax) {
+          std::cerr << "Quantized weight is out of range!" << std::endl;
+          return false;
+        }
+      }
+      const int32_t *bias_values = static_cast<const int32_t *>(biases->data);
+      quantized.biases.assign(bias_values, bias_values + biases->count);
+      const double *scale_values =
+          static_cast<const double *>(quantization_scales->data);
+      quantized.weight_scale = scale_values[0];
+      quantized.input_scale = scale_values[1];
+      has_quantization = true;
+    }
+
+    // The weights are replaced, so any quantization of the old ones is stale.
+    ClearQuantization();
+    for (size_t l = 0; l < model_.layers.size(); ++l) {
+      LoadLayerWeights(*layer_weights[l], &model_.layers[l].weight_buffer());
+    }
+    weight_file_ = std::move(file);
+    if (has_quantization) {
+      return SetQuantizedWeights(std::move(quantized_weights));
+    }
+    return true;
+  }
+
  private:
+  // Backpropagation algorithm. Expects the forward pass of the batch_size
+  // samples in `in` to be stored in eval_layer_outputs_ and the gradient of
+  // the objective with respect to the network outputs to be stored in
+  // backprop_gradients_. Applies one gradient descent step to every layer,
+  // using the gradients summed across the batch.
+  //
+  // If out_weight_gradients is set, the weights are left alone and the summed
+  // gradients of layer i go to (*out_weight_gradients)[i] instead (see
+  // BatchGradients()).
+  void Backpropagate(
+      const std::unique_ptr<compute::ClBuffer> &in, size_t batch_size,
+      const std::unique_ptr<compute::ClBuffer> &input_gradients,
+      std::vector<compute::ClBuffer> *out_weight_gradients = nullptr) {
+    ReserveBatchCapacity(batch_size);
+    // The weights are about to change, see Quantize().
+    ClearQuantization();
+    if (!out_weight_gradients) {
+      ++optimizer_steps_;
+    }
+
+    if (backend_ == NativeCpu) {
+      NativeBackpropagate(in, batch_size, input_gradients,
+                          out_weight_gradients);
+      return;
+    }
+
+    // Load all weights into the GPU (weights which are already in the GPU will
+    // be skipped).
+    LoadWeightsToGpu();
+    graph().Import(&opencl_.queue);
+
+    // For each layer, take the current backpropagated gradients and pass them
+    // to the weight gradient kernel to calculate weight updates. Then pass
+    // them to the input gradient kernel to calculate the gradient for the next
+    // layer.
+    for (int i = model_.layers.size() - 1; i >= 0; --i) {
+      auto &layer = model_.layers[i];
+      if (BackpropagationFused(i)) {
+        // The layer after this one already applied the activation's
+        // derivative, pass its gradients straight through.
+        continue;
+      }
+      const compute::ClBuffer &gpu_layer_input =
+          (i > 0) ? eval_layer_outputs_->at(i - 1) : *in;
+
+      if (layer.GetDimensions().num_inputs > 0) {
+        // Backprop gradient calculation. Dimension 1 is the sample.
+        std::string input_kernel_name = layer.InputGradientKernelName();
+        cl::Kernel &input_update = CacheFetchKernel(input_kernel_name);
+        CL_CHECK(input_update.setArg(0, *gpu_layer_input.gpu_buffer()));
+        CL_CHECK(input_update.setArg(1, *layer.weight_buffer().gpu_buffer()));
+        CL_CHECK(input_update.setArg(2, *backprop_gradients_->gpu_buffer()));
+        CL_CHECK(
+            input_update.setArg(3, *next_backprop_gradients_->gpu_buffer()));
+        CL_CHECK(input_update.setArg(
+            4, *InputPreActivations(i, gpu_layer_input).gpu_buffer()));
+        auto workgroup = (layer.bp_train_workgroup_size() != 0)
+                             ? cl::NDRange(layer.bp_train_workgroup_size(), 1)
+                             : cl::NullRange;
+        graph().EnqueueKernel(
+            input_update,
+            cl::NDRange(layer.GetDimensions().num_inputs, batch_size),
+            workgroup,
+            {*gpu_layer_input.gpu_buffer(), *layer.weight_buffer().gpu_buffer(),
+             *backprop_gradients_->gpu_buffer(),
+             *InputPreActivations(i, gpu_layer_input).gpu_buffer()},
+            {*next_backprop_gradients_->gpu_buffer()});
+      } else {
+        std::cerr
+            << "Error, incorrect model config. Layer with zero inputs found: "
+            << layer.LayerSuffix() << std::endl;
+      }
+
+      if (layer.weight_buffer().size() > 0 && out_weight_gradients) {
+        EnqueueWeightGradients(layer, gpu_layer_input, batch_size,
+                               *out_weight_gradients->at(i).gpu_buffer());
+      } else if (layer.weight_buffer().size() > 0 &&
+                 learning_parameters_.optimizer != SGD) {
+        // The gradients go to a scratch buffer, and are applied right away.
+        EnqueueWeightGradients(layer, gpu_layer_input, batch_size,
+                               *next_weight_buffer_->gpu_buffer());
+        EnqueueWeightUpdate(layer, *next_weight_buffer_->gpu_buffer());
+      } else if (layer.weight_buffer().size() > 0) {
+        // The kernel reads the old weights while writing the new ones, so
+        // they need separate buffers. It writes every weight, so the spare
+        // buffer's old contents don't matter.
+        compute::ClBuffer &gpu_new_weights = *spare_weights_[i];
+
+        // Backprop layer weight updates. The kernel sums each weight's
+        // gradient over the batch.
+        std::string weight_kernel_name = layer.WeightUpdateKernelName();
+        cl::Kernel &weight_update = CacheFetchKernel(weight_kernel_name);
+        CL_CHECK(weight_update.setArg(0, *gpu_layer_input.gpu_buffer()));
+        CL_CHECK(weight_update.setArg(1, *layer.weight_buffer().gpu_buffer()));
+        CL_CHECK(weight_update.setArg(2, *backprop_gradients_->gpu_buffer()));
+        CL_CHECK(weight_update.setArg(3, *gpu_new_weights.gpu_buffer()));
+        CL_CHECK(weight_update.setArg(4, *learning_rate_buffer_->gpu_buffer()));
+        CL_CHECK(weight_update.setArg(5, static_cast<cl_int>(batch_size)));
+        const KernelRange range = layer.WeightUpdateRange();
+        graph().EnqueueKernel(
+            weight_update, GlobalRange(range), LocalRange(range),
+            {*gpu_layer_input.gpu_buffer(), *layer.weight_buffer().gpu_buffer(),
+             *backprop_gradients_->gpu_buffer(),
+             *learning_rate_buffer_->gpu_buffer()},
+            {*gpu_new_weights.gpu_buffer()});
+        layer.weight_buffer().swap(gpu_new_weights);
+      }
+
+      // Use the new input gradients for the next layer backwards (the one
+      // before this one, we're iterating backwards).
+      backprop_gradients_.swap(next_backprop_gradients_);
+    }
+    if (input_gradients) {
+      // Copied on the device, since backprop_gradients_ is reused by the next
+      // step. The gradients stay on the GPU until the caller reads them back.
+      const size_t size = backprop_gradients_->size();
+      if (input_gradients->GetBufferLocation() != compute::ClBuffer::GPU ||
+          input_gradients->device_format() != number_format() ||
+          input_gradients->size() != size) {
+        std::unique_ptr<compute::ClBuffer> buffer = MakeGpuBuffer(size);
+        input_gradients->swap(*buffer);
+      }
+      graph().EnqueueCopy(*backprop_gradients_->gpu_buffer(),
+                          *input_gradients->gpu_buffer(), 0, 0,
+                          size * compute::DeviceFormatSize(number_format()));
+    }
+    graph().Export(&opencl_.queue);
+  }
+
+  // Native CPU implementation of Evaluate(). Runs the same generated kernels,
+  // with the intermediate outputs in the host arenas of memory_plan_.
+  std::unique_ptr<compute::ClBuffer> NativeEvaluate(
+      const std::unique_ptr<compute::ClBuffer> &inputs, size_t batch_size,
+      std::unique_ptr<std::vector<compute::ClBuffer>> &out_layer_outputs) {
+    auto result =
+        std::make_unique<compute::ClBuffer>(batch_size * output_size());
+    result->PinToCpu();
+    const double *layer_input = inputs->data();
+    for (size_t index = 0; index < model_.layers.size(); ++index) {
+      Layer &layer = model_.layers[index];
+      const size_t num_outputs = layer.GetDimensions().num_outputs;
+      const size_t layer_output_size = batch_size * num_outputs;
+      // See Evaluate().
+      const size_t output_index =
+          layer.has_fused_activation() ? index + 1 : index;
+      double *layer_output = (output_index + 1 == model_.layers.size())
+                                 ? result->data()
+                                 : NativeArena(memory_plan_.OutputArena(index),
+                                               batch_size);
+      const bool save_pre_activations =
+          layer.has_fused_activation() && out_layer_outputs;
+      if (save_pre_activations &&
+          native_pre_activations_.size() < layer_output_size) {
+        native_pre_activations_.resize(layer_output_size);
+      }
+      double *pre_activations = save_pre_activations
+                                    ? native_pre_activations_.data()
+                                    : layer_output;
+      if (IsQuantized(index) && !out_layer_outputs) {
+        NativeQuantizedEvaluate(index, layer_input, layer_output, batch_size);
+        index = output_index;
+        layer_input = layer_output;
+        continue;
+      }
+      native_program_->Launch(
+          layer.EvaluateKernelName(), num_outputs, batch_size, layer_input,
+          layer.weight_buffer().data(), layer_output,
+          static_cast<int>(batch_size), pre_activations,
+          static_cast<int>(save_pre_activations));
+      if (out_layer_outputs) {
+        SaveLayerOutputs(pre_activations, layer_output_size,
+                         &out_layer_outputs->at(index));
+        if (output_index != index) {
+          SaveLayerOutputs(layer_output, layer_output_size,
+                           &out_layer_outputs->at(output_index));
+        }
+      }
+      index = output_index;
+      layer_input = layer_output;
+    }
+    return result;
+  }
+
+  // Host counterpart of InferenceArena().
+  double *NativeArena(size_t arena, size_t batch_size) {
+    const size_t required_size = batch_size * memory_plan_.arena_size(arena);
+    if (native_arenas_[arena].size() < required_size) {
+      native_arenas_[arena].resize(required_size);
+    }
+    return native_arenas_[arena].data();
+  }
+
+  static void SaveLayerOutputs(const double *outputs, size_t size,
+                               compute::ClBuffer *saved_outputs) {
+    saved_outputs->PinToCpu();
+    saved_outputs->resize(size);
+    std::copy(outputs, outputs + size, saved_outputs->data());
+  }
+
+  // Native CPU implementation of Backpropagate().
+  void NativeBackpropagate(
+      const std::unique_ptr<compute::ClBuffer> &in, size_t batch_size,
+      const std::unique_ptr<compute::ClBuffer> &input_gradients,
+      std::vector<compute::ClBuffer> *out_weight_gradients) {
+    for (int i = model_.layers.size() - 1; i >= 0; --i) {
+      auto &layer = model_.layers[i];
+      if (BackpropagationFused(i)) {
+        continue;
+      }
+      compute::ClBuffer &layer_input =
+          (i > 0) ? eval_layer_outputs_->at(i - 1) : *in;
+
+      if (layer.GetDimensions().num_inputs > 0) {
+        native_program_->Launch(
+            layer.InputGradientKernelName(), layer.GetDimensions().num_inputs,
+            batch_size, layer_input.data(), layer.weight_buffer().data(),
+            static_cast<const double *>(backprop_gradients_->data()),
+            next_backprop_gradients_->data(),
+            InputPreActivations(i, layer_input).data());
+      }
+
+      const size_t number_of_weights = layer.weight_buffer().size();
+      if (number_of_weights > 0 && out_weight_gradients) {
+        NativeWeightGradients(layer, layer_input, batch_size,
+                              out_weight_gradients->at(i).data());
+      } else if (number_of_weights > 0 &&
+                 learning_parameters_.optimizer != SGD) {
+        NativeWeightGradients(layer, layer_input, batch_size,
+                              next_weight_buffer_->data());
+        NativeWeightUpdate(layer, next_weight_buffer_->data());
+      } else if (number_of_weights > 0) {
+        // The kernel reads the old weights while writing the new ones, so the
+        // new weights go to a scratch buffer first.
+        native_program_->Launch(
+            layer.WeightUpdateKernelName(), number_of_weights, 1,
+            layer_input.data(), layer.weight_buffer().data(),
+            static_cast<const double *>(backprop_gradients_->data()),
+            next_weight_buffer_->data(), learning_rate_buffer_->data(),
+            static_cast<int>(batch_size));
+        std::copy(next_weight_buffer_->data(),
+                  next_weight_buffer_->data() + number_of_weights,
+                  layer.weight_buffer().data());
+      }
+
+      backprop_gradients_.swap(next_backprop_gradients_);
+    }
+    if (input_gradients) {
+      input_gradients->PinToCpu();
+      input_gradients->resize(backprop_gradients_->size());
+      std::copy(backprop_gradients_->data(),
+                backprop_gradients_->data() + backprop_gradients_->size(),
+                input_gradients->data());
+    }
+  }
+
+  // Replaces a layer's weights with an array of a MappedWeightFile, which
+  // must outlive the layer's buffer (see LoadWeightsFromFile()).
+  void LoadLayerWeights(const WeightArray &array, compute::ClBuffer *weights) {
+    if (backend_ == OpenCl && number_format() == compute::Float64 &&
+        array.type == WeightFloat64 && array.count > 0) {
+      // The mapping is private and writable, so the device may use it as the
+      // buffer's host memory.
+      cl_int buffer_init;
+      auto gpu_buffer = std::make_unique<cl::Buffer>(
+          std::get<0>(opencl_.compilation_units),
+          CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR,
+          array.count * sizeof(double), const_cast<void *>(array.data),
+          &buffer_init);
+      CL_CHECK(buffer_init);
+      *weights = compute::ClBuffer(&opencl_.queue,
+                                   &std::get<0>(opencl_.compilation_units),
+                                   std::move(gpu_buffer), compute::Float64);
+      return;
+    }
+    weights->MoveToCpu();
+    if (array.type == WeightFloat64) {
+      std::memcpy(weights->data(), array.data, array.count * sizeof(double));
+      return;
+    }
+    const float *values = static_cast<const float *>(array.data);
+    std::copy(values, values + array.count, weights->data());
+  }
+
+  // True if Evaluate() runs the given layer with its int8 kernels (unless the
+  // layer outputs are saved).
+  bool IsQuantized(size_t layer) const {
+    return layer < quantized_layers_.size() &&
+           !quantized_layers_[layer].weights.weights.empty();
+  }
+
+  // Installs int8 weights (empty for layers which aren't quantized) and
+  // uploads them to the device. Returns false if they don't fit the network.
+  bool SetQuantizedWeights(std::vector<QuantizedWeights> quantized_weights) {
+    if (quantized_weights.size() != model_.layers.size()) {
+      std::cerr << "Expected quantized weights for " << model_.layers.size()
+                << " layers, got " << quantized_weights.size() << "."
+                << std::endl;
+      return false;
+    }
+    for (size_t i = 0; i < model_.layers.size(); ++i) {
+      const QuantizedWeights &quantized = quantized_weights[i];
+      if (quantized.weights.empty()) {
+        continue;
+      }
+      const size_t row_size = model_.layers[i].QuantizedRowSize();
+      if (row_size == 0 ||
+          quantized.weights.size() !=
+              model_.layers[i].weight_buffer().size() ||
+          quantized.biases.size() * row_size != quantized.weights.size()) {
+        std::cerr << "Quantized weights do not match layer "
+                  << model_.layers[i].LayerSuffix() << "." << std::endl;
+        return false;
+      }
+    }
+
+    CompileQuantizedKernelsIfRequired();
+    quantized_layers_.clear();
+    quantized_layers_.resize(model_.layers.size());
+    for (size_t i = 0; i < model_.layers.size(); ++i) {
+      QuantizedLayerState &state = quantized_layers_[i];
+      state.weights = std::move(quantized_weights[i]);
+      if (state.weights.weights.empty()) {
+        continue;
+      }
+      state.scales = MakeBuffer(
+          {1.0 / state.weights.input_scale,
+           state.weights.weight_scale * state.weights.input_scale});
+      state.scales->MoveToGpu();
+      if (backend_ == NativeCpu) {
+        continue;
+      }
+      state.gpu_weights = UploadGpuBuffer(state.weights.weights);
+      state.gpu_biases = UploadGpuBuffer(state.weights.biases);
+    }
+    return true;
+  }
+
+  template <typename T>
+  cl::Buffer UploadGpuBuffer(const std::vector<T> &values) {
+    cl_int buffer_init;
+    cl::Buffer buffer(std::get<0>(opencl_.compilation_units),
+                      CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                      values.size() * sizeof(T),
+                      const_cast<T *>(values.data()), &buffer_init);
+    CL_CHECK(buffer_init);
+    return buffer;
+  }
+
+  // The int8 kernels are compiled into a program of their own the first time
+  // the network is quantized, so that networks which never are don't pay for
+  // them. They don't depend on the quantization itself (the scales are read
+  // from a buffer), so this only happens once.
+  void CompileQuantizedKernelsIfRequired() {
+    CompileKernelsIfRequired();
+    if (backend_ == NativeCpu) {
+      if (!native_quantized_program_) {
+        native_quantized_program_ =
+            compute::NativeProgram::Compile(GenerateQuantizedKernelSources());
+      }
+      return;
+    }
+    if (opencl_.quantized_program_compiled) {
+      return;
+    }
+    cl_int result;
+    cl::Program program(std::get<0>(opencl_.compilation_units),
+                        GenerateQuantizedKernelSources(), &result);
+    CL_CHECK(result);
+    if (program.build({opencl_.device}) != CL_SUCCESS) {
+      std::string log;
+      program.getBuildInfo(opencl_.device, CL_PROGRAM_BUILD_LOG, &log);
+      std::cerr << "Failed to build the quantized kernels: " << log
+                << std::endl;
+      std::exit(1);
+    }
+    opencl_.quantized_program = program;
+    opencl_.quantized_program_compiled = true;
+  }
+
+  std::vector<std::string> GenerateQuantizedKernelSources() const {
+    std::vector<std::string> kernel_sources = {PrecisionPrelude()};
+    for (const Layer &layer : model_.layers) {
+      if (layer.QuantizedRowSize() != 0) {
+        kernel_sources.push_back(layer.GenerateQuantizedEvaluationKernel());
+      }
+    }
+    return kernel_sources;
+  }
+
+  // Writes the gradients of a layer's weights, summed over the batch, to
+  // gradients. Runs the layer's weight_delta kernel with a learning rate of
+  // -1 (see gradient_scale_buffer_).
+  void EnqueueWeightGradients(Layer &layer, const compute::ClBuffer &input,
+                              size_t batch_size, const cl::Buffer &gradients) {
+    const cl::Buffer &weights = *layer.weight_buffer().gpu_buffer();
+    cl::Kernel &gradient_kernel =
+        CacheFetchKernel(layer.WeightGradientKernelName());
+    CL_CHECK(gradient_kernel.setArg(0, *input.gpu_buffer()));
+    CL_CHECK(gradient_kernel.setArg(1, weights));
+    CL_CHECK(gradient_kernel.setArg(2, *backprop_gradients_->gpu_buffer()));
+    CL_CHECK(gradient_kernel.setArg(3, gradients));
+    CL_CHECK(gradient_kernel.setArg(4, *gradient_scale_buffer_->gpu_buffer()));
+    CL_CHECK(gradient_kernel.setArg(5, static_cast<cl_int>(batch_size)));
+    const KernelRange range = layer.WeightUpdateRange();
+    graph().EnqueueKernel(gradient_kernel, GlobalRange(range),
+                          LocalRange(range),
+                          {*input.gpu_buffer(), weights,
+                           *backprop_gradients_->gpu_buffer(),
+                           *gradient_scale_buffer_->gpu_buffer()},
+                          {gradients});
+  }
+
+  // Updates the weights of a layer and the optimizer state in place, with the
+  // optimizer's fused kernel. The weights are only written after the layer's
+  // input gradient kernel has read them (see EventGraph).
+  void EnqueueWeightUpdate(Layer &layer, const cl::Buffer &gradients) {
+    const cl::Buffer &weights = *layer.weight_buffer().gpu_buffer();
+    const LearningParameters &params = learning_parameters_;
+    std::vector<compute::ClBuffer> &state = layer.optimizer_state();
+    cl::Kernel &update = CacheFetchKernel(OptimizerKernelName());
+    CL_CHECK(update.setArg(0, weights));
+    CL_CHECK(update.setArg(1, gradients));
+    std::vector<cl::Buffer> writes = {weights};
+    cl_uint arg = 2;
+    for (compute::ClBuffer &buffer : state) {
+      CL_CHECK(update.setArg(arg++, *buffer.gpu_buffer()));
+      writes.push_back(*buffer.gpu_buffer());
+    }
+    CL_CHECK(update.setArg(arg++, *learning_rate_buffer_->gpu_buffer()));
+    switch (params.optimizer) {
+      case Momentum:
+        CL_CHECK(update.setArg(arg++, static_cast<float>(params.momentum)));
+        break;
+      case RMSProp:
+        CL_CHECK(update.setArg(arg++, static_cast<float>(params.rho)));
+        CL_CHECK(update.setArg(arg++, static_cast<float>(params.epsilon)));
+        break;
+      case Adam:
+        CL_CHECK(update.setArg(arg++, static_cast<float>(params.beta1)));
+        CL_CHECK(update.setArg(arg++, static_cast<float>(params.beta2)));
+        CL_CHECK(update.setArg(arg++, static_cast<float>(params.epsilon)));
+        CL_CHECK(update.setArg(arg++, static_cast<float>(AdamStepSize())));
+        break;
+      default:
+        break;
+    }
+    graph().EnqueueKernel(
+        update, cl::NDRange(layer.weight_buffer().size()), cl::NullRange,
+        {gradients, *learning_rate_buffer_->gpu_buffer()}, writes);
+  }
+
+  // Native CPU implementation of EnqueueWeightGradients().
+  void NativeWeightGradients(Layer &layer, compute::ClBuffer &input,
+                             size_t batch_size, double *gradients) {
+    native_program_->Launch(
+        layer.WeightGradientKernelName(), layer.weight_buffer().size(), 1,
+        input.data(), layer.weight_buffer().data(),
+        static_cast<const double *>(backprop_gradients_->data()), gradients,
+        gradient_scale_buffer_->data(), static_cast<int>(batch_size));
+  }
+
+  // Native CPU implementation of EnqueueWeightUpdate().
+  void NativeWeightUpdate(Layer &layer, const double *gradients) {
+    const size_t number_of_weights = layer.weight_buffer().size();
+    double *weights = layer.weight_buffer().data();
+    const LearningParameters &params = learning_parameters_;
+    std::vector<compute::ClBuffer> &state = layer.optimizer_state();
+    double *learning_rate = learning_rate_buffer_->data();
+    switch (params.optimizer) {
+      case SGD:
+        native_program_->Launch(OptimizerKernelName(), number_of_weights, 1,
+                                weights, gradients, learning_rate);
+        break;
+      case Momentum:
+        native_program_->Launch(OptimizerKernelName(), number_of_weights, 1,
+                                weights, gradients, state[0].data(),
+                                learning_rate,
+                                static_cast<float>(params.momentum));
+        break;
+      case RMSProp:
+        native_program_->Launch(
+            OptimizerKernelName(), number_of_weights, 1, weights, gradients,
+            state[0].data(), learning_rate, static_cast<float>(params.rho),
+            static_cast<float>(params.epsilon));
+        break;
+      case Adam:
+        native_program_->Launch(
+            OptimizerKernelName(), number_of_weights, 1, weights, gradients,
+            state[0].data(), state[1].data(), learning_rate,
+            static_cast<float>(params.beta1), static_cast<float>(params.beta2),
+            static_cast<float>(params.epsilon),
+            static_cast<float>(AdamStepSize()));
+        break;
+      default:
+        break;
+    }
+  }
+
+  std::string OptimizerKernelName() const {
+    switch (learning_parameters_.optimizer) {
+      case SGD:
+        return "sgd_update";
+      case Momentum:
+        return "momentum_update";
+      case RMSProp:
+        return "rmsprop_update";
+      case Adam:
+        return "adam_update";
+      default:
+        std::cerr << "Unknown optimizer: " << learning_parameters_.optimizer
+                  << std::endl;
+        std::exit(1);
+    }
+  }
+
+  // Adam's bias correction of the learning rate at the current step.
+  double AdamStepSize() const {
+    const double step = static_cast<double>(optimizer_steps_);
+    return std::sqrt(1.0 - std::pow(learning_parameters_.beta2, step)) /
+           (1.0 - std::pow(learning_parameters_.beta1, step));
+  }
+
+  // Quantizes the inputs of a layer into quantized_inputs_, then runs its int8
+  // evaluate kernel on them.
+  void EnqueueQuantizedEvaluate(size_t index, const cl::Buffer &inputs,
+                                const cl::Buffer &outputs, size_t batch_size) {
+    Layer &layer = model_.layers[index];
+    const QuantizedLayerState &quantized = quantized_layers_[index];
+    const size_t input_size = batch_size * layer.GetDimensions().num_inputs;
+    if (quantized_inputs_size_ < input_size) {
+      cl_int buffer_init;
+      quantized_inputs_ =
+          cl::Buffer(std::get<0>(opencl_.compilation_units), CL_MEM_READ_WRITE,
+                     input_size, nullptr, &buffer_init);
+      CL_CHECK(buffer_init);
+      quantized_inputs_size_ = input_size;
+    }
+
+    cl::Kernel &quantize = CacheFetchKernel(layer.QuantizeInputKernelName(),
+                                            opencl_.quantized_program);
+    CL_CHECK(quantize.setArg(0, inputs));
+    CL_CHECK(quantize.setArg(1, quantized_inputs_));
+    CL_CHECK(quantize.setArg(2, *quantized.scales->gpu_buffer()));
+    graph().EnqueueKernel(quantize, cl::NDRange(input_size), cl::NullRange,
+                          {inputs, *quantized.scales->gpu_buffer()},
+                          {quantized_inputs_});
+
+    cl::Kernel &evaluate = CacheFetchKernel(layer.QuantizedEvaluateKernelName(),
+                                            opencl_.quantized_program);
+    CL_CHECK(evaluate.setArg(0, quantized_inputs_));
+    CL_CHECK(evaluate.setArg(1, quantized.gpu_weights));
+    CL_CHECK(evaluate.setArg(2, quantized.gpu_biases));
+    CL_CHECK(evaluate.setArg(3, outputs));
+    CL_CHECK(evaluate.setArg(4, *quantized.scales->gpu_buffer()));
+    const KernelRange range = layer.QuantizedEvaluateRange(batch_size);
+    graph().EnqueueKernel(
+        evaluate, GlobalRange(range), LocalRange(range),
+        {quantized_inputs_, quantized.gpu_weights, quantized.gpu_biases,
+         *quantized.scales->gpu_buffer()},
+        {outputs});
+  }
+
+  // Native CPU implementation of EnqueueQuantizedEvaluate().
+  void NativeQuantizedEvaluate(size_t index, const double *inputs,
+                               double *outputs, size_t batch_size) {
+    Layer &layer = model_.layers[index];
+    const QuantizedLayerState &quantized = quantized_layers_[index];
+    const size_t input_size = batch_size * layer.GetDimensions().num_inputs;
+    if (native_quantized_inputs_.size() < input_size) {
+      native_quantized_inputs_.resize(input_size);
+    }
+    native_quantized_program_->Launch(
+        layer.QuantizeInputKernelName(), input_size, 1, inputs,
+        native_quantized_inputs_.data(),
+        static_cast<const double *>(quantized.scales->data()));
+    native_quantized_program_->Launch(
+        layer.QuantizedEvaluateKernelName(),
+        layer.GetDimensions().num_outputs, batch_size,
+        static_cast<const int8_t *>(native_quantized_inputs_.data()),
+        quantized.weights.weights.data(), quantized.weights.biases.data(),
+        outputs, static_cast<const double *>(quantized.scales->data()));
+  }
+
+  // Fuses each activation layer which follows a dense or convolution layer
+  // into it (see Layer::FuseActivation()), which saves a kernel launch and a
+  // round trip of the layer's outputs through global memory. In the backward
+  // pass, the activation's derivative is applied by the input gradient kernel
+  // of the layer after the activation, if there is one. Layer indices, weights
+  // and saved layer outputs are unaffected: the producing layer's saved
+  // outputs are still the values before the activation.
+  void FuseActivations() {
+    for (size_t i = 0; i + 1 < model_.layers.size(); ++i) {
+      Layer &producer = model_.layers[i];
+      const Layer &activation = model_.layers[i + 1];
+      if (!producer.CanFuseActivation() || !activation.activation_function()) {
+        continue;
+      }
+      producer.FuseActivation(*activation.activation_function());
+      if (i + 2 < model_.layers.size()) {
+        model_.layers[i + 2].FuseInputActivation(
+            *activation.activation_function());
+      }
+    }
+  }
+
+  // True for activation layers whose input gradient kernel is replaced by the
+  // next layer's (see FuseActivations()).
+  bool BackpropagationFused(size_t layer) const {
+    return layer > 0 && layer + 1 < model_.layers.size() &&
+           model_.layers[layer - 1].has_fused_activation() &&
+           model_.layers[layer + 1].has_fused_input_activation();
+  }
+
+  // The input_pre_activations argument of a layer's input gradient kernel.
+  const compute::ClBuffer &InputPreActivations(
+      size_t layer, const compute::ClBuffer &layer_input) const {
+    if (model_.layers[layer].has_fused_input_activation()) {
+      return eval_layer_outputs_->at(layer - 2);
+    }
+    return layer_input;
+  }
+
+  void RequireOpenCl(const std::string &method) const {
+    if (backend_ != OpenCl) {
+      std::cerr << "Nnet::" << method
+                << " is only supported by the OpenCL backend." << std::endl;
+      std::exit(1);
+    }
+  }
+
+  // Grows the preallocated backprop gradient buffers so that they can hold the
+  // gradients of batch_size samples for the widest layer. If pack_samples is
+  // set, also grows the buffers which BatchTrain() packs its samples into.
+  void ReserveBatchCapacity(size_t batch_size, bool pack_samples = false) {
+    const size_t required_size = batch_size * max_layer_output_size_;
+    for (auto *buffer : {&backprop_gradients_, &next_backprop_gradients_}) {
+      if ((*buffer)->size() < required_size) {
+        (*buffer)->MoveToCpu();
+        (*buffer)->resize(required_size);
+        (*buffer)->MoveToGpu();
+      }
+    }
+    if (!pack_samples) {
+      return;
+    }
+    // Their contents don't need to survive, so they're replaced rather than
+    // resized.
+    const std::pair<std::unique_ptr<compute::ClBuffer> *, size_t> packed[] = {
+        {&batch_inputs_, batch_size * input_size()},
+        {&batch_outputs_, batch_size * output_size()}};
+    for (const auto &buffer : packed) {
+      std::unique_ptr<compute::ClBuffer> &samples = *buffer.first;
+      if (samples && samples->size() >= buffer.second) {
+        continue;
+      }
+      samples = (backend_ == NativeCpu)
+                    ? MakeBuffer(buffer.second)
+                    : MakeGpuBuffer(buffer.second, activation_format());
+    }
+  }
+
+  // A GPU buffer of size values in the given format, left uninitialized.
+  // Unlike MakeBuffer() followed by MoveToGpu(), this doesn't write to the
+  // buffer through opencl_.queue, which would wait for the graph.
+  std::unique_ptr<compute::ClBuffer> MakeGpuBuffer(size_t size) {
+    return MakeGpuBuffer(size, number_format());
+  }
+
+  std::unique_ptr<compute::ClBuffer> MakeGpuBuffer(
+      size_t size, compute::DeviceFormat format) {
+    cl_int buffer_init;
+    // Empty buffers aren't allowed, see ClBuffer::MoveToGpu().
+    const size_t bytes =
+        std::max<size_t>(1, size * compute::DeviceFormatSize(format));
+    auto buffer = std::make_unique<cl::Buffer>(
+        std::get<0>(opencl_.compilation_units), CL_MEM_READ_WRITE, bytes,
+        nullptr, &buffer_init);
+    CL_CHECK(buffer_init);
+    return std::make_unique<compute::ClBuffer>(
+        &opencl_.queue, &std::get<0>(opencl_.compilation_units),
+        std::move(buffer), format);
+  }
+
+  // Allocates room for size values in activation_format().
+  cl::Buffer AllocateGpuBuffer(size_t size) {
+    cl_int buffer_init;
+    cl::Buffer buffer(std::get<0>(opencl_.compilation_units), CL_MEM_READ_WRITE,
+                      size * compute::DeviceFormatSize(activation_format()),
+                      nullptr, &buffer_init);
+    CL_CHECK(buffer_init);
+    return buffer;
+  }
+
+  // Returns one of the two inference arenas of memory_plan_, grown (if
+  // needed) to fit batch_size samples.
+  const cl::Buffer &InferenceArena(size_t arena, size_t batch_size) {
+    const size_t required_size = batch_size * memory_plan_.arena_size(arena);
+    if (inference_arena_sizes_[arena] < required_size) {
+      inference_arenas_[arena] = AllocateGpuBuffer(required_size);
+      inference_arena_sizes_[arena] = required_size;
+    }
+    return inference_arenas_[arena];
+  }
+
+  // Sub-buffers must start on a multiple of the device's base address
+  // alignment (which OpenCL reports in bits). Returns it in values of
+  // activation_format().
+  size_t SubBufferAlignment() const {
+    cl_uint alignment_bits = 0;
+    CL_CHECK(opencl_.device.getInfo(CL_DEVICE_MEM_BASE_ADDR_ALIGN,
+                                    &alignment_bits));
+    const size_t alignment_bytes = alignment_bits / 8;
+    const size_t value_size = compute::DeviceFormatSize(activation_format());
+    return std::max<size_t>(1,
+                            (alignment_bytes + value_size - 1) / value_size);
+  }
+
+  // Points eval_layer_outputs_ at sub-buffers of the training pool, laid out
+  // by memory_plan_ for batch_size samples. The pool only grows, and the
+  // sub-buffers are only recreated when the batch size changes.
+  void BindTrainingPool(size_t batch_size) {
+    const bool replan = batch_size != training_batch_size_;
+    if (replan) {
+      const size_t alignment = SubBufferAlignment();
+      const size_t pool_size =
+          memory_plan_.TrainingPoolSize(batch_size, alignment);
+      if (training_pool_size_ < pool_size) {
+        training_pool_ = AllocateGpuBuffer(pool_size);
+        training_pool_size_ = pool_size;
+      }
+      training_outputs_.clear();
+      const size_t value_size = compute::DeviceFormatSize(activation_format());
+      for (const MemoryPlan::Region &region :
+           memory_plan_.TrainingRegions(batch_size, alignment)) {
+        cl_buffer_region cl_region = {region.offset * value_size,
+                                      region.size * value_size};
+        cl_int buffer_init;
+        training_outputs_.push_back(training_pool_.createSubBuffer(
+            CL_MEM_READ_WRITE, CL_BUFFER_CREATE_TYPE_REGION, &cl_region,
+            &buffer_init));
+        CL_CHECK(buffer_init);
+      }
+      training_batch_size_ = batch_size;
+    }
+    // Saved outputs which were moved to the CPU since they were bound no
+    // longer point at the pool.
+    for (size_t i = 0; i < training_outputs_.size(); ++i) {
+      compute::ClBuffer &saved_outputs = eval_layer_outputs_->at(i);
+      if (replan ||
+          saved_outputs.GetBufferLocation() != compute::ClBuffer::GPU) {
+        saved_outputs = compute::ClBuffer(
+            &opencl_.queue, &std::get<0>(opencl_.compilation_units),
+            std::make_unique<cl::Buffer>(training_outputs_[i]),
+            activation_format());
+      }
+    }
+  }
+
   void CalculateInitialWeights(InitStrategy weight_initialization) {
     switch (weight_initialization) {
       case NoWeightInit:
@@ -809,28 +2618,7 @@ class Nnet {
     }
   }
 
-  // a = a + b.
-  cl::CommandQueue VectorAccumulate(compute::ClBuffer &a,
-                                    compute::ClBuffer &b) {
-    cl::Device device = SelectDevice();
-    CompileKernelsIfRequired();
-    auto queue = MakeCommandQueue();
-    std::string accumulate_kernel_name = "vector_accumulate";
-    cl::Kernel &accumulate_kernel = CacheFetchKernel(accumulate_kernel_name);
-    CL_CHECK(accumulate_kernel.setArg(0, *a.gpu_buffer()));
-    CL_CHECK(accumulate_kernel.setArg(1, *b.gpu_buffer()));
-    auto workgroup = cl::NDRange(CalculateWorkgroupSize(a.size()));
-    cl_int result = queue->enqueueNDRangeKernel(
-        accumulate_kernel, cl::NullRange, cl::NDRange(a.size()), workgroup);
-    if (result != CL_SUCCESS) {
-      std::cerr << "Error enqueuing kernel " << accumulate_kernel_name
-                << " & error code: " << result << std::endl;
-      std::exit(1);
-    }
-    return *queue;
-  }
-
-  std::string FileToString(std::string filepath) {
+  static std::string FileToString(std::string filepath) {
   std::ifstream test(filepath);
   if (!test.is_open()) {
     // This is a hack due to Bazel's broken handling of external dependencies.
@@ -869,23 +2657,67 @@ class Nnet {
   ErrorLayer error_;
 
   cl::Kernel &CacheFetchKernel(const std::string &kernel_name) {
+    return CacheFetchKernel(kernel_name,
+                            std::get<1>(opencl_.compilation_units));
+  }
+
+  cl::Kernel &CacheFetchKernel(const std::string &kernel_name,
+                               const cl::Program &program) {
     if (opencl_.kernels.find(kernel_name) == opencl_.kernels.end()) {
-      opencl_.kernels[kernel_name] = cl::Kernel(
-          std::get<1>(opencl_.compilation_units), kernel_name.c_str());
+      opencl_.kernels[kernel_name] = cl::Kernel(program, kernel_name.c_str());
     }
     return opencl_.kernels[kernel_name];
   }
 
   // Pre-allocated GPU buffers. These buffers are preallocated for performance.
   // They are used to perform neural network inference and training.
-  std::unique_ptr<compute::ClBuffer> layer_outputs_;
   std::unique_ptr<compute::ClBuffer> backprop_gradients_;
   std::unique_ptr<compute::ClBuffer> next_backprop_gradients_;
   std::unique_ptr<compute::ClBuffer> next_weight_buffer_;
+  // One per layer, the destination of SGD weight updates.
+  std::vector<std::unique_ptr<compute::ClBuffer>> spare_weights_;
+  // The samples of BatchTrain(), packed together. Null until the first call,
+  // then grown to the largest batch (see ReserveBatchCapacity()).
+  std::unique_ptr<compute::ClBuffer> batch_inputs_;
+  std::unique_ptr<compute::ClBuffer> batch_outputs_;
   std::unique_ptr<compute::ClBuffer> learning_rate_buffer_;
+  // Holds -1, see EnqueueWeightGradients().
+  std::unique_ptr<compute::ClBuffer> gradient_scale_buffer_;
+  LearningParameters learning_parameters_{};
+  // Calls to Backpropagate() since the optimizer state was reset.
+  size_t optimizer_steps_ = 0;
 
   std::unique_ptr<std::vector<compute::ClBuffer>> eval_layer_outputs_;
 
+  // Device memory laid out by memory_plan_ (see Evaluate()). Sizes are in
+  // values.
+  MemoryPlan memory_plan_;
+  std::array<cl::Buffer, 2> inference_arenas_;
+  std::array<size_t, 2> inference_arena_sizes_ = {0, 0};
+  cl::Buffer training_pool_;
+  size_t training_pool_size_ = 0;
+  size_t training_batch_size_ = 0;
+  std::vector<cl::Buffer> training_outputs_;
+  std::array<std::vector<double>, 2> native_arenas_;
+  std::vector<double> native_pre_activations_;
+
+  // Set by Quantize(), indexed by layer. Empty unless the network is
+  // quantized.
+  struct QuantizedLayerState {
+    QuantizedWeights weights;
+    // {1 / input_scale, weight_scale * input_scale}, read by the int8
+    // kernels.
+    std::unique_ptr<compute::ClBuffer> scales;
+    cl::Buffer gpu_weights;
+    cl::Buffer gpu_biases;
+  };
+  std::vector<QuantizedLayerState> quantized_layers_;
+  // The int8 inputs of the quantized layer being evaluated. The size is in
+  // bytes.
+  cl::Buffer quantized_inputs_;
+  size_t quantized_inputs_size_ = 0;
+  std::vector<int8_t> native_quantized_inputs_;
+
   size_t max_layer_output_size_;
 
   // OpenCL state variables.
@@ -895,8 +2727,40 @@ class Nnet {
     cl::Device device;
     cl::CommandQueue queue;
     std::unordered_map<std::string, cl::Kernel> kernels;
+    // See CompileQuantizedKernelsIfRequired().
+    bool quantized_program_compiled = false;
+    cl::Program quantized_program;
+    // Orders the kernels of Evaluate() and training, see graph().
+    EventGraph graph;
   };
 
+  // The dependency graph of the device work, created on first use. Every
+  // public method which enqueues work on it Import()s opencl_.queue first and
+  // Export()s to it when done, so the host only waits for the graph when it
+  // reads a buffer back (or finishes opencl_.queue).
+  EventGraph &graph() {
+    if (!opencl_.graph.initialized()) {
+      opencl_.graph =
+          EventGraph(std::get<0>(opencl_.compilation_units), opencl_.device);
+    }
+    return opencl_.graph;
+  }
+
+  // Replaces opencl_.queue and the graph's queue with queues which have
+  // properties, once the work on them is done. Buffers keep pointing at
+  // opencl_.queue, which is assigned in place.
+  void RecreateQueues(cl_command_queue_properties properties) {
+    CL_CHECK(opencl_.queue.finish());
+    opencl_.graph.Finish();
+    const cl::Context &context = std::get<0>(opencl_.compilation_units);
+    cl_int queue_init;
+    opencl_.queue =
+        cl::CommandQueue(context, opencl_.device, properties, &queue_init);
+    CL_CHECK(queue_init);
+    opencl_.graph = EventGraph(context, opencl_.device, properties);
+    opencl_.graph.set_profiler(profiler_.get());
+  }
+
   OpenClState CompileCl(const std::vector<std::string> &kernel_source,
                         const cl::Device &device) {
     OpenClState cl_state;
@@ -908,12 +2772,58 @@ class Nnet {
     return cl_state;
   }
 
+  // Builds a program from a cached device binary. Returns false if the binary
+  // was rejected (for instance after a driver update), in which case the
+  // caller should compile from source.
+  static bool LoadClBinary(const std::vector<unsigned char> &binary,
+                           const cl::Device &device, OpenClState *cl_state) {
+    cl_int result;
+    cl::Context context(device);
+    std::vector<cl_int> binary_status;
+    cl::Program program(context, {device}, cl::Program::Binaries{binary},
+                        &binary_status, &result);
+    if (result != CL_SUCCESS || program.build({device}) != CL_SUCCESS) {
+      std::cerr << "Discarding cached kernel binary, rebuilding from source."
+                << std::endl;
+      return false;
+    }
+    cl_state->device = device;
+    cl_state->compilation_units = std::make_tuple(context, program);
+    cl_state->queue = cl::CommandQueue(context, device);
+    cl_state->compiled = true;
+    return true;
+  }
+
+  static cl::NDRange GlobalRange(const KernelRange &range) {
+    return cl::NDRange(range.global[0], range.global[1]);
+  }
+
+  static cl::NDRange LocalRange(const KernelRange &range) {
+    return (range.local[0] != 0) ? cl::NDRange(range.local[0], range.local[1])
+                                 : cl::NullRange;
+  }
+
   // Claims ownership over a compute buffer by moving it through the CPU into a
   // the appropriate cl context (and registering this network's command queue).
-  void ClaimOwnership(const std::unique_ptr<compute::ClBuffer> &buffer) {
+  // Its device values are converted to the given format.
+  void ClaimOwnership(const std::unique_ptr<compute::ClBuffer> &buffer,
+                      compute::DeviceFormat format) {
     if (!buffer) return;  // If empty, do nothing.
+    if (backend_ == NativeCpu) {
+      buffer->PinToCpu();
+      return;
+    }
+    if (buffer->command_queue() == &opencl_.queue &&
+        buffer->context() == &std::get<0>(opencl_.compilation_units) &&
+        buffer->device_format() == format && !buffer->IsPinnedToCpu()) {
+      // Already ours, skip the round trip through the CPU (which would wait
+      // for pending writes, see InputPipeline).
+      buffer->MoveToGpu();
+      return;
+    }
     compute::ClBuffer::Location original_location = buffer->GetBufferLocation();
     buffer->MoveToCpu();
+    buffer->SetDeviceFormat(format);
     buffer->RegisterClBackend(&opencl_.queue, 
                               &std::get<0>(opencl_.compilation_units));
     if (original_location == compute::ClBuffer::GPU) {
@@ -921,7 +2831,18 @@ class Nnet {
     }
   }
 
+  Backend backend_;
+  Precision precision_;
+  // Overrides SelectDevice() if set.
+  std::optional<cl::Device> device_;
   OpenClState opencl_;
+  std::unique_ptr<compute::NativeProgram> native_program_;
+  std::unique_ptr<compute::NativeProgram> native_quantized_program_;
+  // See EnableProfiling().
+  std::unique_ptr<Profiler> profiler_;
+  // The file mapped by LoadWeightsFromFile(), which the weight buffers may
+  // still use as their host memory.
+  std::shared_ptr<MappedWeightFile> weight_file_;
 };
 
 }  // namespace nnet
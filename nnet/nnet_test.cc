@@ -1,13 +1,21 @@
 #define CATCH_CONFIG_MAIN
 #include "third_party/catch.h"
 
+#include "nnet/data_parallel.h"
 #include "nnet/nnet.h"
 #include "stats/normal.h"
 #include "symbolic/symbolic_util.h"
 
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
 #include <iostream>
 #include <memory>
+#include <random>
 #include <set>
+#include <sstream>
 #include <string>
 
 namespace nnet {
@@ -179,6 +187,34 @@ TEST_CASE("Simple neural network output is validated", "[nnet]") {
     REQUIRE(output->at(2) == Approx(0.51583).epsilon(EPSILON));
   }
 
+  SECTION("Verify batched output") {
+    const std::vector<std::vector<double>> samples = {
+        {0.1, 0.2, 0.7}, {0.5, -0.3, 0.0}, {1.0, 1.0, 1.0}, {-0.2, 0.9, 0.4}};
+
+    std::vector<double> packed;
+    for (const auto &sample : samples) {
+      packed.insert(packed.end(), sample.begin(), sample.end());
+    }
+    auto batch_output =
+        test_net.BatchEvaluate(test_net.MakeBuffer(packed), samples.size());
+    batch_output->MoveToCpu();
+
+    REQUIRE(batch_output->size() == samples.size() * kOutputSize);
+
+    for (size_t i = 0; i < samples.size(); ++i) {
+      auto output = test_net.Evaluate(test_net.MakeBuffer(samples[i]));
+      output->MoveToCpu();
+      for (size_t j = 0; j < kOutputSize; ++j) {
+        REQUIRE(batch_output->at(i * kOutputSize + j) ==
+                Approx(output->at(j)));
+      }
+    }
+
+    REQUIRE(batch_output->at(0) == Approx(0.19858).epsilon(EPSILON));
+    REQUIRE(batch_output->at(1) == Approx(0.28559).epsilon(EPSILON));
+    REQUIRE(batch_output->at(2) == Approx(0.51583).epsilon(EPSILON));
+  }
+
   SECTION("Verify error") {
     // Incorrect actual output values because the example used had a weird
     // calculation for softmax (a/sum(a)) instead of exp(a)/sum(exp(a)).
@@ -273,6 +309,40 @@ TEST_CASE("Simple neural network output and gradient descent is validated",
     CHECK(model.layers[3].W(s.WeightNumber(1, 1)) == Approx(0.561370121));
   }
 
+  SECTION("Verify batched back propagation of neural network", "[nnet]") {
+    // Weight gradients are summed across the batch, so a batch holding the
+    // same example twice at half the learning rate takes the same step as the
+    // single example above.
+    std::vector<std::unique_ptr<compute::ClBuffer>> inputs;
+    std::vector<std::unique_ptr<compute::ClBuffer>> outputs;
+    for (size_t i = 0; i < 2; ++i) {
+      inputs.push_back(test_net.MakeBuffer({0.05, 0.10}));
+      outputs.push_back(test_net.MakeBuffer({0.01, 0.99}));
+    }
+    test_net.SetLearningParameters(Nnet::LearningParameters{0.25});
+    test_net.BatchTrain(inputs, outputs, {0, 1});
+
+    Architecture model = test_net.model();
+
+    // Layer 1.
+    //
+    // Node 1 edges.
+    CHECK(model.layers[1].W(s.WeightNumber(0, 0)) == Approx(0.149780716));
+    CHECK(model.layers[1].W(s.WeightNumber(0, 1)) == Approx(0.19956143));
+    // Node 2 edges.
+    CHECK(model.layers[1].W(s.WeightNumber(1, 0)) == Approx(0.24975114));
+    CHECK(model.layers[1].W(s.WeightNumber(1, 1)) == Approx(0.29950229));
+
+    // Layer 2.
+    //
+    // Node 1 edges.
+    CHECK(model.layers[3].W(s.WeightNumber(0, 0)) == Approx(0.35891648));
+    CHECK(model.layers[3].W(s.WeightNumber(0, 1)) == Approx(0.408666186));
+    // Node 2 edges.
+    CHECK(model.layers[3].W(s.WeightNumber(1, 0)) == Approx(0.511301270));
+    CHECK(model.layers[3].W(s.WeightNumber(1, 1)) == Approx(0.561370121));
+  }
+
   SECTION("Verify that two halves of the neural network can interoperate", "[nnet]") {
     // Creates two models, A and B, that each represent half of the above neural
     // network. Confirm that you can backprop between them.
@@ -992,6 +1062,91 @@ TEST_CASE("Convolution Layer Gradient checking",
   }
 }
 
+// Strides, padding other than half the filter, non-square filters and
+// filters too large to unroll take different paths through the generated
+// gradient code.
+TEST_CASE("Strided convolution gradients match finite differences",
+          "[convolution_gradient_check]") {
+  constexpr double EPSILON = 0.000001;
+  constexpr double COMPARISON_EPSILON = 0.0001;
+
+  VolumeDimensions input_dimensions;
+  FilterParams filters;
+  SECTION("Stride 2, no padding") {
+    input_dimensions = {5, 4, 2};
+    filters = {3, 3, 2, 2, 0, 3};
+  }
+  SECTION("Non-square filter") {
+    input_dimensions = {6, 5, 2};
+    filters = {3, 2, 2, 1, 1, 2};
+  }
+  SECTION("Filter too large to unroll") {
+    input_dimensions = {9, 8, 1};
+    filters = {8, 8, 1, 2, 2, 2};
+  }
+  const size_t input_size = input_dimensions.width *
+                            input_dimensions.height * input_dimensions.depth;
+  Architecture model(input_size);
+  model.AddConvolutionLayer(input_dimensions, filters, symbolic::Identity);
+  Nnet test_net(model, Nnet::Xavier, MeanSquared);
+
+  stats::Normal initializer(0, 1);
+  auto input = test_net.MakeBuffer(input_size);
+  for (size_t i = 0; i < input_size; ++i) {
+    input->at(i) = initializer.sample();
+  }
+  auto expected = test_net.MakeBuffer(model.output_size());
+  for (size_t i = 0; i < model.output_size(); ++i) {
+    expected->at(i) = initializer.sample();
+  }
+  auto error = [&](const std::unique_ptr<compute::ClBuffer> &in) {
+    auto output = test_net.Evaluate(in);
+    return test_net.Error(output, expected);
+  };
+
+  test_net.SetLearningParameters({.learning_rate = 0});
+  std::unique_ptr<compute::ClBuffer> gradients = test_net.MakeBuffer(0);
+  test_net.Train(input, expected, gradients);
+  gradients->MoveToCpu();
+  input->MoveToCpu();
+  for (size_t i = 0; i < input_size; ++i) {
+    auto input_left = std::make_unique<compute::ClBuffer>(*input);
+    input_left->at(i) -= EPSILON;
+    auto input_right = std::make_unique<compute::ClBuffer>(*input);
+    input_right->at(i) += EPSILON;
+    const double approx_gradient =
+        (error(input_right) - error(input_left)) / (2 * EPSILON);
+    CAPTURE(i);
+    CHECK(gradients->at(i) ==
+          Approx(approx_gradient).epsilon(COMPARISON_EPSILON).margin(1e-6));
+  }
+
+  const size_t num_weights = test_net.layer(1).weight_buffer().size();
+  std::vector<double> approx_gradients(num_weights);
+  for (size_t i = 0; i < num_weights; ++i) {
+    const double weight = test_net.GetWeight(1, i);
+    test_net.GetWeight(1, i) = weight - EPSILON;
+    const double error_left = error(input);
+    test_net.GetWeight(1, i) = weight + EPSILON;
+    const double error_right = error(input);
+    test_net.GetWeight(1, i) = weight;
+    approx_gradients[i] = (error_right - error_left) / (2 * EPSILON);
+  }
+  std::vector<double> weights(num_weights);
+  for (size_t i = 0; i < num_weights; ++i) {
+    weights[i] = test_net.GetWeight(1, i);
+  }
+  test_net.SetLearningParameters({.learning_rate = 1});
+  test_net.Train(input, expected);
+  for (size_t i = 0; i < num_weights; ++i) {
+    CAPTURE(i);
+    CHECK(weights[i] - test_net.GetWeight(1, i) ==
+          Approx(approx_gradients[i])
+              .epsilon(COMPARISON_EPSILON)
+              .margin(1e-6));
+  }
+}
+
 TEST_CASE("Softmax Layer unit tests", "[softmaxnet]") {
   constexpr double EPSILON = 0.001;
 
@@ -1212,6 +1367,1077 @@ TEST_CASE("Save File Format is validated.", "[nnet]") {
     std::string resaved_weights = loaded_net.WeightsToString();
     REQUIRE(resaved_weights == weights);
   }
+
+  SECTION("Verify Save/Load of quantized weights") {
+    auto input = test_net.MakeBuffer({0.5, -1.0, 2.0});
+    test_net.Quantize(input, 1);
+    std::string weights = test_net.WeightsToString();
+    Nnet loaded_net(model, Nnet::NoWeightInit, CrossEntropy);
+    REQUIRE(loaded_net.LoadWeightsFromString(weights));
+    REQUIRE(loaded_net.quantized());
+
+    auto expected = test_net.Evaluate(input);
+    auto actual = loaded_net.Evaluate(loaded_net.MakeBuffer({0.5, -1.0, 2.0}));
+    expected->MoveToCpu();
+    actual->MoveToCpu();
+    REQUIRE(actual->size() == expected->size());
+    for (size_t i = 0; i < expected->size(); ++i) {
+      CAPTURE(i);
+      CHECK(actual->at(i) == Approx(expected->at(i)).epsilon(EPSILON));
+    }
+    REQUIRE(loaded_net.WeightsToString() == weights);
+  }
+}
+
+TEST_CASE("Binary weight files round trip", "[weightfile]") {
+  constexpr size_t kInputSize = 4 * 4 * 2;
+  constexpr size_t kOutputSize = 3;
+  Architecture model(kInputSize);
+  model
+      .AddConvolutionLayer(
+          {
+              4,  // width
+              4,  // height
+              2,  // depth
+          },
+          {
+              3,  // filter x size.
+              3,  // filter y size.
+              2,  // filter z depth size.
+              1,  // stride.
+              1,  // padding.
+              2,  // number of filters.
+          })
+      .AddMaxPoolLayer(/* Input size */ VolumeDimensions{4, 4, 2},
+                       /* Output size */ AreaDimensions{2, 2})
+      .AddDenseLayer(kOutputSize, symbolic::Relu)
+      .AddSoftmaxLayer(kOutputSize);
+  Nnet test_net(model, Nnet::Xavier, CrossEntropy);
+
+  std::vector<double> input_values(kInputSize);
+  for (size_t i = 0; i < kInputSize; ++i) {
+    input_values[i] = std::sin(0.7 * i);
+  }
+
+  char directory[] = "/tmp/weight_file_test.XXXXXX";
+  REQUIRE(mkdtemp(directory) != nullptr);
+  const std::string path = std::string(directory) + "/weights.bin";
+
+  auto check_same_outputs = [&input_values](Nnet *expected_net,
+                                            Nnet *actual_net) {
+    auto expected = expected_net->Evaluate(
+        expected_net->MakeBuffer(input_values));
+    auto actual = actual_net->Evaluate(actual_net->MakeBuffer(input_values));
+    expected->MoveToCpu();
+    actual->MoveToCpu();
+    REQUIRE(actual->size() == expected->size());
+    for (size_t i = 0; i < expected->size(); ++i) {
+      CAPTURE(i);
+      CHECK(actual->at(i) == Approx(expected->at(i)).epsilon(1e-9));
+    }
+  };
+
+  SECTION("Weights are restored exactly") {
+    REQUIRE(test_net.SaveWeightsToFile(path));
+    Nnet loaded_net(model, Nnet::NoWeightInit, CrossEntropy);
+    REQUIRE(loaded_net.LoadWeightsFromFile(path));
+    REQUIRE(!loaded_net.quantized());
+    for (size_t l = 0; l < test_net.number_of_layers(); ++l) {
+      const size_t layer_size = test_net.layer(l).weight_buffer().size();
+      REQUIRE(loaded_net.layer(l).weight_buffer().size() == layer_size);
+      for (size_t i = 0; i < layer_size; ++i) {
+        CAPTURE(l);
+        CAPTURE(i);
+        CHECK(loaded_net.layer(l).W(i) == test_net.layer(l).W(i));
+      }
+    }
+    check_same_outputs(&test_net, &loaded_net);
+  }
+
+  SECTION("Quantized weights are restored") {
+    test_net.Quantize(test_net.MakeBuffer(input_values), 1);
+    REQUIRE(test_net.SaveWeightsToFile(path));
+    Nnet loaded_net(model, Nnet::NoWeightInit, CrossEntropy);
+    REQUIRE(loaded_net.LoadWeightsFromFile(path));
+    REQUIRE(loaded_net.quantized());
+    REQUIRE(loaded_net.InferenceWeightBytes() ==
+            test_net.InferenceWeightBytes());
+    check_same_outputs(&test_net, &loaded_net);
+  }
+
+  SECTION("Corrupt files are rejected") {
+    REQUIRE(test_net.SaveWeightsToFile(path));
+    {
+      // Flip a bit of the first weight, which starts the data section.
+      std::fstream file(path,
+                        std::ios::in | std::ios::out | std::ios::binary);
+      file.seekg(kWeightFileAlignment);
+      char first = file.get();
+      file.seekp(kWeightFileAlignment);
+      file.put(first ^ 1);
+    }
+    Nnet loaded_net(model, Nnet::NoWeightInit, CrossEntropy);
+    REQUIRE(!loaded_net.LoadWeightsFromFile(path));
+  }
+
+  SECTION("Files of other architectures are rejected") {
+    REQUIRE(test_net.SaveWeightsToFile(path));
+    Architecture other_model(kInputSize);
+    other_model.AddDenseLayer(kOutputSize, symbolic::Relu)
+        .AddSoftmaxLayer(kOutputSize);
+    Nnet other_net(other_model, Nnet::NoWeightInit, CrossEntropy);
+    REQUIRE(!other_net.LoadWeightsFromFile(path));
+  }
+
+  std::remove(path.c_str());
+}
+
+TEST_CASE("Native CPU backend matches the OpenCL backend", "[native]") {
+  constexpr size_t kInputSize = 8 * 8 * 2;
+  constexpr size_t kOutputSize = 4;
+  constexpr size_t kBatchSize = 3;
+  Architecture model(kInputSize);
+  model
+      .AddConvolutionLayer(
+          {
+              8,  // width
+              8,  // height
+              2,  // depth
+          },
+          {
+              3,  // filter x size.
+              3,  // filter y size.
+              2,  // filter z depth size.
+              1,  // stride.
+              1,  // padding.
+              3,  // number of filters.
+          })
+      .AddMaxPoolLayer(/* Input size */ VolumeDimensions{8, 8, 3},
+                       /* Output size */ AreaDimensions{4, 4})
+      .AddDenseLayer(kOutputSize, symbolic::Identity)
+      .AddSoftmaxLayer(kOutputSize);
+
+  Nnet opencl_net(model, Nnet::Xavier, CrossEntropy, Nnet::OpenCl);
+  Nnet native_net(model, Nnet::NoWeightInit, CrossEntropy, Nnet::NativeCpu);
+  for (size_t l = 0; l < opencl_net.number_of_layers(); ++l) {
+    const size_t layer_size = opencl_net.layer(l).weight_buffer().size();
+    for (size_t i = 0; i < layer_size; ++i) {
+      native_net.GetWeight(l, i) = opencl_net.GetWeight(l, i);
+    }
+  }
+
+  stats::Normal initializer(0, 1);
+  std::vector<std::unique_ptr<compute::ClBuffer>> opencl_inputs;
+  std::vector<std::unique_ptr<compute::ClBuffer>> native_inputs;
+  std::vector<std::unique_ptr<compute::ClBuffer>> opencl_outputs;
+  std::vector<std::unique_ptr<compute::ClBuffer>> native_outputs;
+  std::vector<double> packed_inputs;
+  for (size_t sample = 0; sample < kBatchSize; ++sample) {
+    std::vector<double> input(kInputSize);
+    for (double &value : input) {
+      value = initializer.sample();
+    }
+    std::vector<double> output(kOutputSize, 0.0);
+    output[sample % kOutputSize] = 1.0;
+    packed_inputs.insert(packed_inputs.end(), input.begin(), input.end());
+    opencl_inputs.push_back(opencl_net.MakeBuffer(input));
+    native_inputs.push_back(native_net.MakeBuffer(input));
+    opencl_outputs.push_back(opencl_net.MakeBuffer(output));
+    native_outputs.push_back(native_net.MakeBuffer(output));
+  }
+
+  SECTION("Verify batched evaluation") {
+    auto opencl_result = opencl_net.BatchEvaluate(
+        opencl_net.MakeBuffer(packed_inputs), kBatchSize);
+    auto native_result = native_net.BatchEvaluate(
+        native_net.MakeBuffer(packed_inputs), kBatchSize);
+    opencl_result->MoveToCpu();
+    native_result->MoveToCpu();
+    REQUIRE(native_result->size() == opencl_result->size());
+    for (size_t i = 0; i < opencl_result->size(); ++i) {
+      CAPTURE(i);
+      CHECK(native_result->at(i) == Approx(opencl_result->at(i)));
+    }
+  }
+
+  SECTION("Verify batch training") {
+    opencl_net.SetLearningParameters(Nnet::LearningParameters{0.1});
+    native_net.SetLearningParameters(Nnet::LearningParameters{0.1});
+    opencl_net.BatchTrain(opencl_inputs, opencl_outputs, {0, 1, 2});
+    native_net.BatchTrain(native_inputs, native_outputs, {0, 1, 2});
+    for (size_t l = 0; l < opencl_net.number_of_layers(); ++l) {
+      const size_t layer_size = opencl_net.layer(l).weight_buffer().size();
+      for (size_t i = 0; i < layer_size; ++i) {
+        CAPTURE(l);
+        CAPTURE(i);
+        CHECK(native_net.GetWeight(l, i) ==
+              Approx(opencl_net.GetWeight(l, i)));
+      }
+    }
+  }
+}
+
+// The tiled kernels only run on the OpenCL backend. Sizes are chosen to not
+// be multiples of the tile sizes.
+TEST_CASE("Tiled dense layers match generated dense layers", "[tiled]") {
+  constexpr size_t kInputSize = 37;
+  constexpr size_t kLayerSize = 70;
+  constexpr size_t kOutputSize = 5;
+  constexpr size_t kBatchSize = 6;
+  Architecture generated_model(kInputSize);
+  generated_model.AddDenseLayer(kLayerSize, symbolic::Sigmoid)
+      .AddDenseLayer(kOutputSize, symbolic::Identity);
+  Architecture tiled_model(kInputSize);
+  tiled_model.AddDenseLayer(kLayerSize, symbolic::Sigmoid, TiledDense)
+      .AddDenseLayer(kOutputSize, symbolic::Identity, TiledDense);
+
+  Nnet generated_net(generated_model, Nnet::Xavier, MeanSquared);
+  Nnet tiled_net(tiled_model, Nnet::NoWeightInit, MeanSquared);
+  for (size_t l = 0; l < generated_net.number_of_layers(); ++l) {
+    const size_t layer_size = generated_net.layer(l).weight_buffer().size();
+    for (size_t i = 0; i < layer_size; ++i) {
+      tiled_net.GetWeight(l, i) = generated_net.GetWeight(l, i);
+    }
+  }
+
+  stats::Normal initializer(0, 1);
+  std::vector<std::unique_ptr<compute::ClBuffer>> generated_inputs;
+  std::vector<std::unique_ptr<compute::ClBuffer>> tiled_inputs;
+  std::vector<std::unique_ptr<compute::ClBuffer>> generated_outputs;
+  std::vector<std::unique_ptr<compute::ClBuffer>> tiled_outputs;
+  std::vector<double> packed_inputs;
+  for (size_t sample = 0; sample < kBatchSize; ++sample) {
+    std::vector<double> input(kInputSize);
+    for (double &value : input) {
+      value = initializer.sample();
+    }
+    std::vector<double> output(kOutputSize);
+    for (double &value : output) {
+      value = initializer.sample();
+    }
+    packed_inputs.insert(packed_inputs.end(), input.begin(), input.end());
+    generated_inputs.push_back(generated_net.MakeBuffer(input));
+    tiled_inputs.push_back(tiled_net.MakeBuffer(input));
+    generated_outputs.push_back(generated_net.MakeBuffer(output));
+    tiled_outputs.push_back(tiled_net.MakeBuffer(output));
+  }
+
+  SECTION("Verify batched evaluation") {
+    auto generated_result = generated_net.BatchEvaluate(
+        generated_net.MakeBuffer(packed_inputs), kBatchSize);
+    auto tiled_result = tiled_net.BatchEvaluate(
+        tiled_net.MakeBuffer(packed_inputs), kBatchSize);
+    generated_result->MoveToCpu();
+    tiled_result->MoveToCpu();
+    REQUIRE(tiled_result->size() == generated_result->size());
+    for (size_t i = 0; i < generated_result->size(); ++i) {
+      CAPTURE(i);
+      CHECK(tiled_result->at(i) == Approx(generated_result->at(i)));
+    }
+  }
+
+  SECTION("Verify batch training") {
+    generated_net.SetLearningParameters(Nnet::LearningParameters{0.1});
+    tiled_net.SetLearningParameters(Nnet::LearningParameters{0.1});
+    generated_net.BatchTrain(generated_inputs, generated_outputs,
+                             {0, 1, 2, 3, 4, 5});
+    tiled_net.BatchTrain(tiled_inputs, tiled_outputs, {0, 1, 2, 3, 4, 5});
+    for (size_t l = 0; l < generated_net.number_of_layers(); ++l) {
+      const size_t layer_size = generated_net.layer(l).weight_buffer().size();
+      for (size_t i = 0; i < layer_size; ++i) {
+        CAPTURE(l);
+        CAPTURE(i);
+        CHECK(tiled_net.GetWeight(l, i) ==
+              Approx(generated_net.GetWeight(l, i)));
+      }
+    }
+  }
+}
+
+namespace {
+
+// Evaluates a single convolution layer with the given strategy on the same
+// random weights and inputs (seeded identically for every strategy).
+std::unique_ptr<compute::ClBuffer> EvaluateConvolution(
+    const VolumeDimensions &input, FilterParams filters,
+    ConvolutionStrategy strategy, size_t batch_size) {
+  filters.strategy = strategy;
+  const size_t input_size = input.width * input.height * input.depth;
+  Architecture model(input_size);
+  model.AddConvolutionLayer(input, filters, symbolic::Identity);
+  Nnet test_net(model, Nnet::NoWeightInit, MeanSquared);
+
+  std::mt19937 generator(1);
+  std::uniform_real_distribution<double> distribution(-1.0, 1.0);
+  // Layer 0 is the input layer.
+  Layer &convolution = test_net.layer(1);
+  for (size_t i = 0; i < convolution.weight_buffer().size(); ++i) {
+    test_net.GetWeight(1, i) = distribution(generator);
+  }
+  std::vector<double> inputs(batch_size * input_size);
+  for (double &value : inputs) {
+    value = distribution(generator);
+  }
+
+  auto outputs =
+      test_net.BatchEvaluate(test_net.MakeBuffer(inputs), batch_size);
+  outputs->MoveToCpu();
+  return outputs;
+}
+
+}  // namespace
+
+// The im2col kernel only runs on the OpenCL backend. Uses stride and padding,
+// and sizes which aren't multiples of the tile sizes.
+TEST_CASE("Im2col convolution matches direct convolution", "[tiled]") {
+  const VolumeDimensions input = {9, 7, 3};
+  const FilterParams filters = {
+      3,  // filter x size.
+      3,  // filter y size.
+      3,  // filter z depth size.
+      2,  // stride.
+      1,  // padding.
+      5,  // number of filters.
+  };
+  constexpr size_t kBatchSize = 3;
+  auto direct =
+      EvaluateConvolution(input, filters, DirectConvolution, kBatchSize);
+  auto im2col =
+      EvaluateConvolution(input, filters, Im2ColConvolution, kBatchSize);
+  REQUIRE(direct->size() == im2col->size());
+  for (size_t i = 0; i < direct->size(); ++i) {
+    CAPTURE(i);
+    CHECK(im2col->at(i) == Approx(direct->at(i)));
+  }
+}
+
+TEST_CASE("Winograd convolution matches direct convolution", "[tiled]") {
+  // Odd output dimensions leave partial 2x2 tiles on the right and bottom.
+  const VolumeDimensions input = {9, 7, 6};
+  const FilterParams filters = {
+      3,   // filter x size.
+      3,   // filter y size.
+      6,   // filter z depth size.
+      1,   // stride.
+      1,   // padding.
+      37,  // number of filters.
+  };
+  REQUIRE(ConvolutionLayer::WinogradEligible(filters));
+  constexpr size_t kBatchSize = 3;
+  auto direct =
+      EvaluateConvolution(input, filters, DirectConvolution, kBatchSize);
+  auto winograd =
+      EvaluateConvolution(input, filters, WinogradConvolution, kBatchSize);
+  REQUIRE(direct->size() == winograd->size());
+  for (size_t i = 0; i < direct->size(); ++i) {
+    CAPTURE(i);
+    CHECK(winograd->at(i) == Approx(direct->at(i)));
+  }
+}
+
+TEST_CASE("Memory plan layout is validated", "[memplan]") {
+  // dense(8) -> sigmoid (fused) -> dense(3) -> max pool(2) -> dense(6) ->
+  // relu (fused).
+  const std::vector<size_t> layer_sizes = {8, 8, 3, 2, 6, 6};
+  const std::vector<bool> fused = {true, false, false, false, true, false};
+  MemoryPlan plan(layer_sizes, fused);
+
+  SECTION("Inference ping-pongs between two arenas") {
+    // Launches: 0 (arena 0), 2 (arena 1), 3 (arena 0), 4 (the result).
+    CHECK(plan.OutputArena(0) == 0);
+    CHECK(plan.OutputArena(2) == 1);
+    CHECK(plan.OutputArena(3) == 0);
+    CHECK(plan.arena_size(0) == 8);
+    CHECK(plan.arena_size(1) == 3);
+  }
+
+  SECTION("Training regions are aligned and disjoint") {
+    constexpr size_t kBatchSize = 3;
+    constexpr size_t kAlignment = 16;
+    const auto regions = plan.TrainingRegions(kBatchSize, kAlignment);
+    REQUIRE(regions.size() == layer_sizes.size());
+    for (size_t i = 0; i < regions.size(); ++i) {
+      CAPTURE(i);
+      CHECK(regions[i].offset % kAlignment == 0);
+      CHECK(regions[i].size == kBatchSize * layer_sizes[i]);
+      if (i > 0) {
+        CHECK(regions[i].offset >= regions[i - 1].offset + regions[i - 1].size);
+      }
+    }
+    CHECK(plan.TrainingPoolSize(kBatchSize, kAlignment) ==
+          regions.back().offset + regions.back().size);
+  }
+}
+
+// Evaluation reuses its buffers between calls, growing them for larger
+// batches. Results must not depend on what ran before.
+TEST_CASE("Evaluation results are independent of earlier calls", "[memplan]") {
+  constexpr size_t kInputSize = 5;
+  constexpr size_t kOutputSize = 3;
+  constexpr size_t kBatchSize = 4;
+  Architecture model(kInputSize);
+  model.AddDenseLayer(7, symbolic::Sigmoid)
+      .AddDenseLayer(11, symbolic::Relu)
+      .AddDenseLayer(kOutputSize, symbolic::Identity);
+  Nnet test_net(model, Nnet::Xavier, MeanSquared);
+
+  stats::Normal initializer(0, 1);
+  std::vector<double> packed_inputs(kBatchSize * kInputSize);
+  for (double &value : packed_inputs) {
+    value = initializer.sample();
+  }
+  std::vector<std::vector<double>> expected;
+  for (size_t sample = 0; sample < kBatchSize; ++sample) {
+    auto begin = packed_inputs.begin() + sample * kInputSize;
+    std::vector<double> input(begin, begin + kInputSize);
+    auto result = test_net.Evaluate(test_net.MakeBuffer(input));
+    result->MoveToCpu();
+    expected.emplace_back(result->data(), result->data() + kOutputSize);
+  }
+
+  // A batch after single samples grows the arenas, and the first result must
+  // survive the second call.
+  auto first = test_net.BatchEvaluate(test_net.MakeBuffer(packed_inputs),
+                                      kBatchSize);
+  auto second = test_net.BatchEvaluate(test_net.MakeBuffer(packed_inputs),
+                                       kBatchSize);
+  first->MoveToCpu();
+  second->MoveToCpu();
+  REQUIRE(first->size() == kBatchSize * kOutputSize);
+  for (size_t sample = 0; sample < kBatchSize; ++sample) {
+    for (size_t i = 0; i < kOutputSize; ++i) {
+      CAPTURE(sample);
+      CAPTURE(i);
+      CHECK(first->at(sample * kOutputSize + i) ==
+            Approx(expected[sample][i]));
+      CHECK(second->at(sample * kOutputSize + i) ==
+            Approx(expected[sample][i]));
+    }
+  }
+}
+
+// The native backend always runs in double precision, where this is trivial.
+TEST_CASE("Reduced precision networks match double precision", "[precision]") {
+  constexpr size_t kInputSize = 6 * 6 * 2;
+  constexpr size_t kOutputSize = 4;
+  constexpr size_t kBatchSize = 5;
+  Architecture model(kInputSize);
+  model
+      .AddConvolutionLayer(
+          {
+              6,  // width
+              6,  // height
+              2,  // depth
+          },
+          {
+              3,  // filter x size.
+              3,  // filter y size.
+              2,  // filter z depth size.
+              1,  // stride.
+              1,  // padding.
+              3,  // number of filters.
+          },
+          symbolic::Relu)
+      .AddDenseLayer(9, symbolic::Sigmoid)
+      .AddDenseLayer(kOutputSize, symbolic::Identity);
+
+  Nnet double_net(model, Nnet::Xavier, MeanSquared);
+  stats::Normal initializer(0, 1);
+  std::vector<std::unique_ptr<compute::ClBuffer>> inputs;
+  std::vector<std::unique_ptr<compute::ClBuffer>> outputs;
+  std::vector<double> packed_inputs;
+  for (size_t sample = 0; sample < kBatchSize; ++sample) {
+    std::vector<double> input(kInputSize);
+    for (double &value : input) {
+      value = initializer.sample();
+    }
+    std::vector<double> output(kOutputSize, 0.0);
+    output[sample % kOutputSize] = 1.0;
+    packed_inputs.insert(packed_inputs.end(), input.begin(), input.end());
+    inputs.push_back(std::make_unique<compute::ClBuffer>(input));
+    outputs.push_back(std::make_unique<compute::ClBuffer>(output));
+  }
+
+  for (Nnet::Precision precision :
+       {Nnet::SinglePrecision, Nnet::MixedPrecision}) {
+    CAPTURE(precision);
+    // Half precision activations keep about three significant digits.
+    const double epsilon = (precision == Nnet::SinglePrecision) ? 1e-4 : 1e-2;
+    Nnet test_net(model, Nnet::NoWeightInit, MeanSquared,
+                  Nnet::DefaultBackend(), precision);
+    for (size_t l = 0; l < double_net.number_of_layers(); ++l) {
+      const size_t layer_size = double_net.layer(l).weight_buffer().size();
+      for (size_t i = 0; i < layer_size; ++i) {
+        test_net.GetWeight(l, i) = double_net.GetWeight(l, i);
+      }
+    }
+
+    auto expected = double_net.BatchEvaluate(
+        double_net.MakeBuffer(packed_inputs), kBatchSize);
+    auto actual = test_net.BatchEvaluate(test_net.MakeBuffer(packed_inputs),
+                                         kBatchSize);
+    expected->MoveToCpu();
+    actual->MoveToCpu();
+    REQUIRE(actual->size() == expected->size());
+    for (size_t i = 0; i < expected->size(); ++i) {
+      CAPTURE(i);
+      CHECK(actual->at(i) ==
+            Approx(expected->at(i)).epsilon(epsilon).margin(epsilon));
+    }
+
+    Nnet reference_net(model, Nnet::NoWeightInit, MeanSquared);
+    for (size_t l = 0; l < double_net.number_of_layers(); ++l) {
+      const size_t layer_size = double_net.layer(l).weight_buffer().size();
+      for (size_t i = 0; i < layer_size; ++i) {
+        reference_net.GetWeight(l, i) = double_net.GetWeight(l, i);
+      }
+    }
+    reference_net.SetLearningParameters(Nnet::LearningParameters{0.1});
+    test_net.SetLearningParameters(Nnet::LearningParameters{0.1});
+    reference_net.BatchTrain(inputs, outputs, {0, 1, 2, 3, 4});
+    test_net.BatchTrain(inputs, outputs, {0, 1, 2, 3, 4});
+    for (size_t l = 0; l < reference_net.number_of_layers(); ++l) {
+      const size_t layer_size = reference_net.layer(l).weight_buffer().size();
+      for (size_t i = 0; i < layer_size; ++i) {
+        CAPTURE(l);
+        CAPTURE(i);
+        CHECK(test_net.GetWeight(l, i) ==
+              Approx(reference_net.GetWeight(l, i))
+                  .epsilon(epsilon)
+                  .margin(epsilon));
+      }
+    }
+  }
+}
+
+TEST_CASE("Weights are quantized to int8", "[quantize]") {
+  CHECK(QuantizeValue(0.5, 0.01) == 50);
+  CHECK(QuantizeValue(-0.005, 0.01) == -1);
+  CHECK(QuantizeValue(3.0, 0.01) == kQuantizedMax);
+  CHECK(QuantizeValue(-3.0, 0.01) == -kQuantizedMax);
+  CHECK(QuantizationScale(0.0) == 1.0);
+
+  // Two rows of two weights and a bias. The biases don't count towards the
+  // weight range.
+  const std::vector<double> weights = {0.5, -0.25, 10.0, -1.0, 0.1, -3.0};
+  QuantizedWeights quantized =
+      QuantizeWeights(weights.data(), weights.size(), 3, 2.0);
+  CHECK(quantized.weight_scale == Approx(1.0 / kQuantizedMax));
+  CHECK(quantized.input_scale == Approx(2.0 / kQuantizedMax));
+  REQUIRE(quantized.weights.size() == weights.size());
+  REQUIRE(quantized.biases.size() == 2);
+  CHECK(quantized.weights[0] == 64);
+  CHECK(quantized.weights[1] == -32);
+  CHECK(quantized.weights[2] == 0);
+  CHECK(quantized.weights[3] == -kQuantizedMax);
+  CHECK(quantized.weights[4] == 13);
+  CHECK(quantized.weights[5] == 0);
+  const double bias_scale = quantized.weight_scale * quantized.input_scale;
+  CHECK(quantized.biases[0] * bias_scale == Approx(10.0).margin(bias_scale));
+  CHECK(quantized.biases[1] * bias_scale == Approx(-3.0).margin(bias_scale));
+  CHECK(quantized.size_in_bytes() == 6 + 2 * sizeof(int32_t));
+}
+
+TEST_CASE("Quantized inference tracks the full precision network",
+          "[quantize]") {
+  constexpr size_t kInputSize = 8 * 8 * 2;
+  constexpr size_t kOutputSize = 5;
+  constexpr size_t kBatchSize = 16;
+  Architecture model(kInputSize);
+  model
+      .AddConvolutionLayer(
+          {
+              8,  // width
+              8,  // height
+              2,  // depth
+          },
+          {
+              3,  // filter x size.
+              3,  // filter y size.
+              2,  // filter z depth size.
+              1,  // stride.
+              1,  // padding.
+              4,  // number of filters.
+          },
+          symbolic::Relu)
+      .AddMaxPoolLayer({8, 8, 4}, {4, 4})
+      .AddDenseLayer(12, symbolic::Sigmoid)
+      .AddDenseLayer(kOutputSize, symbolic::Identity);
+  Nnet test_net(model, Nnet::Xavier, MeanSquared);
+
+  stats::Normal initializer(0, 1);
+  std::vector<double> packed_inputs(kBatchSize * kInputSize);
+  for (double &value : packed_inputs) {
+    value = initializer.sample();
+  }
+  auto expected =
+      test_net.BatchEvaluate(test_net.MakeBuffer(packed_inputs), kBatchSize);
+  expected->MoveToCpu();
+  const size_t full_precision_bytes = test_net.InferenceWeightBytes();
+
+  test_net.Quantize(test_net.MakeBuffer(packed_inputs), kBatchSize);
+  REQUIRE(test_net.quantized());
+  auto actual =
+      test_net.BatchEvaluate(test_net.MakeBuffer(packed_inputs), kBatchSize);
+  actual->MoveToCpu();
+
+  double max_output = 0;
+  for (size_t i = 0; i < expected->size(); ++i) {
+    max_output = std::max(max_output, std::abs(expected->at(i)));
+  }
+  REQUIRE(actual->size() == expected->size());
+  for (size_t i = 0; i < expected->size(); ++i) {
+    CAPTURE(i);
+    CHECK(actual->at(i) == Approx(expected->at(i)).margin(0.05 * max_output));
+  }
+
+  // Only the weights of the dense and convolution layers are quantized, each
+  // weight goes from 8 bytes to 1 (biases to 4).
+  CHECK(test_net.InferenceWeightBytes() * 4 < full_precision_bytes);
+
+  SECTION("Training discards the quantization") {
+    std::vector<std::unique_ptr<compute::ClBuffer>> inputs;
+    std::vector<std::unique_ptr<compute::ClBuffer>> outputs;
+    inputs.push_back(test_net.MakeBuffer(std::vector<double>(
+        packed_inputs.begin(), packed_inputs.begin() + kInputSize)));
+    outputs.push_back(test_net.MakeBuffer(std::vector<double>(kOutputSize)));
+    test_net.BatchTrain(inputs, outputs, {0});
+    CHECK(!test_net.quantized());
+  }
+}
+
+TEST_CASE("Pipelined training matches BatchTrain", "[pipeline]") {
+  constexpr size_t kInputSize = 6;
+  constexpr size_t kOutputSize = 3;
+  constexpr size_t kBatchSize = 4;
+  constexpr size_t kNumBatches = 5;
+  Architecture model(kInputSize);
+  model.AddDenseLayer(8, symbolic::Sigmoid)
+      .AddDenseLayer(kOutputSize, symbolic::Identity)
+      .AddSoftmaxLayer(kOutputSize);
+  Nnet batch_net(model, Nnet::Xavier, CrossEntropy);
+  Nnet pipelined_net(model, Nnet::NoWeightInit, CrossEntropy);
+  for (size_t l = 0; l < batch_net.number_of_layers(); ++l) {
+    const size_t layer_size = batch_net.layer(l).weight_buffer().size();
+    for (size_t i = 0; i < layer_size; ++i) {
+      pipelined_net.GetWeight(l, i) = batch_net.GetWeight(l, i);
+    }
+  }
+
+  stats::Normal initializer(0, 1);
+  std::vector<std::unique_ptr<compute::ClBuffer>> inputs;
+  std::vector<std::unique_ptr<compute::ClBuffer>> outputs;
+  std::vector<std::vector<double>> packed_inputs(kNumBatches);
+  std::vector<std::vector<double>> packed_outputs(kNumBatches);
+  for (size_t sample = 0; sample < kNumBatches * kBatchSize; ++sample) {
+    std::vector<double> input(kInputSize);
+    for (double &value : input) {
+      value = initializer.sample();
+    }
+    std::vector<double> output(kOutputSize, 0.0);
+    output[sample % kOutputSize] = 1.0;
+    const size_t batch = sample / kBatchSize;
+    packed_inputs[batch].insert(packed_inputs[batch].end(), input.begin(),
+                                input.end());
+    packed_outputs[batch].insert(packed_outputs[batch].end(), output.begin(),
+                                 output.end());
+    inputs.push_back(batch_net.MakeBuffer(input));
+    outputs.push_back(batch_net.MakeBuffer(output));
+  }
+
+  std::unique_ptr<InputPipeline> pipeline =
+      pipelined_net.MakeInputPipeline(kBatchSize);
+  REQUIRE(pipeline->depth() == 2);
+  pipeline->Push(packed_inputs[0], packed_outputs[0]);
+  for (size_t batch = 0; batch < kNumBatches; ++batch) {
+    if (batch + 1 < kNumBatches) {
+      pipeline->Push(packed_inputs[batch + 1], packed_outputs[batch + 1]);
+      REQUIRE(pipeline->full());
+    }
+    pipelined_net.BatchTrain(pipeline.get());
+
+    std::set<int> indices;
+    for (size_t sample = 0; sample < kBatchSize; ++sample) {
+      indices.insert(batch * kBatchSize + sample);
+    }
+    batch_net.BatchTrain(inputs, outputs, indices);
+  }
+  REQUIRE(pipeline->empty());
+  REQUIRE(pipeline->stats().batches == kNumBatches);
+  CHECK(pipeline->stats().hidden_seconds() >= 0.0);
+
+  for (size_t l = 0; l < batch_net.number_of_layers(); ++l) {
+    const size_t layer_size = batch_net.layer(l).weight_buffer().size();
+    for (size_t i = 0; i < layer_size; ++i) {
+      CAPTURE(l);
+      CAPTURE(i);
+      CHECK(pipelined_net.GetWeight(l, i) ==
+            Approx(batch_net.GetWeight(l, i)).epsilon(1e-12));
+    }
+  }
+}
+
+TEST_CASE("Data-parallel training matches BatchTrain", "[dataparallel]") {
+  constexpr size_t kInputSize = 6;
+  constexpr size_t kOutputSize = 3;
+  // Uneven on purpose, the shards hold 3 and 2 samples.
+  constexpr size_t kBatchSize = 5;
+  constexpr size_t kNumBatches = 3;
+  Architecture model(kInputSize);
+  model.AddDenseLayer(8, symbolic::Sigmoid)
+      .AddDenseLayer(kOutputSize, symbolic::Identity)
+      .AddSoftmaxLayer(kOutputSize);
+  std::unique_ptr<DataParallelTrainer> trainer;
+  if (Nnet::DefaultBackend() == Nnet::NativeCpu) {
+    trainer = std::make_unique<DataParallelTrainer>(model, 2, CrossEntropy);
+  } else {
+    trainer = std::make_unique<DataParallelTrainer>(model, ReplicaDevices(2),
+                                                    CrossEntropy);
+  }
+  REQUIRE(trainer->replicas() == 2);
+  Nnet batch_net(model, Nnet::NoWeightInit, CrossEntropy);
+  for (size_t l = 0; l < batch_net.number_of_layers(); ++l) {
+    const size_t layer_size = batch_net.layer(l).weight_buffer().size();
+    for (size_t i = 0; i < layer_size; ++i) {
+      batch_net.GetWeight(l, i) = trainer->replica(0).GetWeight(l, i);
+      REQUIRE(trainer->replica(1).GetWeight(l, i) ==
+              batch_net.GetWeight(l, i));
+    }
+  }
+
+  Nnet::LearningParameters params{.learning_rate = 0.1};
+  SECTION("SGD") {}
+  SECTION("Momentum") { params.optimizer = Nnet::Momentum; }
+  trainer->SetLearningParameters(params);
+  batch_net.SetLearningParameters(params);
+
+  stats::Normal initializer(0, 1);
+  std::vector<std::unique_ptr<compute::ClBuffer>> inputs;
+  std::vector<std::unique_ptr<compute::ClBuffer>> outputs;
+  for (size_t batch = 0; batch < kNumBatches; ++batch) {
+    std::vector<double> packed_inputs;
+    std::vector<double> packed_outputs;
+    std::set<int> indices;
+    for (size_t sample = 0; sample < kBatchSize; ++sample) {
+      std::vector<double> input(kInputSize);
+      for (double &value : input) {
+        value = initializer.sample();
+      }
+      std::vector<double> output(kOutputSize, 0.0);
+      output[sample % kOutputSize] = 1.0;
+      packed_inputs.insert(packed_inputs.end(), input.begin(), input.end());
+      packed_outputs.insert(packed_outputs.end(), output.begin(),
+                            output.end());
+      indices.insert(inputs.size());
+      inputs.push_back(batch_net.MakeBuffer(input));
+      outputs.push_back(batch_net.MakeBuffer(output));
+    }
+    std::unique_ptr<compute::ClBuffer> batch_inputs =
+        std::make_unique<compute::ClBuffer>(packed_inputs);
+    std::unique_ptr<compute::ClBuffer> batch_outputs =
+        std::make_unique<compute::ClBuffer>(packed_outputs);
+    trainer->BatchTrain(batch_inputs, batch_outputs, kBatchSize);
+    batch_net.BatchTrain(inputs, outputs, indices);
+  }
+
+  for (size_t r = 0; r < trainer->replicas(); ++r) {
+    for (size_t l = 0; l < batch_net.number_of_layers(); ++l) {
+      const size_t layer_size = batch_net.layer(l).weight_buffer().size();
+      for (size_t i = 0; i < layer_size; ++i) {
+        CAPTURE(r);
+        CAPTURE(l);
+        CAPTURE(i);
+        CHECK(trainer->replica(r).GetWeight(l, i) ==
+              Approx(batch_net.GetWeight(l, i)).epsilon(1e-9));
+      }
+    }
+  }
+}
+
+TEST_CASE("Profiled commands are aggregated and traced", "[profile]") {
+  int layer = 0;
+  CHECK(Profiler::Kind("evaluate_3", &layer) == "evaluate");
+  CHECK(layer == 3);
+  CHECK(Profiler::Kind("evaluate_int8_2", &layer) == "evaluate_int8");
+  CHECK(layer == 2);
+  CHECK(Profiler::Kind("weight_delta_dense_1", &layer) == "weight_delta");
+  CHECK(layer == 1);
+  CHECK(Profiler::Kind("error_sample_sums", &layer) == "error_sample_sums");
+  CHECK(layer == -1);
+
+  Profiler::Options options;
+  options.sample_every = 2;
+  Profiler profiler(options);
+  for (int segment = 0; segment < 4; ++segment) {
+    profiler.BeginSegment();
+    CHECK(profiler.sampling() == (segment % 2 == 0));
+  }
+  CHECK(profiler.sampled_segments() == 2);
+
+  // Two kernels of layer 1 which overlap, then a transfer.
+  profiler.AddRecord({"evaluate_1", "evaluate", 1, 1000, 1500, 2000, 5000});
+  profiler.AddRecord({"new_weights_dense_1", "new_weights", 1, 1000, 1500,
+                      3000, 4000});
+  profiler.AddRecord({"copy", "transfer", -1, 5000, 5000, 6000, 8000});
+  std::map<int, std::map<std::string, Profiler::Stats>> stats =
+      profiler.LayerStats();
+  REQUIRE(stats.size() == 2);
+  CHECK(stats[1]["evaluate"].commands == 1);
+  CHECK(stats[1]["evaluate"].run_seconds == Approx(3e-6));
+  CHECK(stats[1]["new_weights"].wait_seconds == Approx(2e-6));
+  CHECK(stats[-1]["transfer"].run_seconds == Approx(2e-6));
+
+  std::stringstream trace;
+  profiler.WriteChromeTrace(trace);
+  const std::string json = trace.str();
+  CHECK(json.find("\"traceEvents\"") != std::string::npos);
+  CHECK(json.find("{\"name\":\"evaluate_1\",\"cat\":\"evaluate\","
+                  "\"ph\":\"X\",\"pid\":0,\"tid\":0,\"ts\":1.000,"
+                  "\"dur\":3.000") != std::string::npos);
+  // It overlaps evaluate_1, so it goes on a row of its own.
+  CHECK(json.find("{\"name\":\"new_weights_dense_1\",\"cat\":"
+                  "\"new_weights\",\"ph\":\"X\",\"pid\":0,\"tid\":1,")
+        != std::string::npos);
+  CHECK(json.find("{\"name\":\"copy\",\"cat\":\"transfer\",\"ph\":"
+                  "\"X\",\"pid\":0,\"tid\":0,") != std::string::npos);
+
+  if (Nnet::DefaultBackend() == Nnet::OpenCl) {
+    Architecture model(4);
+    model.AddDenseLayer(3, symbolic::Sigmoid)
+        .AddDenseLayer(2, symbolic::Identity);
+    Nnet test_net(model, Nnet::Xavier, MeanSquared);
+    Profiler *network_profiler = test_net.EnableProfiling();
+    std::unique_ptr<compute::ClBuffer> input =
+        test_net.MakeBuffer({0.5, -1.0, 0.25, 2.0});
+    std::unique_ptr<compute::ClBuffer> expected =
+        test_net.MakeBuffer({1.0, -1.0});
+    test_net.Train(input, expected);
+    // Reading the weights back waits for the training step to complete.
+    test_net.layer(1);
+    std::map<int, std::map<std::string, Profiler::Stats>> network_stats =
+        network_profiler->LayerStats();
+    CHECK(network_stats[1]["evaluate"].commands == 1);
+    CHECK(network_stats[1]["input_delta"].commands +
+              network_stats[1]["new_weights"].commands >=
+          1);
+    test_net.DisableProfiling();
+    CHECK(test_net.profiler() == nullptr);
+  }
+}
+
+TEST_CASE("Batch errors are reduced on the device", "[error]") {
+  // More outputs than a reduction workgroup, so each sample is split into
+  // several partial sums.
+  constexpr size_t kOutputSize = 150;
+  constexpr size_t kBatchSize = 5;
+  Architecture model(2);
+  model.AddDenseLayer(kOutputSize, symbolic::Identity);
+  Nnet test_net(model, Nnet::Xavier, MeanSquared);
+
+  stats::Normal initializer(0, 1);
+  std::vector<double> outputs(kBatchSize * kOutputSize);
+  std::vector<double> expected(kBatchSize * kOutputSize);
+  for (size_t i = 0; i < outputs.size(); ++i) {
+    outputs[i] = initializer.sample();
+    expected[i] = initializer.sample();
+  }
+  std::vector<double> sample_errors(kBatchSize, 0.0);
+  double mean_error = 0;
+  for (size_t sample = 0; sample < kBatchSize; ++sample) {
+    for (size_t i = 0; i < kOutputSize; ++i) {
+      const double difference = expected[sample * kOutputSize + i] -
+                                outputs[sample * kOutputSize + i];
+      sample_errors[sample] += difference * difference / 2;
+    }
+    mean_error += sample_errors[sample] / kBatchSize;
+  }
+
+  std::unique_ptr<compute::ClBuffer> output_buffer =
+      test_net.MakeBuffer(outputs);
+  std::unique_ptr<compute::ClBuffer> expected_buffer =
+      test_net.MakeBuffer(expected);
+  CHECK(test_net.BatchError(output_buffer, expected_buffer, kBatchSize) ==
+        Approx(mean_error).epsilon(1e-12));
+
+  std::unique_ptr<compute::ClBuffer> errors =
+      test_net.BatchErrors(output_buffer, expected_buffer, kBatchSize);
+  errors->MoveToCpu();
+  REQUIRE(errors->size() == kBatchSize + 1);
+  for (size_t sample = 0; sample < kBatchSize; ++sample) {
+    CAPTURE(sample);
+    CHECK(errors->at(sample) == Approx(sample_errors[sample]).epsilon(1e-12));
+  }
+  CHECK(errors->at(kBatchSize) == Approx(mean_error).epsilon(1e-12));
+
+  // The error of the first sample alone.
+  CHECK(test_net.Error(output_buffer, expected_buffer) ==
+        Approx(sample_errors[0]).epsilon(1e-12));
+}
+
+TEST_CASE("Classifier accuracy is counted on the device", "[classify]") {
+  constexpr size_t kInputSize = 4;
+  constexpr size_t kClasses = 3;
+  // Not a multiple of the batch size, so the last batch is partial.
+  constexpr size_t kNumSamples = 37;
+  constexpr size_t kBatchSize = 8;
+  Architecture model(kInputSize);
+  model.AddDenseLayer(kClasses, symbolic::Identity);
+  Nnet test_net(model, Nnet::Xavier, MeanSquared);
+
+  stats::Normal initializer(0, 1);
+  std::vector<double> inputs(kNumSamples * kInputSize);
+  for (double &value : inputs) {
+    value = initializer.sample();
+  }
+  std::vector<double> labels(kNumSamples);
+  for (size_t sample = 0; sample < kNumSamples; ++sample) {
+    labels[sample] = (sample * 7) % kClasses;
+  }
+
+  // Predictions on the host.
+  std::unique_ptr<compute::ClBuffer> input_buffer = test_net.MakeBuffer(inputs);
+  std::unique_ptr<compute::ClBuffer> outputs =
+      test_net.BatchEvaluate(input_buffer, kNumSamples);
+  outputs->MoveToCpu();
+  std::vector<size_t> expected_confusion(kClasses * kClasses, 0);
+  size_t expected_correct = 0;
+  for (size_t sample = 0; sample < kNumSamples; ++sample) {
+    const double *output = outputs->data() + sample * kClasses;
+    const size_t predicted =
+        std::max_element(output, output + kClasses) - output;
+    const size_t actual = labels[sample];
+    expected_confusion[actual * kClasses + predicted]++;
+    expected_correct += (predicted == actual);
+  }
+
+  std::unique_ptr<compute::ClBuffer> label_buffer = test_net.MakeBuffer(labels);
+  const Nnet::ClassificationReport report = test_net.EvaluateClassifier(
+      input_buffer, label_buffer, kNumSamples, kBatchSize);
+  REQUIRE(report.samples == kNumSamples);
+  REQUIRE(report.classes == kClasses);
+  CHECK(report.confusion_matrix == expected_confusion);
+  CHECK(report.correct() == expected_correct);
+  CHECK(report.accuracy() ==
+        Approx(static_cast<double>(expected_correct) / kNumSamples));
+}
+
+TEST_CASE("Optimizers update weights on the device", "[optimizer]") {
+  Architecture model(4);
+  model.AddDenseLayer(3, symbolic::Sigmoid)
+      .AddDenseLayer(2, symbolic::Identity);
+  Nnet reference_net(model, Nnet::Xavier, MeanSquared);
+  Nnet test_net(model, Nnet::NoWeightInit, MeanSquared);
+  std::vector<double> initial_weights;
+  for (size_t l = 0; l < reference_net.number_of_layers(); ++l) {
+    const size_t layer_size = reference_net.layer(l).weight_buffer().size();
+    for (size_t i = 0; i < layer_size; ++i) {
+      initial_weights.push_back(reference_net.GetWeight(l, i));
+      test_net.GetWeight(l, i) = initial_weights.back();
+    }
+  }
+  // Weights of a network, in the order of initial_weights.
+  auto weights_of = [](Nnet &net) {
+    std::vector<double> weights;
+    for (size_t l = 0; l < net.number_of_layers(); ++l) {
+      const size_t layer_size = net.layer(l).weight_buffer().size();
+      for (size_t i = 0; i < layer_size; ++i) {
+        weights.push_back(net.GetWeight(l, i));
+      }
+    }
+    return weights;
+  };
+
+  std::unique_ptr<compute::ClBuffer> input =
+      reference_net.MakeBuffer({0.5, -1.0, 0.25, 2.0});
+  std::unique_ptr<compute::ClBuffer> expected =
+      reference_net.MakeBuffer({1.0, -1.0});
+  std::unique_ptr<compute::ClBuffer> test_input =
+      test_net.MakeBuffer({0.5, -1.0, 0.25, 2.0});
+  std::unique_ptr<compute::ClBuffer> test_expected =
+      test_net.MakeBuffer({1.0, -1.0});
+
+  // With a learning rate of 1, an SGD step subtracts the gradient.
+  reference_net.SetLearningParameters({.learning_rate = 1.0});
+  reference_net.Train(input, expected);
+  std::vector<double> gradients = weights_of(reference_net);
+  for (size_t i = 0; i < gradients.size(); ++i) {
+    gradients[i] = initial_weights[i] - gradients[i];
+  }
+
+  constexpr double kLearningRate = 0.01;
+  SECTION("Momentum accumulates a velocity") {
+    Nnet::LearningParameters params{.learning_rate = kLearningRate};
+    params.optimizer = Nnet::Momentum;
+    params.momentum = 0.5;
+    test_net.SetLearningParameters(params);
+    // Layer 1 is the first dense layer.
+    REQUIRE(test_net.layer(1).optimizer_state().size() == 1);
+    // The first step is an SGD step.
+    test_net.Train(test_input, test_expected);
+    const std::vector<double> first_step = weights_of(test_net);
+    for (size_t i = 0; i < gradients.size(); ++i) {
+      CAPTURE(i);
+      CHECK(first_step[i] ==
+            Approx(initial_weights[i] - kLearningRate * gradients[i])
+                .margin(1e-12));
+    }
+    // The second one adds half of the first.
+    Nnet sgd_net(model, Nnet::NoWeightInit, MeanSquared);
+    for (size_t l = 0, w = 0; l < sgd_net.number_of_layers(); ++l) {
+      const size_t layer_size = sgd_net.layer(l).weight_buffer().size();
+      for (size_t i = 0; i < layer_size; ++i, ++w) {
+        sgd_net.GetWeight(l, i) = first_step[w];
+      }
+    }
+    sgd_net.SetLearningParameters({.learning_rate = kLearningRate});
+    std::unique_ptr<compute::ClBuffer> sgd_input =
+        sgd_net.MakeBuffer({0.5, -1.0, 0.25, 2.0});
+    std::unique_ptr<compute::ClBuffer> sgd_expected =
+        sgd_net.MakeBuffer({1.0, -1.0});
+    sgd_net.Train(sgd_input, sgd_expected);
+    test_net.Train(test_input, test_expected);
+    const std::vector<double> sgd_step = weights_of(sgd_net);
+    const std::vector<double> second_step = weights_of(test_net);
+    for (size_t i = 0; i < gradients.size(); ++i) {
+      CAPTURE(i);
+      CHECK(second_step[i] ==
+            Approx(sgd_step[i] + 0.5 * (first_step[i] - initial_weights[i]))
+                .margin(1e-12));
+    }
+  }
+
+  SECTION("RMSProp and Adam normalize the first step") {
+    Nnet::LearningParameters params{.learning_rate = kLearningRate};
+    params.optimizer = Nnet::RMSProp;
+    params.rho = 0.75;
+    // After one RMSProp step, each weight moves by learning_rate /
+    // sqrt(1 - rho). Adam's bias correction makes it learning_rate.
+    double step_size = kLearningRate / std::sqrt(1 - params.rho);
+    size_t state_buffers = 1;
+    SECTION("Adam") {
+      params.optimizer = Nnet::Adam;
+      step_size = kLearningRate;
+      state_buffers = 2;
+    }
+    test_net.SetLearningParameters(params);
+    REQUIRE(test_net.layer(1).optimizer_state().size() == state_buffers);
+    test_net.Train(test_input, test_expected);
+    const std::vector<double> weights = weights_of(test_net);
+    for (size_t i = 0; i < gradients.size(); ++i) {
+      if (std::abs(gradients[i]) < 1e-3) {
+        // Epsilon dominates.
+        continue;
+      }
+      CAPTURE(i);
+      const double direction = (gradients[i] > 0) ? -1.0 : 1.0;
+      CHECK(weights[i] - initial_weights[i] ==
+            Approx(direction * step_size).epsilon(1e-3));
+    }
+
+    // Switching back to SGD drops the state.
+    test_net.SetLearningParameters({.learning_rate = kLearningRate});
+    CHECK(test_net.layer(1).optimizer_state().empty());
+  }
 }
 
 }  // namespace nnet
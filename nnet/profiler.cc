@@ -0,0 +1,232 @@
+#include "nnet/profiler.h"
+
+#include "compute/cl_buffer.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+
+namespace nnet {
+
+namespace {
+
+// Pending commands are collected once there are this many, so that a long run
+// which never reads the results back doesn't hold on to every event.
+constexpr size_t kCollectThreshold = 4096;
+
+// Nanoseconds to the microseconds of the trace event format.
+double Microseconds(uint64_t nanoseconds) { return nanoseconds * 1e-3; }
+
+void WriteJsonString(std::ostream &out, const std::string &value) {
+  out << '"';
+  for (char c : value) {
+    if (c == '"' || c == '\\') {
+      out << '\\';
+    }
+    out << c;
+  }
+  out << '"';
+}
+
+}  // namespace
+
+Profiler::Profiler(const Options &options) : options_(options) {
+  if (options_.sample_every == 0) {
+    std::cerr << "Profiler::Options::sample_every must be at least 1."
+              << std::endl;
+    std::exit(1);
+  }
+}
+
+void Profiler::BeginSegment() {
+  sampling_ = (segments_ % options_.sample_every) == 0;
+  ++segments_;
+  if (sampling_) {
+    ++sampled_segments_;
+  }
+}
+
+void Profiler::RecordKernel(const cl::Event &event, const std::string &name) {
+  pending_.push_back({event, name, false});
+  if (pending_.size() >= kCollectThreshold) {
+    Collect();
+  }
+}
+
+void Profiler::RecordTransfer(const cl::Event &event,
+                              const std::string &name) {
+  pending_.push_back({event, name, true});
+  if (pending_.size() >= kCollectThreshold) {
+    Collect();
+  }
+}
+
+void Profiler::AddRecord(const Record &record) {
+  Stats &stats = stats_[record.layer][record.kind];
+  ++stats.commands;
+  stats.run_seconds += (record.ended - record.started) * 1e-9;
+  stats.wait_seconds += (record.started - record.queued) * 1e-9;
+  if (records_.size() < options_.max_trace_records) {
+    records_.push_back(record);
+  }
+}
+
+const std::vector<Profiler::Record> &Profiler::records() {
+  Collect();
+  return records_;
+}
+
+std::map<int, std::map<std::string, Profiler::Stats>> Profiler::LayerStats() {
+  Collect();
+  return stats_;
+}
+
+void Profiler::WriteSummary(std::ostream &out) {
+  out << std::left << std::setw(8) << "layer" << std::setw(24) << "kind"
+      << std::right << std::setw(10) << "commands" << std::setw(12)
+      << "run (ms)" << std::setw(12) << "wait (ms)" << std::endl;
+  out << std::fixed << std::setprecision(3);
+  for (const auto &layer : LayerStats()) {
+    for (const auto &kind : layer.second) {
+      out << std::left << std::setw(8)
+          << ((layer.first < 0) ? std::string("-")
+                                : std::to_string(layer.first))
+          << std::setw(24) << kind.first << std::right << std::setw(10)
+          << kind.second.commands << std::setw(12)
+          << kind.second.run_seconds * 1e3 << std::setw(12)
+          << kind.second.wait_seconds * 1e3 << std::endl;
+    }
+  }
+}
+
+void Profiler::WriteChromeTrace(std::ostream &out) {
+  Collect();
+  std::vector<const Record *> sorted;
+  uint64_t origin = UINT64_MAX;
+  for (const Record &record : records_) {
+    sorted.push_back(&record);
+    origin = std::min(origin, record.queued);
+  }
+  std::sort(sorted.begin(), sorted.end(),
+            [](const Record *a, const Record *b) {
+              return a->started < b->started;
+            });
+
+  // Each command goes on the first row which is free by the time it starts.
+  std::vector<uint64_t> row_ends;
+  out << std::fixed << std::setprecision(3);
+  out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+  bool first = true;
+  for (const Record *record : sorted) {
+    size_t row = 0;
+    while (row < row_ends.size() && row_ends[row] > record->started) {
+      ++row;
+    }
+    if (row == row_ends.size()) {
+      row_ends.push_back(0);
+    }
+    row_ends[row] = record->ended;
+
+    out << (first ? "\n" : ",\n");
+    first = false;
+    out << "{\"name\":";
+    WriteJsonString(out, record->name);
+    out << ",\"cat\":";
+    WriteJsonString(out, record->kind);
+    out << ",\"ph\":\"X\",\"pid\":0,\"tid\":" << row
+        << ",\"ts\":" << Microseconds(record->started - origin)
+        << ",\"dur\":" << Microseconds(record->ended - record->started)
+        << ",\"args\":{\"layer\":" << record->layer
+        << ",\"queued_us\":" << Microseconds(record->queued - origin)
+        << ",\"submitted_us\":" << Microseconds(record->submitted - origin)
+        << "}}";
+  }
+  for (size_t row = 0; row < row_ends.size(); ++row) {
+    out << (first ? "\n" : ",\n");
+    first = false;
+    out << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":" << row
+        << ",\"args\":{\"name\":\"device " << row << "\"}}";
+  }
+  out << "\n]}\n";
+}
+
+bool Profiler::SaveChromeTrace(const std::string &path) {
+  std::ofstream out(path);
+  if (!out.is_open()) {
+    std::cerr << "Could not open " << path << " to write the trace."
+              << std::endl;
+    return false;
+  }
+  WriteChromeTrace(out);
+  return static_cast<bool>(out);
+}
+
+void Profiler::Clear() {
+  pending_.clear();
+  records_.clear();
+  stats_.clear();
+}
+
+std::string Profiler::Kind(const std::string &name, int *layer) {
+  *layer = -1;
+  const size_t separator = name.find_last_of('_');
+  if (separator == std::string::npos || separator + 1 == name.size() ||
+      !std::all_of(name.begin() + separator + 1, name.end(),
+                   [](char c) { return std::isdigit(c); })) {
+    return name;
+  }
+  for (const char *kind :
+       {"evaluate_int8", "evaluate", "quantize_input", "input_delta",
+        "weight_delta", "new_weights"}) {
+    const std::string prefix(kind);
+    if (name.compare(0, prefix.size(), prefix) == 0 &&
+        name[prefix.size()] == '_') {
+      *layer = std::stoi(name.substr(separator + 1));
+      return prefix;
+    }
+  }
+  return name;
+}
+
+void Profiler::Collect() {
+  std::vector<Pending> still_pending;
+  for (Pending &command : pending_) {
+    cl_int status = CL_COMPLETE;
+    CL_CHECK(
+        command.event.getInfo(CL_EVENT_COMMAND_EXECUTION_STATUS, &status));
+    if (status > CL_COMPLETE) {
+      still_pending.push_back(std::move(command));
+      continue;
+    }
+    if (status < 0) {
+      // The command failed, it has no timestamps.
+      continue;
+    }
+    Record record;
+    record.name = command.name;
+    if (command.transfer) {
+      record.kind = "transfer";
+    } else {
+      record.kind = Kind(command.name, &record.layer);
+    }
+    cl_ulong time = 0;
+    CL_CHECK(command.event.getProfilingInfo(CL_PROFILING_COMMAND_QUEUED,
+                                            &time));
+    record.queued = time;
+    CL_CHECK(command.event.getProfilingInfo(CL_PROFILING_COMMAND_SUBMIT,
+                                            &time));
+    record.submitted = time;
+    CL_CHECK(command.event.getProfilingInfo(CL_PROFILING_COMMAND_START,
+                                            &time));
+    record.started = time;
+    CL_CHECK(command.event.getProfilingInfo(CL_PROFILING_COMMAND_END, &time));
+    record.ended = time;
+    AddRecord(record);
+  }
+  pending_ = std::move(still_pending);
+}
+
+}  // namespace nnet
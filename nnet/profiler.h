@@ -0,0 +1,124 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include "clutil/util.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <ostream>
+#include <string>
+#include <vector>
+
+namespace nnet {
+
+// Device-side timing of the commands of a network (see
+// Nnet::EnableProfiling()). The network's queues are created with
+// CL_QUEUE_PROFILING_ENABLE, and the profiler keeps the event of each command
+// it samples. Their timestamps are only read once the commands have completed,
+// so profiling adds no synchronization.
+//
+// The device work of a network is enqueued in segments, one per call which
+// imports the network's queue into its EventGraph (an Evaluate(), the backward
+// pass of a training step, ...). Options::sample_every picks one segment in
+// that many, and the commands of the others are not recorded at all, which
+// makes it cheap enough to leave on.
+class Profiler {
+ public:
+  struct Options {
+    // Record the commands of one segment in every sample_every.
+    size_t sample_every = 1;
+    // The trace keeps the first max_trace_records records, later ones are only
+    // counted in LayerStats().
+    size_t max_trace_records = 100000;
+  };
+
+  // Timestamps from the device's clock, in nanoseconds. A command is queued
+  // by the host, submitted to the device once its dependencies are met, then
+  // runs from start to end.
+  struct Record {
+    std::string name;
+    // See Kind().
+    std::string kind;
+    // -1 for commands which don't belong to a layer.
+    int layer = -1;
+    uint64_t queued = 0;
+    uint64_t submitted = 0;
+    uint64_t started = 0;
+    uint64_t ended = 0;
+  };
+
+  struct Stats {
+    size_t commands = 0;
+    // Time the commands ran for.
+    double run_seconds = 0.0;
+    // Time between being queued and starting: waiting for other commands or
+    // for the device.
+    double wait_seconds = 0.0;
+  };
+
+  Profiler() {}
+  explicit Profiler(const Options &options);
+
+  // Starts a segment (see above), and decides whether it's sampled.
+  void BeginSegment();
+  // Whether the commands enqueued now should be recorded.
+  bool sampling() const { return sampling_; }
+
+  // Records a kernel, named after its function (see Kind()).
+  void RecordKernel(const cl::Event &event, const std::string &name);
+  // Records a copy or an upload, of kind "transfer".
+  void RecordTransfer(const cl::Event &event, const std::string &name);
+  // Adds a record whose times are already known.
+  void AddRecord(const Record &record);
+
+  // Records of the completed commands, up to Options::max_trace_records.
+  const std::vector<Record> &records();
+
+  // Statistics keyed on the layer index (-1 for other commands), then on the
+  // kind of command.
+  std::map<int, std::map<std::string, Stats>> LayerStats();
+  // LayerStats() as a table, one row per layer and kind.
+  void WriteSummary(std::ostream &out);
+
+  // Writes the records as a Chrome trace (the JSON trace event format, which
+  // chrome://tracing and Perfetto open). Commands which overlap on the device
+  // go on separate rows.
+  void WriteChromeTrace(std::ostream &out);
+  // Returns false if the file couldn't be written.
+  bool SaveChromeTrace(const std::string &path);
+
+  // Forgets every record.
+  void Clear();
+
+  size_t segments() const { return segments_; }
+  size_t sampled_segments() const { return sampled_segments_; }
+
+  // The kind of a kernel from its name: the kernels of layer i are named
+  // "<kind>_..._<i>", where the kind is one of "evaluate", "evaluate_int8",
+  // "quantize_input", "input_delta", "weight_delta" or "new_weights". Other
+  // kernels are their own kind. Sets *layer to i, or -1.
+  static std::string Kind(const std::string &name, int *layer);
+
+ private:
+  struct Pending {
+    cl::Event event;
+    std::string name;
+    bool transfer;
+  };
+
+  // Turns the completed pending commands into records.
+  void Collect();
+
+  Options options_;
+  bool sampling_ = false;
+  size_t segments_ = 0;
+  size_t sampled_segments_ = 0;
+  std::vector<Pending> pending_;
+  std::vector<Record> records_;
+  std::map<int, std::map<std::string, Stats>> stats_;
+};
+
+}  // namespace nnet
+
+#endif  // PROFILER_H
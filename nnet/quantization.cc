@@ -0,0 +1,67 @@
+#include "nnet/quantization.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <limits>
+
+namespace nnet {
+
+double QuantizationScale(double max_magnitude) {
+  return (max_magnitude > 0.0) ? max_magnitude / kQuantizedMax : 1.0;
+}
+
+int8_t QuantizeValue(double value, double scale) {
+  const double quantized = std::round(value / scale);
+  return static_cast<int8_t>(
+      std::min<double>(kQuantizedMax, std::max<double>(-kQuantizedMax,
+                                                       quantized)));
+}
+
+QuantizedWeights QuantizeWeights(const double *weights, size_t size,
+                                 size_t row_size, double max_input) {
+  if (row_size == 0 || size % row_size != 0) {
+    std::cerr << "QuantizeWeights: " << size
+              << " weights do not divide into rows of " << row_size << "."
+              << std::endl;
+    std::exit(1);
+  }
+  const size_t rows = size / row_size;
+
+  // The bias of each row isn't multiplied by an input, so it doesn't count
+  // towards the range of the weights.
+  double max_weight = 0.0;
+  for (size_t row = 0; row < rows; ++row) {
+    for (size_t i = 0; i + 1 < row_size; ++i) {
+      max_weight = std::max(max_weight, std::abs(weights[row * row_size + i]));
+    }
+  }
+
+  QuantizedWeights quantized;
+  quantized.weight_scale = QuantizationScale(max_weight);
+  quantized.input_scale = QuantizationScale(max_input);
+  quantized.weights.resize(size, 0);
+  quantized.biases.resize(rows);
+  const double bias_scale = quantized.weight_scale * quantized.input_scale;
+  for (size_t row = 0; row < rows; ++row) {
+    for (size_t i = 0; i + 1 < row_size; ++i) {
+      quantized.weights[row * row_size + i] =
+          QuantizeValue(weights[row * row_size + i], quantized.weight_scale);
+    }
+    const double bias =
+        std::round(weights[row * row_size + row_size - 1] / bias_scale);
+    quantized.biases[row] = static_cast<int32_t>(std::min<double>(
+        std::numeric_limits<int32_t>::max(),
+        std::max<double>(std::numeric_limits<int32_t>::min(), bias)));
+  }
+  return quantized;
+}
+
+void CalibrationRange::Observe(const double *values, size_t size) {
+  for (size_t i = 0; i < size; ++i) {
+    max_magnitude_ = std::max(max_magnitude_, std::abs(values[i]));
+  }
+}
+
+}  // namespace nnet
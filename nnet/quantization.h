@@ -0,0 +1,63 @@
+#ifndef QUANTIZATION_H
+#define QUANTIZATION_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace nnet {
+
+// Post-training int8 quantization (see Nnet::Quantize()).
+//
+// Values are quantized symmetrically: x ~= scale * q, with q in [-127, 127].
+// The weights of each quantized layer share one scale, as do its inputs. The
+// int8 kernels accumulate q_weight * q_input in an int32, add the bias (which
+// is quantized to an int32 at the scale of the products), and scale the sum
+// back to a real value before storing it.
+
+// The largest magnitude of a quantized value.
+constexpr int kQuantizedMax = 127;
+
+// The scale which maps [-max_magnitude, max_magnitude] onto the full int8
+// range. Returns 1 if max_magnitude is zero (everything quantizes to zero).
+double QuantizationScale(double max_magnitude);
+
+// Rounds value / scale to the nearest integer, saturating to [-127, 127].
+int8_t QuantizeValue(double value, double scale);
+
+// The int8 weights of a layer. Weights are laid out like the layer's own
+// weights: rows of row_size values, one per output channel, each of which
+// ends in the bias. The bias slots of weights are zero, the biases are in
+// biases (one per row).
+struct QuantizedWeights {
+  double weight_scale = 1.0;
+  double input_scale = 1.0;
+  std::vector<int8_t> weights;
+  std::vector<int32_t> biases;
+
+  // Bytes of device memory taken by the quantized layer.
+  size_t size_in_bytes() const {
+    return weights.size() * sizeof(int8_t) + biases.size() * sizeof(int32_t);
+  }
+};
+
+// Quantizes size weights (rows of row_size values, see above) of a layer
+// whose inputs were calibrated to lie within [-max_input, max_input]. Exits if
+// size is not a multiple of row_size.
+QuantizedWeights QuantizeWeights(const double *weights, size_t size,
+                                 size_t row_size, double max_input);
+
+// Tracks the largest input magnitude seen by a layer across calibration
+// batches.
+class CalibrationRange {
+ public:
+  void Observe(const double *values, size_t size);
+  double max_magnitude() const { return max_magnitude_; }
+
+ private:
+  double max_magnitude_ = 0.0;
+};
+
+}  // namespace nnet
+
+#endif  // QUANTIZATION_H
@@ -1,4 +1,6 @@
 #include "nnet/softmax_layer.h"
+#include "symbolic/cse.h"
+#include "symbolic/simplify.h"
 #include <memory>
 
 namespace nnet {
@@ -26,12 +28,15 @@ void SoftmaxLayer::GenerateOutputCode(const symbolic::Expression &index,
   symbolic::Expression max = AppendMaxCode(cg);
   symbolic::Expression retval = GenerateOutputSymbol(index, max);
 
-  cg->AppendLineOfCode("return " + retval.to_string() + cg->linesep());
+  cg->AppendLineOfCode("return " +
+                       symbolic::HoistCommonSubexpressions(
+                           symbolic::Simplify(retval), cg) +
+                       cg->linesep());
 }
 
 symbolic::Expression SoftmaxLayer::AppendMaxCode(codegen::Generator* cg) const {
   symbolic::Expression max = symbolic::Expression::CreateNumericValue("max");
-  cg->AppendLineOfCode(cg->assign("double max", "-INFINITY") + cg->linesep());
+  cg->AppendLineOfCode(cg->assign("number max", "-INFINITY") + cg->linesep());
 
   std::string check_max_expression =
       cg->if_expr(generator_.I("i") + " > " + max.to_string()) + " {\n\t " +
@@ -55,7 +60,10 @@ void SoftmaxLayer::InputGradientCode(const symbolic::Expression &input_index,
     symbolic::Expression kronecker = symbolic::KroneckerDelta(i, input_index);
     retval += ((output_i * (kronecker - output_k)) * Expression::CreateNumericValue(generator_.GRADIENT(i)));
   }
-  cg->AppendLineOfCode("return " + retval.to_string() + cg->linesep());
+  cg->AppendLineOfCode("return " +
+                       symbolic::HoistCommonSubexpressions(
+                           symbolic::Simplify(retval), cg) +
+                       cg->linesep());
 }
 
 void SoftmaxLayer::WeightGradientCode(const symbolic::Expression &weight_index,
@@ -236,8 +236,8 @@ public:
             size_t filter_offset = filter_no * filter_size;
             size_t index =
                 filter_offset + internal::Flatten3d(params.width, params.height,
-                                                    params.depth, x, y, z);
-            weights_[index] = W(filter_no, x, y, z).to_string();
+                                                    params.depth, y, x, z);
+            weights_[index] = W(filter_no, y, x, z).to_string();
           }
         }
       }
@@ -0,0 +1,232 @@
+#include "nnet/weight_file.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+namespace nnet {
+
+namespace {
+
+constexpr char kMagic[8] = {'P', 'L', 'W', 'E', 'I', 'G', 'H', 'T'};
+
+// Magic, version and array count.
+constexpr size_t kHeaderSize = sizeof(kMagic) + 2 * sizeof(uint32_t);
+
+// Name, layer index, type, offset, count and checksum.
+constexpr size_t kNameSize = kWeightFileMaxNameLength + 1;
+constexpr size_t kTableEntrySize =
+    kNameSize + 2 * sizeof(uint32_t) + 3 * sizeof(uint64_t);
+
+size_t AlignUp(size_t offset) {
+  return (offset + kWeightFileAlignment - 1) / kWeightFileAlignment *
+         kWeightFileAlignment;
+}
+
+template <typename T>
+void WriteValue(std::ofstream *out, T value) {
+  out->write(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+// Reads a value at *offset of the mapping and advances the offset. The caller
+// checks the bounds.
+template <typename T>
+T ReadValue(const char *mapping, size_t *offset) {
+  T value;
+  std::memcpy(&value, mapping + *offset, sizeof(value));
+  *offset += sizeof(value);
+  return value;
+}
+
+bool ValidType(uint32_t type) { return type <= WeightInt32; }
+
+}  // namespace
+
+size_t WeightTypeSize(WeightType type) {
+  switch (type) {
+    case WeightFloat64:
+      return sizeof(double);
+    case WeightFloat32:
+      return sizeof(float);
+    case WeightInt8:
+      return sizeof(int8_t);
+    case WeightInt32:
+      return sizeof(int32_t);
+    default:
+      std::cerr << "Unknown weight type: " << type << std::endl;
+      std::exit(1);
+  }
+}
+
+uint64_t WeightChecksum(const void *data, size_t size) {
+  constexpr uint64_t kFnvPrime = 1099511628211ULL;
+  const unsigned char *bytes = static_cast<const unsigned char *>(data);
+  uint64_t hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < size; ++i) {
+    hash ^= bytes[i];
+    hash *= kFnvPrime;
+  }
+  return hash;
+}
+
+bool WriteWeightFile(const std::string &path,
+                     const std::vector<WeightArray> &arrays) {
+  for (const WeightArray &array : arrays) {
+    if (array.name.size() > kWeightFileMaxNameLength) {
+      std::cerr << "Weight array name too long: " << array.name << std::endl;
+      return false;
+    }
+  }
+
+  // Write to a temporary file and rename it into place, so that a reader never
+  // observes a partially written file.
+  const std::string temporary_path =
+      path + ".tmp." + std::to_string(getpid());
+  {
+    std::ofstream out(temporary_path, std::ios::binary | std::ios::trunc);
+    if (!out.is_open()) {
+      std::cerr << "Could not write weight file " << temporary_path
+                << std::endl;
+      return false;
+    }
+    out.write(kMagic, sizeof(kMagic));
+    WriteValue(&out, kWeightFileVersion);
+    WriteValue<uint32_t>(&out, arrays.size());
+
+    size_t offset = AlignUp(kHeaderSize + arrays.size() * kTableEntrySize);
+    std::vector<size_t> offsets;
+    for (const WeightArray &array : arrays) {
+      const size_t bytes = array.count * WeightTypeSize(array.type);
+      // Empty arrays (of layers without weights) take no space in the file.
+      const size_t array_offset = (bytes > 0) ? offset : 0;
+      char name[kNameSize] = {};
+      std::copy(array.name.begin(), array.name.end(), name);
+      out.write(name, sizeof(name));
+      WriteValue<uint32_t>(&out, array.layer_index);
+      WriteValue<uint32_t>(&out, array.type);
+      WriteValue<uint64_t>(&out, array_offset);
+      WriteValue<uint64_t>(&out, array.count);
+      WriteValue<uint64_t>(&out, WeightChecksum(array.data, bytes));
+      offsets.push_back(array_offset);
+      offset = AlignUp(offset + bytes);
+    }
+
+    const std::vector<char> padding(kWeightFileAlignment, 0);
+    for (size_t i = 0; i < arrays.size(); ++i) {
+      if (arrays[i].count == 0) {
+        continue;
+      }
+      const size_t position = out.tellp();
+      out.write(padding.data(), offsets[i] - position);
+      out.write(static_cast<const char *>(arrays[i].data),
+                arrays[i].count * WeightTypeSize(arrays[i].type));
+    }
+    if (!out) {
+      std::cerr << "Could not write weight file " << temporary_path
+                << std::endl;
+      std::remove(temporary_path.c_str());
+      return false;
+    }
+  }
+  if (std::rename(temporary_path.c_str(), path.c_str()) != 0) {
+    std::cerr << "Could not rename " << temporary_path << " to " << path
+              << std::endl;
+    std::remove(temporary_path.c_str());
+    return false;
+  }
+  return true;
+}
+
+std::unique_ptr<MappedWeightFile> MappedWeightFile::Open(
+    const std::string &path) {
+  const int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    std::cerr << "Could not open weight file " << path << std::endl;
+    return nullptr;
+  }
+  struct stat status;
+  if (fstat(fd, &status) != 0 ||
+      static_cast<size_t>(status.st_size) < kHeaderSize) {
+    std::cerr << "Weight file " << path << " is truncated." << std::endl;
+    close(fd);
+    return nullptr;
+  }
+  const size_t size = status.st_size;
+  void *mapping =
+      mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  // The mapping stays valid after the descriptor is closed.
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    std::cerr << "Could not map weight file " << path << std::endl;
+    return nullptr;
+  }
+  std::unique_ptr<MappedWeightFile> file(new MappedWeightFile(mapping, size));
+  const char *bytes = static_cast<const char *>(mapping);
+
+  size_t offset = 0;
+  if (!std::equal(kMagic, kMagic + sizeof(kMagic), bytes)) {
+    std::cerr << path << " is not a weight file." << std::endl;
+    return nullptr;
+  }
+  offset += sizeof(kMagic);
+  const uint32_t version = ReadValue<uint32_t>(bytes, &offset);
+  if (version != kWeightFileVersion) {
+    std::cerr << "Weight file format mismatch! " << version
+              << " != (expected) " << kWeightFileVersion << std::endl;
+    return nullptr;
+  }
+  const uint32_t array_count = ReadValue<uint32_t>(bytes, &offset);
+  if (array_count > (size - kHeaderSize) / kTableEntrySize) {
+    std::cerr << "Weight file " << path << " is truncated." << std::endl;
+    return nullptr;
+  }
+
+  for (uint32_t i = 0; i < array_count; ++i) {
+    const char *name = bytes + offset;
+    offset += kNameSize;
+    const uint32_t layer_index = ReadValue<uint32_t>(bytes, &offset);
+    const uint32_t type = ReadValue<uint32_t>(bytes, &offset);
+    const uint64_t array_offset = ReadValue<uint64_t>(bytes, &offset);
+    const uint64_t count = ReadValue<uint64_t>(bytes, &offset);
+    const uint64_t checksum = ReadValue<uint64_t>(bytes, &offset);
+    if (name[kNameSize - 1] != '\0' || !ValidType(type) ||
+        array_offset % kWeightFileAlignment != 0 || array_offset > size ||
+        count > (size - array_offset) /
+                    WeightTypeSize(static_cast<WeightType>(type))) {
+      std::cerr << "Weight file " << path << " has a corrupt table entry ("
+                << i << ")." << std::endl;
+      return nullptr;
+    }
+    WeightArray array{name, layer_index, static_cast<WeightType>(type),
+                      bytes + array_offset, count};
+    if (WeightChecksum(array.data, count * WeightTypeSize(array.type)) !=
+        checksum) {
+      std::cerr << "Checksum mismatch in weight file " << path
+                << " for array " << array.name << std::endl;
+      return nullptr;
+    }
+    file->arrays_.push_back(std::move(array));
+  }
+  return file;
+}
+
+MappedWeightFile::~MappedWeightFile() { munmap(mapping_, size_); }
+
+const WeightArray *MappedWeightFile::Find(const std::string &name) const {
+  for (const WeightArray &array : arrays_) {
+    if (array.name == name) {
+      return &array;
+    }
+  }
+  return nullptr;
+}
+
+}  // namespace nnet
@@ -0,0 +1,92 @@
+#ifndef WEIGHT_FILE_H
+#define WEIGHT_FILE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace nnet {
+
+// A compact binary container for network weights (see
+// Nnet::SaveWeightsToFile()), which loads without any parsing.
+//
+// The file starts with a header (magic, format version and array count),
+// followed by a table with one entry per array: its name, layer index, type,
+// offset, number of values and FNV-1a checksum. The raw arrays follow the
+// table, each starting on a multiple of kWeightFileAlignment bytes (empty
+// arrays take no space and have offset 0). Values are stored in host byte
+// order.
+//
+// Files are read through mmap, so arrays can be copied straight from the page
+// cache, or handed to OpenCL as host pointers (CL_MEM_USE_HOST_PTR, which
+// wants page-aligned memory) without any copy at all.
+
+// Bump whenever the layout changes.
+constexpr uint32_t kWeightFileVersion = 1;
+
+constexpr size_t kWeightFileAlignment = 4096;
+
+// Names longer than this are rejected when writing.
+constexpr size_t kWeightFileMaxNameLength = 63;
+
+enum WeightType : uint32_t {
+  WeightFloat64 = 0,
+  WeightFloat32,
+  WeightInt8,
+  WeightInt32,
+};
+
+// Size in bytes of a value of the given type.
+size_t WeightTypeSize(WeightType type);
+
+// A named array of values. data points at count values of the given type.
+struct WeightArray {
+  std::string name;
+  uint32_t layer_index;
+  WeightType type;
+  const void *data;
+  size_t count;
+};
+
+// Writes arrays to path (atomically, through a temporary file). Returns false
+// (after logging) on failure.
+bool WriteWeightFile(const std::string &path,
+                     const std::vector<WeightArray> &arrays);
+
+// A weight file mapped into memory. The data of its arrays points into the
+// mapping, which lives as long as this object. The mapping is private and
+// writable: writes through the array pointers (by an OpenCL device using them
+// as host memory, for instance) never reach the file.
+class MappedWeightFile {
+ public:
+  // Maps the file at path and validates its header, table and checksums.
+  // Returns null (after logging why) if the file can't be read or is corrupt.
+  static std::unique_ptr<MappedWeightFile> Open(const std::string &path);
+
+  ~MappedWeightFile();
+
+  MappedWeightFile(const MappedWeightFile &) = delete;
+  MappedWeightFile &operator=(const MappedWeightFile &) = delete;
+
+  const std::vector<WeightArray> &arrays() const { return arrays_; }
+
+  // Returns null if there is no array with this name.
+  const WeightArray *Find(const std::string &name) const;
+
+ private:
+  MappedWeightFile(void *mapping, size_t size)
+      : mapping_(mapping), size_(size) {}
+
+  void *mapping_;
+  size_t size_;
+  std::vector<WeightArray> arrays_;
+};
+
+// 64-bit FNV-1a of size bytes.
+uint64_t WeightChecksum(const void *data, size_t size);
+
+}  // namespace nnet
+
+#endif  // WEIGHT_FILE_H
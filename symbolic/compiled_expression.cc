@@ -0,0 +1,328 @@
+#include "symbolic/compiled_expression.h"
+
+#include "symbolic/integer.h"
+#include "symbolic/numeric_value.h"
+
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <limits>
+
+namespace symbolic {
+
+namespace {
+
+bool Truthy(double value) {
+  return fabs(value) > std::numeric_limits<double>::epsilon();
+}
+
+}  // namespace
+
+// Emits the instructions of each node after those of its children. A node's
+// register is released after its last use, so the number of registers is
+// about the width of the DAG rather than its size.
+class CompiledExpression::Compiler {
+ public:
+  Compiler(const std::vector<std::string>& variables,
+           CompiledExpression* program)
+      : program_(program) {
+    for (size_t i = 0; i < variables.size(); ++i) {
+      variables_.emplace(variables[i], i);
+    }
+  }
+
+  void Compile(const Expression& expression) {
+    CountUses(expression.GetPointer().get());
+    program_->result_ = Emit(expression.GetPointer().get());
+  }
+
+ private:
+  struct NodeState {
+    // Parents which haven't been emitted yet.
+    size_t uses = 0;
+    uint32_t reg = 0;
+    bool emitted = false;
+    // Whether Evaluate() gives the node an Integer value.
+    bool integer = false;
+  };
+
+  void CountUses(const ExpressionNode* node) {
+    if (node == nullptr) {
+      std::cerr << "Cannot compile an expression without a value (such as the "
+                   "derivative of a comparison)."
+                << std::endl;
+      std::exit(1);
+    }
+    if (nodes_.count(node) != 0) {
+      return;
+    }
+    nodes_[node];
+    for (const ExpressionNode* child : node->key().children) {
+      CountUses(child);
+      ++nodes_.at(child).uses;
+    }
+  }
+
+  uint32_t Allocate() {
+    if (!free_.empty()) {
+      uint32_t reg = free_.back();
+      free_.pop_back();
+      return reg;
+    }
+    return static_cast<uint32_t>(program_->registers_++);
+  }
+
+  void Release(const ExpressionNode* child) {
+    NodeState& state = nodes_.at(child);
+    if (--state.uses == 0) {
+      free_.push_back(state.reg);
+    }
+  }
+
+  void Append(Opcode op, uint32_t out, uint32_t a = 0, uint32_t b = 0,
+              uint32_t c = 0, double constant = 0) {
+    Instruction instruction;
+    instruction.op = op;
+    instruction.out = out;
+    instruction.a = a;
+    instruction.b = b;
+    instruction.c = c;
+    instruction.constant = constant;
+    program_->code_.push_back(instruction);
+  }
+
+  static void RejectComplex(double imag, const ExpressionNode* node) {
+    if (imag != 0) {
+      std::cerr << "CompiledExpression only supports real values, got "
+                << node->to_string() << std::endl;
+      std::exit(1);
+    }
+  }
+
+  uint32_t Emit(const ExpressionNode* node) {
+    NodeState& existing = nodes_.at(node);
+    if (existing.emitted) {
+      return existing.reg;
+    }
+
+    if (auto value = dynamic_cast<const NumericValue*>(node)) {
+      return EmitLeaf(node, *value);
+    }
+
+    std::vector<const ExpressionNode*> children = node->key().children;
+    std::vector<uint32_t> operands;
+    std::vector<bool> integer;
+    for (const ExpressionNode* child : children) {
+      operands.push_back(Emit(child));
+      integer.push_back(nodes_.at(child).integer);
+    }
+    auto compound = dynamic_cast<const CompoundExpression*>(node);
+    // A single operand still goes through reduce(), with the default tail 0.
+    if (compound && compound->is_end()) {
+      const uint32_t zero = Allocate();
+      Append(Opcode::kConstant, zero, 0, 0, 0, 0.0);
+      operands.push_back(zero);
+      integer.push_back(false);
+      free_.push_back(zero);
+    }
+    // Operands may share the output register, instructions read all their
+    // operands before writing.
+    for (const ExpressionNode* child : children) {
+      Release(child);
+    }
+    const uint32_t out = Allocate();
+    bool result_integer = false;
+    // Whether an Integer result may have a fractional part.
+    bool truncate = false;
+
+    if (compound) {
+      if (dynamic_cast<const AndExpression*>(node)) {
+        Append(Opcode::kAnd, out, operands[0], operands[1]);
+      } else {
+        const bool is_sum =
+            dynamic_cast<const AdditionExpression*>(node) != nullptr;
+        Append(is_sum ? Opcode::kAdd : Opcode::kMultiply, out, operands[0],
+               operands[1]);
+        // reduce() keeps the type of the head.
+        result_integer = integer[0];
+        truncate = integer[0] && !integer[1];
+      }
+    } else if (dynamic_cast<const DivisionExpression*>(node)) {
+      Append(Opcode::kDivide, out, operands[0], operands[1]);
+      result_integer = integer[0];
+      truncate = integer[0];
+    } else if (dynamic_cast<const ModulusExpression*>(node)) {
+      Append(Opcode::kModulus, out, operands[0], operands[1]);
+      result_integer = integer[0];
+    } else if (dynamic_cast<const IfExpression*>(node)) {
+      Append(Opcode::kSelect, out, operands[0], operands[1], operands[2]);
+      // Each branch already has its own type.
+      result_integer = integer[1] && integer[2];
+    } else if (dynamic_cast<const GteExpression*>(node)) {
+      Append(Opcode::kGte, out, operands[0], operands[1]);
+      result_integer = true;
+    } else if (dynamic_cast<const EqExpression*>(node)) {
+      Append(Opcode::kEq, out, operands[0], operands[1]);
+      result_integer = true;
+    } else if (dynamic_cast<const NotExpression*>(node)) {
+      Append(Opcode::kNot, out, operands[0]);
+      result_integer = true;
+    } else if (auto exponent = dynamic_cast<const ExponentExpression*>(node)) {
+      RejectComplex(exponent->base().imag(), node);
+      // Evaluate() raises the squared norm of the base to half the exponent.
+      Append(Opcode::kPow, out, operands[0], 0, 0,
+             exponent->base().real() * exponent->base().real());
+      result_integer = integer[0];
+      truncate = integer[0];
+    } else if (auto log = dynamic_cast<const LogExpression*>(node)) {
+      RejectComplex(log->base().imag(), node);
+      Append(Opcode::kLog, out, operands[0], 0, 0,
+             std::log(log->base().real()));
+      result_integer = integer[0];
+      truncate = integer[0];
+    } else {
+      std::cerr << "CompiledExpression cannot compile " << node->to_string()
+                << std::endl;
+      std::exit(1);
+    }
+    if (truncate) {
+      Append(Opcode::kTruncate, out, out);
+    }
+
+    NodeState& state = nodes_.at(node);
+    state.reg = out;
+    state.emitted = true;
+    state.integer = result_integer;
+    return out;
+  }
+
+  uint32_t EmitLeaf(const ExpressionNode* node, const NumericValue& value) {
+    const uint32_t out = Allocate();
+    NodeState& state = nodes_.at(node);
+    if (value.is_bound()) {
+      RejectComplex(value.imag(), node);
+      // Integer::real() is already truncated.
+      Append(Opcode::kConstant, out, 0, 0, 0, value.real());
+      state.integer = dynamic_cast<const Integer*>(node) != nullptr;
+    } else {
+      const std::string name = node->to_string();
+      auto variable = variables_.find(name);
+      if (variable == variables_.end()) {
+        std::cerr << "CompiledExpression: variable " << name
+                  << " isn't in the list of variables." << std::endl;
+        std::exit(1);
+      }
+      Append(Opcode::kVariable, out, static_cast<uint32_t>(variable->second));
+      // Bind() replaces variables with the NumericValue they're bound to.
+      state.integer = false;
+    }
+    state.reg = out;
+    state.emitted = true;
+    return out;
+  }
+
+  CompiledExpression* program_;
+  std::unordered_map<std::string, size_t> variables_;
+  std::unordered_map<const ExpressionNode*, NodeState> nodes_;
+  std::vector<uint32_t> free_;
+};
+
+CompiledExpression::CompiledExpression(
+    const Expression& expression, const std::vector<std::string>& variables) {
+  Compiler(variables, this).Compile(expression);
+}
+
+double CompiledExpression::Evaluate(const double* values,
+                                    double* registers) const {
+  double* r = registers;
+  for (const Instruction& instruction : code_) {
+    const uint32_t a = instruction.a;
+    const uint32_t b = instruction.b;
+    switch (instruction.op) {
+      case Opcode::kConstant:
+        r[instruction.out] = instruction.constant;
+        break;
+      case Opcode::kVariable:
+        r[instruction.out] = values[a];
+        break;
+      case Opcode::kAdd:
+        r[instruction.out] = r[a] + r[b];
+        break;
+      case Opcode::kMultiply:
+        r[instruction.out] = r[a] * r[b];
+        break;
+      case Opcode::kDivide:
+        r[instruction.out] = r[a] / r[b];
+        break;
+      case Opcode::kModulus:
+        r[instruction.out] =
+            (static_cast<int>(r[b]) == 0)
+                ? std::numeric_limits<double>::quiet_NaN()
+                : static_cast<int>(r[a]) % static_cast<int>(r[b]);
+        break;
+      case Opcode::kTruncate:
+        r[instruction.out] = std::trunc(r[a]);
+        break;
+      case Opcode::kGte:
+        r[instruction.out] = (r[a] >= r[b]) ? 1.0 : 0.0;
+        break;
+      case Opcode::kEq:
+        r[instruction.out] = (r[a] == r[b]) ? 1.0 : 0.0;
+        break;
+      case Opcode::kNot:
+        r[instruction.out] = Truthy(r[a]) ? 0.0 : 1.0;
+        break;
+      case Opcode::kAnd:
+        r[instruction.out] = (Truthy(r[a]) && Truthy(r[b])) ? 1.0 : 0.0;
+        break;
+      case Opcode::kSelect:
+        r[instruction.out] = Truthy(r[a]) ? r[b] : r[instruction.c];
+        break;
+      case Opcode::kPow:
+        r[instruction.out] = std::pow(instruction.constant, r[a] / 2);
+        break;
+      case Opcode::kLog:
+        r[instruction.out] = std::log(r[a]) / instruction.constant;
+        break;
+    }
+  }
+  return r[result_];
+}
+
+// ExpressionEvaluator Implementation.
+
+ExpressionEvaluator::ExpressionEvaluator(std::vector<std::string> variables)
+    : variables_(std::move(variables)), values_(variables_.size(), 0.0) {
+  for (size_t i = 0; i < variables_.size(); ++i) {
+    indices_.emplace(variables_[i], i);
+  }
+}
+
+size_t ExpressionEvaluator::index(const std::string& variable) const {
+  auto index = indices_.find(variable);
+  if (index == indices_.end()) {
+    std::cerr << "ExpressionEvaluator has no variable " << variable
+              << std::endl;
+    std::exit(1);
+  }
+  return index->second;
+}
+
+double ExpressionEvaluator::Evaluate(const Expression& expression) {
+  const ExpressionNode* root = expression.GetPointer().get();
+  auto program = programs_.find(root);
+  if (program == programs_.end()) {
+    program =
+        programs_
+            .emplace(root, std::make_pair(expression, CompiledExpression(
+                                                          expression,
+                                                          variables_)))
+            .first;
+    if (registers_.size() < program->second.second.registers()) {
+      registers_.resize(program->second.second.registers());
+    }
+  }
+  return program->second.second.Evaluate(values_.data(), registers_.data());
+}
+
+}  // namespace symbolic
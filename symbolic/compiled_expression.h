@@ -0,0 +1,131 @@
+#ifndef COMPILED_EXPRESSION_H
+#define COMPILED_EXPRESSION_H
+
+#include "symbolic/expression.h"
+#include "symbolic/expression_node.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace symbolic {
+
+// An Expression lowered to a flat program for a register machine, for
+// expressions which are evaluated many times with different values of their
+// variables. Bind() and Evaluate() copy the tree and allocate a value per
+// node on every evaluation, while Evaluate() here runs one instruction per
+// (distinct) node over an array of doubles and allocates nothing:
+//
+//   CompiledExpression program(x * x + t, {"x", "t"});
+//   std::vector<double> registers(program.registers());
+//   double values[] = {2.0, 0.5};
+//   program.Evaluate(values, registers.data());  // 4.5
+//
+// The result is that of Bind() and Evaluate(), including the truncation of
+// Integer subexpressions, for real values. Expressions with complex constants
+// aren't supported. Where Evaluate() fails (division by zero, log of a
+// negative number, ...) the result is inf or NaN instead.
+class CompiledExpression {
+ public:
+  CompiledExpression() {}
+
+  // Compiles expression. Every variable of expression must be in variables,
+  // whose order is that of the values passed to Evaluate().
+  CompiledExpression(const Expression& expression,
+                     const std::vector<std::string>& variables);
+
+  // The number of doubles of scratch space Evaluate() needs.
+  size_t registers() const { return registers_; }
+  size_t instructions() const { return code_.size(); }
+
+  // values[i] is the value of variables[i]. registers must hold at least
+  // registers() doubles.
+  double Evaluate(const double* values, double* registers) const;
+
+ private:
+  enum class Opcode : uint8_t {
+    kConstant,
+    kVariable,
+    kAdd,
+    kMultiply,
+    kDivide,
+    kModulus,
+    kTruncate,
+    kGte,
+    kEq,
+    kNot,
+    kAnd,
+    kSelect,
+    kPow,
+    kLog,
+  };
+
+  // out = op(a, b, c). kConstant, kPow and kLog also use constant, and
+  // kVariable reads values[a].
+  struct Instruction {
+    Opcode op;
+    uint32_t out = 0;
+    uint32_t a = 0;
+    uint32_t b = 0;
+    uint32_t c = 0;
+    double constant = 0;
+  };
+
+  class Compiler;
+
+  std::vector<Instruction> code_;
+  size_t registers_ = 0;
+  uint32_t result_ = 0;
+};
+
+// Evaluates many expressions over the same variables, compiling each one the
+// first time it's evaluated. Meant for matrices of expressions which are
+// evaluated at every step of a filter:
+//
+//   ExpressionEvaluator evaluator({"t"});
+//   evaluator.set("t", dt);
+//   Matrix<2, 2, double> transition = transition_.Map(evaluator.AsFunction());
+//
+// After the first evaluation of each expression, evaluating it allocates
+// nothing. Not thread-safe.
+class ExpressionEvaluator {
+ public:
+  explicit ExpressionEvaluator(std::vector<std::string> variables);
+
+  // The index of a variable, to set() it without looking up its name.
+  size_t index(const std::string& variable) const;
+  void set(size_t index, double value) { values_[index] = value; }
+  void set(const std::string& variable, double value) {
+    values_[index(variable)] = value;
+  }
+
+  double Evaluate(const Expression& expression);
+  double operator()(const Expression& expression) {
+    return Evaluate(expression);
+  }
+
+  // For Matrix<Expression>::Map(). The function refers to this evaluator, and
+  // uses the values set at the time it's called.
+  std::function<double(const Expression&)> AsFunction() {
+    return std::ref(*this);
+  }
+
+ private:
+  std::vector<std::string> variables_;
+  std::unordered_map<std::string, size_t> indices_;
+  std::vector<double> values_;
+  std::vector<double> registers_;
+  // Keyed on the expression's (interned) root. The Expression keeps the node
+  // alive, so its address isn't reused by another node.
+  std::unordered_map<const ExpressionNode*,
+                     std::pair<Expression, CompiledExpression>>
+      programs_;
+};
+
+}  // namespace symbolic
+
+#endif /* COMPILED_EXPRESSION_H */
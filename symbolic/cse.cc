@@ -0,0 +1,98 @@
+#include "symbolic/cse.h"
+
+#include "symbolic/numeric_value.h"
+#include "symbolic/simplify.h"
+
+#include <unordered_map>
+#include <vector>
+
+namespace symbolic {
+
+namespace {
+
+struct NodeInfo {
+  std::vector<const ExpressionNode*> children;
+  // Number of parents, counting a parent which uses the node twice as two.
+  size_t uses = 0;
+  // Whether the node is evaluated every time the expression is.
+  bool unconditional = false;
+  bool integral = false;
+};
+
+using NodeInfos = std::unordered_map<const ExpressionNode*, NodeInfo>;
+
+bool IsLeaf(const ExpressionNode* node) {
+  return dynamic_cast<const NumericValue*>(node) != nullptr;
+}
+
+// Fills in infos for node and the nodes below it, and appends them to
+// post_order after their children.
+void Visit(const ExpressionNode* node, NodeInfos* infos,
+           std::vector<const ExpressionNode*>* post_order) {
+  if (infos->count(node) != 0) {
+    return;
+  }
+  std::vector<const ExpressionNode*> children = node->key().children;
+  (*infos)[node];
+  for (const ExpressionNode* child : children) {
+    Visit(child, infos, post_order);
+    ++infos->at(child).uses;
+  }
+  std::vector<bool> integral_children;
+  for (const ExpressionNode* child : children) {
+    integral_children.push_back(infos->at(child).integral);
+  }
+  NodeInfo& info = infos->at(node);
+  info.integral = HasIntegerType(node, integral_children);
+  info.children = std::move(children);
+  post_order->push_back(node);
+}
+
+void MarkUnconditional(const ExpressionNode* node, NodeInfos* infos) {
+  NodeInfo& info = infos->at(node);
+  if (info.unconditional) {
+    return;
+  }
+  info.unconditional = true;
+  size_t evaluated = info.children.size();
+  if (dynamic_cast<const IfExpression*>(node)) {
+    // Only the condition.
+    evaluated = 1;
+  } else if (dynamic_cast<const AndExpression*>(node)) {
+    // && short-circuits, only the head is always evaluated.
+    evaluated = 1;
+  }
+  for (size_t i = 0; i < evaluated; ++i) {
+    MarkUnconditional(info.children[i], infos);
+  }
+}
+
+}  // namespace
+
+std::string HoistCommonSubexpressions(const Expression& expression,
+                                      codegen::Generator* cg,
+                                      const std::string& prefix) {
+  const ExpressionNode* root = expression.GetPointer().get();
+  NodeInfos infos;
+  std::vector<const ExpressionNode*> post_order;
+  Visit(root, &infos, &post_order);
+  MarkUnconditional(root, &infos);
+
+  NodeNames names;
+  ScopedNodeNames scope(&names);
+  for (const ExpressionNode* node : post_order) {
+    const NodeInfo& info = infos.at(node);
+    if (node == root || info.uses < 2 || !info.unconditional || IsLeaf(node)) {
+      continue;
+    }
+    const std::string name = prefix + "_" + std::to_string(names.size());
+    const std::string type = info.integral ? "int" : "number";
+    cg->AppendLineOfCode(
+        cg->assign("const " + type + " " + name, node->to_string()) +
+        cg->linesep());
+    names[node] = name;
+  }
+  return expression.to_string();
+}
+
+}  // namespace symbolic
@@ -0,0 +1,35 @@
+#ifndef CSE_H
+#define CSE_H
+
+#include "codegen/codegen.h"
+#include "symbolic/expression.h"
+
+#include <string>
+
+namespace symbolic {
+
+// Common subexpression elimination for generated code. Since expressions are
+// interned, a subexpression used several times (the exponent sum of a softmax,
+// index math, ...) is a single node with several parents, but to_string()
+// prints it again at every use.
+//
+// Appends to cg a temporary for each such subexpression, in dependency order:
+//
+//   const number cse_0 = (exp(...)) + (...);
+//
+// and returns the code of expression in terms of the temporaries. Temporaries
+// of integer expressions (only Integer leaves, arithmetic and comparisons) are
+// declared int, the others number. Subexpressions which are only evaluated
+// conditionally (in the branches of an IfExpression, or on the right of an
+// &&) aren't hoisted, since they may be guarded by their condition (an array
+// access which is only in bounds if the condition holds, ...).
+//
+// Temporaries are named prefix_0, prefix_1, ..., so several expressions can
+// be hoisted into the same scope with different prefixes.
+std::string HoistCommonSubexpressions(const Expression& expression,
+                                      codegen::Generator* cg,
+                                      const std::string& prefix = "cse");
+
+}  // namespace symbolic
+
+#endif /* CSE_H */
@@ -1,14 +1,103 @@
 #include "expression.h"
 #include "numeric_value.h"
+#include "simplify.h"
 
 #include <algorithm>
 #include <cctype>
 #include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <functional>
 #include <iostream>
+#include <mutex>
 #include <utility>
 
 namespace symbolic {
 
+namespace {
+
+// Nodes which have been interned, see Expression::Intern(). The entries are
+// weak so the table doesn't keep nodes alive, and expired entries are swept
+// whenever the table has doubled in size since the last sweep.
+struct InternTable {
+  std::mutex mutex;
+  std::unordered_map<NodeKey, std::weak_ptr<const ExpressionNode>, NodeKeyHash>
+      nodes;
+  size_t sweep_at = 1024;
+};
+
+// Never destroyed, so that expressions in other static objects can outlive it.
+InternTable& GetInternTable() {
+  static InternTable* table = new InternTable;
+  return *table;
+}
+
+// Guards the results memoized on the nodes (ExpressionNode::string_ and
+// ExpressionNode::derivatives_). Kernels are generated on several threads.
+std::mutex& MemoMutex() {
+  static std::mutex* mutex = new std::mutex;
+  return *mutex;
+}
+
+// The Bind() call in progress on this thread. Shared nodes are only bound once
+// per call.
+struct BindScope {
+  const std::unordered_map<std::string, std::unique_ptr<NumericValue>>* env;
+  std::unordered_map<const ExpressionNode*,
+                     std::shared_ptr<const ExpressionNode>>
+      results;
+};
+
+thread_local BindScope* bind_scope = nullptr;
+
+// Depth of the Derive() calls in progress on this thread. Only the outermost
+// call simplifies its result, which covers those of the inner calls.
+thread_local int derive_depth = 0;
+
+// Counts a Derive() call in derive_depth for the lifetime of the guard.
+class DeriveDepthGuard {
+ public:
+  DeriveDepthGuard() { ++derive_depth; }
+  ~DeriveDepthGuard() { --derive_depth; }
+  DeriveDepthGuard(const DeriveDepthGuard&) = delete;
+  DeriveDepthGuard& operator=(const DeriveDepthGuard&) = delete;
+};
+
+// See ScopedNodeNames.
+thread_local const NodeNames* node_names = nullptr;
+
+uint64_t Bits(double value) {
+  uint64_t bits;
+  std::memcpy(&bits, &value, sizeof(bits));
+  return bits;
+}
+
+void HashCombine(size_t* seed, size_t value) {
+  *seed ^= value + 0x9e3779b97f4a7c15ULL + (*seed << 6) + (*seed >> 2);
+}
+
+}  // namespace
+
+// NodeKey Implementation.
+
+bool NodeKey::operator==(const NodeKey& rhs) const {
+  return *type == *rhs.type && children == rhs.children &&
+         Bits(real) == Bits(rhs.real) && Bits(imag) == Bits(rhs.imag) &&
+         name == rhs.name && flags == rhs.flags;
+}
+
+size_t NodeKeyHash::operator()(const NodeKey& key) const {
+  size_t seed = key.type->hash_code();
+  for (const ExpressionNode* child : key.children) {
+    HashCombine(&seed, std::hash<const ExpressionNode*>()(child));
+  }
+  HashCombine(&seed, std::hash<uint64_t>()(Bits(key.real)));
+  HashCombine(&seed, std::hash<uint64_t>()(Bits(key.imag)));
+  HashCombine(&seed, std::hash<std::string>()(key.name));
+  HashCombine(&seed, std::hash<int>()(key.flags));
+  return seed;
+}
+
 Expression CreateExpression(std::string expression) {
   auto isspace = [](unsigned char const c) { return std::isspace(c); };
   expression.erase(
@@ -55,10 +144,11 @@ Expression CreateExpression(std::string expression) {
 // Expression Implementation.
 
 Expression::Expression(std::unique_ptr<const ExpressionNode>&& root)
-    : expression_root_(std::shared_ptr<const ExpressionNode>(root.release())) {}
+    : expression_root_(
+          Intern(std::shared_ptr<const ExpressionNode>(root.release()))) {}
 
 Expression::Expression(std::shared_ptr<const ExpressionNode> root)
-    : expression_root_(root) {}
+    : expression_root_(Intern(std::move(root))) {}
 
 Expression::Expression(const Expression& other)
     : expression_root_(other.expression_root_) {}
@@ -67,19 +157,56 @@ Expression::Expression(Expression&& rhs)
     : expression_root_(std::move(rhs.expression_root_)) {}
 
 Expression::Expression(const NumericValue& rhs)
-    : expression_root_(std::make_shared<NumericValue>(rhs)) {}
+    : expression_root_(Intern(std::make_shared<NumericValue>(rhs))) {}
 
 Expression::Expression(const Integer& rhs)
-    : expression_root_(std::make_shared<Integer>(rhs)) {}
+    : expression_root_(Intern(std::make_shared<Integer>(rhs))) {}
 
 Expression::Expression(double a)
-    : expression_root_(std::make_shared<NumericValue>(a)) {}
+    : expression_root_(Intern(std::make_shared<NumericValue>(a))) {}
 
 Expression::Expression(int a)
-    : expression_root_(std::make_shared<Integer>(a)) {}
+    : expression_root_(Intern(std::make_shared<Integer>(a))) {}
 
 Expression::Expression(unsigned long a)
-    : expression_root_(std::make_shared<Integer>(a)) {}
+    : expression_root_(Intern(std::make_shared<Integer>(a))) {}
+
+std::shared_ptr<const ExpressionNode> Expression::Intern(
+    std::shared_ptr<const ExpressionNode> root) {
+  // Some nodes have no derivative, and return nullptr from Derive().
+  if (!root) {
+    return root;
+  }
+  NodeKey key = root->key();
+  key.type = &typeid(*root);
+
+  InternTable& table = GetInternTable();
+  std::lock_guard<std::mutex> lock(table.mutex);
+  std::weak_ptr<const ExpressionNode>& entry = table.nodes[std::move(key)];
+  std::shared_ptr<const ExpressionNode> interned = entry.lock();
+  if (interned) {
+    return interned;
+  }
+  entry = root;
+
+  if (table.nodes.size() >= table.sweep_at) {
+    for (auto it = table.nodes.begin(); it != table.nodes.end();) {
+      if (it->second.expired()) {
+        it = table.nodes.erase(it);
+      } else {
+        ++it;
+      }
+    }
+    table.sweep_at = std::max<size_t>(1024, 2 * table.nodes.size());
+  }
+  return root;
+}
+
+size_t Expression::InternTableSize() {
+  InternTable& table = GetInternTable();
+  std::lock_guard<std::mutex> lock(table.mutex);
+  return table.nodes.size();
+}
 
 Expression Expression::CreateInteger(const std::string& name) {
   return Expression(std::make_shared<Integer>(name));
@@ -129,8 +256,8 @@ Expression Expression::operator==(const Expression& rhs) const {
 }
 
 Expression& Expression::operator=(const Expression& rhs) {
-  expression_root_ = std::shared_ptr<const ExpressionNode>(
-      rhs.expression_root_->Clone().release());
+  // Nodes are immutable, so they can be shared instead of cloned.
+  expression_root_ = rhs.expression_root_;
   return *this;
 }
 
@@ -152,7 +279,7 @@ Expression Expression::Bind(const std::string& name,
                             const NumericValue& value) const {
   std::unordered_map<std::string, std::unique_ptr<NumericValue>> env_pointers;
   env_pointers.emplace(name, value.CloneValue());
-  return Expression(expression_root_->Bind(env_pointers));
+  return Bind(env_pointers);
 }
 
 Expression Expression::Bind(const Environment& env) const {
@@ -161,24 +288,84 @@ Expression Expression::Bind(const Environment& env) const {
     env_pointers.emplace(env_entry.first,
                          std::make_unique<NumericValue>(env_entry.second));
   }
-  return Expression(expression_root_->Bind(env_pointers));
+  return Bind(env_pointers);
 }
 
 Expression Expression::Bind(
     const std::unordered_map<std::string, std::unique_ptr<NumericValue>>& env)
     const {
-  return Expression(expression_root_->Bind(env));
+  if (bind_scope == nullptr || bind_scope->env != &env) {
+    // Outermost call, the nodes below share its scope.
+    BindScope scope{&env, {}};
+    BindScope* outer_scope = bind_scope;
+    bind_scope = &scope;
+    Expression result(expression_root_->Bind(env));
+    bind_scope = outer_scope;
+    return result;
+  }
+
+  // Only nodes with several parents can be reached again.
+  if (expression_root_.use_count() <= 1) {
+    return Expression(expression_root_->Bind(env));
+  }
+  auto bound = bind_scope->results.find(expression_root_.get());
+  if (bound != bind_scope->results.end()) {
+    return Expression(bound->second, InternedTag());
+  }
+  Expression result(expression_root_->Bind(env));
+  bind_scope->results.emplace(expression_root_.get(), result.expression_root_);
+  return result;
 }
 
 Expression Expression::Derive(const std::string& x) const {
-  // Optimization to reduce memory consumption. If f(x) does not depend on x,
-  // df(x)/dx = 0.
-  std::set<std::string> unbound_vars = variables();
-  if (unbound_vars.find(x) == unbound_vars.end()) {
-    return Expression(0.0);
+  // Memoized by an inner call, so not simplified yet.
+  std::shared_ptr<const ExpressionNode> unsimplified;
+  {
+    std::lock_guard<std::mutex> lock(MemoMutex());
+    for (const auto& derivative : expression_root_->derivatives_) {
+      if (derivative.x == x) {
+        std::shared_ptr<const ExpressionNode> node = derivative.node.lock();
+        if (node && (derivative.simplified || derive_depth > 0)) {
+          return Expression(std::move(node), InternedTag());
+        }
+        unsimplified = std::move(node);
+        break;
+      }
+    }
   }
 
-  return Expression(expression_root_->Derive(x));
+  Expression result;
+  if (unsimplified) {
+    result = Expression(std::move(unsimplified), InternedTag());
+  } else {
+    // Optimization to reduce memory consumption. If f(x) does not depend on
+    // x, df(x)/dx = 0.
+    std::set<std::string> unbound_vars = variables();
+    if (unbound_vars.find(x) == unbound_vars.end()) {
+      return Expression(0.0);
+    }
+
+    DeriveDepthGuard depth;
+    result = Expression(expression_root_->Derive(x));
+  }
+  const bool simplified = (derive_depth == 0);
+  if (simplified) {
+    result = Simplify(result);
+  }
+  if (result.expression_root_) {
+    std::lock_guard<std::mutex> lock(MemoMutex());
+    auto& derivatives = expression_root_->derivatives_;
+    auto slot = std::find_if(
+        derivatives.begin(), derivatives.end(),
+        [&x](const auto& derivative) { return derivative.x == x; });
+    if (slot == derivatives.end()) {
+      derivatives.push_back({x, result.expression_root_, simplified});
+    } else {
+      slot->node = result.expression_root_;
+      slot->simplified = simplified;
+    }
+  }
+  return result;
 }
 
 std::unique_ptr<NumericValue> Expression::Evaluate() const {
@@ -186,13 +373,45 @@ std::unique_ptr<NumericValue> Expression::Evaluate() const {
 }
 
 void Expression::Reset(std::shared_ptr<const ExpressionNode> root) {
-  expression_root_ = root;
+  expression_root_ = Intern(std::move(root));
 }
 
 std::string Expression::to_string() const {
-  return expression_root_->to_string();
+  if (node_names != nullptr) {
+    auto name = node_names->find(expression_root_.get());
+    if (name != node_names->end()) {
+      return name->second;
+    }
+    // The memoized strings don't use the names.
+    return expression_root_->to_string();
+  }
+
+  // Only the strings of nodes with several parents are kept. Keeping that of
+  // every node would take quadratic memory on long chains of sums.
+  if (expression_root_.use_count() <= 1) {
+    return expression_root_->to_string();
+  }
+  {
+    std::lock_guard<std::mutex> lock(MemoMutex());
+    if (expression_root_->string_) {
+      return *expression_root_->string_;
+    }
+  }
+  std::string result = expression_root_->to_string();
+  std::lock_guard<std::mutex> lock(MemoMutex());
+  if (!expression_root_->string_) {
+    expression_root_->string_ = std::make_unique<const std::string>(result);
+  }
+  return result;
 }
 
+ScopedNodeNames::ScopedNodeNames(const NodeNames* names)
+    : outer_names_(node_names) {
+  node_names = names;
+}
+
+ScopedNodeNames::~ScopedNodeNames() { node_names = outer_names_; }
+
 // IfExpression impl.
 
 std::set<std::string> IfExpression::variables() const {
@@ -244,6 +463,13 @@ std::string IfExpression::to_string() const {
          b_.to_string() + "))";
 }
 
+NodeKey IfExpression::key() const {
+  NodeKey key;
+  key.children = {conditional_.GetPointer().get(), a_.GetPointer().get(),
+                  b_.GetPointer().get()};
+  return key;
+}
+
 // CompoundExpression impl.
 
 std::set<std::string> CompoundExpression::variables() const {
@@ -280,6 +506,16 @@ std::string CompoundExpression::to_string() const {
   return result;
 }
 
+NodeKey CompoundExpression::key() const {
+  NodeKey key;
+  key.children.push_back(head_.GetPointer().get());
+  if (!is_end_) {
+    key.children.push_back(tail_.GetPointer().get());
+  }
+  key.flags = is_end_;
+  return key;
+}
+
 // AdditionExpression Implementation.
 
 std::unique_ptr<NumericValue> AdditionExpression::reduce(
@@ -405,6 +641,12 @@ std::string GteExpression::to_string() const {
   return result;
 }
 
+NodeKey GteExpression::key() const {
+  NodeKey key;
+  key.children = {a_.GetPointer().get(), b_.GetPointer().get()};
+  return key;
+}
+
 // == Expression
 
 std::set<std::string> EqExpression::variables() const {
@@ -453,6 +695,12 @@ std::string EqExpression::to_string() const {
   return result;
 }
 
+NodeKey EqExpression::key() const {
+  NodeKey key;
+  key.children = {a_.GetPointer().get(), b_.GetPointer().get()};
+  return key;
+}
+
 // Not Expression
 
 std::set<std::string> NotExpression::variables() const {
@@ -482,6 +730,12 @@ std::string NotExpression::to_string() const {
   return "!(" + child_.to_string() + ")";
 }
 
+NodeKey NotExpression::key() const {
+  NodeKey key;
+  key.children = {child_.GetPointer().get()};
+  return key;
+}
+
 // DivisionExpression Implementation.
 
 std::set<std::string> DivisionExpression::variables() const {
@@ -562,6 +816,12 @@ std::string DivisionExpression::to_string() const {
   return result;
 }
 
+NodeKey DivisionExpression::key() const {
+  NodeKey key;
+  key.children = {numerator_.GetPointer().get(), denominator_.GetPointer().get()};
+  return key;
+}
+
 // ModulusExpression Implementation.
 
 std::set<std::string> ModulusExpression::variables() const {
@@ -620,6 +880,12 @@ std::string ModulusExpression::to_string() const {
   return result;
 }
 
+NodeKey ModulusExpression::key() const {
+  NodeKey key;
+  key.children = {a_.GetPointer().get(), b_.GetPointer().get()};
+  return key;
+}
+
 // ExponentExpression Impl.
 
 std::shared_ptr<const ExpressionNode> ExponentExpression::Bind(
@@ -672,6 +938,14 @@ std::string ExponentExpression::to_string() const {
   return "pow(" + b_.to_string() + ", " + child_.to_string() + ")";
 }
 
+NodeKey ExponentExpression::key() const {
+  NodeKey key;
+  key.children = {child_.GetPointer().get()};
+  key.real = b_.real();
+  key.imag = b_.imag();
+  return key;
+}
+
 std::unique_ptr<const ExpressionNode> ExponentExpression::Clone() const {
   return std::make_unique<const ExponentExpression>(b_, child_);
 }
@@ -735,6 +1009,14 @@ std::string LogExpression::to_string() const {
   return "log(" + child_.to_string() + ") / log(" + b_.to_string() + ")";
 }
 
+NodeKey LogExpression::key() const {
+  NodeKey key;
+  key.children = {child_.GetPointer().get()};
+  key.real = b_.real();
+  key.imag = b_.imag();
+  return key;
+}
+
 std::unique_ptr<const ExpressionNode> LogExpression::Clone() const {
   return std::make_unique<const LogExpression>(b_, child_);
 }
@@ -25,10 +25,32 @@ using Environment = std::unordered_map<std::string, symbolic::NumericValue>;
 class AdditionExpression;
 class Expression;
 
+// Names which to_string() prints in place of the given nodes.
+using NodeNames = std::unordered_map<const ExpressionNode*, std::string>;
+
+// While in scope, expressions print the nodes in names by their name, so an
+// expression can be printed in terms of temporaries (see symbolic/cse.h).
+// names may grow while in scope. Affects the current thread only.
+class ScopedNodeNames {
+ public:
+  explicit ScopedNodeNames(const NodeNames* names);
+  ~ScopedNodeNames();
+
+ private:
+  const NodeNames* outer_names_;
+};
+
 Expression CreateExpression(std::string expression);
 
 // Class which holds the ExpressionNode tree and provides an easy-to-use
 // interface.
+//
+// Nodes are hash-consed: every node which enters an Expression is interned
+// (see Intern()), so structurally equal subexpressions share one node and the
+// tree is really a DAG. Two expressions are structurally equal iff
+// SameAs() is true. Since nodes are immutable and unique, Derive() and
+// to_string() are memoized on the node, and Bind() is memoized per call so a
+// shared subexpression is only bound once.
 class Expression {
  public:
   Expression() : Expression(0.0) {}
@@ -91,9 +113,29 @@ class Expression {
     return expression_root_;
   }
 
+  // Structural equality, which is pointer equality since nodes are interned.
+  bool SameAs(const Expression& rhs) const {
+    return expression_root_ == rhs.expression_root_;
+  }
+
+  // Returns the interned node structurally equal to root, and interns root if
+  // there is none. The children of root must already be interned, which is
+  // the case for any node built out of Expressions.
+  static std::shared_ptr<const ExpressionNode> Intern(
+      std::shared_ptr<const ExpressionNode> root);
+
+  // The number of entries of the intern table, including nodes which have
+  // been freed but not swept from it yet.
+  static size_t InternTableSize();
+
   std::string to_string() const;
 
  private:
+  // For nodes which are already interned.
+  struct InternedTag {};
+  Expression(std::shared_ptr<const ExpressionNode> root, InternedTag)
+      : expression_root_(std::move(root)) {}
+
   std::shared_ptr<const ExpressionNode> expression_root_;
 };
 
@@ -126,10 +168,16 @@ class IfExpression : public ExpressionNode {
   // (( conditional ) ? ( a ) : ( b ))
   std::string to_string() const override;
 
+  NodeKey key() const override;
+
   std::unique_ptr<const ExpressionNode> Clone() const override {
     return std::make_unique<IfExpression>(conditional_, a_, b_);
   }
 
+  const Expression& conditional() const { return conditional_; }
+  const Expression& a() const { return a_; }
+  const Expression& b() const { return b_; }
+
  private:
   Expression conditional_;
   Expression a_;
@@ -148,6 +196,8 @@ class CompoundExpression : public ExpressionNode {
 
   std::string to_string() const override;
 
+  NodeKey key() const override;
+
   virtual std::unique_ptr<NumericValue> reduce(const NumericValue& a,
                                                const NumericValue& b) const = 0;
 
@@ -155,6 +205,12 @@ class CompoundExpression : public ExpressionNode {
 
   virtual std::unique_ptr<const ExpressionNode> Clone() const override = 0;
 
+  const Expression& head() const { return head_; }
+  // Only meaningful if !is_end().
+  const Expression& tail() const { return tail_; }
+  // Whether this is a single operand, head.
+  bool is_end() const { return is_end_; }
+
  protected:
   CompoundExpression(const Expression& a, const Expression& b)
       : head_(a), tail_(b), is_end_(false) {}
@@ -276,12 +332,17 @@ class GteExpression : public ExpressionNode {
 
   std::string to_string() const override;
 
+  NodeKey key() const override;
+
   std::unique_ptr<const ExpressionNode> Clone() const override {
     std::unique_ptr<GteExpression> clone =
         std::make_unique<GteExpression>(a_, b_);
     return clone;
   }
 
+  const Expression& a() const { return a_; }
+  const Expression& b() const { return b_; }
+
  private:
   Expression a_;
   Expression b_;
@@ -311,12 +372,17 @@ class EqExpression : public ExpressionNode {
 
   std::string to_string() const override;
 
+  NodeKey key() const override;
+
   std::unique_ptr<const ExpressionNode> Clone() const override {
-    std::unique_ptr<GteExpression> clone =
-        std::make_unique<GteExpression>(a_, b_);
+    std::unique_ptr<EqExpression> clone =
+        std::make_unique<EqExpression>(a_, b_);
     return clone;
   }
 
+  const Expression& a() const { return a_; }
+  const Expression& b() const { return b_; }
+
  private:
   Expression a_;
   Expression b_;
@@ -346,12 +412,16 @@ class NotExpression : public ExpressionNode {
 
   std::string to_string() const override;
 
+  NodeKey key() const override;
+
   std::unique_ptr<const ExpressionNode> Clone() const override {
     std::unique_ptr<NotExpression> clone =
         std::make_unique<NotExpression>(child_);
     return clone;
   }
 
+  const Expression& child() const { return child_; }
+
  private:
   Expression child_;
 };
@@ -381,12 +451,17 @@ class DivisionExpression : public ExpressionNode {
 
   std::string to_string() const override;
 
+  NodeKey key() const override;
+
   std::unique_ptr<const ExpressionNode> Clone() const override {
     std::unique_ptr<DivisionExpression> clone =
         std::make_unique<DivisionExpression>(numerator_, denominator_);
     return std::move(clone);
   }
 
+  const Expression& numerator() const { return numerator_; }
+  const Expression& denominator() const { return denominator_; }
+
  private:
   Expression numerator_;
   Expression denominator_;
@@ -418,12 +493,17 @@ class ModulusExpression : public ExpressionNode {
 
   std::string to_string() const override;
 
+  NodeKey key() const override;
+
   std::unique_ptr<const ExpressionNode> Clone() const override {
     std::unique_ptr<ModulusExpression> clone =
         std::make_unique<ModulusExpression>(a_, b_);
     return std::move(clone);
   }
 
+  const Expression& a() const { return a_; }
+  const Expression& b() const { return b_; }
+
  private:
   Expression a_;
   Expression b_;
@@ -455,8 +535,13 @@ class ExponentExpression : public ExpressionNode {
 
   std::string to_string() const override;
 
+  NodeKey key() const override;
+
   std::unique_ptr<const ExpressionNode> Clone() const override;
 
+  const NumericValue& base() const { return b_; }
+  const Expression& child() const { return child_; }
+
  private:
   NumericValue b_;
   Expression child_;
@@ -490,8 +575,13 @@ class LogExpression : public ExpressionNode {
 
   std::string to_string() const override;
 
+  NodeKey key() const override;
+
   std::unique_ptr<const ExpressionNode> Clone() const override;
 
+  const NumericValue& base() const { return b_; }
+  const Expression& child() const { return child_; }
+
  private:
   NumericValue b_;
   Expression child_;
@@ -5,11 +5,36 @@
 #include <memory>
 #include <set>
 #include <string>
+#include <typeinfo>
 #include <unordered_map>
+#include <utility>
+#include <vector>
 
 namespace symbolic {
 
 class NumericValue;
+class ExpressionNode;
+
+// Structural identity of a node. Two nodes with equal keys have the same type,
+// the same children (compared by pointer, children are interned first) and the
+// same value or name, so they're interchangeable. See Expression::Intern().
+struct NodeKey {
+  const std::type_info* type = nullptr;
+  std::vector<const ExpressionNode*> children;
+  // Constant operands (the value of a NumericValue, the base of an
+  // ExponentExpression, ...). Compared bit for bit, so 0.0 and -0.0 differ.
+  double real = 0;
+  double imag = 0;
+  std::string name;
+  // Anything else which tells apart two nodes of the same type.
+  int flags = 0;
+
+  bool operator==(const NodeKey& rhs) const;
+};
+
+struct NodeKeyHash {
+  size_t operator()(const NodeKey& key) const;
+};
 
 // Abstract class which defines the expression interface. Interface is limited
 // to prevent accidental copies (inefficiencies). Not optimized for ease of use.
@@ -32,7 +57,27 @@ class ExpressionNode {
 
   virtual std::unique_ptr<const ExpressionNode> Clone() const = 0;
 
+  // The node's children and constants. NodeKey::type is filled in by the
+  // caller.
+  virtual NodeKey key() const = 0;
+
   virtual ~ExpressionNode() {}
+
+ private:
+  friend class Expression;
+
+  struct Derivative {
+    std::string x;
+    std::weak_ptr<const ExpressionNode> node;
+    // Whether node was simplified, see Expression::Derive().
+    bool simplified = false;
+  };
+
+  // Results memoized by Expression. Nodes are interned and immutable, so these
+  // stay valid for the life of the node. The derivatives are weak, a
+  // derivative may refer back to the node (d/dx e^x).
+  mutable std::unique_ptr<const std::string> string_;
+  mutable std::vector<Derivative> derivatives_;
 };
 
 }  // namespace symbolic
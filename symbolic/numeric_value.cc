@@ -67,6 +67,18 @@ std::unique_ptr<NumericValue> NumericValue::CloneValue() const {
   }
 }
 
+NodeKey NumericValue::key() const {
+  NodeKey key;
+  key.flags = is_bound_;
+  if (is_bound_) {
+    key.real = a_;
+    key.imag = b_;
+  } else {
+    key.name = name_;
+  }
+  return key;
+}
+
 const NumericValue NumericValue::pi(3.141592653589793238);
 const NumericValue NumericValue::e(2.718281828459045235);
 
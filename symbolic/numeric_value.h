@@ -23,6 +23,8 @@ class NumericValue : public ExpressionNode {
   virtual double& imag() { return b_; }
   virtual double real() const { return a_; }
   virtual double imag() const { return b_; }
+  // Whether this is a value rather than a variable.
+  bool is_bound() const { return is_bound_; }
 
   std::shared_ptr<const ExpressionNode> Bind(
       const std::unordered_map<std::string, std::unique_ptr<NumericValue>>& env)
@@ -42,6 +44,8 @@ class NumericValue : public ExpressionNode {
 
   std::unique_ptr<const ExpressionNode> Clone() const override;
 
+  NodeKey key() const override;
+
   static const NumericValue pi;
   static const NumericValue e;
 
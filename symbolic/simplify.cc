@@ -0,0 +1,487 @@
+#include "symbolic/simplify.h"
+
+#include "symbolic/integer.h"
+#include "symbolic/numeric_value.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <string>
+#include <typeinfo>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+
+namespace symbolic {
+
+namespace {
+
+std::atomic<size_t> total_nodes_before(0);
+std::atomic<size_t> total_nodes_after(0);
+
+// The value of a bound NumericValue (or Integer), or nullptr.
+const NumericValue* Constant(const Expression& expression) {
+  const NumericValue* value =
+      dynamic_cast<const NumericValue*>(expression.GetPointer().get());
+  return (value != nullptr && value->is_bound()) ? value : nullptr;
+}
+
+bool IsInteger(const NumericValue* value) {
+  return dynamic_cast<const Integer*>(value) != nullptr;
+}
+
+bool Truthy(double value) {
+  return fabs(value) > std::numeric_limits<double>::epsilon();
+}
+
+Expression MakeConstant(double real, double imag, bool integer) {
+  if (integer) {
+    return Expression(Integer(static_cast<int>(std::trunc(real))));
+  }
+  return Expression(NumericValue(real, imag));
+}
+
+uint64_t Bits(double value) {
+  uint64_t bits;
+  std::memcpy(&bits, &value, sizeof(bits));
+  return bits;
+}
+
+void HashCombine(uint64_t* seed, uint64_t value) {
+  *seed ^= value + 0x9e3779b97f4a7c15ULL + (*seed << 6) + (*seed >> 2);
+}
+
+// One Simplify() call. The results are memoized per node, so each node of the
+// DAG is only rewritten once. Every memoized node is kept alive by the
+// expression it came from, or by simplified_.
+class Simplifier {
+ public:
+  Expression Run(const Expression& expression) {
+    const ExpressionNode* node = expression.GetPointer().get();
+    if (node == nullptr) {
+      return expression;
+    }
+    auto simplified = simplified_.find(node);
+    if (simplified != simplified_.end()) {
+      return simplified->second;
+    }
+    Expression result = Rewrite(expression);
+    simplified_.emplace(node, result);
+    return result;
+  }
+
+ private:
+  Expression Rewrite(const Expression& expression) {
+    const ExpressionNode* node = expression.GetPointer().get();
+    if (dynamic_cast<const NumericValue*>(node)) {
+      return expression;
+    }
+    if (auto sum = dynamic_cast<const AdditionExpression*>(node)) {
+      return Arithmetic(*sum, /*is_sum=*/true);
+    }
+    if (auto product = dynamic_cast<const MultiplicationExpression*>(node)) {
+      return Arithmetic(*product, /*is_sum=*/false);
+    }
+    if (auto conjunction = dynamic_cast<const AndExpression*>(node)) {
+      return And(expression, *conjunction);
+    }
+    if (auto division = dynamic_cast<const DivisionExpression*>(node)) {
+      return Division(expression, *division);
+    }
+    if (auto modulus = dynamic_cast<const ModulusExpression*>(node)) {
+      return Modulus(expression, *modulus);
+    }
+    if (auto conditional = dynamic_cast<const IfExpression*>(node)) {
+      return If(expression, *conditional);
+    }
+    if (auto gte = dynamic_cast<const GteExpression*>(node)) {
+      return Gte(expression, *gte);
+    }
+    if (auto eq = dynamic_cast<const EqExpression*>(node)) {
+      return Eq(expression, *eq);
+    }
+    if (auto negation = dynamic_cast<const NotExpression*>(node)) {
+      return Not(expression, *negation);
+    }
+    if (auto exponent = dynamic_cast<const ExponentExpression*>(node)) {
+      return Exponent(expression, *exponent);
+    }
+    if (auto log = dynamic_cast<const LogExpression*>(node)) {
+      return Log(expression, *log);
+    }
+    return expression;
+  }
+
+  // Appends the operands of a (simplified, so flat) chain of compounds of the
+  // given type, or expression itself if it's something else.
+  static void CollectOperands(const Expression& expression,
+                              const std::type_info& type,
+                              std::vector<Expression>* operands) {
+    const auto* compound =
+        dynamic_cast<const CompoundExpression*>(expression.GetPointer().get());
+    if (compound == nullptr || typeid(*compound) != type) {
+      operands->push_back(expression);
+      return;
+    }
+    CollectOperands(compound->head(), type, operands);
+    if (!compound->is_end()) {
+      CollectOperands(compound->tail(), type, operands);
+    }
+  }
+
+  Expression Arithmetic(const CompoundExpression& node, bool is_sum) {
+    const std::type_info& type = typeid(node);
+    std::vector<Expression> operands;
+    CollectOperands(Run(node.head()), type, &operands);
+    if (!node.is_end()) {
+      CollectOperands(Run(node.tail()), type, &operands);
+    }
+
+    std::vector<Expression> terms;
+    bool have_constant = false;
+    bool integer_constant = true;
+    double real = is_sum ? 0 : 1;
+    double imag = 0;
+    bool terms_integral = true;
+    for (const Expression& operand : operands) {
+      const NumericValue* constant = Constant(operand);
+      if (constant == nullptr) {
+        terms_integral = terms_integral && IsIntegral(operand);
+        terms.push_back(operand);
+        continue;
+      }
+      have_constant = true;
+      integer_constant = integer_constant && IsInteger(constant);
+      if (is_sum) {
+        real += constant->real();
+        imag += constant->imag();
+      } else {
+        const double product_real =
+            real * constant->real() - imag * constant->imag();
+        imag = real * constant->imag() + imag * constant->real();
+        real = product_real;
+      }
+    }
+    const bool integral = terms_integral && integer_constant;
+
+    if (!is_sum && have_constant && real == 0 && imag == 0) {
+      return MakeConstant(0, 0, integral);
+    }
+    const bool identity =
+        have_constant && imag == 0 && real == (is_sum ? 0 : 1);
+    // Dropping the identity mustn't make the result an integer.
+    const bool keep_constant =
+        have_constant && (!identity || terms.empty() ||
+                          (!integer_constant && terms_integral));
+
+    std::stable_sort(terms.begin(), terms.end(),
+                     [this](const Expression& a, const Expression& b) {
+                       return Fingerprint(a.GetPointer().get()) <
+                              Fingerprint(b.GetPointer().get());
+                     });
+    if (keep_constant) {
+      terms.push_back(MakeConstant(real, imag, integer_constant));
+    }
+
+    Expression result = terms[0];
+    for (size_t i = 1; i < terms.size(); ++i) {
+      if (is_sum) {
+        result = Expression(
+            std::make_shared<AdditionExpression>(result, terms[i]));
+      } else {
+        result = Expression(
+            std::make_shared<MultiplicationExpression>(result, terms[i]));
+      }
+    }
+    return result;
+  }
+
+  Expression And(const Expression& expression, const AndExpression& node) {
+    Expression head = Run(node.head());
+    if (node.is_end()) {
+      return head;
+    }
+    Expression tail = Run(node.tail());
+    const NumericValue* head_value = Constant(head);
+    const NumericValue* tail_value = Constant(tail);
+    if (head_value != nullptr && tail_value != nullptr) {
+      return Expression(Integer(
+          (Truthy(head_value->real()) && Truthy(tail_value->real())) ? 1 : 0));
+    }
+    if (head.SameAs(node.head()) && tail.SameAs(node.tail())) {
+      return expression;
+    }
+    return Expression(std::make_shared<AndExpression>(head, tail));
+  }
+
+  Expression Division(const Expression& expression,
+                      const DivisionExpression& node) {
+    Expression numerator = Run(node.numerator());
+    Expression denominator = Run(node.denominator());
+    const NumericValue* n = Constant(numerator);
+    const NumericValue* d = Constant(denominator);
+    if (n != nullptr && d != nullptr) {
+      const double norm = d->real() * d->real() + d->imag() * d->imag();
+      if (norm != 0) {
+        // C divides integers with truncation.
+        if (IsInteger(n) && IsInteger(d)) {
+          return MakeConstant(n->real() / d->real(), 0, true);
+        }
+        return MakeConstant(
+            (n->real() * d->real() + n->imag() * d->imag()) / norm,
+            (n->imag() * d->real() - n->real() * d->imag()) / norm, false);
+      }
+    } else if (n != nullptr && n->real() == 0 && n->imag() == 0) {
+      return MakeConstant(0, 0, IsIntegral(numerator) &&
+                                    IsIntegral(denominator));
+    } else if (d != nullptr && d->real() == 1 && d->imag() == 0 &&
+               (IsInteger(d) || !IsIntegral(numerator))) {
+      return numerator;
+    }
+    if (numerator.SameAs(node.numerator()) &&
+        denominator.SameAs(node.denominator())) {
+      return expression;
+    }
+    return Expression(
+        std::make_shared<DivisionExpression>(numerator, denominator));
+  }
+
+  Expression Modulus(const Expression& expression,
+                     const ModulusExpression& node) {
+    Expression a = Run(node.a());
+    Expression b = Run(node.b());
+    const NumericValue* a_value = Constant(a);
+    const NumericValue* b_value = Constant(b);
+    if (a_value != nullptr && b_value != nullptr && IsInteger(a_value) &&
+        IsInteger(b_value) && b_value->real() != 0) {
+      return Expression(Integer(static_cast<int>(a_value->real()) %
+                                static_cast<int>(b_value->real())));
+    }
+    if (a.SameAs(node.a()) && b.SameAs(node.b())) {
+      return expression;
+    }
+    return Expression(std::make_shared<ModulusExpression>(a, b));
+  }
+
+  Expression If(const Expression& expression, const IfExpression& node) {
+    Expression conditional = Run(node.conditional());
+    Expression a = Run(node.a());
+    Expression b = Run(node.b());
+    if (a.SameAs(b)) {
+      return a;
+    }
+    const NumericValue* condition = Constant(conditional);
+    // The ternary has the common type of both branches, so a branch can only
+    // replace it if they have the same type.
+    if (condition != nullptr && IsIntegral(a) == IsIntegral(b)) {
+      return Truthy(condition->real()) ? a : b;
+    }
+    if (conditional.SameAs(node.conditional()) && a.SameAs(node.a()) &&
+        b.SameAs(node.b())) {
+      return expression;
+    }
+    return Expression(std::make_shared<IfExpression>(conditional, a, b));
+  }
+
+  Expression Gte(const Expression& expression, const GteExpression& node) {
+    Expression a = Run(node.a());
+    Expression b = Run(node.b());
+    const NumericValue* a_value = Constant(a);
+    const NumericValue* b_value = Constant(b);
+    if (a_value != nullptr && b_value != nullptr) {
+      return Expression(Integer((a_value->real() >= b_value->real()) ? 1 : 0));
+    }
+    if (a.SameAs(node.a()) && b.SameAs(node.b())) {
+      return expression;
+    }
+    return Expression(std::make_shared<GteExpression>(a, b));
+  }
+
+  Expression Eq(const Expression& expression, const EqExpression& node) {
+    Expression a = Run(node.a());
+    Expression b = Run(node.b());
+    const NumericValue* a_value = Constant(a);
+    const NumericValue* b_value = Constant(b);
+    if (a_value != nullptr && b_value != nullptr) {
+      // Generated as (a == b) ? 1.0 : 0.0.
+      return MakeConstant((a_value->real() == b_value->real()) ? 1.0 : 0.0, 0,
+                          false);
+    }
+    if (a.SameAs(node.a()) && b.SameAs(node.b())) {
+      return expression;
+    }
+    return Expression(std::make_shared<EqExpression>(a, b));
+  }
+
+  Expression Not(const Expression& expression, const NotExpression& node) {
+    Expression child = Run(node.child());
+    const NumericValue* value = Constant(child);
+    if (value != nullptr) {
+      return Expression(Integer(Truthy(value->real()) ? 0 : 1));
+    }
+    if (child.SameAs(node.child())) {
+      return expression;
+    }
+    return Expression(std::make_shared<NotExpression>(child));
+  }
+
+  // pow() is always a double, even of an integer exponent.
+  Expression Exponent(const Expression& expression,
+                      const ExponentExpression& node) {
+    Expression child = Run(node.child());
+    const NumericValue* value = Constant(child);
+    if (value != nullptr) {
+      std::unique_ptr<NumericValue> result =
+          ExponentExpression(node.base(),
+                             Expression(NumericValue(value->real(),
+                                                     value->imag())))
+              .TryEvaluate();
+      if (result) {
+        return MakeConstant(result->real(), result->imag(), false);
+      }
+    }
+    if (child.SameAs(node.child())) {
+      return expression;
+    }
+    return Expression(std::make_shared<ExponentExpression>(node.base(), child));
+  }
+
+  Expression Log(const Expression& expression, const LogExpression& node) {
+    Expression child = Run(node.child());
+    const NumericValue* value = Constant(child);
+    // Only the real logarithm of positive numbers is defined (and evaluating
+    // others prints errors).
+    if (value != nullptr && value->real() > 0 && value->imag() == 0 &&
+        node.base().imag() == 0) {
+      return MakeConstant(log(value->real()) / log(node.base().real()), 0,
+                          false);
+    }
+    if (child.SameAs(node.child())) {
+      return expression;
+    }
+    return Expression(std::make_shared<LogExpression>(node.base(), child));
+  }
+
+  bool IsIntegral(const Expression& expression) {
+    return IsIntegral(expression.GetPointer().get());
+  }
+
+  bool IsIntegral(const ExpressionNode* node) {
+    if (node == nullptr) {
+      return false;
+    }
+    auto memo = integral_.find(node);
+    if (memo != integral_.end()) {
+      return memo->second;
+    }
+    std::vector<bool> integral_children;
+    for (const ExpressionNode* child : node->key().children) {
+      integral_children.push_back(IsIntegral(child));
+    }
+    const bool integral = HasIntegerType(node, integral_children);
+    integral_.emplace(node, integral);
+    return integral;
+  }
+
+  // A structural hash which is the same from one run to the next (unlike the
+  // node addresses), so the operand order and the generated code are too.
+  uint64_t Fingerprint(const ExpressionNode* node) {
+    if (node == nullptr) {
+      return 0;
+    }
+    auto memo = fingerprints_.find(node);
+    if (memo != fingerprints_.end()) {
+      return memo->second;
+    }
+    NodeKey key = node->key();
+    uint64_t seed = std::hash<std::string>()(typeid(*node).name());
+    for (const ExpressionNode* child : key.children) {
+      HashCombine(&seed, Fingerprint(child));
+    }
+    HashCombine(&seed, Bits(key.real));
+    HashCombine(&seed, Bits(key.imag));
+    HashCombine(&seed, std::hash<std::string>()(key.name));
+    HashCombine(&seed, static_cast<uint64_t>(key.flags));
+    fingerprints_.emplace(node, seed);
+    return seed;
+  }
+
+  std::unordered_map<const ExpressionNode*, Expression> simplified_;
+  std::unordered_map<const ExpressionNode*, bool> integral_;
+  std::unordered_map<const ExpressionNode*, uint64_t> fingerprints_;
+};
+
+}  // namespace
+
+Expression Simplify(const Expression& expression, SimplifyStats* stats) {
+  if (!expression.GetPointer()) {
+    return expression;
+  }
+  Expression result = Simplifier().Run(expression);
+
+  SimplifyStats call_stats;
+  call_stats.nodes_before = NodeCount(expression);
+  call_stats.nodes_after = NodeCount(result);
+  total_nodes_before += call_stats.nodes_before;
+  total_nodes_after += call_stats.nodes_after;
+  if (stats != nullptr) {
+    *stats = call_stats;
+  }
+  return result;
+}
+
+size_t NodeCount(const Expression& expression) {
+  std::unordered_set<const ExpressionNode*> visited;
+  std::vector<const ExpressionNode*> pending = {expression.GetPointer().get()};
+  while (!pending.empty()) {
+    const ExpressionNode* node = pending.back();
+    pending.pop_back();
+    if (node == nullptr || !visited.insert(node).second) {
+      continue;
+    }
+    for (const ExpressionNode* child : node->key().children) {
+      pending.push_back(child);
+    }
+  }
+  return visited.size();
+}
+
+SimplifyStats TotalSimplifyStats() {
+  SimplifyStats stats;
+  stats.nodes_before = total_nodes_before;
+  stats.nodes_after = total_nodes_after;
+  return stats;
+}
+
+bool HasIntegerType(const ExpressionNode* node,
+                    const std::vector<bool>& integral_children) {
+  auto all_integral = [](auto begin, auto end) {
+    return std::all_of(begin, end, [](bool integral) { return integral; });
+  };
+  if (dynamic_cast<const NumericValue*>(node)) {
+    return dynamic_cast<const Integer*>(node) != nullptr;
+  }
+  if (dynamic_cast<const AdditionExpression*>(node) ||
+      dynamic_cast<const MultiplicationExpression*>(node) ||
+      dynamic_cast<const DivisionExpression*>(node) ||
+      dynamic_cast<const ModulusExpression*>(node)) {
+    return all_integral(integral_children.begin(), integral_children.end());
+  }
+  if (dynamic_cast<const IfExpression*>(node)) {
+    // The condition doesn't contribute to the type.
+    return all_integral(integral_children.begin() + 1,
+                        integral_children.end());
+  }
+  // EqExpression is generated as (a == b) ? 1.0 : 0.0, the other comparisons
+  // are ints in C.
+  return dynamic_cast<const GteExpression*>(node) ||
+         dynamic_cast<const NotExpression*>(node) ||
+         dynamic_cast<const AndExpression*>(node);
+}
+
+}  // namespace symbolic
@@ -0,0 +1,54 @@
+#ifndef SIMPLIFY_H
+#define SIMPLIFY_H
+
+#include "symbolic/expression.h"
+#include "symbolic/expression_node.h"
+
+#include <cstddef>
+#include <vector>
+
+namespace symbolic {
+
+struct SimplifyStats {
+  // Distinct nodes, see NodeCount().
+  size_t nodes_before = 0;
+  size_t nodes_after = 0;
+};
+
+// Rewrites expression into a smaller equivalent one:
+//
+//  - Nested sums and products are flattened, their operands sorted into a
+//    canonical order (so a + b and b + a become the same node) and their
+//    constants folded into one: (x + 1) + (2 + y) => (x + y) + 3.
+//  - Identity operands are dropped (x + 0, x * 1, x / 1), and products with a
+//    zero factor become zero.
+//  - Subexpressions whose operands are all constants are evaluated, and
+//    conditionals with a constant condition are replaced by their branch.
+//
+// The result generates code which computes the same value with the same type:
+// an operand which makes a C expression double (x * 1.0 with an integer x) is
+// kept, and integer constants are folded with integer division. Sums and
+// products are reassociated, so floating point results may differ in the last
+// bits.
+//
+// Derive() simplifies its results, and layers simplify the expressions they
+// emit into kernels.
+Expression Simplify(const Expression& expression,
+                    SimplifyStats* stats = nullptr);
+
+// The number of distinct nodes of expression, shared subexpressions are
+// counted once.
+size_t NodeCount(const Expression& expression);
+
+// Sums of the SimplifyStats of every Simplify() call so far, on all threads.
+SimplifyStats TotalSimplifyStats();
+
+// Whether the code generated for node has an integer type in C, given whether
+// that of each of its children (in NodeKey::children order) has. Integer
+// leaves, arithmetic on integers and comparisons are integers.
+bool HasIntegerType(const ExpressionNode* node,
+                    const std::vector<bool>& integral_children);
+
+}  // namespace symbolic
+
+#endif /* SIMPLIFY_H */
@@ -7,9 +7,13 @@
 #include <memory>
 #include <set>
 
+#include "codegen/codegen.h"
+#include "symbolic/compiled_expression.h"
+#include "symbolic/cse.h"
 #include "symbolic/expression.h"
 #include "symbolic/integer.h"
 #include "symbolic/numeric_value.h"
+#include "symbolic/simplify.h"
 #include "symbolic/symbolic_util.h"
 
 using symbolic::Expression;
@@ -161,3 +165,200 @@ TEST_CASE("2D Array index flatten & unflatten", "[symbolic]") {
     REQUIRE(col_result->real() == 4);
   }
 }
+
+TEST_CASE("Structurally equal expressions share a node", "[symbolic]") {
+  Expression a = symbolic::CreateExpression("a*x + b");
+  Expression b = symbolic::CreateExpression("a*x + b");
+  REQUIRE(a.SameAs(b));
+  REQUIRE(!a.SameAs(symbolic::CreateExpression("a*x + c")));
+
+  SECTION("Constants are compared by type and value") {
+    REQUIRE(Expression(1).SameAs(Expression(1)));
+    REQUIRE(!Expression(1).SameAs(Expression(1.0)));
+    REQUIRE(!Expression(0.0).SameAs(Expression(-0.0)));
+  }
+
+  SECTION("Derivatives are memoized") {
+    Expression sigmoid = symbolic::Sigmoid(a);
+    Expression derivative = sigmoid.Derive("x");
+    REQUIRE(derivative.SameAs(sigmoid.Derive("x")));
+    REQUIRE(derivative.Bind({{"a", 2}, {"b", 0}, {"x", 0}}).Evaluate()->real() ==
+            Approx(0.5));
+  }
+
+  SECTION("Shared subexpressions are bound once") {
+    Expression square = a * a;
+    Expression bound = square.Bind({{"a", 3}, {"b", 1}, {"x", 2}});
+    REQUIRE(bound.Evaluate()->real() == Approx(49));
+    REQUIRE(bound.to_string() == square.Bind({{"a", 3}, {"b", 1}, {"x", 2}})
+                                     .to_string());
+  }
+
+  SECTION("Assignment keeps the type of the node") {
+    Expression equal = (a == b);
+    Expression copy;
+    copy = equal;
+    REQUIRE(copy.SameAs(equal));
+    REQUIRE(copy.to_string() == equal.to_string());
+  }
+}
+
+TEST_CASE("Common subexpressions are hoisted into temporaries", "[symbolic]") {
+  codegen::CudaGenerator cg;
+  Expression x = Expression::CreateNumericValue("x");
+  Expression y = Expression::CreateNumericValue("y");
+
+  SECTION("Shared sums are computed once") {
+    Expression expsum = symbolic::Exp(x) + symbolic::Exp(y);
+    Expression softmax =
+        symbolic::Exp(x) / expsum + symbolic::Exp(y) / expsum;
+    std::string code = symbolic::HoistCommonSubexpressions(softmax, &cg);
+    REQUIRE(cg.code() ==
+            "const number cse_0=" + symbolic::Exp(x).to_string() + ";\n"
+            "const number cse_1=" + symbolic::Exp(y).to_string() + ";\n"
+            "const number cse_2=(cse_0)+(cse_1);\n");
+    REQUIRE(code == "((cse_0) / (cse_2))+((cse_1) / (cse_2))");
+  }
+
+  SECTION("Index math is hoisted into ints") {
+    Expression index = symbolic::Flatten2d(
+        10, 5, Expression::CreateInteger("row"),
+        Expression::CreateInteger("col"));
+    std::string code =
+        symbolic::HoistCommonSubexpressions(index * index, &cg, "index");
+    REQUIRE(cg.code() == "const int index_0=" + index.to_string() + ";\n");
+    REQUIRE(code == "(index_0)*(index_0)");
+  }
+
+  SECTION("Guarded subexpressions stay in their branch") {
+    Expression guarded = symbolic::IfInRange(
+        x, 0, 10, (x * y) + (x * y), Expression(0.0));
+    std::string code = symbolic::HoistCommonSubexpressions(guarded, &cg);
+    REQUIRE(cg.code().empty());
+    REQUIRE(code == guarded.to_string());
+  }
+}
+
+TEST_CASE("Expressions are simplified", "[symbolic]") {
+  Expression x = Expression::CreateNumericValue("x");
+  Expression y = Expression::CreateNumericValue("y");
+  Expression i = Expression::CreateInteger("i");
+
+  SECTION("Identities and annihilators are removed") {
+    REQUIRE(symbolic::Simplify(x * 1 + 0).SameAs(x));
+    REQUIRE(symbolic::Simplify(x / 1).SameAs(x));
+    REQUIRE(symbolic::Simplify((x + y) * 0).SameAs(Expression(0.0)));
+    REQUIRE(symbolic::Simplify(i * 0).SameAs(Expression(0)));
+  }
+
+  SECTION("Sums and products are flattened, sorted and folded") {
+    REQUIRE(symbolic::Simplify((x + 1) + (Expression(2) + y))
+                .SameAs(symbolic::Simplify((y + x) + 3)));
+    REQUIRE(symbolic::Simplify((x * 2) * (y * 3))
+                .SameAs(symbolic::Simplify(Expression(6) * (y * x))));
+    REQUIRE(symbolic::Simplify(Expression(2.0) * 3.0 + 1.0)
+                .SameAs(Expression(7.0)));
+  }
+
+  SECTION("Generated code keeps its types") {
+    // Multiplying by 1.0 makes an integer a double.
+    REQUIRE(symbolic::Simplify(i * 1.0).to_string() == (i * 1.0).to_string());
+    REQUIRE(symbolic::Simplify(i * 1).SameAs(i));
+    // Integer division truncates.
+    REQUIRE(symbolic::Simplify(Expression(7) / Expression(2))
+                .SameAs(Expression(3)));
+    REQUIRE(symbolic::Simplify(Expression(7) / Expression(2.0))
+                .SameAs(Expression(3.5)));
+    REQUIRE(symbolic::Simplify(Expression(7) % Expression(4))
+                .SameAs(Expression(3)));
+  }
+
+  SECTION("Constant conditions select their branch") {
+    Expression conditional = symbolic::IfInRange(Expression(3), 0, 10, x, y);
+    REQUIRE(symbolic::Simplify(conditional).SameAs(x));
+    Expression relu = symbolic::Relu(x);
+    REQUIRE(symbolic::Simplify(relu).SameAs(relu));
+  }
+
+  SECTION("Derivatives are simplified") {
+    Expression f = x * x * y + x * 3;
+    // y * (x + x) + 3, rather than
+    // ((x * x) * 0 + y * (x * 1 + x * 1)) + (x * 0 + 3 * 1).
+    REQUIRE(symbolic::NodeCount(f.Derive("x")) == 6);
+    for (double value : {-2.0, 0.5, 3.0}) {
+      REQUIRE(f.Derive("x").Bind({{"x", value}, {"y", 2}}).Evaluate()->real() ==
+              Approx(4 * value + 3));
+    }
+    // Memoized derivatives are already simplified.
+    Expression derivative = f.Derive("x");
+    const size_t simplified_nodes = symbolic::TotalSimplifyStats().nodes_before;
+    REQUIRE(f.Derive("x").SameAs(derivative));
+    REQUIRE(symbolic::TotalSimplifyStats().nodes_before == simplified_nodes);
+  }
+
+  SECTION("Node counts are reported") {
+    symbolic::SimplifyStats stats;
+    Expression simplified =
+        symbolic::Simplify(x * 1 + (y * 0 + Expression(2) * 3), &stats);
+    REQUIRE(stats.nodes_before == 11);
+    REQUIRE(stats.nodes_after == 3);
+    REQUIRE(stats.nodes_after == symbolic::NodeCount(simplified));
+  }
+}
+
+TEST_CASE("Compiled expressions match Bind and Evaluate", "[symbolic]") {
+  Expression x = Expression::CreateNumericValue("x");
+  Expression y = Expression::CreateNumericValue("y");
+
+  std::vector<Expression> expressions = {
+      x * x * y + x * 3,
+      (x - y) / (x + y),
+      symbolic::Sigmoid(x * y),
+      symbolic::Relu(x) + symbolic::LeakyRelu(y),
+      symbolic::Max({x, y, Expression(1.5)}),
+      symbolic::IfInRange(x, -1, 1, x * y, y),
+      symbolic::Exp(x) + symbolic::Log(2, y * y + 1),
+      (x * x).Derive("x") + symbolic::Sigmoid(x).Derive("x"),
+      // Integer subexpressions truncate, as they do with Evaluate().
+      Expression(7) / Expression(2) + (Expression(7) + x),
+      Expression(17) % Expression(5) * y,
+  };
+
+  for (const Expression& expression : expressions) {
+    symbolic::CompiledExpression program(expression, {"x", "y"});
+    std::vector<double> registers(program.registers());
+    for (double a : {-2.0, -0.25, 0.5, 3.0}) {
+      for (double b : {-1.5, 0.75, 2.5}) {
+        double values[] = {a, b};
+        REQUIRE(program.Evaluate(values, registers.data()) ==
+                Approx(expression.Bind({{"x", a}, {"y", b}})
+                           .Evaluate()
+                           ->real()));
+      }
+    }
+  }
+
+  SECTION("Shared nodes are evaluated once") {
+    Expression shared = symbolic::Sigmoid(x * y);
+    symbolic::CompiledExpression program(shared * shared + shared, {"x", "y"});
+    symbolic::CompiledExpression single(shared, {"x", "y"});
+    REQUIRE(program.instructions() == single.instructions() + 2);
+  }
+
+  SECTION("Matrices are mapped with an evaluator") {
+    Matrix<Expression> m = {{x * y, x + y}, {symbolic::Exp(x), y / x}};
+    symbolic::ExpressionEvaluator evaluator({"x", "y"});
+    for (double a : {0.5, 2.0}) {
+      evaluator.set("x", a);
+      evaluator.set(evaluator.index("y"), 3.0);
+      Matrix<double> result = m.Map(evaluator.AsFunction());
+      Matrix<double> expected =
+          symbolic::MapBindAndEvaluate(m, {{"x", a}, {"y", 3.0}});
+      for (size_t i = 0; i < 2; ++i) {
+        for (size_t j = 0; j < 2; ++j) {
+          REQUIRE(result.at(i, j) == Approx(expected.at(i, j)));
+        }
+      }
+    }
+  }
+}